@@ -58,12 +58,16 @@ id<SPUDeltaArchiveProtocol> SPUDeltaArchiveReadPatchAndHeader(NSString *patchFil
 @synthesize itemFilePath = _itemFilePath;
 @synthesize clonedRelativePath = _clonedRelativePath;
 @synthesize sourcePath = _sourcePath;
+@synthesize itemData = _itemData;
+@synthesize contentDigest = _contentDigest;
 @synthesize commands = _commands;
 #if SPARKLE_BUILD_LEGACY_DELTA_SUPPORT
 @synthesize xarContext = _xarContext;
 #endif
 @synthesize mode = _mode;
 @synthesize codedDataLength = _codedDataLength;
+@synthesize blobFrameIndex = _blobFrameIndex;
+@synthesize blobFrameOffset = _blobFrameOffset;
 
 - (instancetype)initWithRelativeFilePath:(NSString *)relativeFilePath commands:(SPUDeltaItemCommands)commands mode:(uint16_t)mode
 {
@@ -21,6 +21,13 @@ typedef NS_ENUM(uint8_t, SPUDeltaItemCommands) {
     SPUDeltaItemCommandModifyPermissions = (1u << 2),
     SPUDeltaItemCommandBinaryDiff = (1u << 3),
     SPUDeltaItemCommandClone = (1u << 4),
+    // Only used with BinaryDiff. The diff was created between the old and new files after filtering their branch instructions (see bsfilter.h)
+    // Older versions of Sparkle don't know about this and will fail to apply such a diff
+    SPUDeltaItemCommandBranchFilter = (1u << 5),
+    // Only used with Extract for regular files. The file has the same contents as an earlier extracted or patched file in the archive,
+    // whose relative path is the item's clonedRelativePath, and has no data of its own in the archive.
+    // Older versions of Sparkle don't know about this and will fail to apply such an item
+    SPUDeltaItemCommandDuplicate = (1u << 6),
 };
 
 // Represents header for our archive
@@ -49,9 +56,16 @@ SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchiveItem : NSObject
 @property (nonatomic, nullable) NSString *itemFilePath;
 // The relative file path of the originating item for clones. This may be null.
 // For example, if /Contents/Resources/hello/foo.txt moves to /Contents/Resources/hello2/foo.txt, the former is the relative path
+// For duplicates, this is instead the relative file path of the earlier extracted or patched item in the new tree with the same contents
 @property (nonatomic, nullable) NSString *clonedRelativePath;
 // The source path of the item to extract file metadata from such as file size.
 @property (nonatomic, nullable) NSString *sourcePath;
+// For creation, the contents of the item to add to the archive instead of reading them from the item's physical file path. This may be null.
+// This is used for binary diffs that are created in memory.
+@property (nonatomic, nullable) NSData *itemData;
+// For creation, a digest of the contents of the regular file the item leaves in the new tree. This may be null.
+// Items with the same digest as an earlier item can be stored as duplicates of it.
+@property (nonatomic, nullable) NSData *contentDigest;
 // The commands that describe the actions to take for this item.
 @property (nonatomic, readonly) SPUDeltaItemCommands commands;
 // Provided change in permissions for item or tracking file mode for the item
@@ -64,16 +78,27 @@ SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchiveItem : NSObject
 #endif
 // Tracking length of item's data in data section, when encoding items and when extracting items
 @property (nonatomic) uint64_t codedDataLength;
+// Location of item's data in archives with a blob index: the frame its data starts in and the offset into that frame
+@property (nonatomic) uint32_t blobFrameIndex;
+@property (nonatomic) uint32_t blobFrameOffset;
 
 @end
 
+// Reads up to length bytes of an item's data into buffer
+// Returns the number of bytes read, 0 after all of the item's data has been read, or -1 on failure
+typedef ssize_t (^SPUDeltaArchiveItemReader)(void *buffer, size_t length);
+
 // A protocol for reading and writing binary delta patches
 // Operations must be done in order. The header must first be read or written before any other operations.
-// For reading, file items cannot be extracted out of order.
+// For reading, file items cannot be extracted out of order unless supportsConcurrentItemAccess is YES.
 @protocol SPUDeltaArchiveProtocol <NSObject>
 
 @property (nonatomic, readonly, class) BOOL maySupportSafeExtraction;
 
+// If YES, file items can be extracted and read in any order and from multiple threads at once
+// while and after enumerating items. This is only known after reading the header.
+@property (nonatomic, readonly) BOOL supportsConcurrentItemAccess;
+
 // If non-nil, there was an error with reading or writing data from the archive
 @property (nonatomic, readonly, nullable) NSError *error;
 
@@ -92,6 +117,11 @@ SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchiveItem : NSObject
 // The item's physical file path must be set as a destination
 - (BOOL)extractItem:(SPUDeltaArchiveItem *)item;
 
+// Read a file item's data from the patch file in order without extracting it to a file first
+// The handler is passed a reader for the item's data and returns NO if it fails. Data the handler doesn't read is skipped.
+// Like extraction, file items cannot be read out of order
+- (BOOL)readItem:(SPUDeltaArchiveItem *)item handler:(BOOL (NS_NOESCAPE ^)(SPUDeltaArchiveItemReader reader))handler;
+
 // ------------
 
 // For writing
@@ -100,7 +130,7 @@ SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchiveItem : NSObject
 - (void)writeHeader:(SPUDeltaArchiveHeader *)header;
 
 // Add item to patch file
-// Physical file path must be provided if there is an extract or binary delta attribute
+// Physical file path or item data must be provided if there is an extract or binary delta attribute
 // Permissions are used only if there is a modify permissions attribute
 - (void)addItem:(SPUDeltaArchiveItem *)item;
 
@@ -0,0 +1,417 @@
+//
+//  SPUDeltaCodec.c
+//  Sparkle
+//
+//  Apple's compression library handles lzma, lzfse, lz4 and zlib on Apple platforms.
+//  Elsewhere lzma and zlib are handled by liblzma and zlib, which read and write the same formats:
+//  Apple's lzma is an xz stream using preset 6, and Apple's zlib is a raw deflate stream using level 5.
+//  lzfse and lz4 use containers only Apple's library reads.
+//  zstd is handled by libzstd on every platform when it's built in.
+//
+
+#include "SPUDeltaCodec.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+#ifdef __APPLE__
+#include <compression.h>
+#else
+#define ZLIB_CONST
+#include <zlib.h>
+#include <lzma.h>
+#endif
+
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+#include <zstd.h>
+#endif
+
+#ifndef __APPLE__
+#define ZLIB_LEVEL 5
+#define ZLIB_RAW_WINDOW_BITS -15
+#define ZLIB_MEMORY_LEVEL 8
+#define LZMA_PRESET 6
+#endif
+
+struct spu_delta_codec_state
+{
+    spu_delta_codec_algorithm algorithm;
+    spu_delta_codec_operation operation;
+    union
+    {
+#ifdef __APPLE__
+        compression_stream apple;
+#else
+        z_stream zlib;
+        lzma_stream lzma;
+#endif
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+        ZSTD_CCtx *zstd_encoder;
+        ZSTD_DCtx *zstd_decoder;
+#endif
+    } backend;
+};
+
+#ifdef __APPLE__
+
+static int platform_init(struct spu_delta_codec_state *state)
+{
+    compression_algorithm algorithm = COMPRESSION_LZMA;
+    switch (state->algorithm) {
+        case SPU_DELTA_CODEC_LZMA:
+            algorithm = COMPRESSION_LZMA;
+            break;
+        case SPU_DELTA_CODEC_LZFSE:
+            algorithm = COMPRESSION_LZFSE;
+            break;
+        case SPU_DELTA_CODEC_LZ4:
+            algorithm = COMPRESSION_LZ4;
+            break;
+        case SPU_DELTA_CODEC_ZLIB:
+            algorithm = COMPRESSION_ZLIB;
+            break;
+        case SPU_DELTA_CODEC_ZSTD:
+            return 0;
+    }
+
+    compression_stream_operation operation = (state->operation == SPU_DELTA_CODEC_ENCODE) ? COMPRESSION_STREAM_ENCODE : COMPRESSION_STREAM_DECODE;
+    return compression_stream_init(&state->backend.apple, operation, algorithm) == COMPRESSION_STATUS_OK;
+}
+
+static spu_delta_codec_status platform_process(struct spu_delta_codec_state *state, spu_delta_codec_stream *stream, int finalize)
+{
+    compression_stream *apple = &state->backend.apple;
+    apple->dst_ptr = stream->dst_ptr;
+    apple->dst_size = stream->dst_size;
+    apple->src_ptr = stream->src_ptr;
+    apple->src_size = stream->src_size;
+
+    compression_status status = compression_stream_process(apple, finalize ? COMPRESSION_STREAM_FINALIZE : 0);
+
+    stream->dst_ptr = apple->dst_ptr;
+    stream->dst_size = apple->dst_size;
+    stream->src_ptr = apple->src_ptr;
+    stream->src_size = apple->src_size;
+
+    if (status == COMPRESSION_STATUS_END) {
+        return SPU_DELTA_CODEC_STATUS_END;
+    }
+    return (status == COMPRESSION_STATUS_OK) ? SPU_DELTA_CODEC_STATUS_OK : SPU_DELTA_CODEC_STATUS_ERROR;
+}
+
+static void platform_destroy(struct spu_delta_codec_state *state)
+{
+    compression_stream_destroy(&state->backend.apple);
+}
+
+#else
+
+static int platform_init(struct spu_delta_codec_state *state)
+{
+    switch (state->algorithm) {
+        case SPU_DELTA_CODEC_ZLIB:
+            if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+                return deflateInit2(&state->backend.zlib, ZLIB_LEVEL, Z_DEFLATED, ZLIB_RAW_WINDOW_BITS, ZLIB_MEMORY_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+            return inflateInit2(&state->backend.zlib, ZLIB_RAW_WINDOW_BITS) == Z_OK;
+        case SPU_DELTA_CODEC_LZMA: {
+            lzma_stream initialStream = LZMA_STREAM_INIT;
+            state->backend.lzma = initialStream;
+            if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+                return lzma_easy_encoder(&state->backend.lzma, LZMA_PRESET, LZMA_CHECK_CRC64) == LZMA_OK;
+            }
+            return lzma_stream_decoder(&state->backend.lzma, UINT64_MAX, 0) == LZMA_OK;
+        }
+        case SPU_DELTA_CODEC_LZFSE:
+        case SPU_DELTA_CODEC_LZ4:
+        case SPU_DELTA_CODEC_ZSTD:
+            return 0;
+    }
+    return 0;
+}
+
+static spu_delta_codec_status platform_process(struct spu_delta_codec_state *state, spu_delta_codec_stream *stream, int finalize)
+{
+    if (state->algorithm == SPU_DELTA_CODEC_ZLIB) {
+        // zlib counts bytes in unsigned ints, so very large buffers are processed over several calls
+        z_stream *zlib = &state->backend.zlib;
+        uInt srcSize = (stream->src_size > UINT_MAX) ? UINT_MAX : (uInt)stream->src_size;
+        uInt dstSize = (stream->dst_size > UINT_MAX) ? UINT_MAX : (uInt)stream->dst_size;
+        zlib->next_in = stream->src_ptr;
+        zlib->avail_in = srcSize;
+        zlib->next_out = stream->dst_ptr;
+        zlib->avail_out = dstSize;
+
+        int result;
+        if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+            result = deflate(zlib, (finalize && srcSize == stream->src_size) ? Z_FINISH : Z_NO_FLUSH);
+        } else {
+            result = inflate(zlib, Z_NO_FLUSH);
+        }
+
+        stream->src_ptr += srcSize - zlib->avail_in;
+        stream->src_size -= srcSize - zlib->avail_in;
+        stream->dst_ptr += dstSize - zlib->avail_out;
+        stream->dst_size -= dstSize - zlib->avail_out;
+
+        if (result == Z_STREAM_END) {
+            return SPU_DELTA_CODEC_STATUS_END;
+        }
+        // Z_BUF_ERROR only means no progress could be made with the buffers given
+        return (result == Z_OK || result == Z_BUF_ERROR) ? SPU_DELTA_CODEC_STATUS_OK : SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    lzma_stream *lzma = &state->backend.lzma;
+    lzma->next_in = stream->src_ptr;
+    lzma->avail_in = stream->src_size;
+    lzma->next_out = stream->dst_ptr;
+    lzma->avail_out = stream->dst_size;
+
+    lzma_ret result = lzma_code(lzma, finalize ? LZMA_FINISH : LZMA_RUN);
+
+    stream->src_ptr = lzma->next_in;
+    stream->src_size = lzma->avail_in;
+    stream->dst_ptr = lzma->next_out;
+    stream->dst_size = lzma->avail_out;
+
+    if (result == LZMA_STREAM_END) {
+        return SPU_DELTA_CODEC_STATUS_END;
+    }
+    return (result == LZMA_OK || result == LZMA_BUF_ERROR) ? SPU_DELTA_CODEC_STATUS_OK : SPU_DELTA_CODEC_STATUS_ERROR;
+}
+
+static void platform_destroy(struct spu_delta_codec_state *state)
+{
+    if (state->algorithm == SPU_DELTA_CODEC_ZLIB) {
+        if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+            deflateEnd(&state->backend.zlib);
+        } else {
+            inflateEnd(&state->backend.zlib);
+        }
+    } else {
+        lzma_end(&state->backend.lzma);
+    }
+}
+
+#endif
+
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+
+static int zstd_init(struct spu_delta_codec_state *state, int level)
+{
+    if (state->operation == SPU_DELTA_CODEC_DECODE) {
+        ZSTD_DCtx *decoder = ZSTD_createDCtx();
+        if (decoder == NULL) {
+            return 0;
+        }
+
+        if (ZSTD_isError(ZSTD_DCtx_setParameter(decoder, ZSTD_d_windowLogMax, SPU_DELTA_CODEC_ZSTD_WINDOW_LOG))) {
+            ZSTD_freeDCtx(decoder);
+            return 0;
+        }
+
+        state->backend.zstd_decoder = decoder;
+        return 1;
+    }
+
+    ZSTD_CCtx *encoder = ZSTD_createCCtx();
+    if (encoder == NULL) {
+        return 0;
+    }
+
+    if ((level != 0 && ZSTD_isError(ZSTD_CCtx_setParameter(encoder, ZSTD_c_compressionLevel, level))) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(encoder, ZSTD_c_enableLongDistanceMatching, 1)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(encoder, ZSTD_c_windowLog, SPU_DELTA_CODEC_ZSTD_WINDOW_LOG))) {
+        ZSTD_freeCCtx(encoder);
+        return 0;
+    }
+
+    state->backend.zstd_encoder = encoder;
+    return 1;
+}
+
+static spu_delta_codec_status zstd_process(struct spu_delta_codec_state *state, spu_delta_codec_stream *stream, int finalize)
+{
+    ZSTD_inBuffer input = {stream->src_ptr, stream->src_size, 0};
+    ZSTD_outBuffer output = {stream->dst_ptr, stream->dst_size, 0};
+
+    // Both return 0 once the frame has been completely written or read
+    size_t result;
+    if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+        result = ZSTD_compressStream2(state->backend.zstd_encoder, &output, &input, finalize ? ZSTD_e_end : ZSTD_e_continue);
+    } else {
+        result = ZSTD_decompressStream(state->backend.zstd_decoder, &output, &input);
+    }
+
+    stream->src_ptr += input.pos;
+    stream->src_size -= input.pos;
+    stream->dst_ptr += output.pos;
+    stream->dst_size -= output.pos;
+
+    if (ZSTD_isError(result)) {
+        return SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    if (result == 0 && (finalize || state->operation == SPU_DELTA_CODEC_DECODE)) {
+        return SPU_DELTA_CODEC_STATUS_END;
+    }
+    return SPU_DELTA_CODEC_STATUS_OK;
+}
+
+static void zstd_destroy(struct spu_delta_codec_state *state)
+{
+    if (state->operation == SPU_DELTA_CODEC_ENCODE) {
+        ZSTD_freeCCtx(state->backend.zstd_encoder);
+    } else {
+        ZSTD_freeDCtx(state->backend.zstd_decoder);
+    }
+}
+
+#endif
+
+int spu_delta_codec_is_supported(spu_delta_codec_algorithm algorithm)
+{
+    switch (algorithm) {
+        case SPU_DELTA_CODEC_LZMA:
+        case SPU_DELTA_CODEC_ZLIB:
+            return 1;
+        case SPU_DELTA_CODEC_LZFSE:
+        case SPU_DELTA_CODEC_LZ4:
+#ifdef __APPLE__
+            return 1;
+#else
+            return 0;
+#endif
+        case SPU_DELTA_CODEC_ZSTD:
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+            return 1;
+#else
+            return 0;
+#endif
+    }
+    return 0;
+}
+
+spu_delta_codec_status spu_delta_codec_stream_init(spu_delta_codec_stream *stream, spu_delta_codec_operation operation, spu_delta_codec_algorithm algorithm, int level)
+{
+    stream->dst_ptr = NULL;
+    stream->dst_size = 0;
+    stream->src_ptr = NULL;
+    stream->src_size = 0;
+    stream->state = NULL;
+
+    if (!spu_delta_codec_is_supported(algorithm)) {
+        return SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    struct spu_delta_codec_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        return SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    state->algorithm = algorithm;
+    state->operation = operation;
+
+    int initialized;
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+    if (algorithm == SPU_DELTA_CODEC_ZSTD) {
+        initialized = zstd_init(state, level);
+    } else
+#endif
+    {
+        (void)level;
+        initialized = platform_init(state);
+    }
+
+    if (!initialized) {
+        free(state);
+        return SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    stream->state = state;
+    return SPU_DELTA_CODEC_STATUS_OK;
+}
+
+spu_delta_codec_status spu_delta_codec_stream_process(spu_delta_codec_stream *stream, int finalize)
+{
+    struct spu_delta_codec_state *state = stream->state;
+    size_t srcSize = stream->src_size;
+    size_t dstSize = stream->dst_size;
+
+    spu_delta_codec_status status;
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+    if (state->algorithm == SPU_DELTA_CODEC_ZSTD) {
+        status = zstd_process(state, stream, finalize);
+    } else
+#endif
+    {
+        status = platform_process(state, stream, finalize);
+    }
+
+    // A decoder that has all of its input and room for output but makes no progress was given a truncated stream
+    if (status == SPU_DELTA_CODEC_STATUS_OK && finalize && state->operation == SPU_DELTA_CODEC_DECODE && dstSize > 0 && stream->src_size == srcSize && stream->dst_size == dstSize) {
+        return SPU_DELTA_CODEC_STATUS_ERROR;
+    }
+
+    return status;
+}
+
+void spu_delta_codec_stream_destroy(spu_delta_codec_stream *stream)
+{
+    struct spu_delta_codec_state *state = stream->state;
+    if (state == NULL) {
+        return;
+    }
+
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+    if (state->algorithm == SPU_DELTA_CODEC_ZSTD) {
+        zstd_destroy(state);
+    } else
+#endif
+    {
+        platform_destroy(state);
+    }
+
+    free(state);
+    stream->state = NULL;
+}
+
+static size_t processBuffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, spu_delta_codec_operation operation, spu_delta_codec_algorithm algorithm, int level)
+{
+    spu_delta_codec_stream stream;
+    if (spu_delta_codec_stream_init(&stream, operation, algorithm, level) != SPU_DELTA_CODEC_STATUS_OK) {
+        return 0;
+    }
+
+    stream.dst_ptr = dst;
+    stream.dst_size = dst_size;
+    stream.src_ptr = src;
+    stream.src_size = src_size;
+
+    spu_delta_codec_status status;
+    do {
+        size_t previousSrcSize = stream.src_size;
+        size_t previousDstSize = stream.dst_size;
+
+        status = spu_delta_codec_stream_process(&stream, 1);
+
+        // Running out of room in dst stops all progress
+        if (status == SPU_DELTA_CODEC_STATUS_OK && stream.src_size == previousSrcSize && stream.dst_size == previousDstSize) {
+            status = SPU_DELTA_CODEC_STATUS_ERROR;
+        }
+    } while (status == SPU_DELTA_CODEC_STATUS_OK);
+
+    spu_delta_codec_stream_destroy(&stream);
+
+    return (status == SPU_DELTA_CODEC_STATUS_END) ? (dst_size - stream.dst_size) : 0;
+}
+
+size_t spu_delta_codec_encode_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, spu_delta_codec_algorithm algorithm, int level)
+{
+    return processBuffer(dst, dst_size, src, src_size, SPU_DELTA_CODEC_ENCODE, algorithm, level);
+}
+
+size_t spu_delta_codec_decode_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, spu_delta_codec_algorithm algorithm)
+{
+    return processBuffer(dst, dst_size, src, src_size, SPU_DELTA_CODEC_DECODE, algorithm, 0);
+}
@@ -0,0 +1,75 @@
+//
+//  SPUDeltaCodec.h
+//  Sparkle
+//
+//  Streaming compression of the contents of version 3 delta archives.
+//  This is plain C so archives can be created and read on platforms without Apple's compression library,
+//  where lzma and zlib compressed archives are handled with liblzma and zlib instead.
+//
+
+#ifndef SPUDELTACODEC_H
+#define SPUDELTACODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    SPU_DELTA_CODEC_LZMA,
+    SPU_DELTA_CODEC_LZFSE,
+    SPU_DELTA_CODEC_LZ4,
+    SPU_DELTA_CODEC_ZLIB,
+    SPU_DELTA_CODEC_ZSTD
+} spu_delta_codec_algorithm;
+
+typedef enum
+{
+    SPU_DELTA_CODEC_ENCODE,
+    SPU_DELTA_CODEC_DECODE
+} spu_delta_codec_operation;
+
+typedef enum
+{
+    SPU_DELTA_CODEC_STATUS_OK = 0,
+    SPU_DELTA_CODEC_STATUS_END = 1,
+    SPU_DELTA_CODEC_STATUS_ERROR = -1
+} spu_delta_codec_status;
+
+// zstd streams match against the last 2^27 bytes (128 MiB) using long distance matching,
+// which finds repeats across files that are far apart in the archive
+// Decoders reject zstd streams that need a larger window
+#define SPU_DELTA_CODEC_ZSTD_WINDOW_LOG 27
+
+// Works like compression_stream: process() consumes bytes from src and produces bytes into dst,
+// advancing both pointers and decreasing both sizes
+typedef struct
+{
+    uint8_t *dst_ptr;
+    size_t dst_size;
+    const uint8_t *src_ptr;
+    size_t src_size;
+
+    // Private to the codec
+    void *state;
+} spu_delta_codec_stream;
+
+// Returns whether this build can compress and decompress the algorithm
+int spu_delta_codec_is_supported(spu_delta_codec_algorithm algorithm);
+
+// Initializes the stream for encoding or decoding the algorithm
+// The level only applies to encoding zstd, where 0 picks zstd's default level
+// Other algorithms use a fixed level so that every platform produces the same format
+spu_delta_codec_status spu_delta_codec_stream_init(spu_delta_codec_stream *stream, spu_delta_codec_operation operation, spu_delta_codec_algorithm algorithm, int level);
+
+// Processes as much of src and dst as possible
+// finalize tells the codec no more input will follow; encoders then flush their remaining output
+// Returns SPU_DELTA_CODEC_STATUS_END once the end of the stream has been written or read
+spu_delta_codec_status spu_delta_codec_stream_process(spu_delta_codec_stream *stream, int finalize);
+
+void spu_delta_codec_stream_destroy(spu_delta_codec_stream *stream);
+
+// One-shot versions of the stream functions, which return the number of bytes written to dst or 0 on failure
+size_t spu_delta_codec_encode_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, spu_delta_codec_algorithm algorithm, int level);
+size_t spu_delta_codec_decode_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size, spu_delta_codec_algorithm algorithm);
+
+#endif
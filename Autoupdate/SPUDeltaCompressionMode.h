@@ -15,7 +15,8 @@ typedef NS_ENUM(uint8_t, SPUDeltaCompressionMode) {
     SPUDeltaCompressionModeLZMA,
     SPUDeltaCompressionModeLZFSE,
     SPUDeltaCompressionModeLZ4,
-    SPUDeltaCompressionModeZLIB
+    SPUDeltaCompressionModeZLIB,
+    SPUDeltaCompressionModeZstd
 };
 
 // For Swift access
@@ -20,6 +20,7 @@ NS_ASSUME_NONNULL_BEGIN
 #define SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CLONE_LOOKUP 4
 #define SPARKLE_DELTA_ARCHIVE_ERROR_CODE_TOO_MANY_FILES 5
 #define SPARKLE_DELTA_ARCHIVE_ERROR_CODE_LINK_TOO_LONG 6
+#define SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX 7
 
 /*
  Modern container format for binary delta archives.
@@ -34,6 +35,11 @@ NS_ASSUME_NONNULL_BEGIN
  The implementation design of this archive is such that we do not seek backwards or skip ahead to fetch data.
  We go through the archive when writing or reading from it in a single pass.
  
+ Archives compressed with anything but bzip2 may instead be compressed in frames (see FRAMES below),
+ which are compressed and decompressed independently on multiple threads.
+ Framed archives may also end with a blob index (see BLOB_INDEX below), which lets readers seek to the data blob of any item
+ and read items out of order or concurrently. Readers that go through the archive in a single pass don't need the index.
+ 
  -- UNCOMPRESSED --
  
  [ HEADER (part 1) ]
@@ -42,12 +48,25 @@ NS_ASSUME_NONNULL_BEGIN
  metadata (See format below. length: 1)
  
     -- METADATA --
-    compressionLevel (bits [0, 4])
-    (bits [5, 6] reserved)
+    compressionLevel (bits [0, 3], zstd levels above 15 are recorded as 15)
+    framedCompression (bit 4)
+    blobIndex (bit 5)
+    (bit 6 reserved)
     fileSystemCompression (bit 7)
  
  -- COMPRESSED --
  
+ [ FRAMES ]
+ Only when framedCompression is set. Everything below is split into frames of 4 MiB that are compressed on their own
+ and stored one after another, each preceded by:
+    compressedLength (length: 4)
+    decompressedLength (length: 4)
+ The last frame is followed by a frame header whose lengths are 0.
+ Frames whose compressedLength has its highest bit set are stored uncompressed, and the rest of compressedLength must equal decompressedLength.
+ Version 3 patches that use frames are at least minor version 3, and ones that store frames are at least minor version 6.
+ Writers store data blobs that look incompressible this way, with each such blob starting a new frame and the frame after it
+ starting compressed frames again.
+ 
  [ HEADER (part 2)]
  majorVersion (length: 2)
  minorVersion (length: 2)
@@ -57,6 +76,12 @@ NS_ASSUME_NONNULL_BEGIN
  [ RELATIVE_FILE_PATH_TABLE ]
  sizeOfRelativeFilePathTable (length: 8 bytes)
  List of null terminated path strings joined together (N paths)
+ Version 3 patches of minor version 5 or later instead front code the paths (N entries):
+    [ Path Entry ]
+        sharedLength (varint, number of leading bytes shared with the previous path, 0 for the first path)
+        suffixLength (varint)
+        suffix (length: suffixLength, not null terminated)
+    (Varints are unsigned LEB128: 7 bits per byte starting with the lowest, with the high bit set on all but the last byte)
  
  [ COMMANDS ]
     [ Command ]
@@ -82,12 +107,18 @@ NS_ASSUME_NONNULL_BEGIN
         [COMMAND: BINARY_DIFF_FILE]
             dataLength (length: 8)
  
+        [COMMAND: DUPLICATE_FILE]
+            originalItemIndex (length: 4, replaces EXTRACT_FILE's dataLength)
+            (Index of an earlier EXTRACT_FILE command for a regular file with the same contents, which isn't a duplicate itself)
+            (Only in version 3 patches of minor version 7 or later. Duplicates have no data blob.)
+ 
         Note: These command types may be OR'd or combined. In those cases, different commands
         that have the same attribute (eg dataLength) are not repeated. This list of metadata is also
         in order in what will be encoded/decoded first.
     
         EXTRACT_FILE and BINARY_DIFF_FILE cannot be combined.
         CLONE_FILE and EXTRACT_FILE cannot be combined.
+        DUPLICATE_FILE is only combined with EXTRACT_FILE of a regular file.
         MODIFY_PERMISSIONS can be combined with either CLONE_FILE, EXTRACT_FILE, BINARY_DIFF_FILE, or just by itself.
         CLONE_FILE can be combined with BINARY_DIFF_FILE or just by itself.
         DELETE can be combined with EXTRACT_FILE, or just by itself. It is only combined with EXTRACT_FILE when the file type (regular, directory, or symlink) changes.
@@ -96,12 +127,36 @@ NS_ASSUME_NONNULL_BEGIN
  All raw binary data joined together
  (P number of blobs where P <= M commands)
  (Indexes for data blobs correspond to indexes for a filtered list of applicable commands (EXTRACT_FILE, BINARY_DIFF_FILE) that have data content)
+ 
+ -- UNCOMPRESSED --
+ 
+ [ BLOB_INDEX ]
+ Only when blobIndex is set. Follows the frame header marking the last frame.
+ frameCount (length: 4)
+ File offsets of the frame headers (length: 8 each, frameCount offsets)
+ blobCount (length: 4)
+    [ Blob Location ]
+        frameIndex (length: 4)
+        frameOffset (length: 4)
+    (blobCount locations, one for each data blob in order)
+    (frameIndex is the frame containing the first byte of the blob, and frameOffset is its offset into the decompressed frame)
+ blobIndexOffset (File offset of the start of the blob index. length: 8)
  */
 SPU_OBJC_DIRECT_MEMBERS @interface SPUSparkleDeltaArchive : NSObject <SPUDeltaArchiveProtocol>
 
 - (instancetype)initWithPatchFileForWriting:(NSString *)patchFile;
+- (instancetype)initWithPatchFileForWriting:(NSString *)patchFile framedCompression:(BOOL)framedCompression;
 - (instancetype)initWithPatchFileForReading:(NSString *)patchFile;
 
+// For writing, whether data blobs that look incompressible are stored in uncompressed frames
+// Only used by framed archives of minor version 3.6 or later. Defaults to NO.
+@property (nonatomic) BOOL storesIncompressibleBlobs;
+
+// For writing, whether extracted regular files with the same contents as an earlier extracted or patched file are written as duplicates of it instead of with data blobs of their own
+// Items are compared by their contentDigest, so items without one are never deduplicated
+// Only used by archives of minor version 3.7 or later. Defaults to NO.
+@property (nonatomic) BOOL deduplicatesBlobs;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -8,9 +8,11 @@
 
 #import "SPUSparkleDeltaArchive.h"
 #import <sys/stat.h>
+#import <unistd.h>
+#import <math.h>
 #import <CommonCrypto/CommonDigest.h>
 #import "SUBinaryDeltaCommon.h"
-#import <compression.h>
+#import "SPUDeltaCodec.h"
 
 #if SPARKLE_BUILD_BZIP2_DELTA_SUPPORT
 #import <bzlib.h>
@@ -21,16 +23,286 @@
 #define SPARKLE_DELTA_FORMAT_MAGIC "spk!"
 #define PARTIAL_IO_CHUNK_SIZE 16384 // this must be >= PATH_MAX
 #define COMPRESSION_BUFFER_SIZE 65536
+#define READ_AHEAD_BUFFER_SIZE 65536
 #define SPARKLE_BZIP2_ERROR_DOMAIN @"Sparkle BZIP2"
 #define SPARKLE_COMPRESSION_ERROR_DOMAIN @"Sparkle Compression"
+#define FRAME_SIZE 4194304 // uncompressed bytes in each frame, except for the last one
+#define MAX_COMPRESSED_FRAME_SIZE (2 * FRAME_SIZE)
+#define STORED_FRAME_FLAG 0x80000000U // set in the compressed length of frames that are stored uncompressed
+#define MIN_STORED_BLOB_SIZE 65536 // smaller blobs aren't worth ending the frame before them
+#define INCOMPRESSIBLE_ENTROPY_THRESHOLD 7.9 // bits per byte
+#define ENTROPY_SAMPLE_COUNT 4
 
 typedef struct
 {
     uint8_t compressionLevel : 4;
-    uint8_t reserved : 3;
+    bool framedCompression : 1;
+    bool blobIndex : 1;
+    uint8_t reserved : 1;
     bool fileSystemCompression : 1;
 } SparkleDeltaArchiveMetadata;
 
+// A frame of the archive that is being compressed or decompressed on a worker thread
+SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchiveFrame : NSObject
+
+- (instancetype)initWithDecodedLength:(uint32_t)decodedLength;
+
+@property (nonatomic, readonly) dispatch_group_t group;
+@property (nonatomic, readonly) uint32_t decodedLength;
+// The frame's data after its group finishes, or nil if processing it failed
+@property (nonatomic) NSData *data;
+// Whether the frame is stored uncompressed
+@property (nonatomic) BOOL stored;
+
+@end
+
+@implementation SPUDeltaArchiveFrame
+
+@synthesize group = _group;
+@synthesize decodedLength = _decodedLength;
+@synthesize data = _data;
+@synthesize stored = _stored;
+
+- (instancetype)initWithDecodedLength:(uint32_t)decodedLength
+{
+    self = [super init];
+    if (self != nil) {
+        _group = dispatch_group_create();
+        _decodedLength = decodedLength;
+    }
+    return self;
+}
+
+@end
+
+static NSData *compressedFrameData(NSData *frameData, spu_delta_codec_algorithm algorithm, int level)
+{
+    // Incompressible frames come out slightly larger than they went in
+    size_t capacity = frameData.length + frameData.length / 16 + 4096;
+    NSMutableData *compressedData = [NSMutableData dataWithLength:capacity];
+    size_t compressedLength = spu_delta_codec_encode_buffer(compressedData.mutableBytes, capacity, frameData.bytes, frameData.length, algorithm, level);
+    if (compressedLength == 0) {
+        return nil;
+    }
+    
+    compressedData.length = compressedLength;
+    return compressedData;
+}
+
+static BOOL isValidFrameHeader(uint32_t compressedLength, uint32_t decodedLength)
+{
+    if ((compressedLength & STORED_FRAME_FLAG) != 0) {
+        return (decodedLength > 0 && decodedLength <= FRAME_SIZE && (compressedLength & ~STORED_FRAME_FLAG) == decodedLength);
+    }
+    
+    return (decodedLength > 0 && decodedLength <= FRAME_SIZE && compressedLength > 0 && compressedLength <= MAX_COMPRESSED_FRAME_SIZE);
+}
+
+static NSData *decompressedFrameData(NSData *compressedData, uint32_t decodedLength, spu_delta_codec_algorithm algorithm)
+{
+    NSMutableData *frameData = [NSMutableData dataWithLength:decodedLength];
+    size_t length = spu_delta_codec_decode_buffer(frameData.mutableBytes, decodedLength, compressedData.bytes, compressedData.length, algorithm);
+    return (length == decodedLength) ? frameData : nil;
+}
+
+// Estimates the bits of entropy per byte of data from the counts of its byte values
+// Data that is already compressed or encrypted comes close to 8, which compressing it again can't improve on
+static double byteEntropy(const uint64_t *byteCounts, uint64_t totalCount)
+{
+    double entropy = 0.0;
+    for (int byteValue = 0; byteValue < 256; byteValue++) {
+        if (byteCounts[byteValue] > 0) {
+            double probability = (double)byteCounts[byteValue] / (double)totalCount;
+            entropy -= probability * log2(probability);
+        }
+    }
+    
+    return entropy;
+}
+
+static void addByteCounts(uint64_t *byteCounts, const uint8_t *bytes, size_t length)
+{
+    for (size_t byteIndex = 0; byteIndex < length; byteIndex++) {
+        byteCounts[bytes[byteIndex]]++;
+    }
+}
+
+// Whether the item has a data blob in the archive
+static BOOL itemHasDataBlob(SPUDeltaItemCommands commands, uint16_t mode)
+{
+    if ((commands & SPUDeltaItemCommandBinaryDiff) != 0) {
+        return YES;
+    }
+    
+    if ((commands & SPUDeltaItemCommandDuplicate) != 0) {
+        return NO;
+    }
+    
+    return (commands & SPUDeltaItemCommandExtract) != 0 && (S_ISREG(mode) || S_ISLNK(mode));
+}
+
+// Relative paths of the archive stored back to back as null terminated file system representations
+// Strings are only created for paths that are looked up, instead of for every path up front
+SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaArchivePathTable : NSObject
+
+- (instancetype)initWithPaths:(NSData *)paths offsets:(NSData *)offsets;
+
+@property (nonatomic, readonly) NSUInteger count;
+
+// Returns nil if the path can't be decoded as a file system representation
+- (NSString *)pathAtIndex:(NSUInteger)index;
+
+@end
+
+@implementation SPUDeltaArchivePathTable
+{
+    NSData *_paths;
+    // Offsets (uint64_t each) of the paths in _paths
+    NSData *_offsets;
+    NSFileManager *_fileManager;
+}
+
+- (instancetype)initWithPaths:(NSData *)paths offsets:(NSData *)offsets
+{
+    self = [super init];
+    if (self != nil) {
+        _paths = paths;
+        _offsets = offsets;
+        _fileManager = [NSFileManager defaultManager];
+    }
+    return self;
+}
+
+- (NSUInteger)count
+{
+    return _offsets.length / sizeof(uint64_t);
+}
+
+- (NSString *)pathAtIndex:(NSUInteger)index
+{
+    assert(index < self.count);
+    
+    const char *path = (const char *)_paths.bytes + ((const uint64_t *)_offsets.bytes)[index];
+    return [_fileManager stringWithFileSystemRepresentation:path length:strlen(path)];
+}
+
+@end
+
+static void appendPathTableVarint(NSMutableData *data, uint64_t value)
+{
+    uint8_t bytes[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+        bytes[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[length++] = (uint8_t)value;
+    
+    [data appendBytes:bytes length:length];
+}
+
+static BOOL readPathTableVarint(const uint8_t *bytes, uint64_t length, uint64_t *position, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (*position >= length) {
+            return NO;
+        }
+        
+        uint8_t byte = bytes[(*position)++];
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+// Decodes a front coded path table into null terminated paths and the offsets where they start
+// Each path reuses the leading bytes of the previous path that it shares, so decoding only ever copies from the last path
+static BOOL decodeFrontCodedPathTable(const uint8_t *table, uint64_t tableLength, NSMutableData *paths, NSMutableData *offsets)
+{
+    uint64_t position = 0;
+    uint64_t previousOffset = 0;
+    uint64_t previousLength = 0;
+    while (position < tableLength) {
+        uint64_t sharedLength = 0;
+        uint64_t suffixLength = 0;
+        if (!readPathTableVarint(table, tableLength, &position, &sharedLength) || !readPathTableVarint(table, tableLength, &position, &suffixLength)) {
+            return NO;
+        }
+        
+        if (sharedLength > previousLength || suffixLength > tableLength - position || sharedLength + suffixLength > PATH_MAX) {
+            return NO;
+        }
+        
+        // A null byte would cut the path short
+        if (memchr(table + position, '\0', suffixLength) != NULL) {
+            return NO;
+        }
+        
+        uint64_t offset = paths.length;
+        [paths increaseLengthBy:sharedLength + suffixLength + 1];
+        
+        char *pathBytes = paths.mutableBytes;
+        memcpy(pathBytes + offset, pathBytes + previousOffset, sharedLength);
+        memcpy(pathBytes + offset + sharedLength, table + position, suffixLength);
+        pathBytes[offset + sharedLength + suffixLength] = '\0';
+        
+        [offsets appendBytes:&offset length:sizeof(offset)];
+        
+        position += suffixLength;
+        previousOffset = offset;
+        previousLength = sharedLength + suffixLength;
+    }
+    
+    return YES;
+}
+
+// Reads length bytes at the offset without moving the file's position, which is safe to do from multiple threads
+static BOOL readFileBytesAtOffset(int fileDescriptor, void *buffer, size_t length, off_t offset)
+{
+    uint8_t *bytes = buffer;
+    while (length > 0) {
+        ssize_t bytesRead = pread(fileDescriptor, bytes, length, offset);
+        if (bytesRead <= 0) {
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            return NO;
+        }
+        
+        bytes += bytesRead;
+        length -= (size_t)bytesRead;
+        offset += bytesRead;
+    }
+    
+    return YES;
+}
+
+static spu_delta_codec_algorithm _codecAlgorithmForMode(SPUDeltaCompressionMode compressionMode)
+{
+    switch (compressionMode) {
+    case SPUDeltaCompressionModeLZMA:
+        return SPU_DELTA_CODEC_LZMA;
+    case SPUDeltaCompressionModeLZFSE:
+        return SPU_DELTA_CODEC_LZFSE;
+    case SPUDeltaCompressionModeLZ4:
+        return SPU_DELTA_CODEC_LZ4;
+    case SPUDeltaCompressionModeZLIB:
+        return SPU_DELTA_CODEC_ZLIB;
+    case SPUDeltaCompressionModeZstd:
+        return SPU_DELTA_CODEC_ZSTD;
+    case SPUDeltaCompressionModeNone:
+    case SPUDeltaCompressionModeBzip2:
+        assert(false);
+    }
+    
+    assert(false);
+}
+
 @implementation SPUSparkleDeltaArchive
 {
     FILE *_file;
@@ -41,16 +313,52 @@ typedef struct
     NSError *_error;
     void *_partialChunkBuffer;
     void *_compressionBuffer;
+    
+    // Bytes decoded ahead of the reader for archives that aren't framed, so reading small fields
+    // like commands and modes is a copy instead of a trip through the decompressor
+    uint8_t *_readAheadBuffer;
+    size_t _readAheadOffset;
+    size_t _readAheadLength;
     NSMutableArray<SPUDeltaArchiveItem *> *_writableItems;
     
-    compression_stream _compressionStream;
+    spu_delta_codec_stream _compressionStream;
     SPUDeltaCompressionMode _compression;
+    // Level the codec encodes with, which only zstd uses
+    int _codecLevel;
+    
+    // Frames being compressed or decompressed in archive order, the frame being read from, and the frame being filled
+    NSMutableArray<SPUDeltaArchiveFrame *> *_pendingFrames;
+    NSData *_currentFrameData;
+    NSUInteger _currentFrameOffset;
+    NSMutableData *_frameBuffer;
+    NSUInteger _maxPendingFrames;
+    // Frames compressed or read in order so far
+    uint32_t _frameCount;
+    
+    // Blob index of the archive: file offsets of the frames (uint64_t each) and locations of the data blobs (uint32_t frame index and offset pairs)
+    // Frames decompressed for reading items through the blob index are cached since small items often share a frame
+    NSMutableData *_frameOffsets;
+    NSMutableData *_blobLocations;
+    NSCache<NSNumber *, NSData *> *_frameCache;
     
     BOOL _initializedCompressionStream;
+    BOOL _framedCompression;
+    // Whether the relative path table is front coded, which is the case for minor version 3.5 and later
+    BOOL _frontCodedPaths;
+    // Whether data blobs that look incompressible are written to stored frames, which framed archives of minor version 3.6 and later may do
+    BOOL _storesIncompressibleBlobs;
+    // Whether extracted files with the same contents as an earlier one are written as duplicates, which archives of minor version 3.7 and later may do
+    BOOL _deduplicatesBlobs;
+    // Whether the frames being filled are stored instead of compressed
+    BOOL _storingFrames;
+    BOOL _readAllFrames;
+    BOOL _decodedToEnd;
     BOOL _writeMode;
 }
 
 @synthesize error = _error;
+@synthesize storesIncompressibleBlobs = _storesIncompressibleBlobs;
+@synthesize deduplicatesBlobs = _deduplicatesBlobs;
 
 + (BOOL)maySupportSafeExtraction
 {
@@ -58,11 +366,17 @@ typedef struct
 }
 
 - (instancetype)initWithPatchFileForWriting:(NSString *)patchFile
+{
+    return [self initWithPatchFileForWriting:patchFile framedCompression:NO];
+}
+
+- (instancetype)initWithPatchFileForWriting:(NSString *)patchFile framedCompression:(BOOL)framedCompression
 {
     self = [super init];
     if (self != nil) {
         _patchFile = [patchFile copy];
         _writableItems = [NSMutableArray array];
+        _framedCompression = framedCompression;
         _writeMode = YES;
     }
     return self;
@@ -95,7 +409,7 @@ typedef struct
     } else
 #endif
     if (_initializedCompressionStream) {
-        compression_stream_destroy(&_compressionStream);
+        spu_delta_codec_stream_destroy(&_compressionStream);
         _initializedCompressionStream = NO;
     }
     
@@ -109,6 +423,33 @@ typedef struct
     
     free(_compressionBuffer);
     _compressionBuffer = NULL;
+    
+    free(_readAheadBuffer);
+    _readAheadBuffer = NULL;
+    _readAheadOffset = 0;
+    _readAheadLength = 0;
+    
+    // Frames still being processed only hold on to their own data
+    _pendingFrames = nil;
+    _currentFrameData = nil;
+    _frameBuffer = nil;
+    _frameCache = nil;
+}
+
+- (BOOL)supportsConcurrentItemAccess
+{
+    return (!_writeMode && _blobLocations != nil);
+}
+
+// Records the error unless there already is one
+// Items read through the blob index may run into errors on multiple threads at once
+- (void)_recordError:(NSError *)error SPU_OBJC_DIRECT
+{
+    @synchronized (self) {
+        if (_error == nil) {
+            _error = error;
+        }
+    }
 }
 
 - (BOOL)createBuffers SPU_OBJC_DIRECT
@@ -127,59 +468,168 @@ typedef struct
         }
     }
     
+    // Framed archives are read from frames that are already decompressed
+    if (!_writeMode && !_framedCompression) {
+        _readAheadBuffer = malloc(READ_AHEAD_BUFFER_SIZE);
+        if (_readAheadBuffer == NULL) {
+            _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to malloc() %d bytes for read ahead buffer.", READ_AHEAD_BUFFER_SIZE] }];
+            return NO;
+        }
+    }
+    
     return YES;
 }
 
-- (BOOL)_readBuffer:(void *)buffer length:(int32_t)length SPU_OBJC_DIRECT
+// Waits for the next frame to be decompressed and makes it the current frame,
+// after reading the frames that follow it and decompressing them on worker threads
+- (BOOL)_readNextFrame SPU_OBJC_DIRECT
 {
-    if (_error != nil) {
+    spu_delta_codec_algorithm algorithm = _codecAlgorithmForMode(_compression);
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    
+    while (!_readAllFrames && _pendingFrames.count < _maxPendingFrames) {
+        uint32_t frameHeader[2] = {0};
+        if (fread(frameHeader, sizeof(frameHeader), 1, _file) < 1) {
+            _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Failed to read frame header from archive." }];
+            return NO;
+        }
+        
+        uint32_t decodedLength = frameHeader[1];
+        if (decodedLength == 0) {
+            // End of frames marker
+            _readAllFrames = YES;
+            break;
+        }
+        
+        if (!isValidFrameHeader(frameHeader[0], decodedLength)) {
+            _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CHUNK_SIZE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Frame of %u compressed bytes and %u decompressed bytes is invalid.", frameHeader[0] & ~STORED_FRAME_FLAG, decodedLength] }];
+            return NO;
+        }
+        
+        BOOL storedFrame = ((frameHeader[0] & STORED_FRAME_FLAG) != 0);
+        uint32_t compressedLength = frameHeader[0] & ~STORED_FRAME_FLAG;
+        
+        NSMutableData *compressedData = [NSMutableData dataWithLength:compressedLength];
+        if (fread(compressedData.mutableBytes, compressedLength, 1, _file) < 1) {
+            _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %u compressed frame bytes from archive.", compressedLength] }];
+            return NO;
+        }
+        
+        SPUDeltaArchiveFrame *frame = [[SPUDeltaArchiveFrame alloc] initWithDecodedLength:decodedLength];
+        if (storedFrame) {
+            frame.data = compressedData;
+        } else {
+            dispatch_group_async(frame.group, queue, ^{
+                frame.data = decompressedFrameData(compressedData, decodedLength, algorithm);
+            });
+        }
+        [_pendingFrames addObject:frame];
+    }
+    
+    SPUDeltaArchiveFrame *frame = _pendingFrames.firstObject;
+    if (frame == nil) {
+        // We're expecting more bytes but we can't read any more bytes
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: @"Failed to decompress and read bytes because we reached the last frame" }];
+        return NO;
+    }
+    [_pendingFrames removeObjectAtIndex:0];
+    
+    dispatch_group_wait(frame.group, DISPATCH_TIME_FOREVER);
+    if (frame.data == nil) {
+        _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to decompress frame of %u bytes.", frame.decodedLength] }];
         return NO;
     }
     
+    if (_frameCache != nil) {
+        // Items read through the blob index are likely to start in the frame the commands end in
+        [_frameCache setObject:frame.data forKey:@(_frameCount) cost:frame.data.length];
+    }
+    _frameCount++;
+    
+    _currentFrameData = frame.data;
+    _currentFrameOffset = 0;
+    return YES;
+}
+
+- (BOOL)_readFramedBuffer:(void *)buffer length:(int32_t)length SPU_OBJC_DIRECT
+{
+    uint8_t *bytes = buffer;
+    NSUInteger bytesLeftoverToRead = (NSUInteger)length;
+    while (bytesLeftoverToRead > 0) {
+        if (_currentFrameOffset == _currentFrameData.length) {
+            if (![self _readNextFrame]) {
+                return NO;
+            }
+            continue;
+        }
+        
+        NSUInteger copyLength = MIN(_currentFrameData.length - _currentFrameOffset, bytesLeftoverToRead);
+        memcpy(bytes, (const uint8_t *)_currentFrameData.bytes + _currentFrameOffset, copyLength);
+        
+        _currentFrameOffset += copyLength;
+        bytes += copyLength;
+        bytesLeftoverToRead -= copyLength;
+    }
+    
+    return YES;
+}
+
+// Decodes up to maxLength bytes from an archive that isn't framed, returning fewer only once the end of the archive is reached
+// Returns -1 on failure
+- (int32_t)_decodeBytes:(void *)buffer maxLength:(int32_t)maxLength SPU_OBJC_DIRECT
+{
+    if (_decodedToEnd) {
+        return 0;
+    }
+    
     switch (_compression) {
         case SPUDeltaCompressionModeNone: {
-            if (fread(buffer, (size_t)length, 1, _file) < 1) {
-                _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d uncompressed bytes from archive.", length] }];
-                return NO;
-            } else {
-                return YES;
+            size_t bytesRead = fread(buffer, 1, (size_t)maxLength, _file);
+            if (bytesRead < (size_t)maxLength) {
+                if (ferror(_file) != 0) {
+                    _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d uncompressed bytes from archive.", maxLength] }];
+                    return -1;
+                }
+                
+                _decodedToEnd = YES;
             }
+            
+            return (int32_t)bytesRead;
         }
         case SPUDeltaCompressionModeBzip2:
         {
 #if SPARKLE_BUILD_BZIP2_DELTA_SUPPORT
             int bzerror = 0;
-            int bytesRead = BZ2_bzRead(&bzerror, _bzipFile, buffer, length);
+            int bytesRead = BZ2_bzRead(&bzerror, _bzipFile, buffer, maxLength);
             
             switch (bzerror) {
-                case BZ_OK:
                 case BZ_STREAM_END:
-                    if (bytesRead < length) {
-                        _error = [NSError errorWithDomain:SPARKLE_BZIP2_ERROR_DOMAIN code:0 userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Only %d out of %d expected bytes were read from the bz2 archive.", bytesRead, length] }];
-                        return NO;
-                    } else {
-                        return YES;
-                    }
+                    // bzip2 can't be read from again after reaching the end of its stream
+                    _decodedToEnd = YES;
+                    return bytesRead;
+                case BZ_OK:
+                    return bytesRead;
                 case BZ_IO_ERROR:
                     _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Encountered unexpected IO error when reading compressed bytes from bz2 archive." }];
-                    return NO;
+                    return -1;
                 default:
                     _error = [NSError errorWithDomain:SPARKLE_BZIP2_ERROR_DOMAIN code:bzerror userInfo:@{ NSLocalizedDescriptionKey: @"Encountered unexpected error when reading compressed bytes from bz2 archive." }];
-                    return NO;
+                    return -1;
             }
 #else
-            return NO;
+            return -1;
 #endif
         }
         case SPUDeltaCompressionModeLZMA:
         case SPUDeltaCompressionModeLZFSE:
         case SPUDeltaCompressionModeLZ4:
-        case SPUDeltaCompressionModeZLIB: {
+        case SPUDeltaCompressionModeZLIB:
+        case SPUDeltaCompressionModeZstd: {
             FILE *file = _file;
             void *compressionBuffer = _compressionBuffer;
             
             _compressionStream.dst_ptr = buffer;
-            _compressionStream.dst_size = (size_t)length;
+            _compressionStream.dst_size = (size_t)maxLength;
             
             while (_compressionStream.dst_size > 0) {
                 // Go through the current incomplete chunk before reading another one
@@ -188,8 +638,8 @@ typedef struct
                     size_t bytesRead = fread(compressionBuffer, 1, COMPRESSION_BUFFER_SIZE, file);
                     if (bytesRead < COMPRESSION_BUFFER_SIZE) {
                         if (feof(file) == 0) {
-                            _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d compressed raw bytes from archive.", length] }];
-                            return NO;
+                            _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d compressed raw bytes from archive.", maxLength] }];
+                            return -1;
                         }
                     }
                     
@@ -198,41 +648,232 @@ typedef struct
                     _compressionStream.src_size = bytesRead;
                 }
                 
-                compression_status status = compression_stream_process(&_compressionStream, feof(file) != 0 ? COMPRESSION_STREAM_FINALIZE : 0);
-                if (status == COMPRESSION_STATUS_ERROR) {
-                    _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:COMPRESSION_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d compressed bytes.", length] }];
-                    return NO;
+                spu_delta_codec_status status = spu_delta_codec_stream_process(&_compressionStream, feof(file) != 0);
+                if (status == SPU_DELTA_CODEC_STATUS_ERROR) {
+                    _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %d compressed bytes.", maxLength] }];
+                    return -1;
                 }
                 
-                if (status == COMPRESSION_STATUS_END && _compressionStream.dst_size > 0) {
-                    // We're expecting more bytes but we can't read any more bytes
-                    _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: @"Failed to decompress and read bytes because we reached EOF" }];
-                    return NO;
+                if (status == SPU_DELTA_CODEC_STATUS_END) {
+                    _decodedToEnd = YES;
+                    break;
                 }
             }
             
-            return YES;
+            return maxLength - (int32_t)_compressionStream.dst_size;
         }
     }
 }
 
-static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMode compressionMode)
+// Reads what the read ahead buffer can't provide
+- (BOOL)_readBufferSlowPath:(void *)buffer length:(int32_t)length SPU_OBJC_DIRECT
 {
-    switch (compressionMode) {
-    case SPUDeltaCompressionModeLZMA:
-        return COMPRESSION_LZMA;
-    case SPUDeltaCompressionModeLZFSE:
-        return COMPRESSION_LZFSE;
-    case SPUDeltaCompressionModeLZ4:
-        return COMPRESSION_LZ4;
-    case SPUDeltaCompressionModeZLIB:
-        return COMPRESSION_ZLIB;
-    case SPUDeltaCompressionModeNone:
-    case SPUDeltaCompressionModeBzip2:
-        assert(false);
+    if (_framedCompression) {
+        return [self _readFramedBuffer:buffer length:length];
     }
     
-    assert(false);
+    uint8_t *bytes = buffer;
+    size_t bytesLeftoverToRead = (size_t)length;
+    
+    size_t readAheadLength = _readAheadLength - _readAheadOffset;
+    if (readAheadLength > 0) {
+        memcpy(bytes, _readAheadBuffer + _readAheadOffset, readAheadLength);
+        bytes += readAheadLength;
+        bytesLeftoverToRead -= readAheadLength;
+    }
+    
+    _readAheadOffset = 0;
+    _readAheadLength = 0;
+    
+    int32_t decodedLength;
+    if (bytesLeftoverToRead >= PARTIAL_IO_CHUNK_SIZE) {
+        // Large reads like chunks of data blobs gain nothing from being copied through the read ahead buffer
+        decodedLength = [self _decodeBytes:bytes maxLength:(int32_t)bytesLeftoverToRead];
+    } else {
+        decodedLength = [self _decodeBytes:_readAheadBuffer maxLength:READ_AHEAD_BUFFER_SIZE];
+        if (decodedLength >= 0) {
+            _readAheadLength = (size_t)decodedLength;
+            _readAheadOffset = MIN(bytesLeftoverToRead, _readAheadLength);
+            memcpy(bytes, _readAheadBuffer, _readAheadOffset);
+        }
+    }
+    
+    if (decodedLength < 0) {
+        return NO;
+    }
+    
+    if ((size_t)decodedLength < bytesLeftoverToRead) {
+        // We're expecting more bytes but we can't read any more bytes
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: @"Failed to decompress and read bytes because we reached EOF" }];
+        return NO;
+    }
+    
+    return YES;
+}
+
+- (BOOL)_readBuffer:(void *)buffer length:(int32_t)length SPU_OBJC_DIRECT
+{
+    if (_error != nil) {
+        return NO;
+    }
+    
+    // Most fields are small and have already been decoded
+    if ((size_t)length <= _readAheadLength - _readAheadOffset && _readAheadBuffer != NULL) {
+        memcpy(buffer, _readAheadBuffer + _readAheadOffset, (size_t)length);
+        _readAheadOffset += (size_t)length;
+        return YES;
+    }
+    
+    return [self _readBufferSlowPath:buffer length:length];
+}
+
+// Reads the blob index at the end of the archive without moving the file's position
+- (BOOL)_readBlobIndex SPU_OBJC_DIRECT
+{
+    int fileDescriptor = fileno(_file);
+    
+    struct stat fileInfo = {0};
+    if (fstat(fileDescriptor, &fileInfo) != 0) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to fstat() patch file: %@", _patchFile] }];
+        return NO;
+    }
+    
+    // The blob index ends with the offset it starts at
+    uint64_t blobIndexOffset = 0;
+    uint64_t blobIndexEnd = (fileInfo.st_size >= (off_t)sizeof(blobIndexOffset)) ? (uint64_t)fileInfo.st_size - sizeof(blobIndexOffset) : 0;
+    if (blobIndexEnd == 0 || !readFileBytesAtOffset(fileDescriptor, &blobIndexOffset, sizeof(blobIndexOffset), (off_t)blobIndexEnd)) {
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: @"Failed to read offset of blob index." }];
+        return NO;
+    }
+    
+    uint32_t frameCount = 0;
+    uint64_t blobIndexLength = (blobIndexOffset < blobIndexEnd) ? blobIndexEnd - blobIndexOffset : 0;
+    if (blobIndexLength < 2 * sizeof(uint32_t) || !readFileBytesAtOffset(fileDescriptor, &frameCount, sizeof(frameCount), (off_t)blobIndexOffset) || (uint64_t)frameCount > (blobIndexLength - 2 * sizeof(uint32_t)) / sizeof(uint64_t)) {
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Blob index at offset %llu is invalid.", blobIndexOffset] }];
+        return NO;
+    }
+    
+    uint64_t frameOffsetsOffset = blobIndexOffset + sizeof(frameCount);
+    NSMutableData *frameOffsets = [NSMutableData dataWithLength:frameCount * sizeof(uint64_t)];
+    
+    uint32_t blobCount = 0;
+    uint64_t blobCountOffset = frameOffsetsOffset + frameOffsets.length;
+    if (!readFileBytesAtOffset(fileDescriptor, frameOffsets.mutableBytes, frameOffsets.length, (off_t)frameOffsetsOffset) || !readFileBytesAtOffset(fileDescriptor, &blobCount, sizeof(blobCount), (off_t)blobCountOffset) || (uint64_t)blobCount * 2 * sizeof(uint32_t) != blobIndexEnd - (blobCountOffset + sizeof(blobCount))) {
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Blob index with %u frames is invalid.", frameCount] }];
+        return NO;
+    }
+    
+    NSMutableData *blobLocations = [NSMutableData dataWithLength:blobCount * 2 * sizeof(uint32_t)];
+    if (!readFileBytesAtOffset(fileDescriptor, blobLocations.mutableBytes, blobLocations.length, (off_t)(blobCountOffset + sizeof(blobCount)))) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %u blob locations from blob index.", blobCount] }];
+        return NO;
+    }
+    
+    const uint64_t *frameOffsetBytes = frameOffsets.bytes;
+    for (uint32_t frameIndex = 0; frameIndex < frameCount; frameIndex++) {
+        if (frameOffsetBytes[frameIndex] >= blobIndexOffset) {
+            _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Offset %llu of frame %u is past the frames.", frameOffsetBytes[frameIndex], frameIndex] }];
+            return NO;
+        }
+    }
+    
+    const uint32_t *blobLocationBytes = blobLocations.bytes;
+    for (uint32_t blobIndex = 0; blobIndex < blobCount; blobIndex++) {
+        // Empty blobs at the end of the archive start right after the last frame
+        if (blobLocationBytes[2 * blobIndex] > frameCount || blobLocationBytes[2 * blobIndex + 1] >= FRAME_SIZE) {
+            _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Location of blob %u is past the frames.", blobIndex] }];
+            return NO;
+        }
+    }
+    
+    _frameOffsets = frameOffsets;
+    _blobLocations = blobLocations;
+    
+    return YES;
+}
+
+// Returns the decompressed frame from the blob index, which is safe to call from multiple threads
+- (NSData *)_decompressedFrameAtIndex:(uint32_t)frameIndex SPU_OBJC_DIRECT
+{
+    NSNumber *frameKey = @(frameIndex);
+    NSData *frameData = [_frameCache objectForKey:frameKey];
+    if (frameData != nil) {
+        return frameData;
+    }
+    
+    if ((NSUInteger)frameIndex >= _frameOffsets.length / sizeof(uint64_t)) {
+        [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: @"Failed to decompress and read bytes because we reached the last frame" }]];
+        return nil;
+    }
+    
+    int fileDescriptor = fileno(_file);
+    uint64_t frameOffset = ((const uint64_t *)_frameOffsets.bytes)[frameIndex];
+    
+    uint32_t frameHeader[2] = {0};
+    if (!readFileBytesAtOffset(fileDescriptor, frameHeader, sizeof(frameHeader), (off_t)frameOffset) || !isValidFrameHeader(frameHeader[0], frameHeader[1])) {
+        [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CHUNK_SIZE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Header of frame %u at offset %llu is invalid.", frameIndex, frameOffset] }]];
+        return nil;
+    }
+    
+    BOOL storedFrame = ((frameHeader[0] & STORED_FRAME_FLAG) != 0);
+    uint32_t compressedLength = frameHeader[0] & ~STORED_FRAME_FLAG;
+    NSMutableData *compressedData = [NSMutableData dataWithLength:compressedLength];
+    if (!readFileBytesAtOffset(fileDescriptor, compressedData.mutableBytes, compressedData.length, (off_t)(frameOffset + sizeof(frameHeader)))) {
+        [self _recordError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to read %u compressed frame bytes from archive.", compressedLength] }]];
+        return nil;
+    }
+    
+    frameData = storedFrame ? compressedData : decompressedFrameData(compressedData, frameHeader[1], _codecAlgorithmForMode(_compression));
+    if (frameData == nil) {
+        [self _recordError:[NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to decompress frame of %u bytes.", frameHeader[1]] }]];
+        return nil;
+    }
+    
+    [_frameCache setObject:frameData forKey:frameKey cost:frameData.length];
+    return frameData;
+}
+
+// Returns a reader for the item's data located through the blob index
+// This doesn't affect reading the archive in order and different readers may be used on multiple threads at once
+- (SPUDeltaArchiveItemReader)_blobIndexReaderForItem:(SPUDeltaArchiveItem *)item SPU_OBJC_DIRECT
+{
+    __block uint32_t frameIndex = item.blobFrameIndex;
+    __block NSUInteger frameOffset = item.blobFrameOffset;
+    __block NSData *frameData = nil;
+    __block uint64_t bytesLeftoverToRead = item.codedDataLength;
+    
+    return ^ssize_t(void *buffer, size_t length) {
+        if (bytesLeftoverToRead == 0 || length == 0) {
+            return 0;
+        }
+        
+        // Move on to the next frame once we're at the end of the current one
+        while (frameData == nil || frameOffset >= frameData.length) {
+            if (frameData != nil) {
+                frameIndex++;
+                frameOffset = 0;
+            }
+            
+            BOOL firstFrame = (frameData == nil);
+            frameData = [self _decompressedFrameAtIndex:frameIndex];
+            if (frameData == nil) {
+                return -1;
+            }
+            
+            // Blobs with data always start inside their frame, so anything else means the blob index is corrupt
+            if (firstFrame && frameOffset >= frameData.length) {
+                [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Blob of %@ starts at offset %lu past the end of frame %u, which has %lu bytes.", item.relativeFilePath, (unsigned long)frameOffset, frameIndex, (unsigned long)frameData.length] }]];
+                return -1;
+            }
+        }
+        
+        NSUInteger copyLength = (NSUInteger)MIN(MIN((uint64_t)length, bytesLeftoverToRead), (uint64_t)(frameData.length - frameOffset));
+        memcpy(buffer, (const uint8_t *)frameData.bytes + frameOffset, copyLength);
+        
+        frameOffset += copyLength;
+        bytesLeftoverToRead -= copyLength;
+        return (ssize_t)copyLength;
+    };
 }
 
 - (nullable SPUDeltaArchiveHeader *)readHeader
@@ -309,9 +950,34 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         case SPUDeltaCompressionModeLZMA:
         case SPUDeltaCompressionModeLZFSE:
         case SPUDeltaCompressionModeLZ4:
-        case SPUDeltaCompressionModeZLIB: {
-            if (compression_stream_init(&_compressionStream, COMPRESSION_STREAM_DECODE, _compressionAlgorithmForMode(compression)) != COMPRESSION_STATUS_OK) {
-                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:COMPRESSION_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to open compression stream for reading" }];
+        case SPUDeltaCompressionModeZLIB:
+        case SPUDeltaCompressionModeZstd: {
+            if (!spu_delta_codec_is_supported(_codecAlgorithmForMode(compression))) {
+                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to open patch because %@ compression is not supported by this build", deltaCompressionStringFromMode(compression)] }];
+                return nil;
+            }
+            
+            if (metadata.framedCompression) {
+                // Frames are decompressed ahead on other threads while earlier ones are read
+                _framedCompression = YES;
+                _pendingFrames = [NSMutableArray array];
+                _maxPendingFrames = MAX(NSProcessInfo.processInfo.activeProcessorCount, 2u);
+                
+                if (metadata.blobIndex) {
+                    if (![self _readBlobIndex]) {
+                        return nil;
+                    }
+                    
+                    // Only the frames up to the end of the commands are read in order, and data blobs are read through the blob index
+                    _frameCache = [[NSCache alloc] init];
+                    _frameCache.totalCostLimit = _maxPendingFrames * FRAME_SIZE;
+                    _maxPendingFrames = 1;
+                }
+                break;
+            }
+            
+            if (spu_delta_codec_stream_init(&_compressionStream, SPU_DELTA_CODEC_DECODE, _codecAlgorithmForMode(compression), 0) != SPU_DELTA_CODEC_STATUS_OK) {
+                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to open compression stream for reading" }];
                 return nil;
             }
             
@@ -338,6 +1004,8 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         return nil;
     }
     
+    _frontCodedPaths = MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) && minorVersion >= SUBinaryDeltaMinorVersion3_5;
+    
     unsigned char beforeTreeHash[CC_SHA1_DIGEST_LENGTH] = {0};
     if (![self _readBuffer:beforeTreeHash length:sizeof(beforeTreeHash)]) {
         return nil;
@@ -351,7 +1019,7 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     return [[SPUDeltaArchiveHeader alloc] initWithCompression:compression compressionLevel:metadata.compressionLevel fileSystemCompression:metadata.fileSystemCompression majorVersion:majorVersion minorVersion:minorVersion beforeTreeHash:beforeTreeHash afterTreeHash:afterTreeHash];
 }
 
-- (NSArray<NSString *> *)_readRelativeFilePaths SPU_OBJC_DIRECT
+- (SPUDeltaArchivePathTable *)_readRelativePathTable SPU_OBJC_DIRECT
 {
     if (_error != nil) {
         return nil;
@@ -364,7 +1032,7 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     
     if (filePathSectionSize == 0) {
         // Nothing has actually changed if there are no entries
-        return @[];
+        return [[SPUDeltaArchivePathTable alloc] initWithPaths:[NSData data] offsets:[NSData data]];
     }
     
     char *fileTableData = calloc(1, filePathSectionSize);
@@ -388,44 +1056,51 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         }
     }
     
-    // Read all relative file paths separated by null terminators
-    NSFileManager *fileManager = [NSFileManager defaultManager];
-    NSMutableArray<NSString *> *relativeFilePaths = [[NSMutableArray alloc] init];
+    if (_frontCodedPaths) {
+        // Paths are usually several times longer than their suffixes
+        NSMutableData *paths = [NSMutableData dataWithCapacity:(NSUInteger)filePathSectionSize * 4];
+        NSMutableData *offsets = [NSMutableData data];
+        BOOL decodedTable = decodeFrontCodedPathTable((const uint8_t *)fileTableData, filePathSectionSize, paths, offsets);
+        
+        free(fileTableData);
+        
+        if (!decodedTable) {
+            _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{ NSLocalizedDescriptionKey: @"Front coded relative path table is corrupt." }];
+            return nil;
+        }
+        
+        return [[SPUDeltaArchivePathTable alloc] initWithPaths:paths offsets:offsets];
+    }
+    
+    // Find the relative file paths separated by null terminators
+    NSMutableData *offsets = [NSMutableData data];
     uint64_t currentStartIndex = 0;
     for (uint64_t index = 0; index < filePathSectionSize; index++) {
         if (fileTableData[index] == '\0') {
-            NSString *relativePath = [fileManager stringWithFileSystemRepresentation:&fileTableData[currentStartIndex] length:index - currentStartIndex];
-            if (relativePath == nil) {
-                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path cannot be decoded as a file system representation: %@", relativePath] }];
-                
-                free(fileTableData);
-                return nil;
-            }
-            
+            [offsets appendBytes:&currentStartIndex length:sizeof(currentStartIndex)];
             currentStartIndex = index + 1;
-            [relativeFilePaths addObject:relativePath];
         }
     }
     
-    free(fileTableData);
-    
-    return relativeFilePaths;
+    NSData *paths = [NSData dataWithBytesNoCopy:fileTableData length:(NSUInteger)filePathSectionSize freeWhenDone:YES];
+    return [[SPUDeltaArchivePathTable alloc] initWithPaths:paths offsets:offsets];
 }
 
 - (void)enumerateItems:(void (^)(SPUDeltaArchiveItem * _Nonnull, BOOL * _Nonnull))itemHandler
 {
     // Parse all relative file paths
-    NSArray<NSString *> *relativeFilePaths = [self _readRelativeFilePaths];
-    if (relativeFilePaths == nil) {
+    SPUDeltaArchivePathTable *relativePathTable = [self _readRelativePathTable];
+    if (relativePathTable == nil) {
         return;
     }
     
-    if (relativeFilePaths.count == 0) {
+    NSUInteger relativePathCount = relativePathTable.count;
+    if (relativePathCount == 0) {
         // No diff changes
         return;
     }
     
-    if (relativeFilePaths.count > UINT32_MAX) {
+    if (relativePathCount > UINT32_MAX) {
         // Very unlikely but we should guard against this
         // Clones rely on 32-bit indexes
         _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_TOO_MANY_FILES userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"There are too many file entries to apply a patch for (more than %u)", UINT32_MAX] }];
@@ -447,6 +1122,11 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                 break;
             }
             
+            if ((commands & SPUDeltaItemCommandDuplicate) != 0 && (commands & (SPUDeltaItemCommandExtract | SPUDeltaItemCommandClone | SPUDeltaItemCommandBinaryDiff)) != SPUDeltaItemCommandExtract) {
+                _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CLONE_LOOKUP userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Item %llu is a duplicate without being extracted", currentItemIndex] }];
+                break;
+            }
+            
             // Check if we need to decode additional data
             uint16_t decodedMode = 0;
             uint64_t decodedDataLength = 0;
@@ -466,12 +1146,16 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                     break;
                 }
                 
-                if ((NSUInteger)cloneRelativePathIndex >= relativeFilePaths.count) {
-                    _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CLONE_LOOKUP userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Index %u is past relative path table bounds of length %lu", cloneRelativePathIndex, (unsigned long)relativeFilePaths.count] }];
+                if ((NSUInteger)cloneRelativePathIndex >= relativePathCount) {
+                    _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CLONE_LOOKUP userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Index %u is past relative path table bounds of length %lu", cloneRelativePathIndex, (unsigned long)relativePathCount] }];
                     break;
                 }
                 
-                clonedRelativePath = relativeFilePaths[cloneRelativePathIndex];
+                clonedRelativePath = [relativePathTable pathAtIndex:cloneRelativePathIndex];
+                if (clonedRelativePath == nil) {
+                    _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path at index %u cannot be decoded as a file system representation", cloneRelativePathIndex] }];
+                    break;
+                }
                 
                 if ((commands & SPUDeltaItemCommandBinaryDiff) != 0) {
                     if (![self _readBuffer:&decodedDataLength length:sizeof(decodedDataLength)]) {
@@ -498,7 +1182,24 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                 
                 // Decode data length
                 // Length doesn't matter for directory names (we already track the name in the relative path)
-                if (S_ISREG(decodedMode)) {
+                if ((commands & SPUDeltaItemCommandDuplicate) != 0) {
+                    // Duplicates have the index of the earlier item with the same contents instead
+                    uint32_t originalItemIndex = 0;
+                    if (![self _readBuffer:&originalItemIndex length:sizeof(originalItemIndex)]) {
+                        break;
+                    }
+                    
+                    SPUDeltaArchiveItem *originalItem = ((NSUInteger)originalItemIndex < archiveItems.count) ? archiveItems[originalItemIndex] : nil;
+                    // The original is an earlier item that writes a regular file of its own, from its data or from a diff
+                    SPUDeltaItemCommands originalCommands = originalItem.commands;
+                    BOOL originalWritesFile = ((originalCommands & SPUDeltaItemCommandDuplicate) == 0) && (((originalCommands & SPUDeltaItemCommandBinaryDiff) != 0) || ((originalCommands & SPUDeltaItemCommandExtract) != 0 && S_ISREG(originalItem.mode)));
+                    if (originalItem == nil || !S_ISREG(decodedMode) || !originalWritesFile) {
+                        _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CLONE_LOOKUP userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Item %llu cannot be a duplicate of item %u", currentItemIndex, originalItemIndex] }];
+                        break;
+                    }
+                    
+                    clonedRelativePath = originalItem.relativeFilePath;
+                } else if (S_ISREG(decodedMode)) {
                     if (![self _readBuffer:&decodedDataLength length:sizeof(decodedDataLength)]) {
                         break;
                     }
@@ -517,7 +1218,18 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                 }
             }
             
-            SPUDeltaArchiveItem *archiveItem = [[SPUDeltaArchiveItem alloc] initWithRelativeFilePath:relativeFilePaths[currentItemIndex] commands:commands mode:decodedMode];
+            if (currentItemIndex >= relativePathCount) {
+                _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_TOO_MANY_FILES userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"There are more commands than entries in the relative path table of length %lu", (unsigned long)relativePathCount] }];
+                break;
+            }
+            
+            NSString *relativePath = [relativePathTable pathAtIndex:(NSUInteger)currentItemIndex];
+            if (relativePath == nil) {
+                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path at index %llu cannot be decoded as a file system representation", currentItemIndex] }];
+                break;
+            }
+            
+            SPUDeltaArchiveItem *archiveItem = [[SPUDeltaArchiveItem alloc] initWithRelativeFilePath:relativePath commands:commands mode:decodedMode];
             
             archiveItem.codedDataLength = decodedDataLength;
             archiveItem.clonedRelativePath = clonedRelativePath;
@@ -532,6 +1244,29 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         return;
     }
     
+    if (_blobLocations != nil) {
+        // Locate the data blobs of items
+        const uint32_t *blobLocations = _blobLocations.bytes;
+        NSUInteger blobCount = _blobLocations.length / (2 * sizeof(uint32_t));
+        NSUInteger blobIndex = 0;
+        for (SPUDeltaArchiveItem *item in archiveItems) {
+            if (!itemHasDataBlob(item.commands, item.mode)) {
+                continue;
+            }
+            
+            if (blobIndex < blobCount) {
+                item.blobFrameIndex = blobLocations[2 * blobIndex];
+                item.blobFrameOffset = blobLocations[2 * blobIndex + 1];
+            }
+            blobIndex++;
+        }
+        
+        if (blobIndex != blobCount) {
+            _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_BLOB_INDEX userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Blob index has %lu blobs but the commands have %lu.", (unsigned long)blobCount, (unsigned long)blobIndex] }];
+            return;
+        }
+    }
+    
     // Feed items back to caller
     BOOL exitedEarly = NO;
     for (SPUDeltaArchiveItem *item in archiveItems) {
@@ -542,6 +1277,31 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     }
 }
 
+// Reads the next bytes of an item's data in order, or through the blob index reader if there is one
+- (BOOL)_readItemData:(void *)buffer length:(int32_t)length blobIndexReader:(SPUDeltaArchiveItemReader)blobIndexReader SPU_OBJC_DIRECT
+{
+    if (blobIndexReader == nil) {
+        return [self _readBuffer:buffer length:length];
+    }
+    
+    uint8_t *bytes = buffer;
+    size_t bytesLeftoverToRead = (size_t)length;
+    while (bytesLeftoverToRead > 0) {
+        ssize_t bytesRead = blobIndexReader(bytes, bytesLeftoverToRead);
+        if (bytesRead <= 0) {
+            if (bytesRead == 0) {
+                [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CHUNK_SIZE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Item data ended %lu bytes early.", (unsigned long)bytesLeftoverToRead] }]];
+            }
+            return NO;
+        }
+        
+        bytes += bytesRead;
+        bytesLeftoverToRead -= (size_t)bytesRead;
+    }
+    
+    return YES;
+}
+
 - (BOOL)extractItem:(SPUDeltaArchiveItem *)item
 {
     NSString *itemFilePath = item.itemFilePath;
@@ -552,6 +1312,10 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     
     uint16_t mode = item.mode;
     
+    // With a blob index, items are extracted out of order and possibly on multiple threads,
+    // so errors are only recorded and the shared buffers aren't used
+    SPUDeltaArchiveItemReader blobIndexReader = (_blobLocations != nil) ? [self _blobIndexReaderForItem:item] : nil;
+    
     NSFileManager *fileManager = [NSFileManager defaultManager];
     if ((commands & SPUDeltaItemCommandBinaryDiff) != 0 || S_ISREG(mode) || S_ISLNK(mode)) {
         // Handle regular files
@@ -566,31 +1330,35 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             
             char itemFilePathString[PATH_MAX + 1] = {0};
             if (![itemFilePath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
-                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path to extract cannot be decoded and expressed as a file system representation: %@", itemFilePath] }];
+                [self _recordError:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path to extract cannot be decoded and expressed as a file system representation: %@", itemFilePath] }]];
                 return NO;
             }
             
             FILE *outputFile = fopen(itemFilePathString, "wb");
             if (outputFile == NULL) {
-                _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to fopen() %@", itemFilePath] }];
+                [self _recordError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to fopen() %@", itemFilePath] }]];
                 return NO;
             }
             
+            BOOL extractedData = YES;
             if (decodedLength > 0) {
                 // Write out archive contents to file in chunks
                 
+                NSMutableData *chunkData = (blobIndexReader != nil) ? [NSMutableData dataWithLength:PARTIAL_IO_CHUNK_SIZE] : nil;
+                void *tempBuffer = (chunkData != nil) ? chunkData.mutableBytes : _partialChunkBuffer;
+                
                 uint64_t bytesLeftoverToCopy = decodedLength;
                 while (bytesLeftoverToCopy > 0) {
                     uint64_t currentBlockSize = (bytesLeftoverToCopy >= PARTIAL_IO_CHUNK_SIZE) ? PARTIAL_IO_CHUNK_SIZE : bytesLeftoverToCopy;
                     
-                    void *tempBuffer = _partialChunkBuffer;
-                    
-                    if (![self _readBuffer:tempBuffer length:(int32_t)currentBlockSize]) {
+                    if (![self _readItemData:tempBuffer length:(int32_t)currentBlockSize blobIndexReader:blobIndexReader]) {
+                        extractedData = NO;
                         break;
                     }
                     
                     if (fwrite(tempBuffer, currentBlockSize, 1, outputFile) < 1) {
-                        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to fwrite() %llu bytes during extraction.", currentBlockSize] }];
+                        [self _recordError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to fwrite() %llu bytes during extraction.", currentBlockSize] }]];
+                        extractedData = NO;
                         break;
                     }
                     
@@ -600,12 +1368,12 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             
             fclose(outputFile);
             
-            if (_error != nil) {
+            if (!extractedData) {
                 return NO;
             }
             
             if ((commands & SPUDeltaItemCommandExtract) != 0 && chmod(itemFilePathString, mode) != 0) {
-                _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to chmod() mode %d on %@", mode, itemFilePath] }];
+                [self _recordError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to chmod() mode %d on %@", mode, itemFilePath] }]];
                 return NO;
             }
         } else {
@@ -613,25 +1381,25 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             
             if (PARTIAL_IO_CHUNK_SIZE < decodedLength) {
                 // Something is seriously wrong
-                _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CHUNK_SIZE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"PARTIAL_IO_CHUNK_SIZE (%d) < decodedLength (%llu)", PARTIAL_IO_CHUNK_SIZE, decodedLength] }];
+                [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_BAD_CHUNK_SIZE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"PARTIAL_IO_CHUNK_SIZE (%d) < decodedLength (%llu)", PARTIAL_IO_CHUNK_SIZE, decodedLength] }]];
                 return NO;
             }
             
             if (decodedLength > PATH_MAX) {
                 // Link is too long
-                _error = [NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_LINK_TOO_LONG userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Decoded length for link (%llu) is too long.", decodedLength] }];
+                [self _recordError:[NSError errorWithDomain:SPARKLE_DELTA_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_ARCHIVE_ERROR_CODE_LINK_TOO_LONG userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Decoded length for link (%llu) is too long.", decodedLength] }]];
                 return NO;
             }
             
             char buffer[PATH_MAX + 1] = {0};
-            if (![self _readBuffer:buffer length:(int32_t)decodedLength]) {
+            if (![self _readItemData:buffer length:(int32_t)decodedLength blobIndexReader:blobIndexReader]) {
                 return NO;
             }
             
             NSString *destinationPath = [fileManager stringWithFileSystemRepresentation:buffer length:decodedLength];
             
             if (destinationPath == nil) {
-                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Destination path for link %@ cannot be created in a file system representation: %@",itemFilePath, destinationPath] }];
+                [self _recordError:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Destination path for link %@ cannot be created in a file system representation: %@",itemFilePath, destinationPath] }]];
                 return NO;
             }
             
@@ -639,13 +1407,13 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             
             NSError *createLinkError = nil;
             if (![fileManager createSymbolicLinkAtPath:itemFilePath withDestinationPath:destinationPath error:&createLinkError]) {
-                _error = createLinkError;
+                [self _recordError:createLinkError];
                 return NO;
             }
             
             char itemFilePathString[PATH_MAX + 1] = {0};
             if (![itemFilePath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
-                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Link path to extract cannot be decoded and expressed as a file system representation: %@", itemFilePath] }];
+                [self _recordError:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Link path to extract cannot be decoded and expressed as a file system representation: %@", itemFilePath] }]];
                 return NO;
             }
             
@@ -657,11 +1425,261 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     } else if (S_ISDIR(mode)) {
         NSError *createDirectoryError = nil;
         if (![fileManager createDirectoryAtPath:itemFilePath withIntermediateDirectories:NO attributes:@{NSFilePosixPermissions: @(mode)} error:&createDirectoryError]) {
-            _error = createDirectoryError;
+            [self _recordError:createDirectoryError];
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)readItem:(SPUDeltaArchiveItem *)item handler:(BOOL (NS_NOESCAPE ^)(SPUDeltaArchiveItemReader))handler
+{
+    if (_blobLocations != nil) {
+        // The item's data is located through the blob index so there's nothing to skip past afterwards
+        return handler([self _blobIndexReaderForItem:item]);
+    }
+    
+    if (_error != nil) {
+        return NO;
+    }
+    
+    SPUDeltaItemCommands commands = item.commands;
+    assert((commands & SPUDeltaItemCommandBinaryDiff) != 0 || ((commands & SPUDeltaItemCommandExtract) != 0 && S_ISREG(item.mode)));
+    
+    __block uint64_t bytesLeftoverToRead = item.codedDataLength;
+    BOOL handled = handler(^ssize_t(void *buffer, size_t length) {
+        if (bytesLeftoverToRead == 0) {
+            return 0;
+        }
+        
+        uint64_t currentBlockSize = MIN(MIN((uint64_t)length, bytesLeftoverToRead), (uint64_t)INT32_MAX);
+        if (![self _readBuffer:buffer length:(int32_t)currentBlockSize]) {
+            return -1;
+        }
+        
+        bytesLeftoverToRead -= currentBlockSize;
+        return (ssize_t)currentBlockSize;
+    });
+    
+    // Skip past any data the handler didn't read so the next item can be read
+    while (_error == nil && bytesLeftoverToRead > 0) {
+        uint64_t currentBlockSize = (bytesLeftoverToRead >= PARTIAL_IO_CHUNK_SIZE) ? PARTIAL_IO_CHUNK_SIZE : bytesLeftoverToRead;
+        if (![self _readBuffer:_partialChunkBuffer length:(int32_t)currentBlockSize]) {
+            break;
+        }
+        
+        bytesLeftoverToRead -= currentBlockSize;
+    }
+    
+    return handled && _error == nil;
+}
+
+// Waits for the oldest frame to be compressed and writes it to the archive
+- (BOOL)_writeOldestFrame SPU_OBJC_DIRECT
+{
+    SPUDeltaArchiveFrame *frame = _pendingFrames.firstObject;
+    [_pendingFrames removeObjectAtIndex:0];
+    
+    dispatch_group_wait(frame.group, DISPATCH_TIME_FOREVER);
+    NSData *compressedData = frame.data;
+    if (compressedData == nil) {
+        _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to compress frame of %u bytes.", frame.decodedLength] }];
+        return NO;
+    }
+    
+    off_t frameOffset = ftello(_file);
+    if (frameOffset < 0) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Failed to retrieve offset of frame." }];
+        return NO;
+    }
+    
+    uint64_t blobIndexFrameOffset = (uint64_t)frameOffset;
+    [_frameOffsets appendBytes:&blobIndexFrameOffset length:sizeof(blobIndexFrameOffset)];
+    
+    uint32_t frameHeader[2] = {(uint32_t)compressedData.length | (frame.stored ? STORED_FRAME_FLAG : 0), frame.decodedLength};
+    if (fwrite(frameHeader, sizeof(frameHeader), 1, _file) < 1 || fwrite(compressedData.bytes, compressedData.length, 1, _file) < 1) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to write %lu compressed frame bytes.", (unsigned long)compressedData.length] }];
+        return NO;
+    }
+    
+    return YES;
+}
+
+// Starts compressing the frame being filled on a worker thread, or stores it as is while storing frames
+- (BOOL)_compressFrameBuffer SPU_OBJC_DIRECT
+{
+    NSData *frameData = _frameBuffer;
+    _frameBuffer = [NSMutableData dataWithCapacity:FRAME_SIZE];
+    
+    SPUDeltaArchiveFrame *frame = [[SPUDeltaArchiveFrame alloc] initWithDecodedLength:(uint32_t)frameData.length];
+    if (_storingFrames) {
+        frame.stored = YES;
+        frame.data = frameData;
+    } else {
+        spu_delta_codec_algorithm algorithm = _codecAlgorithmForMode(_compression);
+        int level = _codecLevel;
+        dispatch_group_async(frame.group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            frame.data = compressedFrameData(frameData, algorithm, level);
+        });
+    }
+    [_pendingFrames addObject:frame];
+    _frameCount++;
+    
+    // Limit how many frames are held in memory
+    while (_pendingFrames.count > _maxPendingFrames) {
+        if (![self _writeOldestFrame]) {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)_writeFramedBuffer:(const void *)buffer length:(int32_t)length SPU_OBJC_DIRECT
+{
+    const uint8_t *bytes = buffer;
+    NSUInteger bytesLeftoverToWrite = (NSUInteger)length;
+    while (bytesLeftoverToWrite > 0) {
+        NSUInteger copyLength = MIN(FRAME_SIZE - _frameBuffer.length, bytesLeftoverToWrite);
+        [_frameBuffer appendBytes:bytes length:copyLength];
+        
+        bytes += copyLength;
+        bytesLeftoverToWrite -= copyLength;
+        
+        if (_frameBuffer.length == FRAME_SIZE && ![self _compressFrameBuffer]) {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+// Records where the data blob about to be written starts for the blob index
+- (void)_addBlobLocation SPU_OBJC_DIRECT
+{
+    uint32_t blobLocation[2] = {_frameCount, (uint32_t)_frameBuffer.length};
+    [_blobLocations appendBytes:blobLocation length:sizeof(blobLocation)];
+}
+
+// Estimates whether the item's data is already compressed, like images, asset catalogs or embedded archives,
+// from the entropy of a few samples spread through it
+- (BOOL)_itemDataIsIncompressible:(SPUDeltaArchiveItem *)item SPU_OBJC_DIRECT
+{
+    uint64_t dataLength = item.codedDataLength;
+    if (dataLength < MIN_STORED_BLOB_SIZE) {
+        return NO;
+    }
+    
+    uint64_t byteCounts[256] = {0};
+    uint64_t sampleStride = (dataLength - PARTIAL_IO_CHUNK_SIZE) / (ENTROPY_SAMPLE_COUNT - 1);
+    
+    NSData *itemData = item.itemData;
+    if (itemData != nil) {
+        const uint8_t *itemBytes = itemData.bytes;
+        for (uint64_t sampleIndex = 0; sampleIndex < ENTROPY_SAMPLE_COUNT; sampleIndex++) {
+            addByteCounts(byteCounts, itemBytes + sampleIndex * sampleStride, PARTIAL_IO_CHUNK_SIZE);
+        }
+    } else {
+        char itemFilePathString[PATH_MAX + 1] = {0};
+        if (![item.itemFilePath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
+            return NO;
+        }
+        
+        FILE *inputFile = fopen(itemFilePathString, "rb");
+        if (inputFile == NULL) {
+            return NO;
+        }
+        
+        BOOL sampledFile = YES;
+        for (uint64_t sampleIndex = 0; sampleIndex < ENTROPY_SAMPLE_COUNT; sampleIndex++) {
+            if (fseeko(inputFile, (off_t)(sampleIndex * sampleStride), SEEK_SET) != 0 || fread(_partialChunkBuffer, PARTIAL_IO_CHUNK_SIZE, 1, inputFile) < 1) {
+                sampledFile = NO;
+                break;
+            }
+            
+            addByteCounts(byteCounts, _partialChunkBuffer, PARTIAL_IO_CHUNK_SIZE);
+        }
+        
+        fclose(inputFile);
+        
+        if (!sampledFile) {
+            // Writing the item will report the error
+            return NO;
+        }
+    }
+    
+    return byteEntropy(byteCounts, ENTROPY_SAMPLE_COUNT * PARTIAL_IO_CHUNK_SIZE) >= INCOMPRESSIBLE_ENTROPY_THRESHOLD;
+}
+
+// Finds extracted regular files with the same contents as an earlier extracted or patched file
+// The digests of the items' contents are provided by the creator of the archive, which has already hashed the new tree
+// Returns the indexes of the duplicates mapped to the indexes of the items they duplicate
+- (NSDictionary<NSNumber *, NSNumber *> *)_duplicateItemIndexesOfItems:(NSArray<SPUDeltaArchiveItem *> *)items SPU_OBJC_DIRECT
+{
+    NSMutableDictionary<NSNumber *, NSNumber *> *duplicateItemIndexes = [NSMutableDictionary dictionary];
+    
+    // Items were added in order so the first item with each digest is the original
+    NSMutableDictionary<NSData *, NSNumber *> *originalItemIndexes = [NSMutableDictionary dictionary];
+    NSUInteger itemCount = items.count;
+    for (NSUInteger itemIndex = 0; itemIndex < itemCount; itemIndex++) {
+        SPUDeltaArchiveItem *item = items[itemIndex];
+        NSData *digest = item.contentDigest;
+        if (digest == nil) {
+            continue;
+        }
+        
+        SPUDeltaItemCommands commands = item.commands;
+        BOOL extractsFile = ((commands & (SPUDeltaItemCommandExtract | SPUDeltaItemCommandClone | SPUDeltaItemCommandBinaryDiff)) == SPUDeltaItemCommandExtract);
+        if (!extractsFile && (commands & SPUDeltaItemCommandBinaryDiff) == 0) {
+            continue;
+        }
+        
+        NSNumber *originalItemIndex = originalItemIndexes[digest];
+        if (originalItemIndex == nil) {
+            originalItemIndexes[digest] = @(itemIndex);
+        } else if (extractsFile) {
+            // Only extracted files can refer to another item, since patched files need their diff
+            duplicateItemIndexes[@(itemIndex)] = originalItemIndex;
+        }
+    }
+    
+    return duplicateItemIndexes;
+}
+
+// Compresses and writes out the remaining frames followed by the end of frames marker and the blob index
+- (BOOL)_finishWritingFrames SPU_OBJC_DIRECT
+{
+    if (_frameBuffer.length > 0 && ![self _compressFrameBuffer]) {
+        return NO;
+    }
+    
+    while (_pendingFrames.count > 0) {
+        if (![self _writeOldestFrame]) {
             return NO;
         }
     }
     
+    uint32_t endFrameHeader[2] = {0, 0};
+    if (fwrite(endFrameHeader, sizeof(endFrameHeader), 1, _file) < 1) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write end of frames marker due to io error" }];
+        return NO;
+    }
+    
+    off_t blobIndexOffset = ftello(_file);
+    uint32_t frameCount = _frameCount;
+    uint32_t blobCount = (uint32_t)(_blobLocations.length / (2 * sizeof(uint32_t)));
+    uint64_t encodedBlobIndexOffset = (uint64_t)blobIndexOffset;
+    if (blobIndexOffset < 0 ||
+        fwrite(&frameCount, sizeof(frameCount), 1, _file) < 1 ||
+        (_frameOffsets.length > 0 && fwrite(_frameOffsets.bytes, _frameOffsets.length, 1, _file) < 1) ||
+        fwrite(&blobCount, sizeof(blobCount), 1, _file) < 1 ||
+        (_blobLocations.length > 0 && fwrite(_blobLocations.bytes, _blobLocations.length, 1, _file) < 1) ||
+        fwrite(&encodedBlobIndexOffset, sizeof(encodedBlobIndexOffset), 1, _file) < 1) {
+        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write blob index due to io error" }];
+        return NO;
+    }
+    
     return YES;
 }
 
@@ -702,7 +1720,12 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         case SPUDeltaCompressionModeLZMA:
         case SPUDeltaCompressionModeLZFSE:
         case SPUDeltaCompressionModeLZ4:
-        case SPUDeltaCompressionModeZLIB: {
+        case SPUDeltaCompressionModeZLIB:
+        case SPUDeltaCompressionModeZstd: {
+            if (_framedCompression) {
+                return [self _writeFramedBuffer:buffer length:length];
+            }
+            
             _compressionStream.src_ptr = buffer;
             _compressionStream.src_size = (size_t)length;
             
@@ -713,8 +1736,8 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                 _compressionStream.dst_ptr = compressionBuffer;
                 _compressionStream.dst_size = COMPRESSION_BUFFER_SIZE;
                 
-                if (compression_stream_process(&_compressionStream, 0) == COMPRESSION_STATUS_ERROR) {
-                    _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:COMPRESSION_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to write %d compressed bytes.", length] }];
+                if (spu_delta_codec_stream_process(&_compressionStream, 0) == SPU_DELTA_CODEC_STATUS_ERROR) {
+                    _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to write %d compressed bytes.", length] }];
                     return NO;
                 }
                 
@@ -761,7 +1784,7 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         return;
     }
     
-    // We only support configuring compression level for bzip2
+    // We only support configuring compression level for bzip2 and zstd
     uint8_t compressionLevel = 0;
     switch (compression) {
         case SPUDeltaCompressionModeBzip2:
@@ -777,6 +1800,22 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
 #else
             _error = [NSError errorWithDomain:SPARKLE_BZIP2_ERROR_DOMAIN code:-1 userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write bzip2 patch because bzip2 support is disabled" }];
             return;
+#endif
+        case SPUDeltaCompressionModeZstd:
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+            // Only 1 - 19 are valid, 0 is a special case for using default 19
+            if (header.compressionLevel <= 0 || header.compressionLevel > SPUDeltaZstdMaxCompressionLevel) {
+                _codecLevel = SPUDeltaZstdMaxCompressionLevel;
+            } else {
+                _codecLevel = header.compressionLevel;
+            }
+            
+            // The metadata only has room for levels up to 15, but the level isn't needed for decoding
+            compressionLevel = (uint8_t)MIN(_codecLevel, 15);
+            break;
+#else
+            _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write zstd patch because zstd support is disabled" }];
+            return;
 #endif
         // Some supported formats below have a documented level even though it's not customizable
         // Let's record them in the archive
@@ -793,7 +1832,13 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             compressionLevel = 0;
     }
     
-    SparkleDeltaArchiveMetadata metadata = {.compressionLevel = compressionLevel, .fileSystemCompression = header.fileSystemCompression};
+    // bzip2 and uncompressed archives aren't compressed in frames
+    if (compression == SPUDeltaCompressionModeNone || compression == SPUDeltaCompressionModeBzip2) {
+        _framedCompression = NO;
+    }
+    
+    // Framed archives always get a blob index
+    SparkleDeltaArchiveMetadata metadata = {.compressionLevel = compressionLevel, .framedCompression = _framedCompression, .blobIndex = _framedCompression, .fileSystemCompression = header.fileSystemCompression};
     
     if (fwrite(&metadata, sizeof(metadata), 1, file) < 1) {
         _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write metadata value due to io error" }];
@@ -831,9 +1876,20 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         case SPUDeltaCompressionModeLZMA:
         case SPUDeltaCompressionModeLZFSE:
         case SPUDeltaCompressionModeLZ4:
-        case SPUDeltaCompressionModeZLIB: {
-            if (compression_stream_init(&_compressionStream, COMPRESSION_STREAM_ENCODE, _compressionAlgorithmForMode(compression)) != COMPRESSION_STATUS_OK) {
-                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:COMPRESSION_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to open compression stream for writing" }];
+        case SPUDeltaCompressionModeZLIB:
+        case SPUDeltaCompressionModeZstd: {
+            if (_framedCompression) {
+                // Frames are compressed on other threads while the next ones are filled
+                _frameBuffer = [NSMutableData dataWithCapacity:FRAME_SIZE];
+                _pendingFrames = [NSMutableArray array];
+                _maxPendingFrames = MAX(NSProcessInfo.processInfo.activeProcessorCount, 2u);
+                _frameOffsets = [NSMutableData data];
+                _blobLocations = [NSMutableData data];
+                break;
+            }
+            
+            if (spu_delta_codec_stream_init(&_compressionStream, SPU_DELTA_CODEC_ENCODE, _codecAlgorithmForMode(compression), _codecLevel) != SPU_DELTA_CODEC_STATUS_OK) {
+                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to open compression stream for writing" }];
                 
                 return;
             }
@@ -853,6 +1909,10 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     uint16_t minorVersion = header.minorVersion;
     [self _writeBuffer:&minorVersion length:sizeof(minorVersion)];
     
+    _frontCodedPaths = MAJOR_VERSION_IS_AT_LEAST(header.majorVersion, SUBinaryDeltaMajorVersion3) && minorVersion >= SUBinaryDeltaMinorVersion3_5;
+    _storesIncompressibleBlobs = _storesIncompressibleBlobs && _framedCompression && MAJOR_VERSION_IS_AT_LEAST(header.majorVersion, SUBinaryDeltaMajorVersion3) && minorVersion >= SUBinaryDeltaMinorVersion3_6;
+    _deduplicatesBlobs = _deduplicatesBlobs && MAJOR_VERSION_IS_AT_LEAST(header.majorVersion, SUBinaryDeltaMajorVersion3) && minorVersion >= SUBinaryDeltaMinorVersion3_7;
+    
     [self _writeBuffer:header.beforeTreeHash length:CC_SHA1_DIGEST_LENGTH];
     [self _writeBuffer:header.afterTreeHash length:CC_SHA1_DIGEST_LENGTH];
 }
@@ -904,27 +1964,39 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
         return;
     }
     
-    // Compute length of path section to write
-    uint64_t totalPathLength = 0;
-    for (SPUDeltaArchiveItem *item in writableItems) {
-        NSString *relativePath = item.relativeFilePath;
-        
-        char relativePathString[PATH_MAX + 1] = {0};
-        if (![relativePath getFileSystemRepresentation:relativePathString maxLength:sizeof(relativePathString) - 1]) {
-            _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path cannot be retrieved and expressed as a file system representation: %@", relativePath] }];
-            break;
-        }
-        
-        totalPathLength += strlen(relativePathString) + 1;
-    }
-    for (NSString *clonedPathEntry in newClonedPathEntries) {
-        char relativePathString[PATH_MAX + 1] = {0};
-        if (![clonedPathEntry getFileSystemRepresentation:relativePathString maxLength:sizeof(relativePathString) - 1]) {
-            _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path for clone cannot be retrieved and expressed as a file system representation: %@", clonedPathEntry] }];
-            break;
+    // Encode the relative path table, with the paths of the items followed by the clone entries
+    NSMutableData *pathTable = [NSMutableData data];
+    {
+        NSUInteger itemCount = writableItems.count;
+        NSUInteger pathCount = itemCount + newClonedPathEntries.count;
+        char previousPath[PATH_MAX + 1] = {0};
+        size_t previousPathLength = 0;
+        for (NSUInteger pathIndex = 0; pathIndex < pathCount; pathIndex++) {
+            NSString *relativePath = (pathIndex < itemCount) ? writableItems[pathIndex].relativeFilePath : newClonedPathEntries[pathIndex - itemCount];
+            
+            char pathBuffer[PATH_MAX + 1] = {0};
+            if (![relativePath getFileSystemRepresentation:pathBuffer maxLength:sizeof(pathBuffer) - 1]) {
+                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path cannot be retrieved and expressed as a file system representation: %@", relativePath] }];
+                break;
+            }
+            
+            size_t pathLength = strlen(pathBuffer);
+            if (_frontCodedPaths) {
+                size_t sharedLength = 0;
+                while (sharedLength < pathLength && sharedLength < previousPathLength && pathBuffer[sharedLength] == previousPath[sharedLength]) {
+                    sharedLength++;
+                }
+                
+                appendPathTableVarint(pathTable, sharedLength);
+                appendPathTableVarint(pathTable, pathLength - sharedLength);
+                [pathTable appendBytes:pathBuffer + sharedLength length:pathLength - sharedLength];
+                
+                memcpy(previousPath, pathBuffer, pathLength + 1);
+                previousPathLength = pathLength;
+            } else {
+                [pathTable appendBytes:pathBuffer length:pathLength + 1];
+            }
         }
-        
-        totalPathLength += strlen(relativePathString) + 1;
     }
     
     if (_error != nil) {
@@ -932,44 +2004,40 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     }
     
     // Write total expected length of path section
+    uint64_t totalPathLength = pathTable.length;
     if (![self _writeBuffer:&totalPathLength length:sizeof(totalPathLength)]) {
         return;
     }
     
-    // Write all of the relative paths
-    for (SPUDeltaArchiveItem *item in writableItems) {
-        NSString *relativePath = item.relativeFilePath;
-        
-        char pathBuffer[PATH_MAX + 1] = {0};
-        if (![relativePath getFileSystemRepresentation:pathBuffer maxLength:PATH_MAX]) {
-            _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path cannot be encoded and expressed as a file system representation: %@", relativePath] }];
-            break;
-        }
-        
-        if (![self _writeBuffer:pathBuffer length:(int32_t)strlen(pathBuffer) + 1]) {
-            break;
-        }
-    }
-    for (NSString *clonedPathEntry in newClonedPathEntries) {
-        char pathBuffer[PATH_MAX + 1] = {0};
-        if (![clonedPathEntry getFileSystemRepresentation:pathBuffer maxLength:PATH_MAX]) {
-            _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path for clone cannot be encoded and expressed as a file system representation: %@", clonedPathEntry] }];
-            break;
-        }
-        
-        if (![self _writeBuffer:pathBuffer length:(int32_t)strlen(pathBuffer) + 1]) {
-            break;
+    // Write all of the relative paths in chunks
+    {
+        uint8_t *pathTableBytes = pathTable.mutableBytes;
+        uint64_t bytesLeftoverToWrite = totalPathLength;
+        while (bytesLeftoverToWrite > 0) {
+            uint64_t currentBlockSize = (bytesLeftoverToWrite >= PARTIAL_IO_CHUNK_SIZE) ? PARTIAL_IO_CHUNK_SIZE : bytesLeftoverToWrite;
+            
+            if (![self _writeBuffer:pathTableBytes + (totalPathLength - bytesLeftoverToWrite) length:(int32_t)currentBlockSize]) {
+                return;
+            }
+            
+            bytesLeftoverToWrite -= currentBlockSize;
         }
     }
     
-    if (_error != nil) {
-        return;
-    }
+    // Extracted files with the same contents as an earlier extracted or patched file refer to it instead of having data of their own
+    NSDictionary<NSNumber *, NSNumber *> *duplicateItemIndexes = _deduplicatesBlobs ? [self _duplicateItemIndexesOfItems:writableItems] : nil;
     
     // Encode the items
+    NSUInteger encodedItemIndex = 0;
     for (SPUDeltaArchiveItem *item in writableItems) {
+        NSNumber *originalItemIndex = duplicateItemIndexes[@(encodedItemIndex)];
+        encodedItemIndex++;
+        
         // Store commands
         SPUDeltaItemCommands commands = item.commands;
+        if (originalItemIndex != nil) {
+            commands |= SPUDeltaItemCommandDuplicate;
+        }
         if (![self _writeBuffer:&commands length:sizeof(commands)]) {
             break;
         }
@@ -1028,22 +2096,29 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             }
             
             if ((commands & SPUDeltaItemCommandBinaryDiff) != 0) {
-                NSString *itemPath = item.itemFilePath;
-                assert(itemPath != nil);
-                
-                char itemFilePathString[PATH_MAX + 1] = {0};
-                if (![itemPath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
-                    _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path cannot be decoded and expressed as a file system representation while encoding cloned binary diff item: %@", itemPath] }];
-                    break;
-                }
-                
-                struct stat fileInfo = {0};
-                if (lstat(itemFilePathString, &fileInfo) != 0) {
-                    _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to lstat() on %@", itemPath] }];
-                    break;
+                uint64_t dataLength;
+                NSData *itemData = item.itemData;
+                if (itemData != nil) {
+                    dataLength = (uint64_t)itemData.length;
+                } else {
+                    NSString *itemPath = item.itemFilePath;
+                    assert(itemPath != nil);
+                    
+                    char itemFilePathString[PATH_MAX + 1] = {0};
+                    if (![itemPath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
+                        _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path cannot be decoded and expressed as a file system representation while encoding cloned binary diff item: %@", itemPath] }];
+                        break;
+                    }
+                    
+                    struct stat fileInfo = {0};
+                    if (lstat(itemFilePathString, &fileInfo) != 0) {
+                        _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to lstat() on %@", itemPath] }];
+                        break;
+                    }
+                    
+                    dataLength = (uint64_t)fileInfo.st_size;
                 }
                 
-                uint64_t dataLength = (uint64_t)fileInfo.st_size;
                 if (![self _writeBuffer:&dataLength length:sizeof(dataLength)]) {
                     break;
                 }
@@ -1096,22 +2171,33 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             // Store data length
             // Length doesn't matter for directory names (we already track the name in the relative path)
             
-            NSString *itemPath = item.itemFilePath;
-            assert(itemPath != nil);
-            
-            char itemFilePathString[PATH_MAX + 1] = {0};
-            if (![itemPath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
-                _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path cannot be decoded and expressed as a file system representation while encoding items: %@", itemPath] }];
-                break;
-            }
-            
+            NSData *itemData = item.itemData;
             struct stat itemFileInfo = {0};
-            if (lstat(itemFilePathString, &itemFileInfo) != 0) {
-                _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to lstat() on %@", itemPath] }];
-                break;
+            if (itemData != nil) {
+                itemFileInfo.st_size = (off_t)itemData.length;
+            } else {
+                NSString *itemPath = item.itemFilePath;
+                assert(itemPath != nil);
+                
+                char itemFilePathString[PATH_MAX + 1] = {0};
+                if (![itemPath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
+                    _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path cannot be decoded and expressed as a file system representation while encoding items: %@", itemPath] }];
+                    break;
+                }
+                
+                if (lstat(itemFilePathString, &itemFileInfo) != 0) {
+                    _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to lstat() on %@", itemPath] }];
+                    break;
+                }
             }
             
-            if ((commands & SPUDeltaItemCommandBinaryDiff) != 0 || S_ISREG(extractMode)) {
+            if (originalItemIndex != nil) {
+                // Store index of the item with the same contents instead
+                uint32_t originalItemCIndex = originalItemIndex.unsignedIntValue;
+                if (![self _writeBuffer:&originalItemCIndex length:sizeof(originalItemCIndex)]) {
+                    break;
+                }
+            } else if ((commands & SPUDeltaItemCommandBinaryDiff) != 0 || S_ISREG(extractMode)) {
                 uint64_t dataLength = (uint64_t)itemFileInfo.st_size;
                 if (![self _writeBuffer:&dataLength length:sizeof(dataLength)]) {
                     break;
@@ -1153,18 +2239,52 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
     
     // Encode all of our file contents
     void *tempBuffer = _partialChunkBuffer;
+    NSUInteger blobItemIndex = 0;
     for (SPUDeltaArchiveItem *item in writableItems) {
+        BOOL duplicateItem = (duplicateItemIndexes[@(blobItemIndex)] != nil);
+        blobItemIndex++;
+        
         SPUDeltaItemCommands commands = item.commands;
-        if ((commands & SPUDeltaItemCommandExtract) != 0 || (commands & SPUDeltaItemCommandBinaryDiff) != 0) {
+        if (!duplicateItem && ((commands & SPUDeltaItemCommandExtract) != 0 || (commands & SPUDeltaItemCommandBinaryDiff) != 0)) {
             NSString *itemPath = item.itemFilePath;
-            assert(itemPath != nil);
+            NSData *itemData = item.itemData;
+            assert(itemPath != nil || itemData != nil);
             
             mode_t extractMode = item.mode;
+            
+            // Incompressible blobs go in frames of their own that are stored as is, which saves compressing and decompressing them
+            BOOL storesBlob = _storesIncompressibleBlobs && ((commands & SPUDeltaItemCommandBinaryDiff) != 0 || S_ISREG(extractMode)) && [self _itemDataIsIncompressible:item];
+            if (storesBlob && _frameBuffer.length > 0 && ![self _compressFrameBuffer]) {
+                break;
+            }
+            _storingFrames = storesBlob;
+            
+            if (_blobLocations != nil && itemHasDataBlob(commands, item.mode)) {
+                [self _addBlobLocation];
+            }
+            
             if ((commands & SPUDeltaItemCommandBinaryDiff) != 0 || S_ISREG(extractMode)) {
                 // Write out file contents to archive in chunks
                 
                 uint64_t totalItemSize = item.codedDataLength;
-                if (totalItemSize > 0) {
+                if (itemData != nil) {
+                    // Contents are already in memory
+                    const uint8_t *itemBytes = itemData.bytes;
+                    uint64_t bytesLeftoverToCopy = totalItemSize;
+                    while (bytesLeftoverToCopy > 0) {
+                        uint64_t currentBlockSize = (bytesLeftoverToCopy >= PARTIAL_IO_CHUNK_SIZE) ? PARTIAL_IO_CHUNK_SIZE : bytesLeftoverToCopy;
+                        
+                        if (![self _writeBuffer:(void *)(itemBytes + (totalItemSize - bytesLeftoverToCopy)) length:(int32_t)currentBlockSize]) {
+                            break;
+                        }
+                        
+                        bytesLeftoverToCopy -= currentBlockSize;
+                    }
+                    
+                    if (_error != nil) {
+                        break;
+                    }
+                } else if (totalItemSize > 0) {
                     char itemFilePathString[PATH_MAX + 1] = {0};
                     if (![itemPath getFileSystemRepresentation:itemFilePathString maxLength:sizeof(itemFilePathString) - 1]) {
                         _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadInvalidFileNameError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Path to finish encoding cannot be decoded and expressed as a file system representation: %@", itemPath] }];
@@ -1217,11 +2337,24 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                     break;
                 }
             }
+            
+            if (storesBlob) {
+                // Compressed frames pick up after the blob
+                if (_frameBuffer.length > 0 && ![self _compressFrameBuffer]) {
+                    break;
+                }
+                _storingFrames = NO;
+            }
         }
     }
     
     // Close up and write final data to compressed streams
     
+    if (_framedCompression) {
+        if (_error == nil) {
+            [self _finishWritingFrames];
+        }
+    } else
 #if SPARKLE_BUILD_BZIP2_DELTA_SUPPORT
     if (_bzipFile != NULL) {
         int bzerror = 0;
@@ -1242,9 +2375,9 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
             _compressionStream.dst_ptr = compressionBuffer;
             _compressionStream.dst_size = COMPRESSION_BUFFER_SIZE;
         
-            compression_status status = compression_stream_process(&_compressionStream, COMPRESSION_STREAM_FINALIZE);
-            if (status == COMPRESSION_STATUS_ERROR) {
-                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:COMPRESSION_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write final bits of Compression based file" }];
+            spu_delta_codec_status status = spu_delta_codec_stream_process(&_compressionStream, 1);
+            if (status == SPU_DELTA_CODEC_STATUS_ERROR) {
+                _error = [NSError errorWithDomain:SPARKLE_COMPRESSION_ERROR_DOMAIN code:SPU_DELTA_CODEC_STATUS_ERROR userInfo:@{ NSLocalizedDescriptionKey: @"Failed to write final bits of Compression based file" }];
                 return;
             }
             
@@ -1256,7 +2389,7 @@ static compression_algorithm _compressionAlgorithmForMode(SPUDeltaCompressionMod
                 }
             }
             
-            if (status == COMPRESSION_STATUS_END) {
+            if (status == SPU_DELTA_CODEC_STATUS_END) {
                 // We're done
                 break;
             }
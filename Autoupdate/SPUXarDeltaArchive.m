@@ -98,6 +98,11 @@ extern char *xar_get_safe_path(xar_file_t f) __attribute__((weak_import));
     return HAS_XAR_GET_SAFE_PATH;
 }
 
+- (BOOL)supportsConcurrentItemAccess
+{
+    return NO;
+}
+
 - (nullable SPUDeltaArchiveHeader *)readHeader
 {
     NSString *patchFile = _patchFile;
@@ -212,7 +217,8 @@ extern char *xar_get_safe_path(xar_file_t f) __attribute__((weak_import));
         case SPUDeltaCompressionModeLZMA:
         case SPUDeltaCompressionModeLZFSE:
         case SPUDeltaCompressionModeLZ4:
-        case SPUDeltaCompressionModeZLIB: {
+        case SPUDeltaCompressionModeZLIB:
+        case SPUDeltaCompressionModeZstd: {
             _error = [NSError errorWithDomain:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_CODE_UNSUPPORTED_COMPRESSION_FAILURE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Version 2 patches only support bzip2 compression."] }];
             
             return;
@@ -228,7 +234,7 @@ extern char *xar_get_safe_path(xar_file_t f) __attribute__((weak_import));
     xar_subdoc_prop_set(attributes, AFTER_TREE_SHA1_KEY, [displayHashFromRawHash(header.afterTreeHash) UTF8String]);
 }
 
-static xar_file_t _xarAddFile(NSMutableDictionary<NSString *, NSValue *> *fileTable, xar_t x, NSString *relativePath, NSString *filePath)
+static xar_file_t _xarAddFile(NSMutableDictionary<NSString *, NSValue *> *fileTable, xar_t x, NSString *relativePath, NSString *filePath, NSData *fileData)
 {
     NSArray<NSString *> *rootRelativePathComponents = relativePath.pathComponents;
     // Relative path must at least have starting "/" component and one more path component
@@ -261,7 +267,9 @@ static xar_file_t _xarAddFile(NSMutableDictionary<NSString *, NSValue *> *fileTa
             BOOL atLastIndex = (componentIndex == relativePathComponentsCount - 1);
             
             NSString *lastPathComponent = subpathComponents.lastObject;
-            if (atLastIndex && filePath != nil) {
+            if (atLastIndex && fileData != nil) {
+                newParent = xar_add_frombuffer(x, lastParent, lastPathComponent.fileSystemRepresentation, (char *)fileData.bytes, fileData.length);
+            } else if (atLastIndex && filePath != nil) {
                 newParent = xar_add_frompath(x, lastParent, lastPathComponent.fileSystemRepresentation, filePath.fileSystemRepresentation);
             } else {
                 newParent = xar_add_frombuffer(x, lastParent, lastPathComponent.fileSystemRepresentation, "", 1);
@@ -285,7 +293,7 @@ static xar_file_t _xarAddFile(NSMutableDictionary<NSString *, NSValue *> *fileTa
     SPUDeltaItemCommands commands = item.commands;
     uint16_t mode = item.mode;
     
-    xar_file_t newFile = _xarAddFile(_fileTable, _x, relativeFilePath, filePath);
+    xar_file_t newFile = _xarAddFile(_fileTable, _x, relativeFilePath, filePath, item.itemData);
     if (newFile == NULL) {
         _error = [NSError errorWithDomain:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_CODE_ADD_FAILURE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to add xar file entry: %@", relativeFilePath] }];
         return;
@@ -408,6 +416,36 @@ static xar_file_t _xarAddFile(NSMutableDictionary<NSString *, NSValue *> *fileTa
     return YES;
 }
 
+- (BOOL)readItem:(SPUDeltaArchiveItem *)item handler:(BOOL (NS_NOESCAPE ^)(SPUDeltaArchiveItemReader))handler
+{
+    if (_error != nil) {
+        return NO;
+    }
+    
+    assert(item.xarContext != NULL);
+    
+    // xar can only extract an item's data all at once
+    xar_file_t file = item.xarContext;
+    char *buffer = NULL;
+    size_t bufferSize = 0;
+    if (xar_extract_tobuffersz(_x, file, &buffer, &bufferSize) != 0) {
+        _error = [NSError errorWithDomain:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_DOMAIN code:SPARKLE_DELTA_XAR_ARCHIVE_ERROR_CODE_EXTRACT_FAILURE userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to extract xar file entry %@ to memory", item.relativeFilePath] }];
+        return NO;
+    }
+    
+    __block size_t bytesRead = 0;
+    BOOL handled = handler(^ssize_t(void *readBuffer, size_t length) {
+        size_t currentBlockSize = MIN(length, bufferSize - bytesRead);
+        memcpy(readBuffer, buffer + bytesRead, currentBlockSize);
+        bytesRead += currentBlockSize;
+        return (ssize_t)currentBlockSize;
+    });
+    
+    free(buffer);
+    
+    return handled;
+}
+
 @end
 
 #endif
@@ -12,6 +12,11 @@
 #import <Foundation/Foundation.h>
 
 @class NSString;
+@class SPUFileDigestCache;
 BOOL applyBinaryDelta(NSString *source, NSString *destination, NSString *patchFile, BOOL verbose, void (^progressCallback)(double), NSError * __autoreleasing *error);
 
+// Same as applyBinaryDelta() but looks up the digests of the source's files in digestCache, which may be nil
+// Only meant for tools that verify patches they created, like generate_appcast. The destination's files are always read.
+BOOL applyBinaryDeltaWithFileDigestCache(NSString *source, NSString *destination, NSString *patchFile, SPUFileDigestCache *digestCache, BOOL verbose, void (^progressCallback)(double), NSError * __autoreleasing *error);
+
 #endif
@@ -13,22 +13,133 @@
 #import <CommonCrypto/CommonDigest.h>
 #import <Foundation/Foundation.h>
 #include "bspatch.h"
+#include "bsfilter.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #import <sys/stat.h>
+#include <unistd.h>
 
 
 #include "AppKitPrevention.h"
 
-static BOOL applyBinaryDeltaToFile(NSString *patchFile, NSString *sourceFilePath, NSString *destinationFilePath)
+static ssize_t readPatchData(void *context, void *buffer, size_t size)
 {
-    const char *argv[] = {"/usr/bin/bspatch", [sourceFilePath fileSystemRepresentation], [destinationFilePath fileSystemRepresentation], [patchFile fileSystemRepresentation]};
-    BOOL success = (bspatch(4, argv) == 0);
-    unlink([patchFile fileSystemRepresentation]);
+    SPUDeltaArchiveItemReader reader = (__bridge SPUDeltaArchiveItemReader)context;
+    return reader(buffer, size);
+}
+
+static int writePatchedData(void *context, const void *buffer, size_t size)
+{
+    return (fwrite(buffer, 1, size, (FILE *)context) == size) ? 0 : -1;
+}
+
+// Reverses the branch filter on a patched file in place
+static BOOL decodeBranchesOfFile(NSString *filePath)
+{
+    int fd = open(filePath.fileSystemRepresentation, O_RDWR);
+    if (fd == -1) {
+        return NO;
+    }
+    
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0 || fileInfo.st_size <= 0) {
+        close(fd);
+        return NO;
+    }
+    
+    // Only the code sections get written to, so map the file instead of reading all of it
+    void *bytes = mmap(NULL, (size_t)fileInfo.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        return NO;
+    }
+    
+    BOOL success = (bsfilter_decode_branches(bytes, fileInfo.st_size) == 1);
+    
+    if (munmap(bytes, (size_t)fileInfo.st_size) != 0) {
+        success = NO;
+    }
+    
     return success;
 }
 
+// Patches the source file with the item's binary diff, which is read straight from the archive
+static BOOL applyBinaryDeltaToFile(id<SPUDeltaArchiveProtocol> archive, SPUDeltaArchiveItem *item, NSString *sourceFilePath, NSString *destinationFilePath)
+{
+    BOOL filteredBranches = ((item.commands & SPUDeltaItemCommandBranchFilter) != 0);
+    
+    NSData *sourceData;
+    if (filteredBranches) {
+        // The diff was created against the source file after filtering it, which changes its code in place
+        NSMutableData *filteredSourceData = [NSMutableData dataWithContentsOfFile:sourceFilePath options:0 error:NULL];
+        if (filteredSourceData == nil || bsfilter_encode_branches(filteredSourceData.mutableBytes, (off_t)filteredSourceData.length) != 1) {
+            return NO;
+        }
+        sourceData = filteredSourceData;
+    } else {
+        // Map the source file so only the parts the patch refers to get loaded into memory
+        sourceData = [NSData dataWithContentsOfFile:sourceFilePath options:NSDataReadingMappedIfSafe error:NULL];
+        if (sourceData == nil) {
+            return NO;
+        }
+    }
+    
+    FILE *destinationFile = fopen(destinationFilePath.fileSystemRepresentation, "w");
+    if (destinationFile == NULL) {
+        return NO;
+    }
+    
+    BOOL success = [archive readItem:item handler:^BOOL(SPUDeltaArchiveItemReader reader) {
+        struct bspatch_source patchSource = {
+            .context = (__bridge void *)reader,
+            .read = readPatchData
+        };
+        struct bspatch_sink patchSink = {
+            .context = destinationFile,
+            .write = writePatchedData
+        };
+        
+        return (bspatch_stream(sourceData.bytes, (off_t)sourceData.length, &patchSource, &patchSink) == 0);
+    }];
+    
+    if (fclose(destinationFile) != 0) {
+        success = NO;
+    }
+    
+    if (success && filteredBranches) {
+        success = decodeBranchesOfFile(destinationFilePath);
+    }
+    
+    return success;
+}
+
+// Modifies the permissions of the item's file if the item changes them
+static NSError *modifyItemPermissions(SPUDeltaArchiveItem *item, NSString *destinationFilePath, BOOL verbose)
+{
+    if ((item.commands & SPUDeltaItemCommandModifyPermissions) == 0) {
+        return nil;
+    }
+    
+    mode_t mode = (mode_t)item.mode;
+    if (!modifyPermissions(destinationFilePath, mode)) {
+        return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteNoPermissionError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to modify permissions (%u) on file %@", mode, destinationFilePath] }];
+    }
+    
+    if (verbose) {
+        fprintf(stderr, "\n👮  %s %s (0%o)", VERBOSE_MODIFIED, [item.relativeFilePath fileSystemRepresentation], mode & PERMISSION_FLAGS);
+    }
+    
+    return nil;
+}
+
 BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *patchFile, BOOL verbose, void (^progressCallback)(double progress), NSError *__autoreleasing *error)
+{
+    return applyBinaryDeltaWithFileDigestCache(source, finalDestination, patchFile, nil, verbose, progressCallback, error);
+}
+
+BOOL applyBinaryDeltaWithFileDigestCache(NSString *source, NSString *finalDestination, NSString *patchFile, SPUFileDigestCache *digestCache, BOOL verbose, void (^progressCallback)(double progress), NSError *__autoreleasing *error)
 {
     SPUDeltaArchiveHeader *header = nil;
     id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(patchFile, &header);
@@ -93,7 +204,7 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
     progressCallback(1/7.0);
     
     unsigned char beforeHash[CC_SHA1_DIGEST_LENGTH] = {0};
-    if (!getRawHashOfTreeWithVersion(beforeHash, source, majorDiffVersion)) {
+    if (!getRawHashOfTreeAndFileTablesWithVersion(beforeHash, source, majorDiffVersion, digestCache, nil, nil)) {
         if (verbose) {
             fprintf(stderr, "\n");
         }
@@ -164,7 +275,50 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
         *error = nil;
     }
     
+    // Archives with a blob index let regular files be patched and extracted on multiple threads
+    // Everything else still happens in order, such as creating the directories those files go in,
+    // and only once the files being written on other threads are done
+    BOOL concurrentItemAccess = archive.supportsConcurrentItemAccess;
+    dispatch_group_t concurrentItemGroup = dispatch_group_create();
+    dispatch_semaphore_t concurrentItemSemaphore = dispatch_semaphore_create((long)NSProcessInfo.processInfo.activeProcessorCount);
+    dispatch_queue_t concurrentItemErrorQueue = dispatch_queue_create("org.sparkle-project.sparkle.delta-apply-errors", DISPATCH_QUEUE_SERIAL);
+    __block NSError *concurrentItemError = nil;
+    
+    // Writes an item's file on another thread, followed by modifying its permissions
+    void (^performItemConcurrently)(SPUDeltaArchiveItem *, NSString *, NSError *(^)(void)) = ^(SPUDeltaArchiveItem *item, NSString *destinationFilePath, NSError *(^itemWork)(void)) {
+        dispatch_semaphore_wait(concurrentItemSemaphore, DISPATCH_TIME_FOREVER);
+        dispatch_group_async(concurrentItemGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            NSError *itemError = itemWork();
+            if (itemError == nil) {
+                itemError = modifyItemPermissions(item, destinationFilePath, verbose);
+            }
+            
+            if (itemError != nil) {
+                dispatch_sync(concurrentItemErrorQueue, ^{
+                    if (concurrentItemError == nil) {
+                        concurrentItemError = itemError;
+                    }
+                });
+            }
+            
+            dispatch_semaphore_signal(concurrentItemSemaphore);
+        });
+    };
+    
     [archive enumerateItems:^(SPUDeltaArchiveItem *item, BOOL *stop) {
+        if (concurrentItemAccess) {
+            // Stop once an item failed on another thread
+            __block BOOL concurrentItemFailed = NO;
+            dispatch_sync(concurrentItemErrorQueue, ^{
+                concurrentItemFailed = (concurrentItemError != nil);
+            });
+            
+            if (concurrentItemFailed) {
+                *stop = YES;
+                return;
+            }
+        }
+        
         NSString *relativePath = item.relativeFilePath;
         
         if ([relativePath.pathComponents containsObject:@".."]) {
@@ -175,6 +329,27 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
             return;
         }
         
+        SPUDeltaItemCommands commands = item.commands;
+        
+        // Wait for the files being written on other threads before the tree is changed in any other way
+        // Otherwise a later item could replace a parent directory of one of those files with a symbolic link that the file is then written through
+        if (concurrentItemAccess) {
+            BOOL writesRegularFile = ((commands & SPUDeltaItemCommandBinaryDiff) != 0) || ((commands & SPUDeltaItemCommandExtract) != 0 && (commands & SPUDeltaItemCommandDuplicate) == 0 && S_ISREG(item.mode));
+            if (!writesRegularFile || (commands & SPUDeltaItemCommandDelete) != 0) {
+                dispatch_group_wait(concurrentItemGroup, DISPATCH_TIME_FOREVER);
+                
+                __block BOOL concurrentItemFailed = NO;
+                dispatch_sync(concurrentItemErrorQueue, ^{
+                    concurrentItemFailed = (concurrentItemError != nil);
+                });
+                
+                if (concurrentItemFailed) {
+                    *stop = YES;
+                    return;
+                }
+            }
+        }
+        
         NSString *sourceFilePath = [source stringByAppendingPathComponent:relativePath];
         NSString *destinationFilePath = [destination stringByAppendingPathComponent:relativePath];
         {
@@ -202,7 +377,6 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
         
         // Files that have no property set that we check for will get ignored
         // This is important because they aren't part of the delta, just part of the directory structure
-        SPUDeltaItemCommands commands = item.commands;
         if ((commands & SPUDeltaItemCommandDelete) != 0) {
             if (!removeTree(destinationFilePath)) {
                 if (verbose) {
@@ -250,21 +424,6 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
                 fprintf(stderr, "\n✂️   %s %s -> %s", VERBOSE_CLONED, [clonedRelativePath fileSystemRepresentation], [relativePath fileSystemRepresentation]);
             }
         } else if ((commands & SPUDeltaItemCommandBinaryDiff) != 0) {
-            NSString *tempDiffFile = temporaryFilename(@"apply-binary-delta");
-            item.itemFilePath = tempDiffFile;
-            
-            if (![archive extractItem:item]) {
-                if (verbose) {
-                    fprintf(stderr, "\n");
-                }
-                if (error != NULL) {
-                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to extract diffed file to %@", tempDiffFile], NSUnderlyingErrorKey: (NSError * _Nonnull)archive.error }];
-                }
-                
-                *stop = YES;
-                return;
-            }
-            
             NSString *sourceDiffFilePath;
             NSString *clonedRelativePath;
             if ((commands & SPUDeltaItemCommandClone) != 0) {
@@ -298,94 +457,166 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
                 needsToCopyFilePermissions = ((commands & SPUDeltaItemCommandClone) != 0) && ((commands & SPUDeltaItemCommandModifyPermissions) == 0);
             }
             
-            if (!applyBinaryDeltaToFile(tempDiffFile, sourceDiffFilePath, destinationFilePath)) {
+            NSError *(^patchItem)(void) = ^NSError *{
+                if (!applyBinaryDeltaToFile(archive, item, sourceDiffFilePath, destinationFilePath)) {
+                    NSError *archiveError = archive.error;
+                    if (archiveError != nil) {
+                        return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to patch %@ to destination %@", sourceFilePath, destinationFilePath], NSUnderlyingErrorKey: archiveError }];
+                    } else {
+                        return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to patch %@ to destination %@", sourceFilePath, destinationFilePath] }];
+                    }
+                }
+                
+                if (needsToCopyFilePermissions) {
+                    struct stat sourceFileInfo = {0};
+                    if (lstat(sourceDiffFilePath.fileSystemRepresentation, &sourceFileInfo) != 0) {
+                        return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to retrieve stat info from %@", sourceFilePath] }];
+                    }
+                    
+                    if (chmod(destinationFilePath.fileSystemRepresentation, sourceFileInfo.st_mode) != 0) {
+                        return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteNoPermissionError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to modify permissions (%u) on file %@", sourceFileInfo.st_mode, destinationFilePath] }];
+                    }
+                }
+                
+                if (verbose) {
+                    if ((commands & SPUDeltaItemCommandClone) != 0) {
+                        fprintf(stderr, "\n🔨  %s %s -> %s", VERBOSE_PATCHED, [clonedRelativePath fileSystemRepresentation], [relativePath fileSystemRepresentation]);
+                    } else {
+                        fprintf(stderr, "\n🔨  %s %s", VERBOSE_PATCHED, [relativePath fileSystemRepresentation]);
+                    }
+                }
+                
+                return nil;
+            };
+            
+            if (concurrentItemAccess) {
+                performItemConcurrently(item, destinationFilePath, patchItem);
+                return;
+            }
+            
+            NSError *patchError = patchItem();
+            if (patchError != nil) {
                 if (verbose) {
                     fprintf(stderr, "\n");
                 }
                 if (error != NULL) {
-                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to patch %@ to destination %@", sourceFilePath, destinationFilePath] }];
+                    *error = patchError;
                 }
                 *stop = YES;
                 return;
             }
-            
-            if (needsToCopyFilePermissions) {
-                struct stat sourceFileInfo = {0};
-                if (lstat(sourceDiffFilePath.fileSystemRepresentation, &sourceFileInfo) != 0) {
-                    if (verbose) {
-                        fprintf(stderr, "\n");
-                    }
-                    if (error != NULL) {
-                        *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to retrieve stat info from %@", sourceFilePath] }];
-                    }
-                    *stop = YES;
-                    return;
-                }
-                
-                if (chmod(destinationFilePath.fileSystemRepresentation, sourceFileInfo.st_mode) != 0) {
-                    if (verbose) {
-                        fprintf(stderr, "\n");
-                    }
-                    if (error != NULL) {
-                        *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteNoPermissionError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to modify permissions (%u) on file %@", sourceFileInfo.st_mode, destinationFilePath] }];
-                    }
-                    *stop = YES;
-                    return;
+        } else if ((commands & SPUDeltaItemCommandDuplicate) != 0) {
+            // The original file was extracted earlier and has been written by now
+            NSString *originalRelativePath = item.clonedRelativePath;
+            if ([originalRelativePath.pathComponents containsObject:@".."]) {
+                if (error != NULL) {
+                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Relative path for duplicate '%@' contains '..' path component", originalRelativePath] }];
                 }
+                *stop = YES;
+                return;
             }
-
-            if (verbose) {
-                if ((commands & SPUDeltaItemCommandClone) != 0) {
-                    fprintf(stderr, "\n🔨  %s %s -> %s", VERBOSE_PATCHED, [clonedRelativePath fileSystemRepresentation], [relativePath fileSystemRepresentation]);
-                } else {
-                    fprintf(stderr, "\n🔨  %s %s", VERBOSE_PATCHED, [relativePath fileSystemRepresentation]);
+            
+            NSString *originalFilePath = [destination stringByAppendingPathComponent:originalRelativePath];
+            
+            // Ensure there isn't an item already at our destination
+            [fileManager removeItemAtPath:destinationFilePath error:NULL];
+            
+            // Copying clones the original file on file systems that support it
+            NSError *copyError = nil;
+            if (![fileManager copyItemAtPath:originalFilePath toPath:destinationFilePath error:&copyError]) {
+                if (verbose) {
+                    fprintf(stderr, "\n");
+                }
+                if (error != NULL) {
+                    *error = copyError;
                 }
+                *stop = YES;
+                return;
             }
-        } else if ((commands & SPUDeltaItemCommandExtract) != 0) { // extract and permission modifications don't coexist
-            item.itemFilePath = destinationFilePath;
-            if (![archive extractItem:item]) {
+            
+            if (chmod(destinationFilePath.fileSystemRepresentation, item.mode) != 0) {
                 if (verbose) {
                     fprintf(stderr, "\n");
                 }
                 if (error != NULL) {
-                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to extract file to %@", destinationFilePath], NSUnderlyingErrorKey: (NSError * _Nonnull)archive.error }];
+                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteNoPermissionError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to modify permissions (%u) on file %@", item.mode, destinationFilePath] }];
                 }
                 *stop = YES;
                 return;
             }
-
+            
             if (verbose) {
-                if (fileExisted) {
-                    fprintf(stderr, "\n✏️  %s %s", VERBOSE_UPDATED, [relativePath fileSystemRepresentation]);
-                } else {
-                    fprintf(stderr, "\n✅  %s %s", VERBOSE_ADDED, [relativePath fileSystemRepresentation]);
+                fprintf(stderr, "\n✂️   %s %s -> %s", VERBOSE_CLONED, [originalRelativePath fileSystemRepresentation], [relativePath fileSystemRepresentation]);
+            }
+        } else if ((commands & SPUDeltaItemCommandExtract) != 0) { // extract and permission modifications don't coexist
+            item.itemFilePath = destinationFilePath;
+            
+            NSError *(^extractItem)(void) = ^NSError *{
+                if (![archive extractItem:item]) {
+                    return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to extract file to %@", destinationFilePath], NSUnderlyingErrorKey: (NSError * _Nonnull)archive.error }];
+                }
+                
+                if (verbose) {
+                    if (fileExisted) {
+                        fprintf(stderr, "\n✏️  %s %s", VERBOSE_UPDATED, [relativePath fileSystemRepresentation]);
+                    } else {
+                        fprintf(stderr, "\n✅  %s %s", VERBOSE_ADDED, [relativePath fileSystemRepresentation]);
+                    }
                 }
+                
+                return nil;
+            };
+            
+            // Directories and symbolic links are created in order since later items may be inside them
+            if (concurrentItemAccess && S_ISREG(item.mode)) {
+                performItemConcurrently(item, destinationFilePath, extractItem);
+                return;
             }
-        } else if (verbose && removedFile) {
-            fprintf(stderr, "\n❌  %s %s", VERBOSE_DELETED, [relativePath fileSystemRepresentation]);
-        }
-
-        if ((commands & SPUDeltaItemCommandModifyPermissions) != 0) {
-            mode_t mode = (mode_t)item.mode;
-            if (!modifyPermissions(destinationFilePath, mode)) {
+            
+            NSError *extractError = extractItem();
+            if (extractError != nil) {
                 if (verbose) {
                     fprintf(stderr, "\n");
                 }
                 if (error != NULL) {
-                    *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteNoPermissionError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Unable to modify permissions (%u) on file %@", mode, destinationFilePath] }];
+                    *error = extractError;
                 }
                 *stop = YES;
                 return;
             }
+        } else if (verbose && removedFile) {
+            fprintf(stderr, "\n❌  %s %s", VERBOSE_DELETED, [relativePath fileSystemRepresentation]);
+        }
 
+        NSError *permissionsError = modifyItemPermissions(item, destinationFilePath, verbose);
+        if (permissionsError != nil) {
             if (verbose) {
-                fprintf(stderr, "\n👮  %s %s (0%o)", VERBOSE_MODIFIED, [relativePath fileSystemRepresentation], mode & PERMISSION_FLAGS);
+                fprintf(stderr, "\n");
             }
+            if (error != NULL) {
+                *error = permissionsError;
+            }
+            *stop = YES;
+            return;
         }
     }];
     
+    // Wait for the items being written on other threads
+    dispatch_group_wait(concurrentItemGroup, DISPATCH_TIME_FOREVER);
+    
     [archive close];
     
+    if (concurrentItemError != nil) {
+        if (verbose) {
+            fprintf(stderr, "\n");
+        }
+        if (error != NULL && *error == nil) {
+            *error = concurrentItemError;
+        }
+        removeTree(destination);
+        return NO;
+    }
+    
     // Set error from enumerating items if we have encountered an error and haven't set it yet
     NSError *archiveError = archive.error;
     if (archiveError != nil) {
@@ -398,7 +629,7 @@ BOOL applyBinaryDelta(NSString *source, NSString *finalDestination, NSString *pa
         removeTree(destination);
         return NO;
     }
-
+    
     progressCallback(5/7.0);
     
     // Re-apply file system compression is requested
@@ -39,6 +39,7 @@
 
 // Changes that break backwards compatibility will have different major versions
 // Changes that affect creating but not applying patches will have different minor versions
+// Opt-in formats that older versions can't apply also have different minor versions, and are only created when requested
 typedef NS_ENUM(uint16_t, SUBinaryDeltaMajorVersion)
 {
     // Note: support for creating or applying version 1 deltas have been removed
@@ -52,17 +53,60 @@ extern SUBinaryDeltaMajorVersion SUBinaryDeltaMajorVersionLatest;
 extern SUBinaryDeltaMajorVersion SUBinaryDeltaMajorVersionFirst;
 extern SUBinaryDeltaMajorVersion SUBinaryDeltaMajorVersionFirstSupported;
 
+// Minor versions of version 3 patches
+typedef NS_ENUM(uint16_t, SUBinaryDeltaMinorVersion)
+{
+    SUBinaryDeltaMinorVersion3_1 = 1,
+    // Diffs may store their control blocks as varints (BSDIFV40), which older versions can't apply
+    SUBinaryDeltaMinorVersion3_2 = 2,
+    // The archive may be compressed in frames, which older versions can't read
+    SUBinaryDeltaMinorVersion3_3 = 3,
+    // The archive may be compressed with zstd, which older versions can't read
+    SUBinaryDeltaMinorVersion3_4 = 4,
+    // The relative path table may be front coded, which older versions can't read
+    SUBinaryDeltaMinorVersion3_5 = 5,
+    // Frames may be stored uncompressed, which older versions can't read
+    SUBinaryDeltaMinorVersion3_6 = 6,
+    // Extracted files may be duplicates of earlier extracted files, which older versions can't apply
+    SUBinaryDeltaMinorVersion3_7 = 7,
+    // Diffs of executables may be branch filtered, which older versions can't apply
+    SUBinaryDeltaMinorVersion3_8 = 8
+};
+
 // Additional compression methods for version 3 patches that we have for debugging are zlib, bzip2, none
-#define COMPRESSION_METHOD_ARGUMENT_DESCRIPTION @"The compression method to use for generating delta updates. Supported methods for version 3 delta files are 'lzma' (best compression, slowest), 'lzfse' (good compression, fast), 'lz4' (worse compression, fastest), and 'default'. Note that version 2 delta files only support 'bzip2', and 'default' so other methods will be ignored if version 2 files are being generated. The 'default' compression for version 3 delta files is currently lzma."
+#define COMPRESSION_METHOD_ARGUMENT_DESCRIPTION @"The compression method to use for generating delta updates. Supported methods for version 3 delta files are 'lzma' (best compression, slowest), 'lzfse' (good compression, fast), 'lz4' (worse compression, fastest), 'zstd' (compression close to lzma, much faster to apply, only available if these tools are built with zstd support, and only applied by applications using a version of Sparkle that is also built with zstd support), and 'default'. Note that version 2 delta files only support 'bzip2', and 'default' so other methods will be ignored if version 2 files are being generated. The 'default' compression for version 3 delta files is currently lzma."
+
+// zstd accepts compression levels from 1 - 19, and level 0 uses the default of 19
+#define SPUDeltaZstdMaxCompressionLevel 19
 
 //#define COMPRESSION_LEVEL_ARGUMENT_DESCRIPTION @"The compression level to use for generating delta updates. This only applies if the compression method used is bzip2 which accepts values from 1 - 9. A special value of 0 will use the default compression level."
 
 SPUDeltaCompressionMode deltaCompressionModeFromDescription(NSString *description, BOOL *requestValid);
 NSString *deltaCompressionStringFromMode(SPUDeltaCompressionMode mode);
 
+// A cache of the digests of regular files that can be kept on disk between runs, so hashing trees that barely changed doesn't need to read every file again
+// Digests are keyed by the file's device, inode, size, modification time and status change time. Any change to a file changes its status change time,
+// so digests of files that were changed shortly before or while they were hashed are never cached, which keeps the cache valid on file systems with coarse timestamps.
+// Trees are only hashed with a cache when one is passed explicitly. Applying a patch on the client doesn't use one.
+SPU_OBJC_DIRECT_MEMBERS @interface SPUFileDigestCache : NSObject
+
+// Loads the cache from path if the file exists and is a valid cache. Otherwise the cache starts out empty.
+- (instancetype)initWithPath:(NSString *)path;
+
+- (instancetype)init NS_UNAVAILABLE;
+
+@property (nonatomic, readonly, copy) NSString *path;
+
+// Writes the cache back to its path, replacing the file atomically
+// Digests that weren't used since the cache was loaded are dropped if the cache gets too large
+- (BOOL)save;
+
+@end
+
 extern int compareFiles(const FTSENT **a, const FTSENT **b);
 BOOL getRawHashOfTreeWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t majorVersion);
-BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t majorVersion, NSMutableDictionary<NSData *, NSMutableArray<NSString *> *> *hashToFileKeyDictionary, NSMutableDictionary<NSString *, NSData *> *fileKeyToHashDictionary);
+// digestCache may be nil to read every file
+BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t majorVersion, SPUFileDigestCache *digestCache, NSMutableDictionary<NSData *, NSMutableArray<NSString *> *> *hashToFileKeyDictionary, NSMutableDictionary<NSString *, NSData *> *fileKeyToHashDictionary);
 NSString *displayHashFromRawHash(const unsigned char *hash);
 void getRawHashFromDisplayHash(unsigned char *hash, NSString *hexHash);
 extern NSString *hashOfTreeWithVersion(NSString *path, uint16_t majorVersion);
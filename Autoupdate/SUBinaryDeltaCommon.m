@@ -50,6 +50,10 @@ SPUDeltaCompressionMode deltaCompressionModeFromDescription(NSString *requestedD
         compression = SPUDeltaCompressionModeLZ4;
     } else if ([description isEqualToString:@"zlib"]) {
         compression = SPUDeltaCompressionModeZLIB;
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+    } else if ([description isEqualToString:@"zstd"]) {
+        compression = SPUDeltaCompressionModeZstd;
+#endif
     } else {
         compression = SPUDeltaCompressionModeDefault;
         
@@ -76,6 +80,8 @@ NSString *deltaCompressionStringFromMode(SPUDeltaCompressionMode mode)
             return @"LZFSE";
         case SPUDeltaCompressionModeZLIB:
             return @"ZLIB";
+        case SPUDeltaCompressionModeZstd:
+            return @"zstd";
         default:
             break;
     }
@@ -114,7 +120,7 @@ uint16_t latestMinorVersionForMajorVersion(SUBinaryDeltaMajorVersion majorVersio
         case SUBinaryDeltaMajorVersion2:
             return 4;
         case SUBinaryDeltaMajorVersion3:
-            return 1;
+            return SUBinaryDeltaMinorVersion3_8;
     }
     return 0;
 }
@@ -156,6 +162,133 @@ NSString *temporaryDirectory(NSString *base)
     return stringWithFileSystemRepresentation(templateResult);
 }
 
+#define FILE_DIGEST_CACHE_MAGIC "SPUFDC01"
+// Digests of files whose status changed less than this many seconds before they were hashed aren't cached
+// File systems like HFS+ and FAT only store timestamps in seconds, so a file changed again right after it was hashed may keep the same timestamps
+#define FILE_DIGEST_CACHE_TIMESTAMP_MARGIN 2
+// Digests that weren't used since the cache was loaded are dropped when saving a cache with more entries than this
+#define FILE_DIGEST_CACHE_MAX_ENTRY_COUNT 1000000
+
+// Fixed width so that cache files don't depend on the layout of struct stat
+typedef struct
+{
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    int64_t modificationSeconds;
+    int64_t modificationNanoseconds;
+    int64_t changeSeconds;
+    int64_t changeNanoseconds;
+} SPUFileDigestCacheKey;
+
+static NSData *_fileDigestCacheKey(const struct stat *fileStatus)
+{
+    SPUFileDigestCacheKey key;
+    memset(&key, 0, sizeof(key));
+    key.device = (uint64_t)fileStatus->st_dev;
+    key.inode = (uint64_t)fileStatus->st_ino;
+    key.size = (int64_t)fileStatus->st_size;
+    key.modificationSeconds = (int64_t)fileStatus->st_mtimespec.tv_sec;
+    key.modificationNanoseconds = (int64_t)fileStatus->st_mtimespec.tv_nsec;
+    key.changeSeconds = (int64_t)fileStatus->st_ctimespec.tv_sec;
+    key.changeNanoseconds = (int64_t)fileStatus->st_ctimespec.tv_nsec;
+    return [NSData dataWithBytes:&key length:sizeof(key)];
+}
+
+@interface SPUFileDigestCache ()
+
+- (BOOL)getDigest:(unsigned char *)digest forFileStatus:(const struct stat *)fileStatus;
+- (void)setDigest:(const unsigned char *)digest forFileStatus:(const struct stat *)fileStatus hashStartTime:(time_t)hashStartTime;
+
+@end
+
+@implementation SPUFileDigestCache
+{
+    NSMutableDictionary<NSData *, NSData *> *_digests;
+    NSMutableSet<NSData *> *_usedKeys;
+}
+
+@synthesize path = _path;
+
+- (instancetype)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self != nil) {
+        _path = [path copy];
+        _digests = [NSMutableDictionary dictionary];
+        _usedKeys = [NSMutableSet set];
+        
+        NSData *cacheData = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+        const size_t magicLength = strlen(FILE_DIGEST_CACHE_MAGIC);
+        const size_t recordLength = sizeof(SPUFileDigestCacheKey) + CC_SHA1_DIGEST_LENGTH;
+        // A cache that isn't valid is ignored and replaced when saving
+        if (cacheData.length >= magicLength && memcmp(cacheData.bytes, FILE_DIGEST_CACHE_MAGIC, magicLength) == 0 && (cacheData.length - magicLength) % recordLength == 0) {
+            const uint8_t *records = (const uint8_t *)cacheData.bytes + magicLength;
+            size_t recordCount = (cacheData.length - magicLength) / recordLength;
+            for (size_t recordIndex = 0; recordIndex < recordCount; recordIndex++) {
+                const uint8_t *record = records + recordIndex * recordLength;
+                NSData *key = [NSData dataWithBytes:record length:sizeof(SPUFileDigestCacheKey)];
+                _digests[key] = [NSData dataWithBytes:record + sizeof(SPUFileDigestCacheKey) length:CC_SHA1_DIGEST_LENGTH];
+            }
+        }
+    }
+    return self;
+}
+
+- (BOOL)getDigest:(unsigned char *)digest forFileStatus:(const struct stat *)fileStatus
+{
+    NSData *key = _fileDigestCacheKey(fileStatus);
+    @synchronized (self) {
+        NSData *cachedDigest = _digests[key];
+        if (cachedDigest == nil) {
+            return NO;
+        }
+        
+        [_usedKeys addObject:key];
+        memcpy(digest, cachedDigest.bytes, CC_SHA1_DIGEST_LENGTH);
+        return YES;
+    }
+}
+
+- (void)setDigest:(const unsigned char *)digest forFileStatus:(const struct stat *)fileStatus hashStartTime:(time_t)hashStartTime
+{
+    // The file may have been changed while it was being hashed, or may still be changed without its timestamps changing
+    if (fileStatus->st_ctimespec.tv_sec + FILE_DIGEST_CACHE_TIMESTAMP_MARGIN > hashStartTime) {
+        return;
+    }
+    
+    NSData *key = _fileDigestCacheKey(fileStatus);
+    @synchronized (self) {
+        _digests[key] = [NSData dataWithBytes:digest length:CC_SHA1_DIGEST_LENGTH];
+        [_usedKeys addObject:key];
+    }
+}
+
+- (BOOL)save
+{
+    NSMutableData *cacheData = [NSMutableData data];
+    [cacheData appendBytes:FILE_DIGEST_CACHE_MAGIC length:strlen(FILE_DIGEST_CACHE_MAGIC)];
+    
+    @synchronized (self) {
+        BOOL savesUsedKeysOnly = (_digests.count > FILE_DIGEST_CACHE_MAX_ENTRY_COUNT);
+        for (NSData *key in _digests) {
+            if (savesUsedKeysOnly && ![_usedKeys containsObject:key]) {
+                continue;
+            }
+            
+            [cacheData appendData:key];
+            [cacheData appendData:_digests[key]];
+        }
+    }
+    
+    NSString *directory = [_path stringByDeletingLastPathComponent];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:NULL];
+    
+    return [cacheData writeToFile:_path options:NSDataWritingAtomic error:NULL];
+}
+
+@end
+
 static void _hashOfBuffer(unsigned char *hash, const char *buffer, ssize_t bufferLength)
 {
     assert(bufferLength >= 0 && bufferLength <= UINT32_MAX);
@@ -165,6 +298,42 @@ static void _hashOfBuffer(unsigned char *hash, const char *buffer, ssize_t buffe
     CC_SHA1_Final(hash, &hashContext);
 }
 
+static BOOL _hashOfRegularFile(unsigned char *hash, const char *path, off_t fileSize, void *tempBuffer, size_t tempBufferSize)
+{
+    if (fileSize <= 0) {
+        _hashOfBuffer(hash, NULL, 0);
+        return YES;
+    }
+    
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("fopen");
+        return NO;
+    }
+    
+    CC_SHA1_CTX hashContext;
+    CC_SHA1_Init(&hashContext);
+    
+    size_t bytesLeft = (size_t)fileSize;
+    while (bytesLeft > 0) {
+        size_t bytesToConsume = (bytesLeft >= tempBufferSize) ? tempBufferSize : bytesLeft;
+        
+        if (fread(tempBuffer, bytesToConsume, 1, file) < 1) {
+            perror("fread");
+            fclose(file);
+            return NO;
+        }
+        
+        CC_SHA1_Update(&hashContext, tempBuffer, (CC_LONG)bytesToConsume);
+        bytesLeft -= bytesToConsume;
+    }
+    
+    CC_SHA1_Final(hash, &hashContext);
+    
+    fclose(file);
+    return YES;
+}
+
 static BOOL _hashOfFileContents(unsigned char *hash, FTSENT *ent, void *tempBuffer, size_t tempBufferSize)
 {
     if (ent->fts_info == FTS_SL) {
@@ -177,37 +346,7 @@ static BOOL _hashOfFileContents(unsigned char *hash, FTSENT *ent, void *tempBuff
 
         _hashOfBuffer(hash, linkDestination, linkDestinationLength);
     } else if (ent->fts_info == FTS_F) {
-        ssize_t fileSize = ent->fts_statp->st_size;
-        if (fileSize <= 0) {
-            _hashOfBuffer(hash, NULL, 0);
-        } else {
-            FILE *file = fopen(ent->fts_path, "rb");
-            if (file == NULL) {
-                perror("fopen");
-                return NO;
-            }
-            
-            CC_SHA1_CTX hashContext;
-            CC_SHA1_Init(&hashContext);
-            
-            size_t bytesLeft = (size_t)fileSize;
-            while (bytesLeft > 0) {
-                size_t bytesToConsume = (bytesLeft >= tempBufferSize) ? tempBufferSize : bytesLeft;
-                
-                if (fread(tempBuffer, bytesToConsume, 1, file) < 1) {
-                    perror("fread");
-                    fclose(file);
-                    return NO;
-                }
-                
-                CC_SHA1_Update(&hashContext, tempBuffer, (CC_LONG)bytesToConsume);
-                bytesLeft -= bytesToConsume;
-            }
-            
-            CC_SHA1_Final(hash, &hashContext);
-            
-            fclose(file);
-        }
+        return _hashOfRegularFile(hash, ent->fts_path, ent->fts_statp->st_size, tempBuffer, tempBufferSize);
     } else if (ent->fts_info == FTS_D) {
         memset(hash, 0xdd, CC_SHA1_DIGEST_LENGTH);
     } else {
@@ -216,12 +355,24 @@ static BOOL _hashOfFileContents(unsigned char *hash, FTSENT *ent, void *tempBuff
     return YES;
 }
 
+// An entry of a tree in the order it's hashed in
+typedef struct
+{
+    // Path of a regular file whose contents are hashed after walking the tree, or NULL if the contents are already hashed
+    char *filePath;
+    struct stat fileStatus;
+    uint16_t type;
+    uint16_t hashedPermissions;
+    BOOL hashedContents;
+    unsigned char contentsHash[CC_SHA1_DIGEST_LENGTH];
+} SUTreeHashEntry;
+
 BOOL getRawHashOfTreeWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t majorVersion)
 {
-    return getRawHashOfTreeAndFileTablesWithVersion(hashBuffer, path, majorVersion, nil, nil);
+    return getRawHashOfTreeAndFileTablesWithVersion(hashBuffer, path, majorVersion, nil, nil, nil);
 }
 
-BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t __unused majorVersion, NSMutableDictionary<NSData *, NSMutableArray<NSString *> *> *hashToFileKeyDictionary, NSMutableDictionary<NSString *, NSData *> *fileKeyToHashDictionary)
+BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSString *path, uint16_t __unused majorVersion, SPUFileDigestCache *digestCache, NSMutableDictionary<NSData *, NSMutableArray<NSString *> *> *hashToFileKeyDictionary, NSMutableDictionary<NSString *, NSData *> *fileKeyToHashDictionary)
 {
     char pathBuffer[PATH_MAX] = { 0 };
     if (![path getFileSystemRepresentation:pathBuffer maxLength:sizeof(pathBuffer)]) {
@@ -235,6 +386,9 @@ BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSStrin
         return NO;
     }
     
+    // Files are only read after this time, so digests of files that changed since then are never cached
+    time_t hashStartTime = time(NULL);
+    
     char *const sourcePaths[] = { pathBuffer, 0 };
     FTS *fts = fts_open(sourcePaths, FTS_PHYSICAL | FTS_NOCHDIR, compareFiles);
     if (!fts) {
@@ -243,12 +397,13 @@ BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSStrin
         return NO;
     }
 
-    CC_SHA1_CTX hashContext;
-    CC_SHA1_Init(&hashContext);
-
     // Ensure the path uses filesystem-specific Unicode normalization #1017
     NSString *normalizedPath = stringWithFileSystemRepresentation(pathBuffer);
 
+    // Walk the tree first, leaving the contents of regular files to be hashed afterwards
+    NSMutableData *entriesData = [NSMutableData data];
+    NSMutableArray<NSString *> *relativePaths = [NSMutableArray array];
+    BOOL walkedTree = YES;
     FTSENT *ent = 0;
     while ((ent = fts_read(fts))) {
         if (ent->fts_info != FTS_F && ent->fts_info != FTS_SL && ent->fts_info != FTS_D)
@@ -261,17 +416,80 @@ BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSStrin
             continue;
         }
 
-        unsigned char fileHash[CC_SHA1_DIGEST_LENGTH];
-        if (!_hashOfFileContents(fileHash, ent, tempBuffer, tempBufferSize)) {
-            fts_close(fts);
-            free(tempBuffer);
-            return NO;
+        SUTreeHashEntry entry = {0};
+        if (ent->fts_info == FTS_F && ent->fts_statp->st_size > 0) {
+            if (digestCache != nil && [digestCache getDigest:entry.contentsHash forFileStatus:ent->fts_statp]) {
+                entry.hashedContents = YES;
+            } else {
+                entry.filePath = strdup(ent->fts_path);
+                if (entry.filePath == NULL) {
+                    perror("strdup");
+                    walkedTree = NO;
+                    break;
+                }
+                entry.fileStatus = *ent->fts_statp;
+            }
+        } else {
+            if (!_hashOfFileContents(entry.contentsHash, ent, tempBuffer, tempBufferSize)) {
+                walkedTree = NO;
+                break;
+            }
+            entry.hashedContents = YES;
         }
-        CC_SHA1_Update(&hashContext, fileHash, sizeof(fileHash));
+
+        uint16_t mode = ent->fts_statp->st_mode;
+        uint16_t permissions = mode & PERMISSION_FLAGS;
+        entry.type = ent->fts_info;
+        
+        // permission of symlinks are 0777 on some linux file systems and can't be changed,
+        // differing from the 0755 macOS default.
+        // hardcoding a value helps avoid differences between filesystems.
+        entry.hashedPermissions = (ent->fts_info == FTS_SL) ? VALID_SYMBOLIC_LINK_PERMISSIONS : permissions;
+
+        [entriesData appendBytes:&entry length:sizeof(entry)];
+        [relativePaths addObject:relativePath];
+    }
+    
+    free(tempBuffer);
+    
+    fts_close(fts);
+    
+    SUTreeHashEntry *entries = entriesData.mutableBytes;
+    NSUInteger entryCount = relativePaths.count;
+    
+    // Hash the contents of regular files on multiple threads
+    // Each file's hash goes in its own entry, so the tree is hashed in the same order regardless of which files finish first
+    if (walkedTree) {
+        dispatch_apply(entryCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t entryIndex) {
+            SUTreeHashEntry *entry = &entries[entryIndex];
+            if (entry->filePath != NULL) {
+                char fileBuffer[16384];
+                entry->hashedContents = _hashOfRegularFile(entry->contentsHash, entry->filePath, entry->fileStatus.st_size, fileBuffer, sizeof(fileBuffer));
+            }
+        });
+    }
+
+    CC_SHA1_CTX hashContext;
+    CC_SHA1_Init(&hashContext);
+    
+    BOOL hashedTree = walkedTree;
+    for (NSUInteger entryIndex = 0; hashedTree && entryIndex < entryCount; entryIndex++) {
+        SUTreeHashEntry *entry = &entries[entryIndex];
+        if (!entry->hashedContents) {
+            hashedTree = NO;
+            break;
+        }
+        
+        if (entry->filePath != NULL && digestCache != nil) {
+            [digestCache setDigest:entry->contentsHash forFileStatus:&entry->fileStatus hashStartTime:hashStartTime];
+        }
+        
+        NSString *relativePath = relativePaths[entryIndex];
+        CC_SHA1_Update(&hashContext, entry->contentsHash, sizeof(entry->contentsHash));
         
         // For file hash tables we only track regular files
-        if (ent->fts_info == FTS_F) {
-            NSData *hashKey = [NSData dataWithBytes:fileHash length:sizeof(fileHash)];
+        if (entry->type == FTS_F) {
+            NSData *hashKey = [NSData dataWithBytes:entry->contentsHash length:sizeof(entry->contentsHash)];
             
             if (hashToFileKeyDictionary != nil) {
                 if (hashToFileKeyDictionary[hashKey] == nil) {
@@ -288,22 +506,17 @@ BOOL getRawHashOfTreeAndFileTablesWithVersion(unsigned char *hashBuffer, NSStrin
         const char *relativePathBytes = [relativePath fileSystemRepresentation];
         CC_SHA1_Update(&hashContext, relativePathBytes, (CC_LONG)strlen(relativePathBytes));
 
-        uint16_t mode = ent->fts_statp->st_mode;
-        uint16_t type = ent->fts_info;
-        uint16_t permissions = mode & PERMISSION_FLAGS;
-        
-        // permission of symlinks are 0777 on some linux file systems and can't be changed,
-        // differing from the 0755 macOS default.
-        // hardcoding a value helps avoid differences between filesystems.
-        uint16_t hashedPermissions = (ent->fts_info == FTS_SL) ? VALID_SYMBOLIC_LINK_PERMISSIONS : permissions;
-
-        CC_SHA1_Update(&hashContext, &type, sizeof(type));
-        CC_SHA1_Update(&hashContext, &hashedPermissions, sizeof(hashedPermissions));
+        CC_SHA1_Update(&hashContext, &entry->type, sizeof(entry->type));
+        CC_SHA1_Update(&hashContext, &entry->hashedPermissions, sizeof(entry->hashedPermissions));
     }
     
-    free(tempBuffer);
+    for (NSUInteger entryIndex = 0; entryIndex < entryCount; entryIndex++) {
+        free(entries[entryIndex].filePath);
+    }
     
-    fts_close(fts);
+    if (!hashedTree) {
+        return NO;
+    }
 
     CC_SHA1_Final(hashBuffer, &hashContext);
     
@@ -13,6 +13,93 @@
 #import "SPUDeltaArchiveProtocol.h"
 
 @class NSString;
+
+// Old files at least this large (1 GiB) are diffed by hashing anchors by default
+#define SPUDeltaDefaultHashDiffThreshold 1073741824ULL
+
+// Options for tuning how a patch is created
+SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaCreationOptions : NSObject
+
+// Number of threads used for sorting the suffixes of an old file before diffing it
+// Defaults to 1, which uses the sequential suffix sorter. More threads than online processors are not used.
+@property (nonatomic) uint32_t suffixSortThreadCount;
+
+// Number of threads used for scanning a new file for differences against its old file
+// Large files are split into this many ranges that are diffed in parallel, at the cost of slightly larger patches
+// Unlike suffixSortThreadCount this affects the patch that gets created. Defaults to 1.
+@property (nonatomic) uint32_t scanThreadCount;
+
+// Maximum number of files that are diffed at the same time. Defaults to 0, which uses the number of active processors.
+// Each diff may use several threads of its own, see suffixSortThreadCount and scanThreadCount.
+@property (nonatomic) uint32_t maximumConcurrentDiffCount;
+
+// Maximum number of bytes that the files being diffed at the same time may take, estimated from the sizes of the files
+// Diffing a file takes several times the size of the old file in memory, so large files wait for others to finish instead of running together.
+// The largest files are diffed first and a file that doesn't fit on its own is diffed alone. Finished patches are kept on disk and don't count against the limit.
+// Defaults to 0, which uses half of the physical memory.
+@property (nonatomic) uint64_t diffMemoryLimit;
+
+// Directory for caching the suffix sorts of old files, so that diffing the same old file again doesn't need to sort it again
+// Cache files are named after a hash of the old file's contents. Defaults to nil, which disables caching.
+// The cache isn't trimmed automatically. Use trimBinaryDeltaSuffixSortCache() for that.
+@property (nonatomic, copy) NSString *suffixSortCacheDirectory;
+
+// Cache of the digests of files, so that hashing the old and new trees doesn't need to read files that were hashed before
+// Defaults to nil, which reads every file. The cache isn't saved automatically. Use -[SPUFileDigestCache save] for that.
+@property (nonatomic) SPUFileDigestCache *fileDigestCache;
+
+// Old files of at least this many bytes are diffed by hashing anchors in them instead of sorting their suffixes
+// This is much faster and takes far less memory for large files but makes larger patches, especially for files with many small changes
+// Defaults to SPUDeltaDefaultHashDiffThreshold. Use UINT64_MAX to always sort suffixes.
+@property (nonatomic) uint64_t hashDiffThreshold;
+
+// Whether to filter the branch instructions of x86_64 and arm64 executables before diffing them, which makes diffs of code smaller
+// Each executable is diffed both with and without filtering and the smaller diff is kept, so this is slower. Only used for version 3 patches,
+// which are then created as minor version SUBinaryDeltaMinorVersion3_8 and can only be applied by versions of Sparkle that support them. Defaults to NO.
+@property (nonatomic) BOOL filtersExecutableBranches;
+
+// Whether to store the control blocks of diffs as varints, which makes patches with many small matches smaller, especially with lz4 and zlib compression
+// Only used for version 3 patches, which are then created as minor version SUBinaryDeltaMinorVersion3_2.
+// Patches with varint control blocks can only be applied by versions of Sparkle that support them. Defaults to NO.
+@property (nonatomic) BOOL usesVarintControlBlocks;
+
+// Whether to compress the archive in independent frames on multiple threads, which also lets applying the patch decompress frames ahead on other threads
+// Frames are compressed on their own so the patch gets slightly larger. Only used for version 3 patches with lzma, lzfse, lz4 or zlib compression,
+// which are then created as minor version SUBinaryDeltaMinorVersion3_3 and can only be applied by versions of Sparkle that support them. Defaults to NO.
+@property (nonatomic) BOOL compressesInFrames;
+
+// Whether to front code the table of relative paths in the archive, storing each path as the length it shares with the previous path and its remaining bytes
+// Makes patches of bundles with many deeply nested files smaller and faster to read. Only used for version 3 patches,
+// which are then created as minor version SUBinaryDeltaMinorVersion3_5 and can only be applied by versions of Sparkle that support them. Defaults to NO.
+@property (nonatomic) BOOL frontCodesRelativePaths;
+
+// Whether to store files that look already compressed (like images, asset catalogs or embedded archives) without compressing them again
+// Saves time creating and applying the patch. Only used along with compressesInFrames, where such files are put in uncompressed frames of their own.
+// The patch is then created as minor version SUBinaryDeltaMinorVersion3_6, which also front codes relative paths, and can only be applied by versions of Sparkle that support it. Defaults to NO.
+@property (nonatomic) BOOL storesIncompressibleData;
+
+// Whether to store added or patched files that have the same contents as another added or patched file once, with the other copies referring to it
+// Files are compared by the SHA-1 digests computed while hashing the new tree, and copies of a patched file aren't diffed at all.
+// Makes patches of bundles with duplicated payloads (like helpers or localized resources) smaller. Only used for version 3 patches,
+// which are then created as minor version SUBinaryDeltaMinorVersion3_7 and can only be applied by versions of Sparkle that support them. Defaults to NO.
+@property (nonatomic) BOOL deduplicatesFiles;
+
+// Whether to also compare files byte by byte when their digests say they are equal while planning the patch
+// By default files are compared by the SHA-1 digests computed while hashing the old and new trees, so each file is only read once. Defaults to NO.
+@property (nonatomic) BOOL comparesEqualFiles;
+
+// Whether to diff files that are new at their path against the old file they have the most content in common with, if any is similar enough
+// This catches renamed helpers, versioned libraries and reorganized resources that the other heuristics miss, instead of storing them whole.
+// Finding similar files reads the whole old tree once. Only used for version 3 patches, which can be applied by any version of Sparkle that supports them. Defaults to NO.
+@property (nonatomic) BOOL diffsSimilarFiles;
+
+@end
+
+// Removes the least recently used files from a suffix sort cache directory until it takes up at most maximumSize bytes
+void trimBinaryDeltaSuffixSortCache(NSString *directory, uint64_t maximumSize);
+
+BOOL createBinaryDeltaWithOptions(NSString *source, NSString *destination, NSString *patchFile, SUBinaryDeltaMajorVersion majorVersion, SPUDeltaCompressionMode compression, uint8_t compressionLevel, SPUDeltaCreationOptions *options, BOOL verbose, NSError * __autoreleasing *error);
+
 BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchFile, SUBinaryDeltaMajorVersion majorVersion, SPUDeltaCompressionMode compression, uint8_t compressionLevel, BOOL verbose, NSError * __autoreleasing *error);
 
 #endif
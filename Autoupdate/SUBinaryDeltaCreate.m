@@ -12,6 +12,9 @@
 #import "SPUDeltaArchiveProtocol.h"
 #import "SPUSparkleDeltaArchive.h"
 #import "SPUXarDeltaArchive.h"
+#include "bsdiff.h"
+#include "bsfilter.h"
+#include "SPUDeltaCodec.h"
 #import <CommonCrypto/CommonDigest.h>
 #include <fcntl.h>
 #include <fts.h>
@@ -26,36 +29,297 @@
 
 #include "AppKitPrevention.h"
 
-extern int bsdiff(int argc, const char **argv);
-
 @interface CreateBinaryDeltaOperation : NSOperation
 
 @property (nonatomic, copy, readonly) NSString *relativePath;
 @property (nonatomic, copy, readonly) NSString *clonedRelativePath;
 @property (nonatomic, readonly) NSString *resultPath;
+@property (nonatomic, readonly) BOOL filteredBranches;
 @property (nonatomic, readonly) NSNumber *oldPermissions;
 @property (nonatomic, readonly) NSNumber *permissions;
 @property (nonatomic, readonly) NSString *fromPath;
 @property (nonatomic, readonly) BOOL changingPermissions;
 
-- (id)initWithRelativePath:(NSString *)relativePath clonedRelativePath:(NSString *)clonedRelativePath oldTree:(NSString *)oldTree newTree:(NSString *)newTree oldPermissions:(NSNumber *)oldPermissions newPermissions:(NSNumber *)permissions changingPermissions:(BOOL)changingPermissions SPU_OBJC_DIRECT;
+// Roughly how many bytes diffing the files takes at most, which is reserved from the memory limit while the operation runs
+@property (nonatomic) uint64_t estimatedMemoryUsage;
+
+- (id)initWithRelativePath:(NSString *)relativePath clonedRelativePath:(NSString *)clonedRelativePath oldTree:(NSString *)oldTree newTree:(NSString *)newTree oldPermissions:(NSNumber *)oldPermissions newPermissions:(NSNumber *)permissions changingPermissions:(BOOL)changingPermissions options:(SPUDeltaCreationOptions *)options filterBranches:(BOOL)filterBranches compression:(SPUDeltaCompressionMode)compression compressionLevel:(uint8_t)compressionLevel varintControl:(BOOL)varintControl SPU_OBJC_DIRECT;
+
+@end
+
+// Runs diffs on a queue while limiting how many run at the same time and how much memory they may take together
+// Diffs are only added to the queue once they fit, so diffs that wait don't take up threads or slots of the queue
+SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaDiffScheduler : NSObject
+
+- (instancetype)initWithMemoryLimit:(uint64_t)memoryLimit maximumConcurrentCount:(NSUInteger)maximumConcurrentCount;
+
+// Runs the operations and returns once all of them have finished
+- (void)runOperations:(NSArray<CreateBinaryDeltaOperation *> *)operations;
+
+@end
+
+@implementation SPUDeltaDiffScheduler
+{
+    NSOperationQueue *_queue;
+    NSCondition *_condition;
+    NSMutableArray<CreateBinaryDeltaOperation *> *_pendingOperations;
+    uint64_t _memoryLimit;
+    uint64_t _reservedMemory;
+    NSUInteger _maximumConcurrentCount;
+    NSUInteger _runningCount;
+}
+
+- (instancetype)initWithMemoryLimit:(uint64_t)memoryLimit maximumConcurrentCount:(NSUInteger)maximumConcurrentCount
+{
+    self = [super init];
+    if (self != nil) {
+        _queue = [[NSOperationQueue alloc] init];
+        _queue.maxConcurrentOperationCount = (NSInteger)maximumConcurrentCount;
+        _condition = [[NSCondition alloc] init];
+        _pendingOperations = [NSMutableArray array];
+        _memoryLimit = memoryLimit;
+        _maximumConcurrentCount = maximumConcurrentCount;
+    }
+    return self;
+}
+
+- (void)runOperations:(NSArray<CreateBinaryDeltaOperation *> *)operations
+{
+    // Start the largest diffs first, which take the longest, so that small diffs fill in the remaining threads at the end
+    NSArray<CreateBinaryDeltaOperation *> *sortedOperations = [operations sortedArrayWithOptions:NSSortStable usingComparator:^NSComparisonResult(CreateBinaryDeltaOperation *operation1, CreateBinaryDeltaOperation *operation2) {
+        if (operation1.estimatedMemoryUsage > operation2.estimatedMemoryUsage) {
+            return NSOrderedAscending;
+        } else if (operation1.estimatedMemoryUsage < operation2.estimatedMemoryUsage) {
+            return NSOrderedDescending;
+        }
+        return NSOrderedSame;
+    }];
+    
+    [_condition lock];
+    [_pendingOperations addObjectsFromArray:sortedOperations];
+    [self _startOperationsThatFit];
+    while (_pendingOperations.count > 0 || _runningCount > 0) {
+        [_condition wait];
+    }
+    [_condition unlock];
+}
+
+// Must be called with the condition locked
+- (void)_startOperationsThatFit
+{
+    NSUInteger operationIndex = 0;
+    while (operationIndex < _pendingOperations.count && _runningCount < _maximumConcurrentCount) {
+        CreateBinaryDeltaOperation *operation = _pendingOperations[operationIndex];
+        uint64_t memoryUsage = operation.estimatedMemoryUsage;
+        
+        // Smaller diffs may start ahead of a larger diff that doesn't fit yet, so that memory and threads don't sit idle
+        // A diff that doesn't fit in the limit at all runs once nothing else is running
+        if (_runningCount > 0 && memoryUsage > _memoryLimit - MIN(_reservedMemory, _memoryLimit)) {
+            operationIndex++;
+            continue;
+        }
+        
+        [_pendingOperations removeObjectAtIndex:operationIndex];
+        _reservedMemory += memoryUsage;
+        _runningCount++;
+        
+        __weak SPUDeltaDiffScheduler *weakSelf = self;
+        operation.completionBlock = ^{
+            [weakSelf _finishOperationWithMemoryUsage:memoryUsage];
+        };
+        [_queue addOperation:operation];
+    }
+}
+
+- (void)_finishOperationWithMemoryUsage:(uint64_t)memoryUsage
+{
+    [_condition lock];
+    _reservedMemory -= memoryUsage;
+    _runningCount--;
+    [self _startOperationsThatFit];
+    [_condition signal];
+    [_condition unlock];
+}
 
 @end
 
+// Suffix sorts of smaller files are quick to recompute and aren't worth caching
+#define MIN_SUFFIX_SORT_CACHE_FILE_SIZE (256 * 1024)
+
+// Old files are hashed this many bytes at a time, which keeps each update within CC_LONG
+#define SUFFIX_SORT_CACHE_HASH_CHUNK_SIZE (1024 * 1024 * 1024)
+
+static NSString *suffixSortCachePath(NSString *directory, NSData *oldData)
+{
+    CC_SHA256_CTX hashContext;
+    CC_SHA256_Init(&hashContext);
+    
+    const unsigned char *bytes = oldData.bytes;
+    NSUInteger length = oldData.length;
+    for (NSUInteger offset = 0; offset < length; offset += SUFFIX_SORT_CACHE_HASH_CHUNK_SIZE) {
+        NSUInteger chunkLength = MIN(length - offset, (NSUInteger)SUFFIX_SORT_CACHE_HASH_CHUNK_SIZE);
+        CC_SHA256_Update(&hashContext, bytes + offset, (CC_LONG)chunkLength);
+    }
+    
+    unsigned char hash[CC_SHA256_DIGEST_LENGTH] = {0};
+    CC_SHA256_Final(hash, &hashContext);
+    
+    NSMutableString *fileName = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2 + 9];
+    for (size_t i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        [fileName appendFormat:@"%02x", hash[i]];
+    }
+    [fileName appendString:@".suffixes"];
+    
+    return [directory stringByAppendingPathComponent:fileName];
+}
+
+static int appendPatchData(void *context, const void *buffer, size_t size)
+{
+    [(__bridge NSMutableData *)context appendBytes:buffer length:size];
+    return 0;
+}
+
+static NSData *createPatchData(NSData *fromData, NSData *toData, SPUDeltaCreationOptions *creationOptions, BOOL varintControl)
+{
+    enum bsdiff_engine engine = ((uint64_t)fromData.length >= creationOptions.hashDiffThreshold) ? BSDIFF_ENGINE_HASH : BSDIFF_ENGINE_SUFFIX_SORT;
+    
+    NSString *cachePath = nil;
+    if (engine == BSDIFF_ENGINE_SUFFIX_SORT && creationOptions.suffixSortCacheDirectory != nil && fromData.length >= MIN_SUFFIX_SORT_CACHE_FILE_SIZE) {
+        cachePath = suffixSortCachePath(creationOptions.suffixSortCacheDirectory, fromData);
+    }
+    
+    struct bsdiff_options options = {
+        .suffix_sort_threads = (int)creationOptions.suffixSortThreadCount,
+        .scan_threads = (int)creationOptions.scanThreadCount,
+        .suffix_sort_cache = cachePath.fileSystemRepresentation,
+        .engine = engine,
+        .varint_control = varintControl
+    };
+    
+    // The patch is kept in memory and written straight into the archive
+    NSMutableData *patchData = [NSMutableData dataWithCapacity:toData.length];
+    struct bsdiff_sink sink = {
+        .context = (__bridge void *)patchData,
+        .write = appendPatchData
+    };
+    
+    if (bsdiff_buffers(fromData.bytes, (off_t)fromData.length, toData.bytes, (off_t)toData.length, &options, &sink) != 0) {
+        return nil;
+    }
+    return patchData;
+}
+
+// Estimates the peak memory bsdiff takes for diffing files of these sizes, including both files,
+// the suffix sort or anchor index of the old file, the diff and extra blocks, and the patch itself
+// Nothing stays in memory after the diff finishes because the patch is written to a temporary file
+static uint64_t estimatedDiffMemoryUsage(uint64_t oldSize, uint64_t newSize, SPUDeltaCreationOptions *creationOptions, BOOL filterBranches)
+{
+    uint64_t indexSize;
+    if (oldSize >= creationOptions.hashDiffThreshold) {
+        // About one 8 byte slot for every 64 bytes, rounded up to a power of two
+        indexSize = oldSize / 4;
+    } else {
+        // Suffixes take 4 bytes each for files below 2 GiB and 8 bytes otherwise
+        // The multithreaded sorter needs the same amount again as scratch space
+        uint64_t suffixSize = (oldSize >= INT32_MAX) ? 8 : 4;
+        indexSize = (oldSize + 1) * suffixSize * ((creationOptions.suffixSortThreadCount > 1) ? 2 : 1);
+    }
+    
+    uint64_t memoryUsage = oldSize + newSize + indexSize + newSize * 3;
+    if (filterBranches) {
+        // Filtered copies of both files, the decoded check of the new file and the first patch are kept while diffing again
+        memoryUsage += oldSize + newSize * 3;
+    }
+    return memoryUsage;
+}
+
+// Estimates how large a patch ends up in the compressed archive, for comparing patches of the same file
+// The patch is compressed the way the archive compresses it, except that bzip2 isn't a codec and is estimated with zlib instead
+static size_t estimatedCompressedSize(NSData *patchData, SPUDeltaCompressionMode compression, uint8_t compressionLevel)
+{
+    size_t length = patchData.length;
+    
+    spu_delta_codec_algorithm algorithm = SPU_DELTA_CODEC_LZMA;
+    int level = 0;
+    switch ((compression == SPUDeltaCompressionModeDefault) ? SPUDeltaCompressionModeLZMA : compression) {
+        case SPUDeltaCompressionModeNone:
+            return length;
+        case SPUDeltaCompressionModeBzip2:
+        case SPUDeltaCompressionModeZLIB:
+            algorithm = SPU_DELTA_CODEC_ZLIB;
+            break;
+        case SPUDeltaCompressionModeLZFSE:
+            algorithm = SPU_DELTA_CODEC_LZFSE;
+            break;
+        case SPUDeltaCompressionModeLZ4:
+            algorithm = SPU_DELTA_CODEC_LZ4;
+            break;
+        case SPUDeltaCompressionModeZstd:
+            algorithm = SPU_DELTA_CODEC_ZSTD;
+            // Same as the level the archive writes with
+            level = (compressionLevel <= 0 || compressionLevel > SPUDeltaZstdMaxCompressionLevel) ? SPUDeltaZstdMaxCompressionLevel : compressionLevel;
+            break;
+        case SPUDeltaCompressionModeLZMA:
+            algorithm = SPU_DELTA_CODEC_LZMA;
+            break;
+    }
+    
+    if (!spu_delta_codec_is_supported(algorithm)) {
+        return length;
+    }
+    
+    uint8_t *buffer = malloc(length);
+    if (buffer == NULL) {
+        return length;
+    }
+    
+    size_t compressedLength = spu_delta_codec_encode_buffer(buffer, length, patchData.bytes, length, algorithm, level);
+    free(buffer);
+    
+    // Patches that don't fit in their own size are incompressible
+    return (compressedLength == 0) ? length : compressedLength;
+}
+
+// Returns a patch between the old and new files with their branch instructions filtered,
+// or nil if they aren't both executables the filter supports
+static NSData *createBranchFilteredPatchData(NSData *fromData, NSData *toData, SPUDeltaCreationOptions *creationOptions, BOOL varintControl)
+{
+    NSMutableData *filteredFromData = [fromData mutableCopy];
+    NSMutableData *filteredToData = [toData mutableCopy];
+    if (bsfilter_encode_branches(filteredFromData.mutableBytes, (off_t)filteredFromData.length) != 1 || bsfilter_encode_branches(filteredToData.mutableBytes, (off_t)filteredToData.length) != 1) {
+        return nil;
+    }
+    
+    // Applying the patch decodes the patched file, so make sure that gives back the new file
+    NSMutableData *decodedToData = [filteredToData mutableCopy];
+    if (bsfilter_decode_branches(decodedToData.mutableBytes, (off_t)decodedToData.length) != 1 || ![decodedToData isEqualToData:toData]) {
+        return nil;
+    }
+    
+    return createPatchData(filteredFromData, filteredToData, creationOptions, varintControl);
+}
+
 @implementation CreateBinaryDeltaOperation
 {
     NSString *_toPath;
+    SPUDeltaCreationOptions *_options;
+    BOOL _filterBranches;
+    SPUDeltaCompressionMode _compression;
+    uint8_t _compressionLevel;
+    BOOL _varintControl;
 }
 
 @synthesize relativePath = _relativePath;
 @synthesize clonedRelativePath = _clonedRelativePath;
 @synthesize resultPath = _resultPath;
+@synthesize filteredBranches = _filteredBranches;
 @synthesize oldPermissions = _oldPermissions;
 @synthesize permissions = _permissions;
 @synthesize fromPath = _fromPath;
 @synthesize changingPermissions = _changingPermissions;
+@synthesize estimatedMemoryUsage = _estimatedMemoryUsage;
 
-- (id)initWithRelativePath:(NSString *)relativePath clonedRelativePath:(NSString *)clonedRelativePath oldTree:(NSString *)oldTree newTree:(NSString *)newTree oldPermissions:(NSNumber *)oldPermissions newPermissions:(NSNumber *)permissions changingPermissions:(BOOL)changingPermissions
+- (id)initWithRelativePath:(NSString *)relativePath clonedRelativePath:(NSString *)clonedRelativePath oldTree:(NSString *)oldTree newTree:(NSString *)newTree oldPermissions:(NSNumber *)oldPermissions newPermissions:(NSNumber *)permissions changingPermissions:(BOOL)changingPermissions options:(SPUDeltaCreationOptions *)options filterBranches:(BOOL)filterBranches compression:(SPUDeltaCompressionMode)compression compressionLevel:(uint8_t)compressionLevel varintControl:(BOOL)varintControl
 {
     if ((self = [super init])) {
         _relativePath = [relativePath copy];
@@ -70,22 +334,91 @@ extern int bsdiff(int argc, const char **argv);
             _fromPath = [oldTree stringByAppendingPathComponent:clonedRelativePath];
         }
         _toPath = [newTree stringByAppendingPathComponent:relativePath];
+        _options = options;
+        _filterBranches = filterBranches;
+        _compression = compression;
+        _compressionLevel = compressionLevel;
+        _varintControl = varintControl;
     }
     return self;
 }
 
 - (void)main
 {
+    // The files and patches are freed before the operation finishes and its memory is given back to the scheduler
+    @autoreleasepool {
+        [self _createPatch];
+    }
+}
+
+- (void)_createPatch SPU_OBJC_DIRECT
+{
+    NSData *fromData = [NSData dataWithContentsOfFile:_fromPath options:0 error:NULL];
+    NSData *toData = [NSData dataWithContentsOfFile:_toPath options:0 error:NULL];
+    if (fromData == nil || toData == nil) {
+        return;
+    }
+    
+    NSData *patchData = createPatchData(fromData, toData, _options, _varintControl);
+    if (patchData == nil) {
+        return;
+    }
+    
+    // Filtering makes diffs of code that moved smaller, but diffs of code that stayed in place can get larger
+    if (_filterBranches) {
+        NSData *filteredPatchData = createBranchFilteredPatchData(fromData, toData, _options, _varintControl);
+        if (filteredPatchData != nil && estimatedCompressedSize(filteredPatchData, _compression, _compressionLevel) < estimatedCompressedSize(patchData, _compression, _compressionLevel)) {
+            patchData = filteredPatchData;
+            _filteredBranches = YES;
+        }
+    }
+    
+    // Finished patches are written out so that they don't add up in memory until the archive is written
     NSString *temporaryFile = temporaryFilename(@"BinaryDelta");
-    const char *argv[] = { "/usr/bin/bsdiff", [_fromPath fileSystemRepresentation], [_toPath fileSystemRepresentation], [temporaryFile fileSystemRepresentation] };
-    int result = bsdiff(4, argv);
-    if (result == 0) {
+    if (temporaryFile == nil) {
+        return;
+    }
+    
+    if ([patchData writeToFile:temporaryFile options:0 error:NULL]) {
         _resultPath = temporaryFile;
+    } else {
+        unlink(temporaryFile.fileSystemRepresentation);
     }
 }
 
 @end
 
+@implementation SPUDeltaCreationOptions
+
+@synthesize suffixSortThreadCount = _suffixSortThreadCount;
+@synthesize scanThreadCount = _scanThreadCount;
+@synthesize maximumConcurrentDiffCount = _maximumConcurrentDiffCount;
+@synthesize diffMemoryLimit = _diffMemoryLimit;
+@synthesize suffixSortCacheDirectory = _suffixSortCacheDirectory;
+@synthesize fileDigestCache = _fileDigestCache;
+@synthesize hashDiffThreshold = _hashDiffThreshold;
+@synthesize filtersExecutableBranches = _filtersExecutableBranches;
+@synthesize usesVarintControlBlocks = _usesVarintControlBlocks;
+@synthesize compressesInFrames = _compressesInFrames;
+@synthesize frontCodesRelativePaths = _frontCodesRelativePaths;
+@synthesize storesIncompressibleData = _storesIncompressibleData;
+@synthesize deduplicatesFiles = _deduplicatesFiles;
+@synthesize comparesEqualFiles = _comparesEqualFiles;
+@synthesize diffsSimilarFiles = _diffsSimilarFiles;
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _suffixSortThreadCount = 1;
+        _scanThreadCount = 1;
+        _hashDiffThreshold = SPUDeltaDefaultHashDiffThreshold;
+    }
+    return self;
+}
+
+@end
+
 #define INFO_PATH_KEY @"path"
 #define INFO_TYPE_KEY @"type"
 #define INFO_PERMISSIONS_KEY @"permissions"
@@ -172,7 +505,41 @@ static NSString *temporaryPatchFile(NSString *patchFile)
 
 #define MIN_FILE_SIZE_FOR_CREATING_DELTA 4096
 
-static BOOL shouldSkipDeltaCompression(NSDictionary *originalInfo, NSDictionary *newInfo)
+// Whether the old and new entries at a path have the same type and contents
+// Regular files are compared by the digests computed while hashing the trees, so planning the patch doesn't read them again
+// Only if comparesEqualFiles is set are regular files with equal digests also compared byte by byte
+static BOOL entriesHaveEqualContents(NSDictionary *originalInfo, NSDictionary *newInfo, NSData *originalHash, NSData *newHash, BOOL comparesEqualFiles)
+{
+    if (!originalInfo) {
+        return NO;
+    }
+    
+    unsigned short originalInfoType = [(NSNumber *)originalInfo[INFO_TYPE_KEY] unsignedShortValue];
+    unsigned short newInfoType = [(NSNumber *)newInfo[INFO_TYPE_KEY] unsignedShortValue];
+    if (originalInfoType != newInfoType) {
+        return NO;
+    }
+    
+    if (originalInfoType == FTS_D) {
+        return YES;
+    }
+    
+    NSString *originalPath = originalInfo[INFO_PATH_KEY];
+    NSString *newPath = newInfo[INFO_PATH_KEY];
+    
+    // Files that weren't hashed with their tree (like custom icon data) and symbolic links are compared directly
+    if (originalInfoType != FTS_F || originalHash == nil || newHash == nil) {
+        return [[NSFileManager defaultManager] contentsEqualAtPath:originalPath andPath:newPath];
+    }
+    
+    if (![originalHash isEqualToData:newHash]) {
+        return NO;
+    }
+    
+    return !comparesEqualFiles || [[NSFileManager defaultManager] contentsEqualAtPath:originalPath andPath:newPath];
+}
+
+static BOOL shouldSkipDeltaCompression(NSDictionary *originalInfo, NSDictionary *newInfo, BOOL equalContents)
 {
     unsigned long long fileSize = [(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue];
     if (fileSize < MIN_FILE_SIZE_FOR_CREATING_DELTA) {
@@ -190,11 +557,8 @@ static BOOL shouldSkipDeltaCompression(NSDictionary *originalInfo, NSDictionary
         return YES;
     }
 
-    NSString *originalPath = originalInfo[INFO_PATH_KEY];
-    NSString *newPath = newInfo[INFO_PATH_KEY];
-
     // Skip delta if the files are equal in content
-    if ([[NSFileManager defaultManager] contentsEqualAtPath:originalPath andPath:newPath]) {
+    if (equalContents) {
         return YES;
     }
 
@@ -214,7 +578,18 @@ static BOOL shouldDeleteThenExtract(NSDictionary *originalInfo, NSDictionary *ne
     return NO;
 }
 
-static BOOL shouldSkipExtracting(NSDictionary *originalInfo, NSDictionary *newInfo)
+// The digest other files are deduplicated against, from hashing the new tree
+// Empty files don't have any data to share so they don't have one
+static NSData *deduplicationDigest(NSDictionary<NSString *, NSData *> *afterFileKeyToHashDictionary, NSDictionary *newInfo, NSString *key)
+{
+    if ([(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue] == 0) {
+        return nil;
+    }
+    
+    return afterFileKeyToHashDictionary[key];
+}
+
+static BOOL shouldSkipExtracting(NSDictionary *originalInfo, NSDictionary *newInfo, BOOL equalContents)
 {
     if (!originalInfo) {
         return NO;
@@ -227,14 +602,10 @@ static BOOL shouldSkipExtracting(NSDictionary *originalInfo, NSDictionary *newIn
         // File types are different
         return NO;
     }
-
-    
-    NSString *originalPath = originalInfo[INFO_PATH_KEY];
-    NSString *newPath = newInfo[INFO_PATH_KEY];
     
     // Don't skip extract if files/symlinks entries are not equal in content
     // (note if the entries are directories, they are equal)
-    if (originalInfoType != FTS_D && ![[NSFileManager defaultManager] contentsEqualAtPath:originalPath andPath:newPath]) {
+    if (!equalContents) {
         return NO;
     }
 
@@ -273,7 +644,7 @@ static BOOL shouldChangePermissions(NSDictionary *originalInfo, NSDictionary *ne
 
 #define MIN_SIZE_FOR_CLONE 4096
 #define MIN_SIZE_FOR_CLONE_DIFF (4096 * 4)
-static NSString *cloneableRelativePath(NSDictionary<NSString *, NSData *> *afterFileKeyToHashDictionary, NSDictionary<NSData *, NSArray<NSString *> *> *beforeHashToFileKeyDictionary, NSDictionary<NSString *, NSString *> *frameworkVersionsSubstitutes, NSDictionary<NSString *, NSString *> *fileSubstitutes, NSDictionary *originalTreeState, NSDictionary *newInfo, NSString *key, NSNumber * __autoreleasing *outNewPermissions, BOOL *clonePermissionsChanged, BOOL *clonedBinaryDiff)
+static NSString *cloneableRelativePath(NSDictionary<NSString *, NSData *> *afterFileKeyToHashDictionary, NSDictionary<NSData *, NSArray<NSString *> *> *beforeHashToFileKeyDictionary, NSDictionary<NSString *, NSString *> *frameworkVersionsSubstitutes, NSDictionary<NSString *, NSString *> *fileSubstitutes, NSDictionary *originalTreeState, NSDictionary *newInfo, NSString *key, BOOL comparesEqualFiles, NSNumber * __autoreleasing *outNewPermissions, BOOL *clonePermissionsChanged, BOOL *clonedBinaryDiff)
 {
     // Avoid clones for small files. Small files can compress very well, sometimes better than tracking clones.
     if ([(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue] <= MIN_SIZE_FOR_CLONE) {
@@ -301,7 +672,8 @@ static NSString *cloneableRelativePath(NSDictionary<NSString *, NSData *> *after
                 NSString *clonePath = oldCloneInfo[INFO_PATH_KEY];
                 NSString *newPath = newInfo[INFO_PATH_KEY];
                 
-                if (![[NSFileManager defaultManager] contentsEqualAtPath:clonePath andPath:newPath]) {
+                // The digests of both files are already known to be equal
+                if (comparesEqualFiles && ![[NSFileManager defaultManager] contentsEqualAtPath:clonePath andPath:newPath]) {
                     continue;
                 }
                 
@@ -403,14 +775,278 @@ static NSString *cloneableRelativePath(NSDictionary<NSString *, NSData *> *after
     return nil;
 }
 
+// Number of the smallest fingerprints of a file that are kept for estimating its resemblance to other files (a bottom-k MinHash sketch)
+#define SIMILARITY_SKETCH_SIZE 128
+// About one in 64 positions of a file is fingerprinted, chosen by the 64 bytes before it so that inserted or removed bytes don't shift the others
+#define SIMILARITY_ANCHOR_SHIFT 58
+// Old files need to share at least this fraction of fingerprints with a new file to be diffed against it
+#define SIMILARITY_MIN_RESEMBLANCE 0.25
+// Old files that are many times smaller or larger than a new file aren't worth diffing against it
+#define SIMILARITY_MAX_SIZE_RATIO 4
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t fingerprints[SIMILARITY_SKETCH_SIZE];
+} SPUDeltaSimilaritySketch;
+
+static uint64_t similarityMix(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// Keeps the SIMILARITY_SKETCH_SIZE smallest distinct fingerprints in ascending order
+static void addSimilarityFingerprint(SPUDeltaSimilaritySketch *sketch, uint64_t fingerprint)
+{
+    if (sketch->count == SIMILARITY_SKETCH_SIZE && fingerprint >= sketch->fingerprints[SIMILARITY_SKETCH_SIZE - 1]) {
+        return;
+    }
+    
+    uint32_t low = 0;
+    uint32_t high = sketch->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (sketch->fingerprints[middle] < fingerprint) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    if (low < sketch->count && sketch->fingerprints[low] == fingerprint) {
+        return;
+    }
+    
+    uint32_t keptCount = (sketch->count == SIMILARITY_SKETCH_SIZE) ? SIMILARITY_SKETCH_SIZE - 1 : sketch->count;
+    memmove(&sketch->fingerprints[low + 1], &sketch->fingerprints[low], (keptCount - low) * sizeof(sketch->fingerprints[0]));
+    sketch->fingerprints[low] = fingerprint;
+    if (sketch->count < SIMILARITY_SKETCH_SIZE) {
+        sketch->count++;
+    }
+}
+
+static void getSimilaritySketchOfBytes(SPUDeltaSimilaritySketch *sketch, const uint8_t *bytes, size_t length, const uint64_t *gear)
+{
+    memset(sketch, 0, sizeof(*sketch));
+    
+    // Gear hash, whose value only depends on the last 64 bytes
+    uint64_t hash = 0;
+    for (size_t byteIndex = 0; byteIndex < length; byteIndex++) {
+        hash = (hash << 1) + gear[bytes[byteIndex]];
+        if (byteIndex >= 63 && (hash >> SIMILARITY_ANCHOR_SHIFT) == 0) {
+            addSimilarityFingerprint(sketch, similarityMix(hash));
+        }
+    }
+}
+
+// Estimates the Jaccard index of the fingerprints of two files from the smallest fingerprints of their union
+static double estimatedResemblance(const SPUDeltaSimilaritySketch *sketch1, const SPUDeltaSimilaritySketch *sketch2)
+{
+    uint32_t index1 = 0;
+    uint32_t index2 = 0;
+    uint32_t unionCount = 0;
+    uint32_t sharedCount = 0;
+    while (unionCount < SIMILARITY_SKETCH_SIZE && (index1 < sketch1->count || index2 < sketch2->count)) {
+        if (index2 >= sketch2->count || (index1 < sketch1->count && sketch1->fingerprints[index1] < sketch2->fingerprints[index2])) {
+            index1++;
+        } else if (index1 >= sketch1->count || sketch2->fingerprints[index2] < sketch1->fingerprints[index1]) {
+            index2++;
+        } else {
+            sharedCount++;
+            index1++;
+            index2++;
+        }
+        unionCount++;
+    }
+    
+    return (unionCount == 0) ? 0.0 : (double)sharedCount / unionCount;
+}
+
+// Finds the old file that a new file has the most content in common with, so the new file can be diffed against it
+// even when it was renamed or moved in a way the other heuristics don't catch
+SPU_OBJC_DIRECT_MEMBERS @interface SPUDeltaSimilarityIndex : NSObject
+
+- (instancetype)initWithTreeState:(NSDictionary *)treeState;
+
+- (NSString *)relativePathOfFileMostSimilarToFileAtPath:(NSString *)path size:(uint64_t)size;
+
+@end
+
+@implementation SPUDeltaSimilarityIndex
+{
+    NSArray<NSString *> *_relativePaths;
+    NSData *_sizesData;
+    NSData *_sketchesData;
+    uint64_t _gear[256];
+}
+
+- (instancetype)initWithTreeState:(NSDictionary *)treeState
+{
+    self = [super init];
+    if (self != nil) {
+        uint64_t state = 0;
+        for (size_t gearIndex = 0; gearIndex < 256; gearIndex++) {
+            state += 0x9e3779b97f4a7c15ULL;
+            _gear[gearIndex] = similarityMix(state);
+        }
+        
+        // Sorted so that the first of equally similar files is picked regardless of the order of the dictionary
+        NSMutableArray<NSString *> *relativePaths = [NSMutableArray array];
+        for (NSString *relativePath in [treeState.allKeys sortedArrayUsingSelector:@selector(compare:)]) {
+            NSDictionary *info = treeState[relativePath];
+            if ([(NSNumber *)info[INFO_TYPE_KEY] unsignedShortValue] == FTS_F && [(NSNumber *)info[INFO_SIZE_KEY] unsignedLongLongValue] > MIN_SIZE_FOR_CLONE_DIFF) {
+                [relativePaths addObject:relativePath];
+            }
+        }
+        
+        NSUInteger fileCount = relativePaths.count;
+        NSMutableData *sizesData = [NSMutableData dataWithLength:fileCount * sizeof(uint64_t)];
+        NSMutableData *sketchesData = [NSMutableData dataWithLength:fileCount * sizeof(SPUDeltaSimilaritySketch)];
+        uint64_t *sizes = sizesData.mutableBytes;
+        SPUDeltaSimilaritySketch *sketches = sketchesData.mutableBytes;
+        
+        NSMutableArray<NSString *> *paths = [NSMutableArray arrayWithCapacity:fileCount];
+        for (NSUInteger fileIndex = 0; fileIndex < fileCount; fileIndex++) {
+            NSDictionary *info = treeState[relativePaths[fileIndex]];
+            sizes[fileIndex] = [(NSNumber *)info[INFO_SIZE_KEY] unsignedLongLongValue];
+            [paths addObject:info[INFO_PATH_KEY]];
+        }
+        
+        // Old files are sketched on multiple threads. Files that can't be read keep an empty sketch, which doesn't resemble anything.
+        const uint64_t *gear = _gear;
+        dispatch_apply(fileCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t fileIndex) {
+            @autoreleasepool {
+                NSData *data = [NSData dataWithContentsOfFile:paths[fileIndex] options:NSDataReadingMappedIfSafe error:NULL];
+                if (data != nil) {
+                    getSimilaritySketchOfBytes(&sketches[fileIndex], data.bytes, data.length, gear);
+                }
+            }
+        });
+        
+        _relativePaths = relativePaths;
+        _sizesData = sizesData;
+        _sketchesData = sketchesData;
+    }
+    return self;
+}
+
+- (NSString *)relativePathOfFileMostSimilarToFileAtPath:(NSString *)path size:(uint64_t)size
+{
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    if (data == nil) {
+        return nil;
+    }
+    
+    SPUDeltaSimilaritySketch sketch;
+    getSimilaritySketchOfBytes(&sketch, data.bytes, data.length, _gear);
+    
+    const uint64_t *sizes = _sizesData.bytes;
+    const SPUDeltaSimilaritySketch *sketches = _sketchesData.bytes;
+    
+    NSString *bestRelativePath = nil;
+    double bestResemblance = SIMILARITY_MIN_RESEMBLANCE;
+    for (NSUInteger fileIndex = 0; fileIndex < _relativePaths.count; fileIndex++) {
+        if (sizes[fileIndex] / SIMILARITY_MAX_SIZE_RATIO > size || size / SIMILARITY_MAX_SIZE_RATIO > sizes[fileIndex]) {
+            continue;
+        }
+        
+        double resemblance = estimatedResemblance(&sketch, &sketches[fileIndex]);
+        if (resemblance > bestResemblance || (bestRelativePath == nil && resemblance >= bestResemblance)) {
+            bestResemblance = resemblance;
+            bestRelativePath = _relativePaths[fileIndex];
+        }
+    }
+    return bestRelativePath;
+}
+
+@end
+
+void trimBinaryDeltaSuffixSortCache(NSString *directory, uint64_t maximumSize)
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSArray<NSURLResourceKey> *keys = @[NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey, NSURLIsRegularFileKey];
+    NSArray<NSURL *> *files = [fileManager contentsOfDirectoryAtURL:[NSURL fileURLWithPath:directory isDirectory:YES] includingPropertiesForKeys:keys options:0 error:NULL];
+    if (files == nil) {
+        return;
+    }
+    
+    NSMutableDictionary<NSURL *, NSDictionary<NSURLResourceKey, id> *> *valuesByFile = [NSMutableDictionary dictionary];
+    uint64_t totalSize = 0;
+    for (NSURL *file in files) {
+        NSDictionary<NSURLResourceKey, id> *values = [file resourceValuesForKeys:keys error:NULL];
+        if (values == nil || ![values[NSURLIsRegularFileKey] boolValue]) {
+            continue;
+        }
+        
+        valuesByFile[file] = values;
+        totalSize += [values[NSURLTotalFileAllocatedSizeKey] unsignedLongLongValue];
+    }
+    
+    // bsdiff marks cache files as used by updating their modification date, so remove the oldest first
+    NSArray<NSURL *> *filesByAge = [valuesByFile.allKeys sortedArrayUsingComparator:^NSComparisonResult(NSURL *file1, NSURL *file2) {
+        NSDate *date1 = valuesByFile[file1][NSURLContentModificationDateKey];
+        NSDate *date2 = valuesByFile[file2][NSURLContentModificationDateKey];
+        return [date1 compare:date2];
+    }];
+    
+    for (NSURL *file in filesByAge) {
+        if (totalSize <= maximumSize) {
+            break;
+        }
+        
+        if ([fileManager removeItemAtURL:file error:NULL]) {
+            totalSize -= MIN(totalSize, [valuesByFile[file][NSURLTotalFileAllocatedSizeKey] unsignedLongLongValue]);
+        }
+    }
+}
+
 BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchFile, SUBinaryDeltaMajorVersion majorVersion, SPUDeltaCompressionMode compression, uint8_t compressionLevel, BOOL verbose, NSError *__autoreleasing *error)
+{
+    return createBinaryDeltaWithOptions(source, destination, patchFile, majorVersion, compression, compressionLevel, nil, verbose, error);
+}
+
+BOOL createBinaryDeltaWithOptions(NSString *source, NSString *destination, NSString *patchFile, SUBinaryDeltaMajorVersion majorVersion, SPUDeltaCompressionMode compression, uint8_t compressionLevel, SPUDeltaCreationOptions *options, BOOL verbose, NSError *__autoreleasing *error)
 {
     assert(source);
     assert(destination);
     assert(patchFile);
     assert(majorVersion >= SUBinaryDeltaMajorVersionFirst && majorVersion <= SUBinaryDeltaMajorVersionLatest);
 
+    if (options == nil) {
+        options = [[SPUDeltaCreationOptions alloc] init];
+    }
+    
+    // Patches are marked with the oldest minor version that can apply them, so they stay applicable
+    // by older versions unless formats those versions don't support are requested
+    BOOL varintControl = options.usesVarintControlBlocks && MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3);
+    BOOL framedCompression = options.compressesInFrames && MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) && compression != SPUDeltaCompressionModeNone && compression != SPUDeltaCompressionModeBzip2;
     uint16_t minorVersion = latestMinorVersionForMajorVersion(majorVersion);
+    if (MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3)) {
+        if (options.filtersExecutableBranches) {
+            minorVersion = SUBinaryDeltaMinorVersion3_8;
+        } else if (options.deduplicatesFiles) {
+            minorVersion = SUBinaryDeltaMinorVersion3_7;
+        } else if (options.storesIncompressibleData && framedCompression) {
+            minorVersion = SUBinaryDeltaMinorVersion3_6;
+        } else if (options.frontCodesRelativePaths) {
+            minorVersion = SUBinaryDeltaMinorVersion3_5;
+        } else if (compression == SPUDeltaCompressionModeZstd) {
+            minorVersion = SUBinaryDeltaMinorVersion3_4;
+        } else if (framedCompression) {
+            minorVersion = SUBinaryDeltaMinorVersion3_3;
+        } else if (varintControl) {
+            minorVersion = SUBinaryDeltaMinorVersion3_2;
+        } else {
+            minorVersion = SUBinaryDeltaMinorVersion3_1;
+        }
+    }
+    
+    if (options.suffixSortCacheDirectory != nil) {
+        // Diffs are still created if the cache can't be written to
+        [[NSFileManager defaultManager] createDirectoryAtPath:options.suffixSortCacheDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+    }
 
     NSMutableDictionary *originalTreeState = [NSMutableDictionary dictionary];
 
@@ -507,9 +1143,11 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
 
     // This dictionary will help us keep track of clones
     NSMutableDictionary<NSData *, NSMutableArray<NSString *> *> *beforeHashToFileKeyDictionary = MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) ? [NSMutableDictionary dictionary] : nil;
+    // This dictionary lets us compare old and new files without reading them again
+    NSMutableDictionary<NSString *, NSData *> *beforeFileKeyToHashDictionary = [NSMutableDictionary dictionary];
     
     unsigned char beforeHash[CC_SHA1_DIGEST_LENGTH] = {0};
-    if (!getRawHashOfTreeAndFileTablesWithVersion(beforeHash, source, majorVersion, beforeHashToFileKeyDictionary, nil)) {
+    if (!getRawHashOfTreeAndFileTablesWithVersion(beforeHash, source, majorVersion, options.fileDigestCache, beforeHashToFileKeyDictionary, beforeFileKeyToHashDictionary)) {
         if (verbose) {
             fprintf(stderr, "\n");
         }
@@ -683,11 +1321,11 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
     }
     fts_close(fts);
 
-    // This dictionary will help us keep track of clones
-    NSMutableDictionary<NSString *, NSData *> *afterFileKeyToHashDictionary = MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) ? [NSMutableDictionary dictionary] : nil;
+    // This dictionary will help us keep track of clones and compare old and new files
+    NSMutableDictionary<NSString *, NSData *> *afterFileKeyToHashDictionary = [NSMutableDictionary dictionary];
     
     unsigned char afterHash[CC_SHA1_DIGEST_LENGTH] = {0};
-    if (!getRawHashOfTreeAndFileTablesWithVersion(afterHash, destination, majorVersion, nil, afterFileKeyToHashDictionary)) {
+    if (!getRawHashOfTreeAndFileTablesWithVersion(afterHash, destination, majorVersion, options.fileDigestCache, nil, afterFileKeyToHashDictionary)) {
         if (verbose) {
             fprintf(stderr, "\n");
         }
@@ -708,7 +1346,10 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
     
     id<SPUDeltaArchiveProtocol> archive;
     if (majorVersion >= SUBinaryDeltaMajorVersion3) {
-        archive = [[SPUSparkleDeltaArchive alloc] initWithPatchFileForWriting:temporaryFile];
+        SPUSparkleDeltaArchive *sparkleArchive = [[SPUSparkleDeltaArchive alloc] initWithPatchFileForWriting:temporaryFile framedCompression:framedCompression];
+        sparkleArchive.storesIncompressibleBlobs = options.storesIncompressibleData;
+        sparkleArchive.deduplicatesBlobs = options.deduplicatesFiles;
+        archive = sparkleArchive;
     } else {
 #if SPARKLE_BUILD_LEGACY_DELTA_SUPPORT
         archive = [[SPUXarDeltaArchive alloc] initWithPatchFileForWriting:temporaryFile];
@@ -736,8 +1377,16 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
         return NO;
     }
 
-    NSOperationQueue *deltaQueue = [[NSOperationQueue alloc] init];
+    NSUInteger maximumConcurrentDiffCount = (options.maximumConcurrentDiffCount > 0) ? options.maximumConcurrentDiffCount : MAX(NSProcessInfo.processInfo.activeProcessorCount, (NSUInteger)1);
+    uint64_t diffMemoryLimit = (options.diffMemoryLimit > 0) ? options.diffMemoryLimit : NSProcessInfo.processInfo.physicalMemory / 2;
     NSMutableArray *deltaOperations = [NSMutableArray array];
+    
+    // Digests of the files added so far, which later files with the same contents can be stored as duplicates of
+    BOOL deduplicatesFiles = options.deduplicatesFiles && MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3);
+    NSMutableSet<NSData *> *addedFileDigests = [NSMutableSet set];
+    
+    // Version 2 archives have no way of recording that a diff was filtered
+    BOOL filterBranches = options.filtersExecutableBranches && MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3);
 
     // Sort the keys by preferring the ones from the original tree to appear first
     // We want to enforce deleting before extracting in the case paths differ only by case
@@ -843,6 +1492,7 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
         }
     }
 
+    SPUDeltaSimilarityIndex *similarityIndex = nil;
     for (NSString *key in keys) {
         id value = [newTreeState valueForKey:key];
 
@@ -857,8 +1507,9 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
 
         NSDictionary *originalInfo = originalTreeState[key];
         NSDictionary *newInfo = newTreeState[key];
-        if (shouldSkipDeltaCompression(originalInfo, newInfo)) {
-            if (shouldSkipExtracting(originalInfo, newInfo)) {
+        BOOL equalContents = entriesHaveEqualContents(originalInfo, newInfo, beforeFileKeyToHashDictionary[key], afterFileKeyToHashDictionary[key], options.comparesEqualFiles);
+        if (shouldSkipDeltaCompression(originalInfo, newInfo, equalContents)) {
+            if (shouldSkipExtracting(originalInfo, newInfo, equalContents)) {
                 if (shouldChangePermissions(originalInfo, newInfo)) {
                     [archive addItem:[[SPUDeltaArchiveItem alloc] initWithRelativeFilePath:key commands:SPUDeltaItemCommandModifyPermissions mode:[(NSNumber *)newInfo[INFO_PERMISSIONS_KEY] unsignedShortValue]]];
 
@@ -871,13 +1522,30 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
                 NSNumber *newPermissions = nil;
                 BOOL clonePermissionsChanged = NO;
                 BOOL clonedBinaryDiff = NO;
-                NSString *clonedRelativePath = MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) ? cloneableRelativePath(afterFileKeyToHashDictionary, beforeHashToFileKeyDictionary, frameworkVersionsSubstitutes, fileSubstitutes, originalTreeState, newInfo, key, &newPermissions, &clonePermissionsChanged, &clonedBinaryDiff) : nil;
+                NSString *clonedRelativePath = MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) ? cloneableRelativePath(afterFileKeyToHashDictionary, beforeHashToFileKeyDictionary, frameworkVersionsSubstitutes, fileSubstitutes, originalTreeState, newInfo, key, options.comparesEqualFiles, &newPermissions, &clonePermissionsChanged, &clonedBinaryDiff) : nil;
+                
+                // Otherwise diff a file that's new at its path against the most similar old file
+                if (clonedRelativePath == nil && options.diffsSimilarFiles && MAJOR_VERSION_IS_AT_LEAST(majorVersion, SUBinaryDeltaMajorVersion3) && originalInfo == nil && [(NSNumber *)newInfo[INFO_TYPE_KEY] unsignedShortValue] == FTS_F && [(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue] > MIN_SIZE_FOR_CLONE_DIFF) {
+                    // The old tree is only read for this once there is a file that may need it
+                    if (similarityIndex == nil) {
+                        similarityIndex = [[SPUDeltaSimilarityIndex alloc] initWithTreeState:originalTreeState];
+                    }
+                    
+                    clonedRelativePath = [similarityIndex relativePathOfFileMostSimilarToFileAtPath:newInfo[INFO_PATH_KEY] size:[(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue]];
+                    if (clonedRelativePath != nil) {
+                        NSDictionary *similarInfo = originalTreeState[clonedRelativePath];
+                        newPermissions = newInfo[INFO_PERMISSIONS_KEY];
+                        clonePermissionsChanged = ([(NSNumber *)similarInfo[INFO_PERMISSIONS_KEY] unsignedShortValue] != newPermissions.unsignedShortValue);
+                        clonedBinaryDiff = YES;
+                    }
+                }
+                
                 if (clonedRelativePath != nil) {
                     if (clonedBinaryDiff) {
                         NSDictionary *cloneInfo = originalTreeState[clonedRelativePath];
                         
-                        CreateBinaryDeltaOperation *operation = [[CreateBinaryDeltaOperation alloc] initWithRelativePath:key clonedRelativePath:clonedRelativePath oldTree:source newTree:destination oldPermissions:cloneInfo[INFO_PERMISSIONS_KEY] newPermissions:newPermissions changingPermissions:clonePermissionsChanged];
-                        [deltaQueue addOperation:operation];
+                        CreateBinaryDeltaOperation *operation = [[CreateBinaryDeltaOperation alloc] initWithRelativePath:key clonedRelativePath:clonedRelativePath oldTree:source newTree:destination oldPermissions:cloneInfo[INFO_PERMISSIONS_KEY] newPermissions:newPermissions changingPermissions:clonePermissionsChanged options:options filterBranches:filterBranches compression:compression compressionLevel:compressionLevel varintControl:varintControl];
+                        operation.estimatedMemoryUsage = estimatedDiffMemoryUsage([(NSNumber *)cloneInfo[INFO_SIZE_KEY] unsignedLongLongValue], [(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue], options, filterBranches);
                         [deltaOperations addObject:operation];
                     } else {
                         SPUDeltaItemCommands commands = SPUDeltaItemCommandClone;
@@ -910,6 +1578,14 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
                     item.itemFilePath = path;
                     item.sourcePath = path;
                     
+                    if (deduplicatesFiles) {
+                        NSData *digest = deduplicationDigest(afterFileKeyToHashDictionary, newInfo, key);
+                        if (digest != nil) {
+                            item.contentDigest = digest;
+                            [addedFileDigests addObject:digest];
+                        }
+                    }
+                    
                     [archive addItem:item];
 
                     if (verbose) {
@@ -924,13 +1600,36 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
         } else {
             NSNumber *permissions = newInfo[INFO_PERMISSIONS_KEY];
             
-            CreateBinaryDeltaOperation *operation = [[CreateBinaryDeltaOperation alloc] initWithRelativePath:key clonedRelativePath:nil oldTree:source newTree:destination oldPermissions:originalInfo[INFO_PERMISSIONS_KEY] newPermissions:permissions changingPermissions:shouldChangePermissions(originalInfo, newInfo)];
-            [deltaQueue addOperation:operation];
+            CreateBinaryDeltaOperation *operation = [[CreateBinaryDeltaOperation alloc] initWithRelativePath:key clonedRelativePath:nil oldTree:source newTree:destination oldPermissions:originalInfo[INFO_PERMISSIONS_KEY] newPermissions:permissions changingPermissions:shouldChangePermissions(originalInfo, newInfo) options:options filterBranches:filterBranches compression:compression compressionLevel:compressionLevel varintControl:varintControl];
+            operation.estimatedMemoryUsage = estimatedDiffMemoryUsage([(NSNumber *)originalInfo[INFO_SIZE_KEY] unsignedLongLongValue], [(NSNumber *)newInfo[INFO_SIZE_KEY] unsignedLongLongValue], options, filterBranches);
             [deltaOperations addObject:operation];
         }
     }
 
-    [deltaQueue waitUntilAllOperationsAreFinished];
+    // Files that are patched to the same contents as an earlier added or patched file are not diffed
+    // They are added after the diffs instead, as duplicates of that file
+    NSMutableArray<NSString *> *duplicateKeys = [NSMutableArray array];
+    if (deduplicatesFiles) {
+        NSMutableArray *uniqueDeltaOperations = [NSMutableArray array];
+        for (CreateBinaryDeltaOperation *operation in deltaOperations) {
+            NSString *relativePath = operation.relativePath;
+            NSData *digest = deduplicationDigest(afterFileKeyToHashDictionary, newTreeState[relativePath], relativePath);
+            if (digest != nil && [addedFileDigests containsObject:digest]) {
+                [duplicateKeys addObject:relativePath];
+                continue;
+            }
+            
+            if (digest != nil) {
+                [addedFileDigests addObject:digest];
+            }
+            [uniqueDeltaOperations addObject:operation];
+        }
+        deltaOperations = uniqueDeltaOperations;
+    }
+    
+    // The patch still stores the diffs in the order of deltaOperations
+    SPUDeltaDiffScheduler *diffScheduler = [[SPUDeltaDiffScheduler alloc] initWithMemoryLimit:diffMemoryLimit maximumConcurrentCount:maximumConcurrentDiffCount];
+    [diffScheduler runOperations:deltaOperations];
 
     BOOL deltaOperationsFailed = NO;
     for (CreateBinaryDeltaOperation *operation in deltaOperations) {
@@ -940,7 +1639,7 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
                 fprintf(stderr, "\n");
             }
             if (error != NULL) {
-                *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to create patch from source %@ and destination %@", operation.relativePath, resultPath] }];
+                *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:@"Failed to create patch from source %@ for destination %@", operation.fromPath, operation.relativePath] }];
             }
             deltaOperationsFailed = YES;
             break;
@@ -965,11 +1664,17 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
         if (clonedRelativePath != nil) {
             commands |= SPUDeltaItemCommandClone;
         }
+        if (operation.filteredBranches) {
+            commands |= SPUDeltaItemCommandBranchFilter;
+        }
         
         SPUDeltaArchiveItem *item = [[SPUDeltaArchiveItem alloc] initWithRelativeFilePath:relativePath commands:commands mode:mode.unsignedShortValue];
         item.itemFilePath = resultPath;
         item.sourcePath = operation.fromPath;
         item.clonedRelativePath = clonedRelativePath;
+        if (deduplicatesFiles) {
+            item.contentDigest = deduplicationDigest(afterFileKeyToHashDictionary, newTreeState[relativePath], relativePath);
+        }
         
         [archive addItem:item];
 
@@ -981,12 +1686,30 @@ BOOL createBinaryDelta(NSString *source, NSString *destination, NSString *patchF
     }
     
     if (!deltaOperationsFailed) {
+        for (NSString *key in duplicateKeys) {
+            NSString *path = [destination stringByAppendingPathComponent:key];
+            
+            SPUDeltaArchiveItem *item = [[SPUDeltaArchiveItem alloc] initWithRelativeFilePath:key commands:SPUDeltaItemCommandExtract mode:0];
+            item.itemFilePath = path;
+            item.sourcePath = path;
+            item.contentDigest = deduplicationDigest(afterFileKeyToHashDictionary, newTreeState[key], key);
+            
+            [archive addItem:item];
+            
+            if (verbose) {
+                if (originalTreeState[key] != nil) {
+                    fprintf(stderr, "\n✏️  %s %s", VERBOSE_UPDATED, [key fileSystemRepresentation]);
+                } else {
+                    fprintf(stderr, "\n✅  %s %s", VERBOSE_ADDED, [key fileSystemRepresentation]);
+                }
+            }
+        }
+        
         [archive finishEncodingItems];
     }
     
     [archive close];
     
-    // Clean up operations after the archive has finished encoding
     for (CreateBinaryDeltaOperation *operation in deltaOperations) {
         NSString *resultPath = operation.resultPath;
         if (resultPath != nil) {
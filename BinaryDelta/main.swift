@@ -23,6 +23,45 @@ struct Create: ParsableCommand {
     @Option(name: .long, help: .hidden)
     var compressionLevel: UInt8 = 0
     
+    @Option(name: .long, help: ArgumentHelp("The number of threads to use for sorting the suffixes of each original file before diffing it. Using more threads can speed up creating patches that contain large files but does not change the generated patch. At most the number of processors can be used.", valueName: "threads"))
+    var suffixSortThreads: UInt32 = 1
+    
+    @Option(name: .long, help: ArgumentHelp("The number of threads to use for scanning each new file for differences. Large files are split into this many parts that are diffed in parallel, which is faster but makes the generated patch slightly larger.", valueName: "threads"))
+    var scanThreads: UInt32 = 1
+    
+    @Option(name: .long, help: ArgumentHelp("The size in megabytes from which original files are diffed by hashing parts of them instead of sorting them. This is much faster and takes far less memory for large files, but makes the generated patch larger. Pass 0 to hash every file.", valueName: "megabytes"))
+    var hashDiffThreshold: UInt64 = SPUDeltaDefaultHashDiffThreshold / (1024 * 1024)
+    
+    @Option(name: .long, help: ArgumentHelp("The maximum number of files to diff at the same time. By default this depends on the number of processors.", valueName: "count"))
+    var concurrentDiffs: UInt32 = 0
+    
+    @Option(name: .long, help: ArgumentHelp("The maximum amount of memory in megabytes that the files being diffed at the same time may take, estimated from their sizes. Large files are diffed first and wait for each other to finish instead of running together once they would take more memory. By default half of the physical memory is used.", valueName: "megabytes"))
+    var diffMemoryLimit: UInt64 = 0
+    
+    @Flag(name: .customLong("filter-branches"), help: ArgumentHelp("Filter the branch instructions of x86_64 and arm64 executables before diffing them, which can make patches of code that moved around much smaller. Each executable is diffed both with and without filtering, so creating the patch is slower. Only supported by version 3 patches, which are then created as version 3.8 patches that can only be applied by versions of Sparkle that support filtered diffs."))
+    var filterBranches: Bool = false
+    
+    @Flag(name: .customLong("varint-control"), help: ArgumentHelp("Store the control data of diffs as variable length integers, which makes patches of files with many small changes smaller, especially with lz4 compression. Only supported by version 3 patches, which are then created as version 3.2 patches that can only be applied by versions of Sparkle that support them."))
+    var varintControl: Bool = false
+    
+    @Flag(name: .customLong("framed-compression"), help: ArgumentHelp("Compress the patch in independent frames using multiple threads, which also speeds up applying it. Patches get slightly larger. Only supported by version 3 patches using lzma, lzfse, lz4, zlib or zstd compression, which are then created as version 3.3 patches (or 3.4 patches for zstd) that can only be applied by versions of Sparkle that support them."))
+    var framedCompression: Bool = false
+    
+    @Flag(name: .customLong("front-coded-paths"), help: ArgumentHelp("Store each path in the patch as the part it shares with the previous path and the rest of it, which makes patches of bundles with many nested files smaller and faster to read. Only supported by version 3 patches, which are then created as version 3.5 patches that can only be applied by versions of Sparkle that support them."))
+    var frontCodedPaths: Bool = false
+    
+    @Flag(name: .customLong("store-incompressible"), help: ArgumentHelp("Store files that look already compressed, like images and asset catalogs, without compressing them again. This makes creating and applying the patch faster. Requires --framed-compression. The patch is then created as a version 3.6 patch that can only be applied by versions of Sparkle that support it."))
+    var storeIncompressible: Bool = false
+    
+    @Flag(name: .customLong("deduplicate-files"), help: ArgumentHelp("Store added or changed files that have the same contents as another added or changed file only once, which makes patches of bundles with duplicated files smaller. Only supported by version 3 patches, which are then created as version 3.7 patches that can only be applied by versions of Sparkle that support them."))
+    var deduplicateFiles: Bool = false
+    
+    @Flag(name: .customLong("compare-equal-files"), help: ArgumentHelp("Compare files byte by byte when their hashes say they are unchanged or can be cloned. By default files are only compared by the hashes computed for verifying the patch, so each file is read once. This doesn't change the generated patch unless two different files have the same SHA-1 hash."))
+    var compareEqualFiles: Bool = false
+    
+    @Flag(name: .customLong("diff-similar-files"), help: ArgumentHelp("Diff files that are new at their path, like renamed helpers or moved resources, against the original file they have the most content in common with instead of storing them whole. Finding similar files reads the whole original bundle once more. Only supported by version 3 patches."))
+    var diffSimilarFiles: Bool = false
+    
     @Argument(help: ArgumentHelp("Path to original bundle to create a patch from."))
     var beforeTree: String
     
@@ -36,7 +75,11 @@ struct Create: ParsableCommand {
         var validCompression: ObjCBool = false
         let compressionMode = deltaCompressionModeFromDescription(compression, &validCompression)
         guard validCompression.boolValue else {
-            fputs("Error: unrecognized compression \(compression)\n", stderr)
+            if compression.lowercased() == "zstd" {
+                fputs("Error: compression \(compression) is not supported because BinaryDelta was built without zstd support\n", stderr)
+            } else {
+                fputs("Error: unrecognized compression \(compression)\n", stderr)
+            }
             throw ExitCode(1)
         }
         
@@ -55,6 +98,17 @@ struct Create: ParsableCommand {
                 throw ExitCode(1)
             }
             break
+        case .zstd:
+            guard version >= 3 else {
+                fputs("Error: version \(version) patch files do not support compression \(compression)\n", stderr)
+                throw ExitCode(1)
+            }
+            
+            guard compressionLevel >= 0 && compressionLevel <= SPUDeltaZstdMaxCompressionLevel else {
+                fputs("Error: compression level \(compressionLevel) is not valid.\n", stderr)
+                throw ExitCode(1)
+            }
+            break
         case .LZMA:
             fallthrough
         case .LZFSE:
@@ -77,6 +131,61 @@ struct Create: ParsableCommand {
             throw ExitCode(1)
         }
         
+        guard suffixSortThreads >= 1 && suffixSortThreads <= ProcessInfo.processInfo.activeProcessorCount else {
+            fputs("Error: suffix sort threads must be between 1 and the number of processors (\(ProcessInfo.processInfo.activeProcessorCount)).\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard scanThreads >= 1 else {
+            fputs("Error: scan threads must be at least 1.\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard hashDiffThreshold <= UInt64.max / (1024 * 1024) else {
+            fputs("Error: hash diff threshold is too large.\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard diffMemoryLimit <= UInt64.max / (1024 * 1024) else {
+            fputs("Error: diff memory limit is too large.\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !filterBranches || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support filtering branches\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !varintControl || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support varint control data\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !framedCompression || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support framed compression\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !frontCodedPaths || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support front coded paths\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !deduplicateFiles || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support deduplicating files\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !diffSimilarFiles || version >= 3 else {
+            fputs("Error: version \(version) patch files do not support diffing similar files\n", stderr)
+            throw ExitCode(1)
+        }
+        
+        guard !storeIncompressible || framedCompression else {
+            fputs("Error: --store-incompressible requires --framed-compression\n", stderr)
+            throw ExitCode(1)
+        }
+        
         guard version >= SUBinaryDeltaMajorVersionFirst.rawValue else {
             fputs("Error: version provided \(version) is not valid.\n", stderr)
             throw ExitCode(1)
@@ -115,8 +224,23 @@ struct Create: ParsableCommand {
             throw ExitCode(1)
         }
         
+        let creationOptions = SPUDeltaCreationOptions()
+        creationOptions.suffixSortThreadCount = suffixSortThreads
+        creationOptions.scanThreadCount = scanThreads
+        creationOptions.hashDiffThreshold = hashDiffThreshold * 1024 * 1024
+        creationOptions.maximumConcurrentDiffCount = concurrentDiffs
+        creationOptions.diffMemoryLimit = diffMemoryLimit * 1024 * 1024
+        creationOptions.filtersExecutableBranches = filterBranches
+        creationOptions.usesVarintControlBlocks = varintControl
+        creationOptions.compressesInFrames = framedCompression
+        creationOptions.frontCodesRelativePaths = frontCodedPaths
+        creationOptions.storesIncompressibleData = storeIncompressible
+        creationOptions.deduplicatesFiles = deduplicateFiles
+        creationOptions.comparesEqualFiles = compareEqualFiles
+        creationOptions.diffsSimilarFiles = diffSimilarFiles
+        
         var createDiffError: NSError? = nil
-        if !createBinaryDelta(beforeTree, afterTree, patchFile, majorDeltaVersion, compressionMode, compressionLevel, verbose, &createDiffError) {
+        if !createBinaryDeltaWithOptions(beforeTree, afterTree, patchFile, majorDeltaVersion, compressionMode, compressionLevel, creationOptions, verbose, &createDiffError) {
             if let error = createDiffError {
                 fputs("\(error.localizedDescription)\n", stderr)
             } else {
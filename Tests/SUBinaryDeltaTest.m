@@ -11,14 +11,19 @@
 #import "SUBinaryDeltaCommon.h"
 #import "SUBinaryDeltaCreate.h"
 #import "SUBinaryDeltaApply.h"
+#import "SPUDeltaArchive.h"
+#import <CommonCrypto/CommonDigest.h>
 #import <sys/stat.h>
 #include <sys/xattr.h>
+#include "bssimd.h"
+#include "bsfilter.h"
 
 @interface SUBinaryDeltaTest : XCTestCase
 
 @end
 
 typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory);
+typedef void (^SUDeltaDiffFileHandler)(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile);
 
 @implementation SUBinaryDeltaTest
 
@@ -46,7 +51,7 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     XCTAssert(YES, @"Pass");
 }
 
-- (BOOL)createAndApplyPatchUsingVersion:(SUBinaryDeltaMajorVersion)majorVersion compressionMode:(SPUDeltaCompressionMode)compressionMode beforeDiffHandler:(SUDeltaHandler)beforeDiffHandler afterDiffHandler:(SUDeltaHandler)afterDiffHandler afterPatchHandler:(SUDeltaHandler)afterPatchHandler
+- (BOOL)createAndApplyPatchUsingVersion:(SUBinaryDeltaMajorVersion)majorVersion compressionMode:(SPUDeltaCompressionMode)compressionMode compressionLevel:(uint8_t)compressionLevel options:(SPUDeltaCreationOptions *)options beforeDiffHandler:(SUDeltaHandler)beforeDiffHandler diffFileHandler:(SUDeltaDiffFileHandler)diffFileHandler afterPatchHandler:(SUDeltaHandler)afterPatchHandler
 {
     NSString *sourceDirectory = temporaryDirectory(@"Spąrkle_temp1エンジン");
     NSString *destinationDirectory = temporaryDirectory(@"Spąrkle_temp2エンジン");
@@ -65,11 +70,11 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     }
     
     NSError *createDiffError = nil;
-    BOOL createdDiff = createBinaryDelta(sourceDirectory, destinationDirectory, diffFile, majorVersion, compressionMode, 0, NO, &createDiffError);
+    BOOL createdDiff = createBinaryDeltaWithOptions(sourceDirectory, destinationDirectory, diffFile, majorVersion, compressionMode, compressionLevel, options, NO, &createDiffError);
     if (!createdDiff) {
         NSLog(@"Creating binary diff failed with error: %@", createDiffError);
-    } else if (afterDiffHandler != nil) {
-        afterDiffHandler(fileManager, sourceDirectory, destinationDirectory);
+    } else if (diffFileHandler != nil) {
+        diffFileHandler(fileManager, sourceDirectory, destinationDirectory, diffFile);
     }
     
     NSError *applyDiffError = nil;
@@ -94,6 +99,49 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     return appliedDiff;
 }
 
+- (BOOL)createAndApplyPatchUsingVersion:(SUBinaryDeltaMajorVersion)majorVersion compressionMode:(SPUDeltaCompressionMode)compressionMode beforeDiffHandler:(SUDeltaHandler)beforeDiffHandler afterDiffHandler:(SUDeltaHandler)afterDiffHandler afterPatchHandler:(SUDeltaHandler)afterPatchHandler
+{
+    SUDeltaDiffFileHandler diffFileHandler = nil;
+    if (afterDiffHandler != nil) {
+        diffFileHandler = ^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *__unused diffFile) {
+            afterDiffHandler(fileManager, sourceDirectory, destinationDirectory);
+        };
+    }
+    
+    return [self createAndApplyPatchUsingVersion:majorVersion compressionMode:compressionMode compressionLevel:0 options:nil beforeDiffHandler:beforeDiffHandler diffFileHandler:diffFileHandler afterPatchHandler:afterPatchHandler];
+}
+
+// Creates and applies a version 3 patch using creation options, handing the created patch file to the diff file handler
+- (void)createAndApplyPatchUsingCompressionMode:(SPUDeltaCompressionMode)compressionMode options:(SPUDeltaCreationOptions *)options beforeDiffHandler:(SUDeltaHandler)beforeDiffHandler diffFileHandler:(SUDeltaDiffFileHandler)diffFileHandler
+{
+    BOOL success = [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersionLatest compressionMode:compressionMode compressionLevel:0 options:options beforeDiffHandler:beforeDiffHandler diffFileHandler:diffFileHandler afterPatchHandler:nil];
+    XCTAssertTrue(success);
+}
+
+// Returns the contents of a version 3 patch created between the directories, for comparing against a patch created differently
+- (NSData *)patchDataWithSource:(NSString *)source destination:(NSString *)destination compressionMode:(SPUDeltaCompressionMode)compressionMode options:(SPUDeltaCreationOptions *)options
+{
+    NSString *diffFile = temporaryFilename(@"Sparkle_diff");
+    
+    NSError *error = nil;
+    XCTAssertTrue(createBinaryDeltaWithOptions(source, destination, diffFile, SUBinaryDeltaMajorVersionLatest, compressionMode, 0, options, NO, &error), @"%@", error);
+    NSData *patchData = [NSData dataWithContentsOfFile:diffFile];
+    XCTAssertNotNil(patchData);
+    
+    XCTAssertTrue([[NSFileManager defaultManager] removeItemAtPath:diffFile error:nil]);
+    return patchData;
+}
+
+- (SPUDeltaArchiveHeader *)headerOfPatchFile:(NSString *)diffFile
+{
+    SPUDeltaArchiveHeader *header = nil;
+    id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(diffFile, &header);
+    XCTAssertNil(archive.error);
+    XCTAssertNotNil(header);
+    [archive close];
+    return header;
+}
+
 - (BOOL)createAndApplyPatchWithBeforeDiffHandler:(SUDeltaHandler)beforeDiffHandler afterDiffHandler:(SUDeltaHandler)afterDiffHandler afterPatchHandler:(SUDeltaHandler)afterPatchHandler
 {
 #if SPARKLE_BUILD_LEGACY_DELTA_SUPPORT
@@ -116,6 +164,10 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     
     BOOL version3DeltaFormatWithZLIBSuccess = [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersion3 compressionMode:SPUDeltaCompressionModeZLIB beforeDiffHandler:beforeDiffHandler afterDiffHandler:afterDiffHandler afterPatchHandler:afterPatchHandler];
     
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+    BOOL version3DeltaFormatWithZstdSuccess = [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersion3 compressionMode:SPUDeltaCompressionModeZstd beforeDiffHandler:beforeDiffHandler afterDiffHandler:afterDiffHandler afterPatchHandler:afterPatchHandler];
+#endif
+    
     BOOL version2FormatSuccess = !testingVersion2Delta || [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersion2 compressionMode:SPUDeltaCompressionModeDefault beforeDiffHandler:beforeDiffHandler afterDiffHandler:afterDiffHandler afterPatchHandler:afterPatchHandler];
     
     return (
@@ -124,6 +176,9 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
         version3DeltaFormatWithBZIP2Success &&
 #endif
         version3DeltaFormatWithZLIBSuccess &&
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+        version3DeltaFormatWithZstdSuccess &&
+#endif
         version2FormatSuccess
     );
 }
@@ -148,6 +203,69 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     return [beforeHash isEqualToString:afterHash];
 }
 
+- (void)testTreeHashOfKnownTree
+{
+    // Hashing files on multiple threads mustn't change the hash, which older versions of Sparkle compute too
+    NSString *directory = temporaryDirectory(@"Sparkle_temp1");
+    NSFileManager *fileManager = [[NSFileManager alloc] init];
+    
+    XCTAssertTrue([fileManager createDirectoryAtPath:[directory stringByAppendingPathComponent:@"a"] withIntermediateDirectories:NO attributes:@{NSFilePosixPermissions: @0755} error:NULL]);
+    XCTAssertTrue([[NSData dataWithBytes:"hello" length:5] writeToFile:[directory stringByAppendingPathComponent:@"a/b"] atomically:NO]);
+    XCTAssertTrue([[NSData data] writeToFile:[directory stringByAppendingPathComponent:@"c"] atomically:NO]);
+    XCTAssertTrue([fileManager createSymbolicLinkAtPath:[directory stringByAppendingPathComponent:@"d"] withDestinationPath:@"c" error:NULL]);
+    XCTAssertTrue([fileManager setAttributes:@{NSFilePosixPermissions: @0755} ofItemAtPath:[directory stringByAppendingPathComponent:@"a"] error:NULL]);
+    XCTAssertTrue([fileManager setAttributes:@{NSFilePosixPermissions: @0644} ofItemAtPath:[directory stringByAppendingPathComponent:@"a/b"] error:NULL]);
+    XCTAssertTrue([fileManager setAttributes:@{NSFilePosixPermissions: @0600} ofItemAtPath:[directory stringByAppendingPathComponent:@"c"] error:NULL]);
+    
+    XCTAssertEqualObjects(hashOfTree(directory), @"d5854a1fff116c87fa7d3ac31030ce57787c7c3b");
+    
+    XCTAssertTrue([fileManager removeItemAtPath:directory error:nil]);
+}
+
+- (void)testTreeHashWithFileDigestCache
+{
+    NSString *directory = temporaryDirectory(@"Sparkle_temp1");
+    NSString *cachePath = [temporaryDirectory(@"Sparkle_digests") stringByAppendingPathComponent:@"file_digests"];
+    NSFileManager *fileManager = [[NSFileManager alloc] init];
+    
+    NSString *changedFile = [directory stringByAppendingPathComponent:@"A"];
+    XCTAssertTrue([[NSData dataWithBytes:"hello" length:5] writeToFile:changedFile atomically:NO]);
+    XCTAssertTrue([[NSData dataWithBytes:"world" length:5] writeToFile:[directory stringByAppendingPathComponent:@"B"] atomically:NO]);
+    
+    // Digests of files that changed right before they were hashed aren't cached
+    sleep(3);
+    
+    NSString *expectedHash = hashOfTree(directory);
+    XCTAssertNotNil(expectedHash);
+    
+    SPUFileDigestCache *cache = [[SPUFileDigestCache alloc] initWithPath:cachePath];
+    unsigned char hash[CC_SHA1_DIGEST_LENGTH] = {0};
+    XCTAssertTrue(getRawHashOfTreeAndFileTablesWithVersion(hash, directory, SUBinaryDeltaMajorVersionLatest, cache, nil, nil));
+    XCTAssertEqualObjects(displayHashFromRawHash(hash), expectedHash);
+    XCTAssertTrue([cache save]);
+    
+    NSData *cacheData = [NSData dataWithContentsOfFile:cachePath];
+    XCTAssertGreaterThan(cacheData.length, 8u);
+    
+    SPUFileDigestCache *loadedCache = [[SPUFileDigestCache alloc] initWithPath:cachePath];
+    XCTAssertTrue(getRawHashOfTreeAndFileTablesWithVersion(hash, directory, SUBinaryDeltaMajorVersionLatest, loadedCache, nil, nil));
+    XCTAssertEqualObjects(displayHashFromRawHash(hash), expectedHash);
+    
+    // Changing a file in place invalidates its cached digest
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:changedFile];
+    XCTAssertNotNil(fileHandle);
+    [fileHandle writeData:[NSData dataWithBytes:"j" length:1]];
+    [fileHandle closeFile];
+    
+    NSString *changedHash = hashOfTree(directory);
+    XCTAssertNotEqualObjects(changedHash, expectedHash);
+    XCTAssertTrue(getRawHashOfTreeAndFileTablesWithVersion(hash, directory, SUBinaryDeltaMajorVersionLatest, loadedCache, nil, nil));
+    XCTAssertEqualObjects(displayHashFromRawHash(hash), changedHash);
+    
+    XCTAssertTrue([fileManager removeItemAtPath:directory error:nil]);
+    XCTAssertTrue([fileManager removeItemAtPath:[cachePath stringByDeletingLastPathComponent] error:nil]);
+}
+
 - (void)testNoFilesDiff
 {
     [self createAndApplyPatchWithHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
@@ -364,6 +482,42 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     }];
 }
 
+- (void)testManySmallFilesDiff
+{
+    // Enough items that their commands span many read ahead buffers, with fields that straddle the buffer boundaries
+    SUDeltaHandler handler = ^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        for (NSUInteger directoryIndex = 0; directoryIndex < 30; directoryIndex++) {
+            NSString *directoryName = [NSString stringWithFormat:@"%lu", (unsigned long)directoryIndex];
+            XCTAssertTrue([fileManager createDirectoryAtPath:[sourceDirectory stringByAppendingPathComponent:directoryName] withIntermediateDirectories:NO attributes:nil error:NULL]);
+            XCTAssertTrue([fileManager createDirectoryAtPath:[destinationDirectory stringByAppendingPathComponent:directoryName] withIntermediateDirectories:NO attributes:nil error:NULL]);
+        }
+        
+        for (NSUInteger fileIndex = 0; fileIndex < 3000; fileIndex++) {
+            NSString *fileName = [NSString stringWithFormat:@"%lu/file%lu", (unsigned long)(fileIndex % 30), (unsigned long)fileIndex];
+            NSMutableData *data = [NSMutableData dataWithLength:fileIndex % 97];
+            memset(data.mutableBytes, (int)(fileIndex & 0xFF), data.length);
+            
+            if (fileIndex % 3 != 0) {
+                XCTAssertTrue([data writeToFile:[sourceDirectory stringByAppendingPathComponent:fileName] atomically:NO]);
+            }
+            
+            if (fileIndex % 5 != 0) {
+                if (data.length > 0 && fileIndex % 2 == 0) {
+                    ((uint8_t *)data.mutableBytes)[0] ^= 1;
+                }
+                XCTAssertTrue([data writeToFile:[destinationDirectory stringByAppendingPathComponent:fileName] atomically:NO]);
+            }
+            
+            if (fileIndex % 7 == 0) {
+                XCTAssertTrue([fileManager createSymbolicLinkAtPath:[destinationDirectory stringByAppendingPathComponent:[fileName stringByAppendingString:@"-link"]] withDestinationPath:[fileName lastPathComponent] error:NULL]);
+            }
+        }
+    };
+    
+    [self createAndApplyPatchWithHandler:handler];
+    XCTAssertTrue([self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersion3 compressionMode:SPUDeltaCompressionModeNone beforeDiffHandler:handler afterDiffHandler:nil afterPatchHandler:nil]);
+}
+
 - (void)testInvalidSource
 {
     BOOL success = [self createAndApplyPatchWithBeforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
@@ -404,6 +558,25 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     return [NSData dataWithBytesNoCopy:buffer length:bufferSize];
 }
 
+// Returns the same pseudo random bytes for the same seed
+// Masking the bytes leaves data that compresses without having long matches
+- (NSData *)randomDataWithLength:(NSUInteger)length seed:(uint32_t)seed byteMask:(uint8_t)byteMask
+{
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = data.mutableBytes;
+    uint32_t state = seed;
+    for (NSUInteger byteIndex = 0; byteIndex < length; byteIndex++) {
+        state = state * 1103515245 + 12345;
+        bytes[byteIndex] = (uint8_t)((state >> 16) & byteMask);
+    }
+    return data;
+}
+
+- (NSData *)randomDataWithLength:(NSUInteger)length seed:(uint32_t)seed
+{
+    return [self randomDataWithLength:length seed:seed byteMask:0xFF];
+}
+
 - (void)testBigDataSameDiff
 {
     [self createAndApplyPatchWithHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
@@ -430,6 +603,714 @@ typedef void (^SUDeltaHandler)(NSFileManager *fileManager, NSString *sourceDirec
     }];
 }
 
+- (void)testBigDataDifferentDiffWithSuffixSortThreads
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.suffixSortThreadCount = 4;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        NSMutableData *sourceData = [NSMutableData dataWithData:[self bigData2]];
+        for (NSUInteger byteIndex = 0; byteIndex < sourceData.length; byteIndex += 7) {
+            ((uint8_t *)sourceData.mutableBytes)[byteIndex] = (uint8_t)(byteIndex % 251);
+        }
+        
+        XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        // Sorting suffixes with multiple threads must not change the patch
+        XCTAssertEqualObjects([NSData dataWithContentsOfFile:diffFile], [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil]);
+    }];
+}
+
+- (void)testDiffsScheduledWithMemoryLimit
+{
+    // Every diff goes over this limit, so they run one at a time
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.maximumConcurrentDiffCount = 2;
+    options.diffMemoryLimit = 1;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Changed files of different sizes, so the largest is scheduled first
+        NSArray<NSNumber *> *fileLengths = @[@8192, @([self bigData2].length), @65536, @([self bigData2].length / 2)];
+        for (NSUInteger fileIndex = 0; fileIndex < fileLengths.count; fileIndex++) {
+            NSData *newData = [[self bigData2] subdataWithRange:NSMakeRange(0, fileLengths[fileIndex].unsignedIntegerValue)];
+            NSMutableData *oldData = [NSMutableData dataWithData:newData];
+            for (NSUInteger byteIndex = fileIndex; byteIndex < oldData.length; byteIndex += 509) {
+                ((uint8_t *)oldData.mutableBytes)[byteIndex] ^= 0x5A;
+            }
+            
+            NSString *fileName = [NSString stringWithFormat:@"File%lu", (unsigned long)fileIndex];
+            XCTAssertTrue([oldData writeToFile:[sourceDirectory stringByAppendingPathComponent:fileName] atomically:YES]);
+            XCTAssertTrue([newData writeToFile:[destinationDirectory stringByAppendingPathComponent:fileName] atomically:YES]);
+        }
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        // Scheduling diffs differently must not change the patch
+        XCTAssertEqualObjects([NSData dataWithContentsOfFile:diffFile], [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil]);
+    }];
+}
+
+- (void)testLargeDataDifferentDiffWithScanThreads
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.scanThreadCount = 4;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeDefault options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Large enough to be split into several ranges that are scanned separately
+        const NSUInteger dataLength = 5 * 1024 * 1024;
+        NSData *sourceData = [self randomDataWithLength:dataLength seed:1];
+        
+        NSMutableData *destinationData = [NSMutableData dataWithData:sourceData];
+        for (NSUInteger byteIndex = 0; byteIndex < dataLength; byteIndex += 4099) {
+            ((uint8_t *)destinationData.mutableBytes)[byteIndex] ^= 0xFF;
+        }
+        [destinationData replaceBytesInRange:NSMakeRange(dataLength / 2, 1000) withBytes:NULL length:0];
+        
+        XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([destinationData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+    } diffFileHandler:nil];
+}
+
+- (void)testLargeDataDifferentDiffWithHashEngine
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.hashDiffThreshold = 0;
+    options.scanThreadCount = 4;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeDefault options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        const NSUInteger dataLength = 5 * 1024 * 1024;
+        NSData *sourceData = [self randomDataWithLength:dataLength seed:1];
+        
+        // Changes are far enough apart for the anchors between them to be found
+        NSMutableData *destinationData = [NSMutableData dataWithData:sourceData];
+        for (NSUInteger byteIndex = 0; byteIndex < dataLength; byteIndex += 4099) {
+            ((uint8_t *)destinationData.mutableBytes)[byteIndex] ^= 0xFF;
+        }
+        [destinationData replaceBytesInRange:NSMakeRange(dataLength / 2, 1000) withBytes:NULL length:0];
+        [destinationData replaceBytesInRange:NSMakeRange(dataLength / 4, 0) withBytes:"inserted" length:8];
+        
+        XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([destinationData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        // The hash engine misses some matches but shouldn't be far off here
+        NSUInteger sortedDiffLength = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeDefault options:nil].length;
+        XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length, sortedDiffLength * 2);
+    }];
+}
+
+- (void)testLargeDataDifferentDiffWithSuffixSortCache
+{
+    NSString *cacheDirectory = temporaryDirectory(@"Sparkle_cache");
+    
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.suffixSortCacheDirectory = cacheDirectory;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Large enough for its suffix sort to be cached
+        const NSUInteger dataLength = 1024 * 1024;
+        NSData *sourceData = [self randomDataWithLength:dataLength seed:1];
+        
+        NSMutableData *destinationData = [NSMutableData dataWithData:sourceData];
+        for (NSUInteger byteIndex = 0; byteIndex < dataLength; byteIndex += 4099) {
+            ((uint8_t *)destinationData.mutableBytes)[byteIndex] ^= 0xFF;
+        }
+        
+        XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([destinationData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        NSData *uncachedDiffData = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil];
+        
+        // The first patch filled the cache and the second one reads from it
+        XCTAssertEqualObjects([NSData dataWithContentsOfFile:diffFile], uncachedDiffData);
+        XCTAssertEqualObjects([self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:options], uncachedDiffData);
+        
+        NSArray<NSString *> *cacheFiles = [fileManager contentsOfDirectoryAtPath:cacheDirectory error:NULL];
+        XCTAssertEqual(cacheFiles.count, 1u);
+        XCTAssertEqualObjects(cacheFiles.firstObject.pathExtension, @"suffixes");
+        
+        // A damaged cache file is ignored and replaced
+        NSString *cacheFile = [cacheDirectory stringByAppendingPathComponent:cacheFiles.firstObject];
+        NSMutableData *cacheData = [NSMutableData dataWithContentsOfFile:cacheFile];
+        memset((uint8_t *)cacheData.mutableBytes + cacheData.length / 2, 0xFF, 64);
+        XCTAssertTrue([cacheData writeToFile:cacheFile atomically:YES]);
+        
+        XCTAssertEqualObjects([self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:options], uncachedDiffData);
+        XCTAssertEqual([fileManager contentsOfDirectoryAtPath:cacheDirectory error:NULL].count, 1u);
+    }];
+    
+    NSFileManager *fileManager = [[NSFileManager alloc] init];
+    trimBinaryDeltaSuffixSortCache(cacheDirectory, 0);
+    XCTAssertEqual([fileManager contentsOfDirectoryAtPath:cacheDirectory error:NULL].count, 0u);
+    XCTAssertTrue([fileManager removeItemAtPath:cacheDirectory error:nil]);
+}
+
+- (void)testBigDataDifferentDiffWithVarintControlBlocks
+{
+    SUDeltaHandler beforeDiffHandler = ^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Many small changes make for many control triples
+        NSMutableData *sourceData = [NSMutableData dataWithData:[self bigData2]];
+        for (NSUInteger byteIndex = 0; byteIndex < sourceData.length; byteIndex += 7) {
+            ((uint8_t *)sourceData.mutableBytes)[byteIndex] = (uint8_t)(byteIndex % 251);
+        }
+        
+        XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+    };
+    
+    // Only patches that need it are marked as a version older clients can't apply
+    __block NSUInteger fixedDiffLength = 0;
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:nil beforeDiffHandler:beforeDiffHandler diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+        XCTAssertEqual([self headerOfPatchFile:diffFile].minorVersion, SUBinaryDeltaMinorVersion3_1);
+        fixedDiffLength = [NSData dataWithContentsOfFile:diffFile].length;
+    }];
+    
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.usesVarintControlBlocks = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:beforeDiffHandler diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+        XCTAssertEqual([self headerOfPatchFile:diffFile].minorVersion, SUBinaryDeltaMinorVersion3_2);
+        XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length, fixedDiffLength);
+    }];
+}
+
+- (void)testDeeplyNestedFilesDiffWithFrontCodedPaths
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.frontCodesRelativePaths = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Paths that share long prefixes, like the resources of a framework
+        NSString *resourcesPath = @"Contents/Frameworks/Sparkle.framework/Versions/B/Resources";
+        for (NSUInteger localizationIndex = 0; localizationIndex < 20; localizationIndex++) {
+            NSString *localizationPath = [resourcesPath stringByAppendingPathComponent:[NSString stringWithFormat:@"Localization%lu.lproj", (unsigned long)localizationIndex]];
+            XCTAssertTrue([fileManager createDirectoryAtPath:[sourceDirectory stringByAppendingPathComponent:localizationPath] withIntermediateDirectories:YES attributes:nil error:NULL]);
+            XCTAssertTrue([fileManager createDirectoryAtPath:[destinationDirectory stringByAppendingPathComponent:localizationPath] withIntermediateDirectories:YES attributes:nil error:NULL]);
+            
+            for (NSUInteger fileIndex = 0; fileIndex < 20; fileIndex++) {
+                NSString *filePath = [localizationPath stringByAppendingPathComponent:[NSString stringWithFormat:@"SUUpdateAlert%lu.strings", (unsigned long)fileIndex]];
+                NSData *sourceData = [[NSString stringWithFormat:@"\"Update\" = \"%lu %lu\";", (unsigned long)localizationIndex, (unsigned long)fileIndex] dataUsingEncoding:NSUTF8StringEncoding];
+                NSData *destinationData = [[NSString stringWithFormat:@"\"Update\" = \"%lu %lu!\";", (unsigned long)localizationIndex, (unsigned long)fileIndex] dataUsingEncoding:NSUTF8StringEncoding];
+                
+                XCTAssertTrue([sourceData writeToFile:[sourceDirectory stringByAppendingPathComponent:filePath] atomically:NO]);
+                XCTAssertTrue([destinationData writeToFile:[destinationDirectory stringByAppendingPathComponent:filePath] atomically:NO]);
+            }
+        }
+        
+        // A moved file is cloned from a path looked up in the table
+        NSData *movedData = [self bigData1];
+        XCTAssertTrue([movedData writeToFile:[sourceDirectory stringByAppendingPathComponent:[resourcesPath stringByAppendingPathComponent:@"Localization0.lproj/Moved"]] atomically:NO]);
+        XCTAssertTrue([movedData writeToFile:[destinationDirectory stringByAppendingPathComponent:[resourcesPath stringByAppendingPathComponent:@"Localization19.lproj/Moved"]] atomically:NO]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        XCTAssertEqual([self headerOfPatchFile:diffFile].minorVersion, SUBinaryDeltaMinorVersion3_5);
+        
+        NSUInteger plainDiffLength = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil].length;
+        XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length, plainDiffLength);
+    }];
+}
+
+- (void)testLargeDataAddedWithFramedCompression
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.compressesInFrames = YES;
+    
+    const SPUDeltaCompressionMode compressionModes[] = {SPUDeltaCompressionModeLZMA, SPUDeltaCompressionModeLZ4};
+    for (size_t compressionIndex = 0; compressionIndex < sizeof(compressionModes) / sizeof(compressionModes[0]); compressionIndex++) {
+        SPUDeltaCompressionMode compressionMode = compressionModes[compressionIndex];
+        [self createAndApplyPatchUsingCompressionMode:compressionMode options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+            // Large enough to span several frames, with items before and after the frame boundaries
+            XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+            XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+            XCTAssertTrue([[self randomDataWithLength:9 * 1024 * 1024 seed:1 byteMask:0x3F] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"B"] atomically:YES]);
+            XCTAssertTrue([[NSData dataWithBytes:"lol" length:3] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"C"] atomically:YES]);
+        } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+            SPUDeltaArchiveHeader *header = [self headerOfPatchFile:diffFile];
+            XCTAssertEqual(header.compression, compressionMode);
+            XCTAssertEqual(header.minorVersion, SUBinaryDeltaMinorVersion3_3);
+        }];
+    }
+}
+
+#if SPARKLE_BUILD_ZSTD_DELTA_SUPPORT
+- (void)testLargeDataAddedWithZstdCompression
+{
+    // Level 0 uses the default level of 19, which is recorded as 15
+    const uint8_t compressionLevels[] = {0, 3};
+    const uint8_t recordedCompressionLevels[] = {15, 3};
+    for (size_t levelIndex = 0; levelIndex < sizeof(compressionLevels) / sizeof(compressionLevels[0]); levelIndex++) {
+        uint8_t recordedCompressionLevel = recordedCompressionLevels[levelIndex];
+        for (int framed = 0; framed <= 1; framed++) {
+            SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+            options.compressesInFrames = (framed != 0);
+            
+            BOOL success = [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersionLatest compressionMode:SPUDeltaCompressionModeZstd compressionLevel:compressionLevels[levelIndex] options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+                XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+                XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+                XCTAssertTrue([[self randomDataWithLength:6 * 1024 * 1024 seed:1 byteMask:0x3F] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"B"] atomically:YES]);
+            } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+                SPUDeltaArchiveHeader *header = [self headerOfPatchFile:diffFile];
+                XCTAssertEqual(header.compression, SPUDeltaCompressionModeZstd);
+                XCTAssertEqual(header.compressionLevel, recordedCompressionLevel);
+                XCTAssertEqual(header.minorVersion, SUBinaryDeltaMinorVersion3_4);
+            } afterPatchHandler:nil];
+            XCTAssertTrue(success);
+        }
+    }
+}
+#endif
+
+- (void)testReadingItemsOutOfOrderWithBlobIndex
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.compressesInFrames = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeLZ4 options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Files spanning frames, sharing frames, and without any data
+        NSData *largeData = [self randomDataWithLength:6 * 1024 * 1024 seed:1 byteMask:0x3F];
+        
+        XCTAssertTrue([largeData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[NSData dataWithBytes:"lol" length:3] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"B"] atomically:YES]);
+        XCTAssertTrue([[largeData subdataWithRange:NSMakeRange(1000, 3 * 1024 * 1024)] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"C"] atomically:YES]);
+        XCTAssertTrue([[NSData data] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"D"] atomically:YES]);
+        XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"E"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"E"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        SPUDeltaArchiveHeader *header = nil;
+        id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(diffFile, &header);
+        XCTAssertNil(archive.error);
+        XCTAssertTrue(archive.supportsConcurrentItemAccess);
+        
+        NSMutableArray<SPUDeltaArchiveItem *> *items = [NSMutableArray array];
+        [archive enumerateItems:^(SPUDeltaArchiveItem *item, __unused BOOL *stop) {
+            if ((item.commands & SPUDeltaItemCommandExtract) != 0 || (item.commands & SPUDeltaItemCommandBinaryDiff) != 0) {
+                [items addObject:item];
+            }
+        }];
+        XCTAssertNil(archive.error);
+        XCTAssertEqual(items.count, 5u);
+        
+        // Read the items backwards and all at once
+        NSMutableArray<NSData *> *itemContents = [NSMutableArray array];
+        for (NSUInteger itemIndex = 0; itemIndex < items.count; itemIndex++) {
+            [itemContents addObject:[NSMutableData data]];
+        }
+        
+        dispatch_apply(items.count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iteration) {
+            NSUInteger itemIndex = items.count - 1 - iteration;
+            NSMutableData *contents = (NSMutableData *)itemContents[itemIndex];
+            BOOL readItem = [archive readItem:items[itemIndex] handler:^BOOL(SPUDeltaArchiveItemReader reader) {
+                uint8_t buffer[4096];
+                ssize_t bytesRead;
+                while ((bytesRead = reader(buffer, sizeof(buffer))) > 0) {
+                    [contents appendBytes:buffer length:(NSUInteger)bytesRead];
+                }
+                return (bytesRead == 0);
+            }];
+            XCTAssertTrue(readItem);
+        });
+        XCTAssertNil(archive.error);
+        
+        for (NSUInteger itemIndex = 0; itemIndex < items.count; itemIndex++) {
+            SPUDeltaArchiveItem *item = items[itemIndex];
+            if ((item.commands & SPUDeltaItemCommandBinaryDiff) != 0) {
+                XCTAssertEqual((uint64_t)itemContents[itemIndex].length, item.codedDataLength);
+            } else {
+                NSData *expectedContents = [NSData dataWithContentsOfFile:[destinationDirectory stringByAppendingPathComponent:item.relativeFilePath]];
+                XCTAssertEqualObjects(itemContents[itemIndex], expectedContents, @"%@", item.relativeFilePath);
+            }
+        }
+        
+        [archive close];
+    }];
+}
+
+- (void)testIncompressibleDataStoredInFrames
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.compressesInFrames = YES;
+    options.storesIncompressibleData = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeLZMA options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // Random bytes like those of compressed images, spanning stored frames, between compressible files
+        NSData *randomData = [self randomDataWithLength:5 * 1024 * 1024 + 123 seed:1];
+        
+        XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([randomData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"B"] atomically:YES]);
+        XCTAssertTrue([[self bigData1] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"C"] atomically:YES]);
+        XCTAssertTrue([[randomData subdataWithRange:NSMakeRange(0, 1000)] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"D"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+        XCTAssertEqual([self headerOfPatchFile:diffFile].minorVersion, SUBinaryDeltaMinorVersion3_6);
+    }];
+}
+
+- (void)testDuplicateFilesAddedWithDeduplication
+{
+    // Copies of a new helper, one of them with different permissions, next to a different file of the same size
+    NSData *helperData = [self bigData2];
+    SUDeltaHandler beforeDiffHandler = ^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        // A changed file that ends up with the same contents as the helpers below, so it isn't diffed
+        XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        
+        // Copies of a changed library, where only the first copy is diffed
+        NSMutableData *libraryData = [NSMutableData dataWithData:[self bigData1]];
+        ((uint8_t *)libraryData.mutableBytes)[0] ^= 0xFF;
+        for (NSString *directoryName in @[@"Lib1", @"Lib2"]) {
+            XCTAssertTrue([fileManager createDirectoryAtPath:[sourceDirectory stringByAppendingPathComponent:directoryName] withIntermediateDirectories:NO attributes:nil error:NULL]);
+            XCTAssertTrue([fileManager createDirectoryAtPath:[destinationDirectory stringByAppendingPathComponent:directoryName] withIntermediateDirectories:NO attributes:nil error:NULL]);
+            XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:[directoryName stringByAppendingPathComponent:@"Lib"]] atomically:YES]);
+            XCTAssertTrue([libraryData writeToFile:[destinationDirectory stringByAppendingPathComponent:[directoryName stringByAppendingPathComponent:@"Lib"]] atomically:YES]);
+        }
+        
+        NSMutableData *otherData = [NSMutableData dataWithData:helperData];
+        ((uint8_t *)otherData.mutableBytes)[otherData.length / 2] ^= 0xFF;
+        for (NSString *directoryName in @[@"Helper1", @"Helper2", @"Helper3"]) {
+            NSString *directory = [destinationDirectory stringByAppendingPathComponent:directoryName];
+            XCTAssertTrue([fileManager createDirectoryAtPath:directory withIntermediateDirectories:NO attributes:nil error:NULL]);
+            XCTAssertTrue([helperData writeToFile:[directory stringByAppendingPathComponent:@"Helper"] atomically:YES]);
+            XCTAssertTrue([[NSData data] writeToFile:[directory stringByAppendingPathComponent:@"Empty"] atomically:YES]);
+        }
+        XCTAssertTrue([fileManager setAttributes:@{NSFilePosixPermissions: @0755} ofItemAtPath:[destinationDirectory stringByAppendingPathComponent:@"Helper2/Helper"] error:NULL]);
+        XCTAssertTrue([otherData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"Other"] atomically:YES]);
+    };
+    
+    SPUDeltaCreationOptions *deduplicatingOptions = [[SPUDeltaCreationOptions alloc] init];
+    deduplicatingOptions.deduplicatesFiles = YES;
+    
+    SPUDeltaCreationOptions *framedDeduplicatingOptions = [[SPUDeltaCreationOptions alloc] init];
+    framedDeduplicatingOptions.deduplicatesFiles = YES;
+    framedDeduplicatingOptions.compressesInFrames = YES;
+    
+    // Apply both in order and, with frames, through the blob index on multiple threads
+    NSArray<SPUDeltaCreationOptions *> *optionsList = @[deduplicatingOptions, framedDeduplicatingOptions];
+    const SPUDeltaCompressionMode compressionModes[] = {SPUDeltaCompressionModeNone, SPUDeltaCompressionModeLZMA};
+    for (NSUInteger optionsIndex = 0; optionsIndex < optionsList.count; optionsIndex++) {
+        SPUDeltaCompressionMode compressionMode = compressionModes[optionsIndex];
+        BOOL success = [self createAndApplyPatchUsingVersion:SUBinaryDeltaMajorVersionLatest compressionMode:compressionMode compressionLevel:0 options:optionsList[optionsIndex] beforeDiffHandler:beforeDiffHandler diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+            SPUDeltaArchiveHeader *header = nil;
+            id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(diffFile, &header);
+            XCTAssertNil(archive.error);
+            XCTAssertEqual(header.minorVersion, SUBinaryDeltaMinorVersion3_7);
+            
+            NSMutableDictionary<NSString *, NSString *> *originalPaths = [NSMutableDictionary dictionary];
+            __block NSUInteger diffCount = 0;
+            [archive enumerateItems:^(SPUDeltaArchiveItem *item, __unused BOOL *stop) {
+                if ((item.commands & SPUDeltaItemCommandDuplicate) != 0) {
+                    originalPaths[item.relativeFilePath] = item.clonedRelativePath;
+                }
+                if ((item.commands & SPUDeltaItemCommandBinaryDiff) != 0) {
+                    diffCount++;
+                }
+            }];
+            XCTAssertNil(archive.error);
+            XCTAssertEqualObjects(originalPaths, (@{@"/A": @"/Helper1/Helper", @"/Helper2/Helper": @"/Helper1/Helper", @"/Helper3/Helper": @"/Helper1/Helper", @"/Lib2/Lib": @"/Lib1/Lib"}));
+            XCTAssertEqual(diffCount, 1u);
+            [archive close];
+            
+            if (compressionMode == SPUDeltaCompressionModeNone) {
+                // Two of the three copies of the helper and the copy of the library's diff aren't stored
+                NSUInteger plainDiffLength = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil].length;
+                XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length + helperData.length, plainDiffLength);
+            }
+        } afterPatchHandler:^(NSFileManager *fileManager, NSString *__unused destinationDirectory, NSString *patchDirectory) {
+            NSDictionary<NSFileAttributeKey, id> *helperAttributes = [fileManager attributesOfItemAtPath:[patchDirectory stringByAppendingPathComponent:@"Helper2/Helper"] error:NULL];
+            XCTAssertEqual([helperAttributes[NSFilePosixPermissions] shortValue], 0755);
+        }];
+        XCTAssertTrue(success);
+    }
+}
+
+- (void)testPlanningWithComparedEqualFiles
+{
+    // An unchanged file, a moved file that gets cloned, a changed file and a file whose permissions changed
+    SUDeltaHandler beforeDiffHandler = ^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData1] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"B"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"C"] atomically:YES]);
+        XCTAssertTrue([[self bigData1] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"D"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"D"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[sourceDirectory stringByAppendingPathComponent:@"E"] atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"E"] atomically:YES]);
+        XCTAssertTrue([fileManager setAttributes:@{NSFilePosixPermissions: @0755} ofItemAtPath:[destinationDirectory stringByAppendingPathComponent:@"E"] error:NULL]);
+    };
+    
+    // Comparing files byte by byte plans the same patch as comparing their digests
+    NSMutableArray<NSArray *> *itemsList = [NSMutableArray array];
+    for (NSNumber *comparesEqualFiles in @[@NO, @YES]) {
+        SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+        options.comparesEqualFiles = comparesEqualFiles.boolValue;
+        
+        [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeDefault options:options beforeDiffHandler:beforeDiffHandler diffFileHandler:^(NSFileManager *__unused fileManager, NSString *__unused sourceDirectory, NSString *__unused destinationDirectory, NSString *diffFile) {
+            SPUDeltaArchiveHeader *header = nil;
+            id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(diffFile, &header);
+            XCTAssertNil(archive.error);
+            
+            NSMutableArray<NSString *> *items = [NSMutableArray array];
+            [archive enumerateItems:^(SPUDeltaArchiveItem *item, __unused BOOL *stop) {
+                [items addObject:[NSString stringWithFormat:@"%@ %u %@", item.relativeFilePath, item.commands, item.clonedRelativePath]];
+            }];
+            XCTAssertNil(archive.error);
+            [archive close];
+            [itemsList addObject:items];
+            
+            XCTAssertEqual([items indexesOfObjectsPassingTest:^BOOL(NSString *itemDescription, __unused NSUInteger index, __unused BOOL *stop) {
+                return [itemDescription hasPrefix:@"/A "];
+            }].count, 0u);
+            XCTAssertTrue([items containsObject:[NSString stringWithFormat:@"/C %u /B", SPUDeltaItemCommandClone]]);
+            XCTAssertTrue([items containsObject:[NSString stringWithFormat:@"/E %u (null)", SPUDeltaItemCommandModifyPermissions]]);
+        }];
+    }
+    XCTAssertEqual(itemsList.count, 2u);
+    XCTAssertEqualObjects(itemsList.firstObject, itemsList.lastObject);
+}
+
+- (void)testRenamedFileDiffedWithSimilarFiles
+{
+    // A helper that is renamed and moved with a few changes, an unrelated unchanged file and an unrelated new file
+    NSData *oldHelperData = [self randomDataWithLength:262144 seed:1];
+    NSMutableData *newHelperData = [NSMutableData dataWithData:oldHelperData];
+    for (NSUInteger byteIndex = 1000; byteIndex < newHelperData.length; byteIndex += 20000) {
+        ((uint8_t *)newHelperData.mutableBytes)[byteIndex] ^= 0xFF;
+    }
+    
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.diffsSimilarFiles = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeNone options:options beforeDiffHandler:^(NSFileManager *fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        XCTAssertTrue([fileManager createDirectoryAtPath:[sourceDirectory stringByAppendingPathComponent:@"Helpers"] withIntermediateDirectories:NO attributes:nil error:NULL]);
+        XCTAssertTrue([fileManager createDirectoryAtPath:[destinationDirectory stringByAppendingPathComponent:@"Tools"] withIntermediateDirectories:NO attributes:nil error:NULL]);
+        XCTAssertTrue([oldHelperData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"Helpers/OldHelper"] atomically:YES]);
+        XCTAssertTrue([newHelperData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"Tools/NewTool"] atomically:YES]);
+        
+        NSData *unrelatedData = [self randomDataWithLength:262144 seed:2];
+        XCTAssertTrue([unrelatedData writeToFile:[sourceDirectory stringByAppendingPathComponent:@"Unrelated"] atomically:YES]);
+        XCTAssertTrue([unrelatedData writeToFile:[destinationDirectory stringByAppendingPathComponent:@"Unrelated"] atomically:YES]);
+        XCTAssertTrue([[self randomDataWithLength:262144 seed:3] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"Fresh"] atomically:YES]);
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        SPUDeltaArchiveHeader *header = nil;
+        id<SPUDeltaArchiveProtocol> archive = SPUDeltaArchiveReadPatchAndHeader(diffFile, &header);
+        XCTAssertNil(archive.error);
+        
+        __block BOOL foundNewTool = NO;
+        __block BOOL foundFresh = NO;
+        [archive enumerateItems:^(SPUDeltaArchiveItem *item, __unused BOOL *stop) {
+            if ([item.relativeFilePath isEqualToString:@"/Tools/NewTool"]) {
+                XCTAssertEqual(item.commands & (SPUDeltaItemCommandBinaryDiff | SPUDeltaItemCommandClone), SPUDeltaItemCommandBinaryDiff | SPUDeltaItemCommandClone);
+                XCTAssertEqualObjects(item.clonedRelativePath, @"/Helpers/OldHelper");
+                foundNewTool = YES;
+            } else if ([item.relativeFilePath isEqualToString:@"/Fresh"]) {
+                XCTAssertEqual(item.commands, SPUDeltaItemCommandExtract);
+                foundFresh = YES;
+            }
+        }];
+        XCTAssertNil(archive.error);
+        XCTAssertTrue(foundNewTool);
+        XCTAssertTrue(foundFresh);
+        [archive close];
+        
+        // The renamed helper is stored as a small diff instead of in full
+        NSUInteger plainDiffLength = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeNone options:nil].length;
+        XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length + newHelperData.length / 2, plainDiffLength);
+    }];
+}
+
+- (void)testBigDataDifferentDiffWithRegularFilesAdded
+{
+    [self createAndApplyPatchWithHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        NSString *sourceFile = [sourceDirectory stringByAppendingPathComponent:@"B"];
+        NSString *destinationFile = [destinationDirectory stringByAppendingPathComponent:@"B"];
+        NSString *sourceFile2 = [sourceDirectory stringByAppendingPathComponent:@"D"];
+        NSString *destinationFile2 = [destinationDirectory stringByAppendingPathComponent:@"D"];
+        
+        // Binary diffs are read straight out of the archive so make sure the items around them are still read correctly
+        XCTAssertTrue([[self bigData1] writeToFile:sourceFile atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:destinationFile atomically:YES]);
+        XCTAssertTrue([[self bigData2] writeToFile:sourceFile2 atomically:YES]);
+        XCTAssertTrue([[self bigData1] writeToFile:destinationFile2 atomically:YES]);
+        XCTAssertTrue([[NSData dataWithBytes:"loltest" length:7] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"A"] atomically:YES]);
+        XCTAssertTrue([[NSData dataWithBytes:"lol" length:3] writeToFile:[destinationDirectory stringByAppendingPathComponent:@"C"] atomically:YES]);
+        
+        XCTAssertFalse([self testDirectoryHashEqualityWithSource:sourceDirectory destination:destinationDirectory]);
+    }];
+}
+
+- (void)testVectorKernelsMatchScalarKernels
+{
+    const struct bssimd_kernels *scalar = bssimd_kernels(BSSIMD_SCALAR);
+    XCTAssertTrue(scalar != NULL);
+    
+    const size_t size = 16384;
+    u_char *a = malloc(size);
+    u_char *b = malloc(size);
+    u_char *expected = malloc(size);
+    u_char *actual = malloc(size);
+    
+    // Make most bytes equal so that runs of equal bytes straddle vector boundaries
+    arc4random_buf(a, size);
+    memcpy(b, a, size);
+    for (size_t i = 0; i < size / 8; i++) {
+        b[arc4random_uniform((uint32_t)size)] ^= (u_char)(1 + arc4random_uniform(255));
+    }
+    
+    for (int level = BSSIMD_SSE2; level <= BSSIMD_NEON; level++) {
+        const struct bssimd_kernels *kernels = bssimd_kernels((enum bssimd_level)level);
+        if (kernels == NULL) {
+            continue;
+        }
+        
+        for (off_t offset = 0; offset < 33; offset++) {
+            for (off_t length = 0; length + offset <= 1100; length += 1 + length / 8) {
+                XCTAssertEqual(kernels->mismatch(a + offset, b + offset, length), scalar->mismatch(a + offset, b + offset, length), @"%s", kernels->name);
+                XCTAssertEqual(kernels->mismatch(a + offset, a + offset, length), length, @"%s", kernels->name);
+                XCTAssertEqual(kernels->countequal(a + offset, b + offset, length), scalar->countequal(a + offset, b + offset, length), @"%s", kernels->name);
+                if (length <= 64) {
+                    XCTAssertEqual(kernels->equalmask(a + offset, b + offset, (size_t)length), scalar->equalmask(a + offset, b + offset, (size_t)length), @"%s", kernels->name);
+                }
+                
+                scalar->subtract(expected, a + offset, b, length);
+                kernels->subtract(actual, a + offset, b, length);
+                XCTAssertEqual(memcmp(expected, actual, (size_t)length), 0, @"%s", kernels->name);
+                
+                scalar->add(expected, b + offset, length);
+                kernels->add(actual, b + offset, length);
+                XCTAssertEqual(memcmp(expected, actual, (size_t)length), 0, @"%s", kernels->name);
+            }
+        }
+        
+        // Counters are flushed every 255 vectors
+        XCTAssertEqual(kernels->countequal(a, b, (off_t)size), scalar->countequal(a, b, (off_t)size), @"%s", kernels->name);
+        XCTAssertEqual(kernels->countequal(a, a, (off_t)size), (off_t)size, @"%s", kernels->name);
+    }
+    
+    free(a);
+    free(b);
+    free(expected);
+    free(actual);
+}
+
+// Builds a minimal Mach-O whose code calls into a table of functions at its start
+// Inserting code after the functions moves every call without changing what it calls
+- (NSData *)executableDataWithCPUType:(uint32_t)cpuType insertedCodeLength:(uint32_t)insertedCodeLength
+{
+    const uint32_t codeOffset = 4096;
+    const uint32_t functionsLength = 4096;
+    const uint32_t callsLength = 256 * 1024;
+    const uint32_t codeLength = functionsLength + insertedCodeLength + callsLength;
+    const uint64_t codeAddress = 0x100000000ULL + codeOffset;
+    const BOOL arm64 = (cpuType == 0x0100000c);
+    
+    NSMutableData *data = [NSMutableData dataWithLength:codeOffset + codeLength];
+    uint8_t *bytes = data.mutableBytes;
+    
+    uint32_t header[] = {0xfeedfacf, cpuType, arm64 ? 0 : 3, 2, 1, 72 + 80, 0, 0};
+    memcpy(bytes, header, sizeof(header));
+    
+    uint8_t *segment = bytes + sizeof(header);
+    uint32_t segmentCommand[] = {0x19, 72 + 80};
+    memcpy(segment, segmentCommand, sizeof(segmentCommand));
+    memcpy(segment + 8, "__TEXT", 6);
+    uint64_t segmentFileSize = data.length;
+    memcpy(segment + 48, &segmentFileSize, sizeof(segmentFileSize));
+    uint32_t sectionCount = 1;
+    memcpy(segment + 64, &sectionCount, sizeof(sectionCount));
+    
+    uint8_t *section = segment + 72;
+    memcpy(section, "__text", 6);
+    memcpy(section + 16, "__TEXT", 6);
+    uint64_t sectionInfo[] = {codeAddress, codeLength};
+    memcpy(section + 32, sectionInfo, sizeof(sectionInfo));
+    memcpy(section + 48, &codeOffset, sizeof(codeOffset));
+    uint32_t sectionFlags = 0x80000400;
+    memcpy(section + 64, &sectionFlags, sizeof(sectionFlags));
+    
+    uint8_t *code = bytes + codeOffset;
+    memcpy(code, [self randomDataWithLength:functionsLength seed:1].bytes, functionsLength);
+    
+    // Fill the inserted code with nops
+    for (uint32_t i = functionsLength; i < functionsLength + insertedCodeLength; i += 4) {
+        uint32_t nop = arm64 ? 0xd503201f : 0x90909090;
+        memcpy(code + i, &nop, sizeof(nop));
+    }
+    
+    // Each call picks its target and register from its own random value
+    NSData *callValues = [self randomDataWithLength:(callsLength / 8) * sizeof(uint32_t) seed:2];
+    const uint32_t *callValue = callValues.bytes;
+    for (uint32_t i = functionsLength + insertedCodeLength; i + 8 <= codeLength; i += 8) {
+        uint32_t randomValue = *callValue++;
+        uint64_t target = codeAddress + ((randomValue >> 16) % 64) * 64;
+        uint64_t position = codeAddress + i;
+        if (arm64) {
+            // bl followed by a mov
+            uint32_t instructions[] = {0x94000000 | ((uint32_t)((target - position) >> 2) & 0x03ffffff), 0xaa0003e0 | ((randomValue >> 8) & 0x1f)};
+            memcpy(code + i, instructions, sizeof(instructions));
+        } else {
+            // call followed by a mov
+            uint32_t displacement = (uint32_t)(target - (position + 5));
+            code[i] = 0xe8;
+            memcpy(code + i + 1, &displacement, sizeof(displacement));
+            code[i + 5] = 0x48;
+            code[i + 6] = 0x89;
+            code[i + 7] = (uint8_t)(0xc0 | ((randomValue >> 8) & 0x3f));
+        }
+    }
+    
+    return data;
+}
+
+- (void)testBranchFilterRoundTrip
+{
+    NSData *x86Executable = [self executableDataWithCPUType:0x01000007 insertedCodeLength:0];
+    NSData *arm64Executable = [self executableDataWithCPUType:0x0100000c insertedCodeLength:0];
+    
+    // A universal file holding both executables
+    NSMutableData *universalExecutable = [NSMutableData dataWithLength:4096];
+    uint32_t fatHeader[] = {CFSwapInt32HostToBig(0xcafebabe), CFSwapInt32HostToBig(2)};
+    memcpy(universalExecutable.mutableBytes, fatHeader, sizeof(fatHeader));
+    NSArray<NSData *> *slices = @[x86Executable, arm64Executable];
+    for (NSUInteger sliceIndex = 0; sliceIndex < slices.count; sliceIndex++) {
+        NSData *slice = slices[sliceIndex];
+        uint32_t fatArch[] = {0, 0, CFSwapInt32HostToBig((uint32_t)universalExecutable.length), CFSwapInt32HostToBig((uint32_t)slice.length), CFSwapInt32HostToBig(12)};
+        memcpy((uint8_t *)universalExecutable.mutableBytes + 8 + sliceIndex * sizeof(fatArch), fatArch, sizeof(fatArch));
+        [universalExecutable appendData:slice];
+    }
+    
+    for (NSData *executable in @[x86Executable, arm64Executable, universalExecutable]) {
+        NSMutableData *filteredData = [executable mutableCopy];
+        XCTAssertEqual(bsfilter_encode_branches(filteredData.mutableBytes, (off_t)filteredData.length), 1);
+        XCTAssertNotEqualObjects(filteredData, executable);
+        
+        XCTAssertEqual(bsfilter_decode_branches(filteredData.mutableBytes, (off_t)filteredData.length), 1);
+        XCTAssertEqualObjects(filteredData, executable);
+    }
+    
+    // Other files are left alone
+    NSMutableData *otherData = [NSMutableData dataWithData:[self bigData1]];
+    XCTAssertEqual(bsfilter_encode_branches(otherData.mutableBytes, (off_t)otherData.length), 0);
+    XCTAssertEqualObjects(otherData, [self bigData1]);
+}
+
+- (void)testExecutableDiffWithBranchFilter
+{
+    SPUDeltaCreationOptions *options = [[SPUDeltaCreationOptions alloc] init];
+    options.filtersExecutableBranches = YES;
+    
+    [self createAndApplyPatchUsingCompressionMode:SPUDeltaCompressionModeDefault options:options beforeDiffHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
+        NSArray<NSNumber *> *cpuTypes = @[@(0x01000007), @(0x0100000c)];
+        for (NSNumber *cpuType in cpuTypes) {
+            NSString *fileName = [NSString stringWithFormat:@"%x", cpuType.unsignedIntValue];
+            XCTAssertTrue([[self executableDataWithCPUType:cpuType.unsignedIntValue insertedCodeLength:0] writeToFile:[sourceDirectory stringByAppendingPathComponent:fileName] atomically:YES]);
+            XCTAssertTrue([[self executableDataWithCPUType:cpuType.unsignedIntValue insertedCodeLength:64] writeToFile:[destinationDirectory stringByAppendingPathComponent:fileName] atomically:YES]);
+        }
+    } diffFileHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory, NSString *diffFile) {
+        // Branch filtered diffs aren't used unless asked for
+        NSUInteger unfilteredDiffLength = [self patchDataWithSource:sourceDirectory destination:destinationDirectory compressionMode:SPUDeltaCompressionModeDefault options:nil].length;
+        XCTAssertLessThan([NSData dataWithContentsOfFile:diffFile].length * 4, unfilteredDiffLength);
+        
+        // Older clients would patch filtered diffs against unfiltered files, so the patch is marked as a version they can't apply
+        XCTAssertEqual([self headerOfPatchFile:diffFile].minorVersion, SUBinaryDeltaMinorVersion3_8);
+    }];
+}
+
 - (void)testRegularFileAdded
 {
     [self createAndApplyPatchWithHandler:^(NSFileManager *__unused fileManager, NSString *sourceDirectory, NSString *destinationDirectory) {
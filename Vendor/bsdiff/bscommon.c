@@ -6,7 +6,15 @@
  */
 
 #include "bscommon.h"
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Large reads and writes are split up because read(2) and write(2) can reject
+   byte counts above INT_MAX */
+#define MAX_IO_CHUNK_SIZE (1 << 30)
 
 u_char *readfile(const char *filename, off_t *outSize)
 {
@@ -18,11 +26,11 @@ u_char *readfile(const char *filename, off_t *outSize)
         goto cleanup;
     }
     
-    if (fseek(file, 0L, SEEK_END) != 0) {
+    if (fseeko(file, 0, SEEK_END) != 0) {
         goto cleanup;
     }
     
-    long offset = ftell(file);
+    off_t offset = ftello(file);
     if (offset == -1) {
         goto cleanup;
     }
@@ -40,12 +48,16 @@ u_char *readfile(const char *filename, off_t *outSize)
         goto cleanup;
     }
     
-    if (fseek(file, 0L, SEEK_SET) != 0) {
+    if (fseeko(file, 0, SEEK_SET) != 0) {
         goto cleanup;
     }
     
-    if (fread(buffer, 1, size, file) < size) {
-        goto cleanup;
+    for (size_t bytesRead = 0; bytesRead < size;) {
+        size_t chunkSize = (size - bytesRead < MAX_IO_CHUNK_SIZE) ? (size - bytesRead) : MAX_IO_CHUNK_SIZE;
+        if (fread(buffer + bytesRead, 1, chunkSize, file) < chunkSize) {
+            goto cleanup;
+        }
+        bytesRead += chunkSize;
     }
     
     success = 0;
@@ -60,3 +72,56 @@ cleanup:
     
     return buffer;
 }
+
+void *mapfile(const char *filename, off_t *outSize)
+{
+    /* mmap() can't map empty files, so they're all represented by this buffer */
+    static u_char emptyBuffer[1] = {0};
+    
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    void *buffer;
+    if (fileInfo.st_size == 0) {
+        buffer = emptyBuffer;
+    } else {
+        void *mapping = mmap(NULL, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        buffer = (mapping != MAP_FAILED) ? mapping : NULL;
+    }
+    
+    /* The mapping stays valid after the file is closed */
+    close(fd);
+    
+    if (buffer != NULL && outSize != NULL) {
+        *outSize = fileInfo.st_size;
+    }
+    
+    return buffer;
+}
+
+void unmapfile(void *mapping, off_t size)
+{
+    if (mapping != NULL && size > 0) {
+        munmap(mapping, (size_t)size);
+    }
+}
+
+int writebuffer(FILE *file, const u_char *buffer, size_t size)
+{
+    for (size_t bytesWritten = 0; bytesWritten < size;) {
+        size_t chunkSize = (size - bytesWritten < MAX_IO_CHUNK_SIZE) ? (size - bytesWritten) : MAX_IO_CHUNK_SIZE;
+        if (fwrite(buffer + bytesWritten, 1, chunkSize, file) < chunkSize) {
+            return -1;
+        }
+        bytesWritten += chunkSize;
+    }
+    return 0;
+}
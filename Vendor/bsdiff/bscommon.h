@@ -13,4 +13,15 @@
 
 u_char *readfile(const char *filename, off_t *outSize);
 
+/* Maps the contents of 'filename' into memory read-only so its pages are only
+   loaded as they're used, instead of reading the whole file up front. Returns
+   NULL on failure. The mapping must not be written to and must be released
+   with unmapfile(). */
+void *mapfile(const char *filename, off_t *outSize);
+
+void unmapfile(void *mapping, off_t size);
+
+/* Writes all 'size' bytes of 'buffer' to 'file'. Returns 0 on success and -1 on failure. */
+int writebuffer(FILE *file, const u_char *buffer, size_t size);
+
 #endif
@@ -29,27 +29,91 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c, v 1.1 2005/08/06 01:59:0
 #endif
 
 #include <sys/types.h>
+#include "bsdiff.h"
 #include "sais.h"
+#include "psufsort.h"
+#include "bssimd.h"
 
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "bscommon.h"
 
 #define MIN(x, y) (((x)<(y)) ? (x) : (y))
 
-/* matchlen(old, oldsize, new, newsize)
+/* Files smaller than this are suffix sorted with 32-bit indexes, which halves
+   the memory needed for the suffix sort */
+#define MAX_SIZE_FOR_32BIT_INDEXES INT32_MAX
+
+/* Ranges of the new file that are scanned in parallel are at least this large */
+#define MIN_SCAN_RANGE_SIZE (1 << 20)
+
+/* Matches longer than this are compared a block at a time by matchlen() */
+#define MATCHLEN_BLOCK_SIZE 256
+
+/* Number of bytes the forward and backward extensions of matches compare at once.
+   This is the most bssimd_kernels.equalmask() accepts. */
+#define EXTENSION_BLOCK_SIZE 64
+
+/* Number of control values that are encoded before being written out together */
+#define CTRL_WRITE_BATCH_SIZE 512
+
+/* Most bytes a 64-bit value takes as a varint */
+#define MAX_VARINT_SIZE 10
+
+/* The hash engine indexes the old file by anchors, which are the positions
+   where a rolling hash of the ANCHOR_WINDOW_SIZE bytes before them has its top
+   ANCHOR_SPACING_BITS bits clear. Anchors depend only on the bytes around
+   them, so the same content has the same anchors in both files wherever it is,
+   and anchors are 2^ANCHOR_SPACING_BITS bytes apart on average. */
+#define ANCHOR_WINDOW_SIZE 32
+#define ANCHOR_SPACING_BITS 6
+
+/* Most overlapping anchor matches considered at each position of the new file */
+#define MAX_OVERLAPPING_ANCHOR_MATCHES 8
+
+/* Suffix sort cache files start with a header holding this magic, the size of
+   the old file and the size of each index, followed by the suffix sort exactly
+   as it's laid out in memory */
+#define SUFFIX_CACHE_MAGIC "BSSUFS01"
+#define SUFFIX_CACHE_HEADER_SIZE 32
+
+/* suffixat(I, wide, i)
  *
- * Returns the length of the longest common prefix between 'old' and 'new'. */
-static off_t matchlen(u_char *old, off_t oldsize, u_char *new, off_t newsize)
+ * Returns the i-th entry of the suffix sort 'I', which holds off_t entries if
+ * 'wide' is set and int32_t entries otherwise. */
+static inline off_t suffixat(const void *I, int wide, off_t i)
+{
+    return wide ? ((const off_t *)I)[i] : ((const int32_t *)I)[i];
+}
+
+/* matchwords(old, new, i, n)
+ *
+ * Returns the index of the first byte from 'i' to 'n' that differs between
+ * 'old' and 'new', or 'n' if there is none. */
+static inline off_t matchwords(const u_char *old, const u_char *new, off_t i, off_t n)
 {
-    off_t i;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /* Compare eight bytes at a time. The lowest set bit of the difference
+     * belongs to the first mismatching byte. */
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, old + i, sizeof(a));
+        memcpy(&b, new + i, sizeof(b));
+        if (a != b)
+            return i + (__builtin_ctzll(a ^ b) / 8);
+    }
+#endif
 
-    for (i = 0; (i < oldsize) && (i < newsize); i++)
+    for (; i < n; i++)
     {
         if (old[i] != new[i])
             break;
@@ -58,37 +122,267 @@ static off_t matchlen(u_char *old, off_t oldsize, u_char *new, off_t newsize)
     return i;
 }
 
-/* search(I, old, oldsize, new, newsize, st, en, pos)
+/* matchlen(simd, old, oldsize, new, newsize)
+ *
+ * Returns the length of the longest common prefix between 'old' and 'new'. */
+static off_t matchlen(const struct bssimd_kernels *simd, const u_char *old, off_t oldsize,
+        const u_char *new, off_t newsize)
+{
+    off_t n = MIN(oldsize, newsize);
+    off_t head = MIN(n, MATCHLEN_BLOCK_SIZE);
+
+    /* Most matches are short, so check the first word inline before handing
+     * the rest of the head to the vector kernels */
+    off_t word = MIN(head, (off_t)sizeof(uint64_t));
+    off_t i = matchwords(old, new, 0, word);
+    if (i < word)
+        return i;
+
+    i += simd->mismatch(old + i, new + i, head - i);
+    if (i < head)
+        return i;
+
+    /* Skip over the rest of long matches with memcmp, which is faster at
+     * this than comparing words. Blocks double in size until one differs or
+     * runs past the end, and are then halved to narrow down where. */
+    off_t block = MATCHLEN_BLOCK_SIZE;
+    while ((i + block <= n) && (memcmp(old + i, new + i, (size_t)block) == 0))
+    {
+        i += block;
+        block *= 2;
+    }
+
+    while (block > MATCHLEN_BLOCK_SIZE)
+    {
+        block /= 2;
+        if ((i + block <= n) && (memcmp(old + i, new + i, (size_t)block) == 0))
+            i += block;
+    }
+
+    return i + simd->mismatch(old + i, new + i, n - i);
+}
+
+/* search(simd, I, wide, old, oldsize, new, newsize, st, en, pos)
  *
  * Searches for the longest prefix of 'new' that occurs in 'old', stores its
  * offset in '*pos', and returns its length. 'I' should be the suffix sort of
- * 'old', and 'st' and 'en' are the lowest and highest indices in the suffix
- * sort to consider. If you're searching all suffixes, 'st = 0' and 'en =
- * oldsize - 1'. */
-static off_t search(off_t *I, u_char *old, off_t oldsize,
-        u_char *new, off_t newsize, off_t st, off_t en, off_t *pos)
+ * 'old' with entries as wide as described by 'wide', and 'st' and 'en' are
+ * the lowest and highest indices in the suffix sort to consider. If you're
+ * searching all suffixes, 'st = 0' and 'en = oldsize - 1'.
+ *
+ * This is a binary search that remembers how long a prefix of 'new' the
+ * suffixes at 'st' and 'en' are known to match. Every suffix between them
+ * matches at least the shorter of the two, so each probe only needs to compare
+ * the bytes after it instead of starting over from the beginning. */
+static off_t search(const struct bssimd_kernels *simd, const void *I, int wide,
+        const u_char *old, off_t oldsize, const u_char *new, off_t newsize, off_t st, off_t en, off_t *pos)
 {
     off_t x, y;
+    off_t stlen = 0, enlen = 0;     /* matched prefix lengths at 'st' and 'en' */
+    off_t sti, eni;
+
+    while (en - st >= 2) {
+        off_t skip = MIN(stlen, enlen);
 
-    if (en - st < 2) {
-        x = matchlen(old + I[st], oldsize - I[st], new, newsize);
-        y = matchlen(old + I[en], oldsize - I[en], new, newsize);
+        x = st + (en - st)/2;
+        off_t xi = suffixat(I, wide, x);
+        off_t xlen = skip + matchlen(simd, old + xi + skip, oldsize - xi - skip,
+                new + skip, newsize - skip);
 
-        if (x > y) {
-            *pos = I[st];
-            return x;
+        /* Narrow down to the upper half if the suffix at 'x' sorts before
+         * 'new' when both are cut to the shorter of their lengths. */
+        if ((xlen < oldsize - xi) && (xlen < newsize) && (old[xi + xlen] < new[xlen])) {
+            st = x;
+            stlen = xlen;
         } else {
-            *pos = I[en];
-            return y;
+            en = x;
+            enlen = xlen;
         }
     }
 
-    x = st + (en - st)/2;
-    if (memcmp(old + I[x], new, (size_t)(MIN(oldsize - I[x], newsize))) < 0) {
-        return search(I, old, oldsize, new, newsize, x, en, pos);
+    sti = suffixat(I, wide, st);
+    eni = suffixat(I, wide, en);
+    x = stlen + matchlen(simd, old + sti + stlen, oldsize - sti - stlen, new + stlen, newsize - stlen);
+    y = enlen + matchlen(simd, old + eni + enlen, oldsize - eni - enlen, new + enlen, newsize - enlen);
+
+    if (x > y) {
+        *pos = sti;
+        return x;
     } else {
-        return search(I, old, oldsize, new, newsize, st, x, pos);
-    };
+        *pos = eni;
+        return y;
+    }
+}
+
+/* Hash table of the anchors in the old file */
+struct anchorindex
+{
+    uint64_t gear[256];     /* random values the rolling hash adds for each byte */
+    off_t *slots;           /* end of the first anchor window hashing to each slot, or -1 */
+    int slotbits;           /* log2 of the number of slots */
+};
+
+/* A match between the old and new files found through an anchor, extended
+   as far as the files match in both directions */
+struct anchormatch
+{
+    off_t newstart;
+    off_t newend;
+    off_t oldstart;
+};
+
+/* Shifting the hash left by two bits per byte makes it a hash of the last
+   32 bytes, which is the anchor window */
+static inline uint64_t rollhash(const struct anchorindex *index, uint64_t hash, u_char byte)
+{
+    return (hash << 2) + index->gear[byte];
+}
+
+static inline int isanchor(uint64_t hash)
+{
+    return (hash >> (64 - ANCHOR_SPACING_BITS)) == 0;
+}
+
+static inline size_t anchorslot(const struct anchorindex *index, uint64_t hash)
+{
+    return (size_t)((hash * 0x9e3779b97f4a7c15ULL) >> (64 - index->slotbits));
+}
+
+/* buildanchorindex(old, oldsize, index)
+ *
+ * Hashes the anchors of 'old' into 'index'. Returns 0 on success and -1 if
+ * memory could not be allocated. 'index->slots' must be freed with free(). */
+static int buildanchorindex(const u_char *old, off_t oldsize, struct anchorindex *index)
+{
+    /* The gear values only need to look random, and must be the same for
+       both files */
+    uint64_t state = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        index->gear[i] = z ^ (z >> 31);
+    }
+
+    /* About one slot per anchor */
+    index->slotbits = 10;
+    while ((index->slotbits < 40) && (((off_t)1 << index->slotbits) < (oldsize >> ANCHOR_SPACING_BITS))) {
+        index->slotbits++;
+    }
+
+    size_t slotcount = (size_t)1 << index->slotbits;
+    if ((index->slots = malloc(slotcount * sizeof(off_t))) == NULL) {
+        warn("Failed to allocate memory for the anchor index");
+        return -1;
+    }
+    for (size_t i = 0; i < slotcount; i++) {
+        index->slots[i] = -1;
+    }
+
+    uint64_t hash = 0;
+    for (off_t i = 0; i < oldsize; i++) {
+        hash = rollhash(index, hash, old[i]);
+        if ((i + 1 >= ANCHOR_WINDOW_SIZE) && isanchor(hash)) {
+            off_t *slot = &index->slots[anchorslot(index, hash)];
+            if (*slot < 0) {
+                *slot = i + 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* findanchormatches(simd, index, old, oldsize, new, newsize, outmatches, outcount)
+ *
+ * Looks up the anchors of 'new' in the anchor index of 'old' and stores the
+ * matches they lead to, in the order they start in 'new', in '*outmatches'.
+ * Returns 0 on success and -1 if memory could not be allocated.
+ * '*outmatches' must be freed with free(). */
+static int findanchormatches(const struct bssimd_kernels *simd, const struct anchorindex *index,
+        const u_char *old, off_t oldsize, const u_char *new, off_t newsize,
+        struct anchormatch **outmatches, off_t *outcount)
+{
+    struct anchormatch *matches = NULL;
+    off_t count = 0, capacity = 0;
+    off_t lastend = 0;                  /* end of the last match in 'new' */
+    uint64_t hash = 0;
+
+    for (off_t i = 0; i < newsize; i++) {
+        hash = rollhash(index, hash, new[i]);
+        if ((i + 1 < ANCHOR_WINDOW_SIZE) || !isanchor(hash)) {
+            continue;
+        }
+
+        /* Matches are taken greedily, so anchors within the last match are
+           skipped. This keeps the time linear when there are many repeats. */
+        off_t newend = i + 1;
+        if (newend <= lastend) {
+            continue;
+        }
+
+        off_t oldend = index->slots[anchorslot(index, hash)];
+        if (oldend < 0) {
+            continue;
+        }
+
+        if (memcmp(old + oldend - ANCHOR_WINDOW_SIZE, new + newend - ANCHOR_WINDOW_SIZE, ANCHOR_WINDOW_SIZE) != 0) {
+            continue;
+        }
+
+        off_t back = ANCHOR_WINDOW_SIZE;
+        while ((back < newend - lastend) && (back < oldend) && (old[oldend - back - 1] == new[newend - back - 1])) {
+            back++;
+        }
+        off_t forward = matchlen(simd, old + oldend, oldsize - oldend, new + newend, newsize - newend);
+
+        if (count == capacity) {
+            off_t newcapacity = (capacity > 0) ? capacity * 2 : 1024;
+            struct anchormatch *newmatches = realloc(matches, (size_t)newcapacity * sizeof(*matches));
+            if (newmatches == NULL) {
+                warnx("Failed to allocate memory for anchor matches");
+                free(matches);
+                return -1;
+            }
+            matches = newmatches;
+            capacity = newcapacity;
+        }
+
+        matches[count].newstart = newend - back;
+        matches[count].newend = newend + forward;
+        matches[count].oldstart = oldend - back;
+        count++;
+
+        lastend = newend + forward;
+    }
+
+    *outmatches = matches;
+    *outcount = count;
+    return 0;
+}
+
+/* anchorsearch(matches, count, first, scan, pos)
+ *
+ * Counterpart of search() for the hash engine. Returns the length of the
+ * longest of the anchor 'matches' at position 'scan' of the new file and
+ * stores where it is in the old file in '*pos'. '*first' is the index of the
+ * first match that may still contain 'scan', and is updated as 'scan'
+ * increases. */
+static off_t anchorsearch(const struct anchormatch *matches, off_t count, off_t *first, off_t scan, off_t *pos)
+{
+    while ((*first < count) && (matches[*first].newend <= scan)) {
+        (*first)++;
+    }
+
+    off_t len = 0;
+    for (off_t m = *first; (m < count) && (m < *first + MAX_OVERLAPPING_ANCHOR_MATCHES) && (matches[m].newstart <= scan); m++) {
+        if (matches[m].newend - scan > len) {
+            len = matches[m].newend - scan;
+            *pos = matches[m].oldstart + (scan - matches[m].newstart);
+        }
+    }
+
+    return len;
 }
 
 /* offtout(x, buf)
@@ -117,99 +411,127 @@ static void offtout(off_t x, u_char *buf)
         buf[7] |= 0x80;
 }
 
-int bsdiff(int argc, char *argv[]); // Added by AMM: suppresses a warning about the following not having a prototype.
-
-int bsdiff(int argc, char *argv[])
+/* varintout(x, buf)
+ *
+ * Writes 'x' to 'buf' as a varint of 7 bits per byte, lowest bits first, with
+ * the top bit of each byte set when more bytes follow. Returns the number of
+ * bytes written, which is at most MAX_VARINT_SIZE. */
+static size_t varintout(uint64_t x, u_char *buf)
 {
-    u_char *old = NULL,*new = NULL;           /* contents of old, new files */
-    off_t oldsize = 0, newsize = 0;     /* length of old, new files */
-    off_t *I = NULL,*V = NULL;                /* arrays used for suffix sort; I is ordering */
-    off_t scan = 0;                 /* position of current match in old file */
-    off_t pos = 0;              /* position of current match in new file */
-    off_t len = 0;                  /* length of current match */
-    off_t lastscan = 0;             /* position of previous match in old file */
-    off_t lastpos = 0;              /* position of previous match in new file */
-    off_t lastoffset = 0;           /* lastpos - lastscan */
-    off_t oldscore = 0, scsc = 0;       /* temp variables in match search */
-    off_t s = 0, Sf = 0, lenf = 0, Sb = 0, lenb = 0;    /* temp vars in match extension */
-    off_t overlap = 0, Ss = 0, lens = 0;
-    off_t i = 0;
-    off_t dblen = 0, eblen = 0;         /* length of diff, extra sections */
-    u_char *db = NULL,*eb = NULL;             /* contents of diff, extra sections */
-    u_char buf[8] = {0};
-    u_char header[32] = {0};
-    FILE * pf = NULL;
-    int exitstatus = -1;
+    size_t len = 0;
 
-    if (argc != 4) {
-        warnx("usage: %s oldfile newfile patchfile\n", argv[0]);
-        goto cleanup;
+    while (x >= 0x80) {
+        buf[len++] = (u_char)(x | 0x80);
+        x >>= 7;
     }
+    buf[len++] = (u_char)x;
 
-    old = readfile(argv[1], &oldsize);
-    if (old == NULL) {
-        warn("old file error: %s", argv[1]);
-        goto cleanup;
+    return len;
+}
+
+/* ctrlout(value, index, varint, buf)
+ *
+ * Writes the control value 'value' at 'index' within its triple to 'buf',
+ * either as 8 bytes or as a varint. The lengths in a triple are never
+ * negative so they're stored as they are, while the seek is zigzag encoded so
+ * small seeks backwards stay short. Returns the number of bytes written. */
+static size_t ctrlout(off_t value, off_t index, int varint, u_char *buf)
+{
+    if (!varint) {
+        offtout(value, buf);
+        return 8;
     }
 
-    if (((I = malloc(((size_t)oldsize + 1) * sizeof(off_t))) == NULL) ||
-        ((V = malloc(((size_t)oldsize + 1) * sizeof(off_t))) == NULL)) {
-        warn("Failed to allocate memory for I or V");
-        goto cleanup;
+    if (index % 3 != 2) {
+        return varintout((uint64_t)value, buf);
     }
+    return varintout(((uint64_t)value << 1) ^ (uint64_t)(value >> 63), buf);
+}
 
-    /* Do a suffix sort on the old file. */
-    I[0] = oldsize;
-    sais(old, I+1, (int)oldsize);
+/* Control triples, diff data and extra data for one range of the new file */
+struct scanrange
+{
+    off_t start;            /* offset of the range in the new file */
+    off_t length;           /* length of the range */
+    off_t oldstart;         /* old file position the range's first triple applies at */
+    off_t oldend;           /* old file position after the range's last triple */
+    off_t *ctrl;            /* control triples */
+    off_t ctrllen, ctrlcap; /* number of entries used and allocated in ctrl */
+    u_char *db, *eb;        /* diff and extra data, each with room for 'length' bytes */
+    off_t dblen, eblen;     /* length of diff, extra data */
+    int exitstatus;
+};
 
-    free(V);
-    V = NULL;
-    
-    new = readfile(argv[2], &newsize);
-    if (new == NULL) {
-        warn("new file error: %s", argv[2]);
-        goto cleanup;
-    }
+/* Everything the threads scanning ranges of the new file share */
+struct scancontext
+{
+    const struct bssimd_kernels *simd;
+    const void *I;
+    int wide;
+    const struct anchorindex *index;    /* set instead of I when using the hash engine */
+    const u_char *old;
+    off_t oldsize;
+    const u_char *new;
+    struct scanrange *range;
+    pthread_t thread;
+    int threadcreated;
+};
 
-    if (((db = malloc((size_t)newsize + 1)) == NULL) ||
-        ((eb = malloc((size_t)newsize + 1)) == NULL)) {
-        warn("Failed to allocate memory for db or eb");
-        goto cleanup;
+/* addctrl(range, lenf, extralen, seeklen)
+ *
+ * Appends a control triple to 'range'. Returns 0 on success and -1 if memory
+ * could not be allocated. */
+static int addctrl(struct scanrange *range, off_t lenf, off_t extralen, off_t seeklen)
+{
+    if (range->ctrllen + 3 > range->ctrlcap) {
+        off_t newcap = (range->ctrlcap > 0) ? range->ctrlcap * 2 : 3 * 1024;
+        off_t *newctrl = realloc(range->ctrl, (size_t)newcap * sizeof(off_t));
+        if (newctrl == NULL) {
+            return -1;
+        }
+        range->ctrl = newctrl;
+        range->ctrlcap = newcap;
     }
-    dblen = 0;
-    eblen = 0;
 
-    /* Create the patch file */
-    if ((pf = fopen(argv[3], "w")) == NULL) {
-        warn("%s", argv[3]);
-        goto cleanup;
-    }
+    range->ctrl[range->ctrllen++] = lenf;
+    range->ctrl[range->ctrllen++] = extralen;
+    range->ctrl[range->ctrllen++] = seeklen;
+    return 0;
+}
 
-    /* Header is
-        0    8     "BSDIFN40"
-        8    8    length of ctrl block
-        16    8    length of diff block
-        24    8    length of new file */
-    /* File is
-        0    32    Header
-        32    ??    ctrl block
-        ??    ??    diff block
-        ??    ??    extra block */
-    memcpy(header, "BSDIFN40", 8);
-    offtout(0, header + 8);
-    offtout(0, header + 16);
-    offtout(newsize, header + 24);
-    if (fwrite(header, 32, 1, pf) != 1) {
-        warn("fwrite(%s)", argv[3]);
-        goto cleanup;
-    }
+/* diffrange(simd, I, wide, matches, matchcount, old, oldsize, new, newsize, range)
+ *
+ * Computes the differences between 'old' and 'new', where 'new' is the part
+ * of the new file covered by 'range' and 'newsize' is its length. Matches
+ * are looked up in 'I', the suffix sort of 'old', or if 'I' is NULL, among
+ * the 'matchcount' anchor 'matches' found for 'new' by the hash engine.
+ * The control triples, diff data and extra data are stored in 'range'. The
+ * first control triple applies at 'range->oldstart' in the old file. */
+static int diffrange(const struct bssimd_kernels *simd, const void *I, int wide,
+        const struct anchormatch *matches, off_t matchcount,
+        const u_char *old, off_t oldsize, const u_char *new, off_t newsize, struct scanrange *range)
+{
+    off_t firstmatch = 0;           /* first anchor match that may contain 'scan' */
+    off_t scan = 0;                 /* position of current match in old file */
+    off_t pos = 0;              /* position of current match in new file */
+    off_t len = 0;                  /* length of current match */
+    off_t lastscan = 0;             /* position of previous match in old file */
+    off_t lastpos = 0;              /* position of previous match in new file */
+    off_t lastoffset = 0;           /* lastpos - lastscan */
+    off_t oldscore = 0, scsc = 0;       /* temp variables in match search */
+    off_t s = 0, Sf = 0, lenf = 0, Sb = 0, lenb = 0;    /* temp vars in match extension */
+    off_t overlap = 0, Ss = 0, lens = 0;
+    off_t i = 0, j = 0, n = 0;
+    uint64_t equal = 0;                 /* bits of the bytes that match in an extension block */
+    off_t dblen = 0, eblen = 0;         /* length of diff, extra sections */
+    u_char *db = range->db, *eb = range->eb;  /* contents of diff, extra sections */
 
-    /* Compute the differences, writing ctrl as we go */
+    /* Compute the differences, collecting ctrl as we go */
     scan = 0;
     len = 0;
     lastscan = 0;
-    lastpos = 0;
-    lastoffset = 0;
+    lastpos = range->oldstart;
+    lastoffset = range->oldstart;
     while (scan < newsize) {
         oldscore = 0;
 
@@ -217,15 +539,19 @@ int bsdiff(int argc, char *argv[])
             /* 'oldscore' is the number of characters that match between the
              * substrings 'old[lastoffset + scan:lastoffset + scsc]' and
              * 'new[scan:scsc]'. */
-            len = search(I, old, oldsize, new + scan, newsize - scan,
-                    0, oldsize, &pos);
+            if (I == NULL)
+                len = anchorsearch(matches, matchcount, &firstmatch, scan, &pos);
+            else
+                len = search(simd, I, wide, old, oldsize, new + scan, newsize - scan,
+                        0, oldsize, &pos);
 
             /* If this match extends further than the last one, add any new
              * matching characters to 'oldscore'. */
-            for (; scsc < scan + len; scsc++) {
-                if ((scsc + lastoffset < oldsize) &&
-                    (old[scsc + lastoffset] == new[scsc]))
-                    oldscore++;
+            if (scsc < scan + len) {
+                n = MIN(scan + len, oldsize - lastoffset) - scsc;
+                if (n > 0)
+                    oldscore += simd->countequal(old + scsc + lastoffset, new + scsc, n);
+                scsc = scan + len;
             }
 
             /* Choose this as our match if it contains more than eight
@@ -246,31 +572,58 @@ int bsdiff(int argc, char *argv[])
          * better serviced by a forward extension of the previous match. */
         if ((len != oldscore) || (scan == newsize)) {
             /* Figure out how far forward the previous match should be
-             * extended... */
+             * extended...
+             *
+             * Bytes are compared EXTENSION_BLOCK_SIZE at a time. The score
+             * 's * 2 - i' changes by one per byte, so a block can be skipped
+             * without looking at its bytes one by one if it couldn't beat the
+             * best score even if every byte matched. */
             s = 0;
             Sf = 0;
             lenf = 0;
-            for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
-                if (old[lastpos + i] == new[lastscan + i])
-                    s++;
-                i++;
-                if (s * 2 - i > Sf * 2 - lenf) {
-                    Sf = s;
-                    lenf = i;
+            n = MIN(scan - lastscan, oldsize - lastpos);
+            for (i = 0; i < n;) {
+                off_t block = MIN(n - i, EXTENSION_BLOCK_SIZE);
+                equal = simd->equalmask(old + lastpos + i, new + lastscan + i, (size_t)block);
+                if (s * 2 - i + block <= Sf * 2 - lenf) {
+                    s += __builtin_popcountll(equal);
+                    i += block;
+                    continue;
+                }
+
+                for (j = 0; j < block; j++) {
+                    s += (off_t)((equal >> j) & 1);
+                    i++;
+                    if (s * 2 - i > Sf * 2 - lenf) {
+                        Sf = s;
+                        lenf = i;
+                    }
                 }
             }
 
-            /* ... and how far backwards the next match should be extended. */
+            /* ... and how far backwards the next match should be extended,
+             * scanning each block from its end. */
             lenb = 0;
             if (scan < newsize) {
                 s = 0;
                 Sb = 0;
-                for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
-                    if (old[pos - i] == new[scan - i])
-                        s++;
-                    if (s * 2 - i > Sb * 2 - lenb) {
-                        Sb = s;
-                        lenb = i;
+                n = MIN(scan - lastscan, pos);
+                for (i = 1; i <= n;) {
+                    off_t block = MIN(n - i + 1, EXTENSION_BLOCK_SIZE);
+                    equal = simd->equalmask(old + pos - i - block + 1, new + scan - i - block + 1, (size_t)block);
+                    if (s * 2 - (i - 1) + block <= Sb * 2 - lenb) {
+                        s += __builtin_popcountll(equal);
+                        i += block;
+                        continue;
+                    }
+
+                    for (j = block - 1; j >= 0; j--) {
+                        s += (off_t)((equal >> j) & 1);
+                        if (s * 2 - i > Sb * 2 - lenb) {
+                            Sb = s;
+                            lenb = i;
+                        }
+                        i++;
                     }
                 }
             }
@@ -300,8 +653,7 @@ int bsdiff(int argc, char *argv[])
             }
 
             /* Write the diff data for the last match to the diff section... */
-            for (i = 0; i < lenf; i++)
-                db[dblen + i] = new[lastscan + i] - old[lastpos + i];
+            simd->subtract(db + dblen, new + lastscan, old + lastpos, lenf);
             /* ... and, if there's a gap between the extensions just
              * calculated, write the data in that gap to the extra section. */
             for (i = 0; i< (scan - lenb) - (lastscan + lenf); i++)
@@ -311,28 +663,16 @@ int bsdiff(int argc, char *argv[])
             dblen += lenf;
             eblen += (scan - lenb) - (lastscan + lenf);
 
-            /* Write the following triple of integers to the control section:
+            /* Add the following triple of integers to the control section:
              *  - length of the diff
              *  - length of the extra section
              *  - offset between the end of the diff and the start of the next
              *      diff, in the old file
              */
-            offtout(lenf, buf);
-            if (fwrite(buf, 8, 1, pf) != 1) {
-                warnx("fwrite");
-                goto cleanup;
-            }
-
-            offtout((scan - lenb) - (lastscan + lenf), buf);
-            if (fwrite(buf, 8, 1, pf) != 1) {
-                warn("fwrite");
-                goto cleanup;
-            }
-
-            offtout((pos - lenb) - (lastpos + lenf), buf);
-            if (fwrite(buf, 8, 1, pf) != 1) {
-                warn("fwrite");
-                goto cleanup;
+            if (addctrl(range, lenf, (scan - lenb) - (lastscan + lenf),
+                    (pos - lenb) - (lastpos + lenf)) != 0) {
+                warnx("Failed to allocate memory for ctrl");
+                return -1;
             }
 
             /* Update the variables describing the last match. Note that
@@ -345,62 +685,460 @@ int bsdiff(int argc, char *argv[])
         }
     }
 
-    /* Compute size of compressed ctrl data */
-    if ((len = ftello(pf)) == -1) {
-        warn("ftello");
-        goto cleanup;
+    range->dblen = dblen;
+    range->eblen = eblen;
+    range->oldend = lastpos;
+    return 0;
+}
+
+static void *diffrangethread(void *context)
+{
+    struct scancontext *scancontext = context;
+    struct scanrange *range = scancontext->range;
+    struct anchormatch *matches = NULL;
+    off_t matchcount = 0;
+
+    if (scancontext->index != NULL &&
+        findanchormatches(scancontext->simd, scancontext->index, scancontext->old, scancontext->oldsize,
+            scancontext->new + range->start, range->length, &matches, &matchcount) != 0) {
+        range->exitstatus = -1;
+        return NULL;
     }
-    offtout(len - 32, header + 8);
 
-    /* Write diff data */
-    if (dblen && fwrite(db, (size_t)dblen, 1, pf) != 1) {
-        warn("fwrite");
-        goto cleanup;
+    range->exitstatus = diffrange(scancontext->simd, scancontext->I, scancontext->wide,
+            matches, matchcount,
+            scancontext->old, scancontext->oldsize,
+            scancontext->new + range->start, range->length, range);
+    free(matches);
+    return NULL;
+}
+
+/* ctrlvalue(ranges, rangecount, r, c)
+ *
+ * Returns control value 'c' of range 'r'. Each range's triples start at its
+ * own 'oldstart', so the last seek of every range is adjusted to land where
+ * the next range starts. */
+static off_t ctrlvalue(const struct scanrange *ranges, int rangecount, int r, off_t c)
+{
+    const struct scanrange *range = &ranges[r];
+    off_t value = range->ctrl[c];
+    if ((c == range->ctrllen - 1) && (r + 1 < rangecount)) {
+        value += ranges[r + 1].oldstart - range->oldend;
+    }
+    return value;
+}
+
+/* ctrlsize(ranges, rangecount, varint)
+ *
+ * Returns the size of the control block writectrl() writes. */
+static off_t ctrlsize(const struct scanrange *ranges, int rangecount, int varint)
+{
+    u_char buf[MAX_VARINT_SIZE];
+    off_t size = 0;
+
+    for (int r = 0; r < rangecount; r++) {
+        if (!varint) {
+            size += ranges[r].ctrllen * 8;
+            continue;
+        }
+        for (off_t c = 0; c < ranges[r].ctrllen; c++) {
+            size += (off_t)ctrlout(ctrlvalue(ranges, rangecount, r, c), c, varint, buf);
+        }
+    }
+
+    return size;
+}
+
+/* writectrl(sink, ranges, rangecount, varint)
+ *
+ * Writes the control triples of all ranges to 'sink', as varints if 'varint'
+ * is set. */
+static int writectrl(const struct bsdiff_sink *sink, const struct scanrange *ranges, int rangecount, int varint)
+{
+    u_char buf[MAX_VARINT_SIZE * CTRL_WRITE_BATCH_SIZE] = {0};
+    size_t buflen = 0;
+
+    for (int r = 0; r < rangecount; r++) {
+        const struct scanrange *range = &ranges[r];
+        for (off_t c = 0; c < range->ctrllen; c++) {
+            buflen += ctrlout(ctrlvalue(ranges, rangecount, r, c), c, varint, buf + buflen);
+            if (buflen > sizeof(buf) - MAX_VARINT_SIZE) {
+                if (sink->write(sink->context, buf, buflen) != 0) {
+                    return -1;
+                }
+                buflen = 0;
+            }
+        }
+    }
+
+    if (buflen > 0 && sink->write(sink->context, buf, buflen) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int writefile(void *context, const void *buffer, size_t size)
+{
+    return writebuffer((FILE *)context, buffer, size);
+}
+
+int bsdiff(int argc, const char * const argv[])
+{
+    if (argc != 4) {
+        warnx("usage: %s oldfile newfile patchfile\n", argv[0]);
+        return -1;
     }
 
-    /* Compute size of compressed diff data */
-    if ((newsize = ftello(pf)) == -1) {
-        warn("ftello");
+    return bsdiff_files(argv[1], argv[2], argv[3], NULL);
+}
+
+int bsdiff_files(const char *oldfile, const char *newfile, const char *patchfile, const struct bsdiff_options *options)
+{
+    u_char *old = NULL,*new = NULL;           /* contents of old, new files */
+    off_t oldsize = 0, newsize = 0;     /* length of old, new files */
+    FILE * pf = NULL;
+    int exitstatus = -1;
+
+    old = readfile(oldfile, &oldsize);
+    if (old == NULL) {
+        warn("old file error: %s", oldfile);
         goto cleanup;
     }
-    offtout(newsize - len, header + 16);
 
-    /* Write extra data */
-    if (eblen && fwrite(eb, (size_t)eblen, 1, pf) != 1) {
-        warn("fwrite");
+    new = readfile(newfile, &newsize);
+    if (new == NULL) {
+        warn("new file error: %s", newfile);
         goto cleanup;
     }
 
-    /* Seek to the beginning, write the header, and close the file */
-    if (fseeko(pf, 0, SEEK_SET)) {
-        warn("fseeko");
+    /* Create the patch file */
+    if ((pf = fopen(patchfile, "w")) == NULL) {
+        warn("%s", patchfile);
         goto cleanup;
     }
-    if (fwrite(header, 32, 1, pf) != 1) {
-        warn("fwrite(%s)", argv[3]);
+
+    struct bsdiff_sink sink = { pf, writefile };
+    if (bsdiff_buffers(old, oldsize, new, newsize, options, &sink) != 0) {
         goto cleanup;
     }
+
     if (fclose(pf)) {
         warn("fclose");
         pf = NULL;
         goto cleanup;
     }
     pf = NULL;
-    
+
     exitstatus = 0;
 cleanup:
 
     if (pf != NULL) {
         fclose(pf);
     }
-    
+
+    free(old);
+    free(new);
+
+    return exitstatus;
+}
+
+/* sortsuffixes(old, oldsize, wide, threads)
+ *
+ * Returns the suffix sort of 'old' with off_t entries if 'wide' is set and
+ * int32_t entries otherwise, sorted with 'threads' threads, or NULL if memory
+ * could not be allocated. The result must be freed with free(). */
+static void *sortsuffixes(const u_char *old, off_t oldsize, int wide, int threads)
+{
+    size_t indexsize = wide ? sizeof(off_t) : sizeof(int32_t);
+    void *I = NULL, *V = NULL;
+
+    /* V is only needed as scratch space by the multithreaded sort */
+    if (((I = malloc(((size_t)oldsize + 1) * indexsize)) == NULL) ||
+        ((threads > 1) && (V = malloc(((size_t)oldsize + 1) * indexsize)) == NULL)) {
+        warn("Failed to allocate memory for I or V");
+        free(I);
+        return NULL;
+    }
+
+    /* Do a suffix sort on the old file. */
+    if (threads > 1) {
+        int sorted = wide ?
+            psufsort(old, I, V, oldsize, threads) :
+            psufsort32(old, I, V, oldsize, threads);
+        free(V);
+        if (sorted != 0) {
+            warn("Failed to allocate memory for suffix sorting");
+            free(I);
+            return NULL;
+        }
+    } else if (wide) {
+        ((off_t *)I)[0] = oldsize;
+        sais(old, (off_t *)I + 1, oldsize);
+    } else {
+        ((int32_t *)I)[0] = (int32_t)oldsize;
+        sais32(old, (int32_t *)I + 1, (int32_t)oldsize);
+    }
+
+    return I;
+}
+
+/* loadsuffixcache(path, oldsize, indexsize, outsize)
+ *
+ * Maps the suffix sort cached at 'path' for an old file of 'oldsize' bytes
+ * with entries of 'indexsize' bytes. Returns the start of the mapping, which
+ * must be released with unmapfile() using '*outsize', or NULL if there's no
+ * valid cache file. The suffix sort starts SUFFIX_CACHE_HEADER_SIZE bytes in. */
+static void *loadsuffixcache(const char *path, off_t oldsize, size_t indexsize, off_t *outsize)
+{
+    off_t size = 0;
+    void *mapping = mapfile(path, &size);
+    const u_char *map = mapping;
+    if (map == NULL) {
+        return NULL;
+    }
+
+    off_t cachedoldsize = 0;
+    uint64_t cachedindexsize = 0;
+    if (size == SUFFIX_CACHE_HEADER_SIZE + (oldsize + 1) * (off_t)indexsize) {
+        memcpy(&cachedoldsize, map + 8, sizeof(cachedoldsize));
+        memcpy(&cachedindexsize, map + 16, sizeof(cachedindexsize));
+    }
+
+    int valid = (size == SUFFIX_CACHE_HEADER_SIZE + (oldsize + 1) * (off_t)indexsize) &&
+        (memcmp(map, SUFFIX_CACHE_MAGIC, 8) == 0) &&
+        (cachedoldsize == oldsize) && (cachedindexsize == indexsize);
+
+    /* Every entry is used to index into the old file, so make sure a damaged
+       cache file can't point outside of it */
+    const void *I = map + SUFFIX_CACHE_HEADER_SIZE;
+    int wide = (indexsize == sizeof(off_t));
+    valid = valid && (suffixat(I, wide, 0) == oldsize);
+    for (off_t i = 1; valid && i <= oldsize; i++) {
+        off_t index = suffixat(I, wide, i);
+        valid = (index >= 0) && (index < oldsize);
+    }
+
+    if (!valid) {
+        unmapfile(mapping, size);
+        return NULL;
+    }
+
+    /* Mark the cache file as recently used so callers can evict the least
+       recently used files first */
+    utimes(path, NULL);
+
+    *outsize = size;
+    return mapping;
+}
+
+/* storesuffixcache(path, I, oldsize, indexsize)
+ *
+ * Writes the suffix sort 'I' of an old file of 'oldsize' bytes to the cache
+ * file at 'path'. The file is written under a temporary name and then renamed
+ * so that concurrent readers never see a partially written file. Failing to
+ * write the cache isn't an error. */
+static void storesuffixcache(const char *path, const void *I, off_t oldsize, size_t indexsize)
+{
+    u_char header[SUFFIX_CACHE_HEADER_SIZE] = {0};
+    uint64_t cachedindexsize = indexsize;
+    memcpy(header, SUFFIX_CACHE_MAGIC, 8);
+    memcpy(header + 8, &oldsize, sizeof(oldsize));
+    memcpy(header + 16, &cachedindexsize, sizeof(cachedindexsize));
+
+    size_t temppathsize = strlen(path) + sizeof(".XXXXXX");
+    char *temppath = malloc(temppathsize);
+    if (temppath == NULL) {
+        return;
+    }
+    snprintf(temppath, temppathsize, "%s.XXXXXX", path);
+
+    int fd = mkstemp(temppath);
+    FILE *file = (fd != -1) ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        if (fd != -1) {
+            close(fd);
+            unlink(temppath);
+        }
+        free(temppath);
+        return;
+    }
+
+    int written = (writebuffer(file, header, sizeof(header)) == 0) &&
+        (writebuffer(file, I, ((size_t)oldsize + 1) * indexsize) == 0);
+    if ((fclose(file) != 0) || !written || (rename(temppath, path) != 0)) {
+        unlink(temppath);
+    }
+    free(temppath);
+}
+
+int bsdiff_buffers(const unsigned char *old, off_t oldsize, const unsigned char *new, off_t newsize, const struct bsdiff_options *options, const struct bsdiff_sink *sink)
+{
+    void *I = NULL;                     /* suffix sort of the old file, if it's computed here */
+    const void *suffixes = NULL;        /* suffix sort of the old file, either I or from the cache */
+    void *cachemap = NULL;              /* mapped suffix sort cache file */
+    off_t cachemapsize = 0;
+    struct anchorindex index;           /* anchors of the old file, when using the hash engine */
+    int wide = 0;                       /* whether I holds off_t or int32_t entries */
+    size_t indexsize = 0;               /* size of each entry in I */
+    off_t ctrllen = 0, dblen = 0;       /* length of ctrl, diff blocks */
+    u_char *db = NULL,*eb = NULL;             /* contents of diff, extra sections */
+    struct scanrange *ranges = NULL;    /* ranges of the new file that are scanned independently */
+    struct scancontext *contexts = NULL;
+    int rangecount = 1;
+    u_char header[32] = {0};
+    int suffix_sort_threads = (options != NULL) ? options->suffix_sort_threads : 1;
+    int scan_threads = (options != NULL) ? options->scan_threads : 1;
+    const char *suffix_sort_cache = (options != NULL) ? options->suffix_sort_cache : NULL;
+    enum bsdiff_engine engine = (options != NULL) ? options->engine : BSDIFF_ENGINE_SUFFIX_SORT;
+    int varint_control = (options != NULL) ? options->varint_control : 0;
+    int exitstatus = -1;
+
+    index.slots = NULL;
+    wide = (oldsize >= MAX_SIZE_FOR_32BIT_INDEXES);
+    indexsize = wide ? sizeof(off_t) : sizeof(int32_t);
+
+    if (engine == BSDIFF_ENGINE_SUFFIX_SORT && suffix_sort_cache != NULL) {
+        cachemap = loadsuffixcache(suffix_sort_cache, oldsize, indexsize, &cachemapsize);
+    }
+
+    if (engine == BSDIFF_ENGINE_HASH) {
+        if (buildanchorindex(old, oldsize, &index) != 0) {
+            goto cleanup;
+        }
+    } else if (cachemap != NULL) {
+        suffixes = (const u_char *)cachemap + SUFFIX_CACHE_HEADER_SIZE;
+    } else {
+        if ((I = sortsuffixes(old, oldsize, wide, suffix_sort_threads)) == NULL) {
+            goto cleanup;
+        }
+        suffixes = I;
+
+        if (suffix_sort_cache != NULL) {
+            storesuffixcache(suffix_sort_cache, I, oldsize, indexsize);
+        }
+    }
+
+    if (((db = malloc((size_t)newsize + 1)) == NULL) ||
+        ((eb = malloc((size_t)newsize + 1)) == NULL)) {
+        warn("Failed to allocate memory for db or eb");
+        goto cleanup;
+    }
+
+    /* Split the new file into ranges that are scanned in parallel. Matches
+       can't span ranges, so ranges are kept large to limit the effect on the
+       size of the patch. */
+    if (scan_threads > 1 && newsize / MIN_SCAN_RANGE_SIZE > 1) {
+        rangecount = (newsize / MIN_SCAN_RANGE_SIZE < scan_threads) ? (int)(newsize / MIN_SCAN_RANGE_SIZE) : scan_threads;
+    }
+
+    if (((ranges = calloc((size_t)rangecount, sizeof(*ranges))) == NULL) ||
+        ((contexts = calloc((size_t)rangecount, sizeof(*contexts))) == NULL)) {
+        warn("Failed to allocate memory for scanning");
+        goto cleanup;
+    }
+
+    for (int r = 0; r < rangecount; r++) {
+        struct scanrange *range = &ranges[r];
+        range->start = newsize * r / rangecount;
+        range->length = newsize * (r + 1) / rangecount - range->start;
+        /* Data tends to be at similar offsets in both files, so start each
+           range at the matching position in the old file */
+        range->oldstart = MIN(range->start, oldsize);
+        range->db = db + range->start;
+        range->eb = eb + range->start;
+
+        contexts[r].simd = bssimd_best();
+        contexts[r].I = suffixes;
+        contexts[r].wide = wide;
+        contexts[r].index = (engine == BSDIFF_ENGINE_HASH) ? &index : NULL;
+        contexts[r].old = old;
+        contexts[r].oldsize = oldsize;
+        contexts[r].new = new;
+        contexts[r].range = range;
+    }
+
+    /* The first range is scanned on this thread. If a thread can't be
+       created its range is scanned here afterwards instead. */
+    for (int r = 1; r < rangecount; r++) {
+        contexts[r].threadcreated = (pthread_create(&contexts[r].thread, NULL, diffrangethread, &contexts[r]) == 0);
+    }
+    diffrangethread(&contexts[0]);
+    for (int r = 1; r < rangecount; r++) {
+        if (contexts[r].threadcreated) {
+            pthread_join(contexts[r].thread, NULL);
+        } else {
+            diffrangethread(&contexts[r]);
+        }
+    }
+
+    for (int r = 0; r < rangecount; r++) {
+        if (ranges[r].exitstatus != 0) {
+            goto cleanup;
+        }
+        dblen += ranges[r].dblen;
+    }
+    ctrllen = ctrlsize(ranges, rangecount, varint_control);
+
+    /* Header is
+        0    8     "BSDIFN40", or "BSDIFV40" with a varint ctrl block
+        8    8    length of ctrl block
+        16    8    length of diff block
+        24    8    length of new file */
+    /* File is
+        0    32    Header
+        32    ??    ctrl block
+        ??    ??    diff block
+        ??    ??    extra block */
+    memcpy(header, varint_control ? "BSDIFV40" : "BSDIFN40", 8);
+    offtout(ctrllen, header + 8);
+    offtout(dblen, header + 16);
+    offtout(newsize, header + 24);
+    if (sink->write(sink->context, header, 32) != 0) {
+        warnx("Failed to write patch header");
+        goto cleanup;
+    }
+
+    /* Write ctrl data */
+    if (writectrl(sink, ranges, rangecount, varint_control) != 0) {
+        warnx("Failed to write ctrl data");
+        goto cleanup;
+    }
+
+    /* Write diff data */
+    for (int r = 0; r < rangecount; r++) {
+        if (sink->write(sink->context, ranges[r].db, (size_t)ranges[r].dblen) != 0) {
+            warnx("Failed to write diff data");
+            goto cleanup;
+        }
+    }
+
+    /* Write extra data */
+    for (int r = 0; r < rangecount; r++) {
+        if (sink->write(sink->context, ranges[r].eb, (size_t)ranges[r].eblen) != 0) {
+            warnx("Failed to write extra data");
+            goto cleanup;
+        }
+    }
+
+    exitstatus = 0;
+cleanup:
+
     /* Free the memory we used */
+    if (ranges != NULL) {
+        for (int r = 0; r < rangecount; r++) {
+            free(ranges[r].ctrl);
+        }
+    }
+    free(ranges);
+    free(contexts);
     free(db);
     free(eb);
     free(I);
-    free(V);
-    free(old);
-    free(new);
+    free(index.slots);
+    if (cachemap != NULL) {
+        unmapfile(cachemap, cachemapsize);
+    }
 
     return exitstatus;
 }
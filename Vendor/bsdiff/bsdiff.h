@@ -0,0 +1,95 @@
+/*
+ *  bsdiff.h
+ *  Sparkle
+ *
+ *  Options for creating binary patches.
+ */
+
+#ifndef BSDIFF_H
+#define BSDIFF_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* How matches between the old and new files are found */
+enum bsdiff_engine
+{
+    /* Sorts the suffixes of the old file so the longest match at every
+       position of the new file can be found. Produces the smallest patches
+       but takes several times the size of the old file in memory and is slow
+       for large files. */
+    BSDIFF_ENGINE_SUFFIX_SORT = 0,
+
+    /* Hashes anchors spread through the old file and looks up the anchors of
+       the new file in them, in the style of rsync. Much faster and takes a
+       small fraction of the memory, but misses matches shorter than about
+       100 bytes, so patches get larger. Meant for large files that are mostly
+       unchanged. */
+    BSDIFF_ENGINE_HASH
+};
+
+struct bsdiff_options
+{
+    /* Number of threads used for sorting the suffixes of the old file.
+       Values of 0 or 1 sort on the calling thread using sais. */
+    int suffix_sort_threads;
+
+    /* Number of threads used for scanning the new file for differences.
+       The new file is split into this many ranges of at least 1 MiB that
+       are scanned independently. Matches can't span ranges, so using more
+       ranges trades a slightly larger patch for speed. Values of 0 or 1 scan
+       the whole file at once. */
+    int scan_threads;
+
+    /* Path of a file caching the suffix sort of the old file, or NULL. If the
+       file exists and holds a suffix sort for a file of the same size, the
+       suffix sort is mapped from it instead of being computed. Otherwise the
+       suffix sort is computed and written to it. The cache file doesn't record
+       what the old file contained, so callers must use a different path for
+       every distinct old file, for instance by naming it after a hash of its
+       contents. */
+    const char *suffix_sort_cache;
+
+    /* Engine used for finding matches. The suffix sort options are ignored by
+       the hash engine. Either engine's patches are applied the same way. */
+    enum bsdiff_engine engine;
+
+    /* Whether to write the BSDIFV40 format, which stores the control block as
+       varints instead of 8 bytes per value. Patches with many small matches
+       get noticeably smaller, but versions of bspatch that predate the format
+       can't apply them. */
+    int varint_control;
+};
+
+/* bsdiff_files(oldfile, newfile, patchfile, options)
+ *
+ * Creates a BSDIFN40 or BSDIFV40 patch at 'patchfile' that transforms
+ * 'oldfile' into 'newfile'. 'options' may be NULL to use the defaults. The
+ * patch produced only depends on 'scan_threads', 'engine' and
+ * 'varint_control' out of the options passed.
+ *
+ * Returns 0 on success and -1 on failure. */
+int bsdiff_files(const char *oldfile, const char *newfile, const char *patchfile, const struct bsdiff_options *options);
+
+/* Receives a patch in order as it's created. 'write' returns 0 on success and
+   -1 on failure. */
+struct bsdiff_sink
+{
+    void *context;
+    int (*write)(void *context, const void *buffer, size_t size);
+};
+
+/* bsdiff_buffers(old, oldsize, new, newsize, options, sink)
+ *
+ * Same as bsdiff_files() but diffs the 'oldsize' bytes at 'old' against the
+ * 'newsize' bytes at 'new' and writes the patch to 'sink' from start to end,
+ * so neither the files nor the patch need to be stored on disk.
+ *
+ * Returns 0 on success and -1 on failure. */
+int bsdiff_buffers(const unsigned char *old, off_t oldsize, const unsigned char *new, off_t newsize, const struct bsdiff_options *options, const struct bsdiff_sink *sink);
+
+// So that we can use this method in SUBinaryDeltaCreate.m.
+// Silences the GCC warning that the prototype doesn't exist.
+int bsdiff(int argc, const char * const argv[]);
+
+#endif
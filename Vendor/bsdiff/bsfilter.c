@@ -0,0 +1,478 @@
+/*
+ *  bsfilter.c
+ *  Sparkle
+ *
+ *  Branch filter for executables.
+ *
+ *  x86_64 call and jmp instructions with 32-bit displacements have their
+ *  displacements turned into absolute targets, much like the BCJ filter used
+ *  by xz. Only displacements within 16 MiB are converted, and converted
+ *  targets are wrapped to that range, so the decoder can tell which
+ *  instructions were converted without knowing their original operands.
+ *
+ *  arm64 instructions are always 4 bytes, so the b, bl and adrp instructions
+ *  are found exactly and their immediates are turned into absolute targets
+ *  modulo the size of the immediate.
+ */
+
+#include "bsfilter.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MH_MAGIC_64 0xfeedfacfU
+#define FAT_MAGIC 0xcafebabeU
+#define FAT_MAGIC_64 0xcafebabfU
+#define CPU_TYPE_X86_64 0x01000007U
+#define CPU_TYPE_ARM64 0x0100000cU
+#define LC_SEGMENT_64 0x19U
+#define S_ZEROFILL 0x1U
+#define S_ATTR_PURE_INSTRUCTIONS 0x80000000U
+
+#define MACH_HEADER_64_SIZE 32
+#define SEGMENT_COMMAND_64_SIZE 72
+#define SECTION_64_SIZE 80
+#define FAT_HEADER_SIZE 8
+#define FAT_ARCH_SIZE 20
+#define FAT_ARCH_64_SIZE 32
+
+#define ELF_HEADER_64_SIZE 64
+#define ELF_SECTION_HEADER_64_SIZE 64
+#define EM_X86_64 62
+#define EM_AARCH64 183
+#define SHT_PROGBITS 1
+#define SHF_EXECINSTR 0x4U
+
+/* Universal files don't have more slices than this in practice. The limit also
+   stops Java class files, which share the universal file magic, from being
+   scanned for thousands of slices. */
+#define MAX_FAT_ARCHS 64
+
+enum codearch
+{
+    CODE_X86_64,
+    CODE_ARM64
+};
+
+struct codesection
+{
+    enum codearch arch;
+    off_t offset;
+    off_t size;
+    uint64_t address;
+};
+
+struct headerrange
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct codesections
+{
+    struct codesection *sections;
+    size_t count;
+    size_t capacity;
+
+    /* Headers the code sections were found from. Code overlapping any of them
+       is left alone, so the decoder finds the same code sections. */
+    struct headerrange *headers;
+    size_t headercount;
+    size_t headercapacity;
+};
+
+static uint16_t readle16(const u_char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t readle32(const u_char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t readle64(const u_char *p)
+{
+    return (uint64_t)readle32(p) | ((uint64_t)readle32(p + 4) << 32);
+}
+
+static uint32_t readbe32(const u_char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t readbe64(const u_char *p)
+{
+    return ((uint64_t)readbe32(p) << 32) | (uint64_t)readbe32(p + 4);
+}
+
+static void writele32(u_char *p, uint32_t value)
+{
+    p[0] = (u_char)value;
+    p[1] = (u_char)(value >> 8);
+    p[2] = (u_char)(value >> 16);
+    p[3] = (u_char)(value >> 24);
+}
+
+/* Returns whether [offset, offset + length) lies within [0, size) */
+static int inbounds(uint64_t offset, uint64_t length, off_t size)
+{
+    return offset <= (uint64_t)size && length <= (uint64_t)size - offset;
+}
+
+/* Returns whether [offset1, offset1 + length1) and [offset2, offset2 + length2) overlap */
+static int overlaps(uint64_t offset1, uint64_t length1, uint64_t offset2, uint64_t length2)
+{
+    return offset1 < offset2 + length2 && offset2 < offset1 + length1;
+}
+
+/* Makes room for one more item in the array at '*items'. Returns 0 on success and -1 on failure. */
+static int reserveitem(void **items, size_t count, size_t *capacity, size_t itemsize)
+{
+    if (count < *capacity) {
+        return 0;
+    }
+
+    size_t newcapacity = (*capacity == 0) ? 16 : *capacity * 2;
+    void *newitems = realloc(*items, newcapacity * itemsize);
+    if (newitems == NULL) {
+        return -1;
+    }
+    *items = newitems;
+    *capacity = newcapacity;
+    return 0;
+}
+
+static int addheader(struct codesections *list, uint64_t offset, uint64_t size)
+{
+    if (reserveitem((void **)&list->headers, list->headercount, &list->headercapacity, sizeof(*list->headers)) != 0) {
+        return -1;
+    }
+
+    struct headerrange *header = &list->headers[list->headercount++];
+    header->offset = offset;
+    header->size = size;
+    return 0;
+}
+
+static int addsection(struct codesections *list, enum codearch arch, off_t offset, off_t size, uint64_t address)
+{
+    if (size <= 0) {
+        return 0;
+    }
+
+    if (reserveitem((void **)&list->sections, list->count, &list->capacity, sizeof(*list->sections)) != 0) {
+        return -1;
+    }
+
+    struct codesection *section = &list->sections[list->count++];
+    section->arch = arch;
+    section->offset = offset;
+    section->size = size;
+    section->address = address;
+    return 0;
+}
+
+/* Finds the code sections of the 64-bit Mach-O file at [base, base + size) */
+static int findmachosections(const u_char *buffer, off_t base, off_t size, struct codesections *list)
+{
+    if (size < MACH_HEADER_64_SIZE) {
+        return 0;
+    }
+
+    // Other slices mustn't change this header even if it turns out not to be supported
+    if (addheader(list, (uint64_t)base, MACH_HEADER_64_SIZE) != 0) {
+        return -1;
+    }
+
+    const u_char *header = buffer + base;
+    if (readle32(header) != MH_MAGIC_64) {
+        return 0;
+    }
+
+    enum codearch arch;
+    uint32_t cputype = readle32(header + 4);
+    if (cputype == CPU_TYPE_X86_64) {
+        arch = CODE_X86_64;
+    } else if (cputype == CPU_TYPE_ARM64) {
+        arch = CODE_ARM64;
+    } else {
+        return 0;
+    }
+
+    uint32_t ncmds = readle32(header + 16);
+    uint64_t commandsend = MACH_HEADER_64_SIZE + (uint64_t)readle32(header + 20);
+    if (!inbounds(0, commandsend, size)) {
+        return 0;
+    }
+
+    if (addheader(list, (uint64_t)base, commandsend) != 0) {
+        return -1;
+    }
+
+    uint64_t commandoffset = MACH_HEADER_64_SIZE;
+    for (uint32_t commandindex = 0; commandindex < ncmds; commandindex++) {
+        if (commandoffset + 8 > commandsend) {
+            break;
+        }
+
+        const u_char *command = header + commandoffset;
+        uint32_t cmd = readle32(command);
+        uint32_t cmdsize = readle32(command + 4);
+        if (cmdsize < 8 || cmdsize > commandsend - commandoffset) {
+            break;
+        }
+
+        if (cmd == LC_SEGMENT_64 && cmdsize >= SEGMENT_COMMAND_64_SIZE) {
+            uint32_t nsects = readle32(command + 64);
+            if ((uint64_t)nsects * SECTION_64_SIZE > cmdsize - SEGMENT_COMMAND_64_SIZE) {
+                break;
+            }
+
+            for (uint32_t sectionindex = 0; sectionindex < nsects; sectionindex++) {
+                const u_char *section = command + SEGMENT_COMMAND_64_SIZE + (uint64_t)sectionindex * SECTION_64_SIZE;
+                uint64_t address = readle64(section + 32);
+                uint64_t sectionsize = readle64(section + 40);
+                uint64_t sectionoffset = readle32(section + 48);
+                uint32_t flags = readle32(section + 64);
+
+                if ((flags & S_ATTR_PURE_INSTRUCTIONS) == 0 || (flags & 0xff) == S_ZEROFILL) {
+                    continue;
+                }
+
+                if (!inbounds(sectionoffset, sectionsize, size)) {
+                    continue;
+                }
+
+                if (addsection(list, arch, base + (off_t)sectionoffset, (off_t)sectionsize, address) != 0) {
+                    return -1;
+                }
+            }
+        }
+
+        commandoffset += cmdsize;
+    }
+
+    return 0;
+}
+
+/* Finds the code sections of every slice of the universal file in 'buffer' */
+static int findfatsections(const u_char *buffer, off_t size, struct codesections *list)
+{
+    uint32_t magic = readbe32(buffer);
+    uint64_t archsize = (magic == FAT_MAGIC_64) ? FAT_ARCH_64_SIZE : FAT_ARCH_SIZE;
+    uint32_t narchs = readbe32(buffer + 4);
+    if (narchs == 0 || narchs > MAX_FAT_ARCHS) {
+        return 0;
+    }
+
+    uint64_t headerend = FAT_HEADER_SIZE + narchs * archsize;
+    if (!inbounds(0, headerend, size)) {
+        return 0;
+    }
+
+    if (addheader(list, 0, headerend) != 0) {
+        return -1;
+    }
+
+    for (uint32_t archindex = 0; archindex < narchs; archindex++) {
+        const u_char *fatarch = buffer + FAT_HEADER_SIZE + archindex * archsize;
+
+        uint64_t sliceoffset;
+        uint64_t slicesize;
+        if (magic == FAT_MAGIC_64) {
+            sliceoffset = readbe64(fatarch + 8);
+            slicesize = readbe64(fatarch + 16);
+        } else {
+            sliceoffset = readbe32(fatarch + 8);
+            slicesize = readbe32(fatarch + 12);
+        }
+
+        if (sliceoffset < headerend || !inbounds(sliceoffset, slicesize, size)) {
+            continue;
+        }
+
+        if (findmachosections(buffer, (off_t)sliceoffset, (off_t)slicesize, list) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Finds the code sections of the little endian 64-bit ELF file in 'buffer' */
+static int findelfsections(const u_char *buffer, off_t size, struct codesections *list)
+{
+    if (size < ELF_HEADER_64_SIZE || buffer[4] != 2 || buffer[5] != 1) {
+        return 0;
+    }
+
+    enum codearch arch;
+    uint16_t machine = readle16(buffer + 18);
+    if (machine == EM_X86_64) {
+        arch = CODE_X86_64;
+    } else if (machine == EM_AARCH64) {
+        arch = CODE_ARM64;
+    } else {
+        return 0;
+    }
+
+    uint64_t sectionheadersoffset = readle64(buffer + 40);
+    uint16_t sectionheadersize = readle16(buffer + 58);
+    uint16_t sectioncount = readle16(buffer + 60);
+    uint64_t sectionheaderssize = (uint64_t)sectionheadersize * sectioncount;
+
+    if (sectionheadersize < ELF_SECTION_HEADER_64_SIZE || !inbounds(sectionheadersoffset, sectionheaderssize, size)) {
+        return 0;
+    }
+
+    if (addheader(list, 0, ELF_HEADER_64_SIZE) != 0 || addheader(list, sectionheadersoffset, sectionheaderssize) != 0) {
+        return -1;
+    }
+
+    for (uint16_t sectionindex = 0; sectionindex < sectioncount; sectionindex++) {
+        const u_char *sectionheader = buffer + sectionheadersoffset + (uint64_t)sectionindex * sectionheadersize;
+        uint32_t type = readle32(sectionheader + 4);
+        uint64_t flags = readle64(sectionheader + 8);
+        uint64_t address = readle64(sectionheader + 16);
+        uint64_t sectionoffset = readle64(sectionheader + 24);
+        uint64_t sectionsize = readle64(sectionheader + 32);
+
+        if (type != SHT_PROGBITS || (flags & SHF_EXECINSTR) == 0 || !inbounds(sectionoffset, sectionsize, size)) {
+            continue;
+        }
+
+        if (addsection(list, arch, (off_t)sectionoffset, (off_t)sectionsize, address) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int findcodesections(const u_char *buffer, off_t size, struct codesections *list)
+{
+    if (size < 8) {
+        return 0;
+    }
+
+    uint32_t bigendianmagic = readbe32(buffer);
+    if (bigendianmagic == FAT_MAGIC || bigendianmagic == FAT_MAGIC_64) {
+        return findfatsections(buffer, size, list);
+    } else if (readle32(buffer) == MH_MAGIC_64) {
+        return findmachosections(buffer, 0, size, list);
+    } else if (memcmp(buffer, "\177ELF", 4) == 0) {
+        return findelfsections(buffer, size, list);
+    }
+    return 0;
+}
+
+static void filterx86_64(u_char *code, off_t size, uint64_t address, int encode)
+{
+    // An opcode that isn't converted looks at bytes that may belong to the
+    // operand of an opcode up to 3 bytes later, which would differ between the
+    // encoder and decoder if that opcode got converted
+    off_t lastunconverted = -4;
+
+    off_t i = 0;
+    while (i + 5 <= size) {
+        if ((code[i] & 0xfe) != 0xe8) {
+            i++;
+            continue;
+        }
+
+        // call and jmp with a 32-bit displacement whose top byte is a sign extension
+        if ((code[i + 4] == 0x00 || code[i + 4] == 0xff) && i - lastunconverted > 3) {
+            uint32_t displacement = readle32(code + i + 1);
+            uint32_t position = (uint32_t)(address + (uint64_t)i + 5);
+            uint32_t target = encode ? displacement + position : displacement - position;
+
+            // Wrap the result so its top byte is a sign extension too
+            target &= 0x01ffffff;
+            if ((target & 0x01000000) != 0) {
+                target |= 0xfe000000;
+            }
+
+            writele32(code + i + 1, target);
+            i += 5;
+        } else {
+            lastunconverted = i;
+            i++;
+        }
+    }
+}
+
+static void filterarm64(u_char *code, off_t size, uint64_t address, int encode)
+{
+    for (off_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t instruction = readle32(code + i);
+        uint64_t position = address + (uint64_t)i;
+
+        if ((instruction & 0x7c000000) == 0x14000000) {
+            // b and bl, which hold a 26-bit word displacement
+            uint32_t pc = (uint32_t)(position >> 2);
+            uint32_t target = encode ? instruction + pc : instruction - pc;
+            instruction = (instruction & 0xfc000000) | (target & 0x03ffffff);
+        } else if ((instruction & 0x9f000000) == 0x90000000) {
+            // adrp, which holds a 21-bit page displacement split into two fields
+            uint32_t pages = ((instruction >> 29) & 0x3) | (((instruction >> 5) & 0x7ffff) << 2);
+            uint32_t page = (uint32_t)(position >> 12);
+            uint32_t target = (encode ? pages + page : pages - page) & 0x1fffff;
+            instruction = (instruction & 0x9f00001f) | ((target & 0x3) << 29) | ((target >> 2) << 5);
+        } else {
+            continue;
+        }
+
+        writele32(code + i, instruction);
+    }
+}
+
+/* Returns whether the code section overlaps any of the headers in 'list' */
+static int overlapsheader(const struct codesections *list, const struct codesection *section)
+{
+    for (size_t index = 0; index < list->headercount; index++) {
+        const struct headerrange *header = &list->headers[index];
+        if (overlaps((uint64_t)section->offset, (uint64_t)section->size, header->offset, header->size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int filterbranches(u_char *buffer, off_t size, int encode)
+{
+    struct codesections list = {NULL, 0, 0, NULL, 0, 0};
+    int result = findcodesections(buffer, size, &list);
+    if (result == 0) {
+        // Sections may overlap in malformed files, so decode them in reverse order
+        for (size_t index = 0; index < list.count; index++) {
+            struct codesection *section = &list.sections[encode ? index : list.count - 1 - index];
+            if (overlapsheader(&list, section)) {
+                continue;
+            }
+
+            u_char *code = buffer + section->offset;
+            if (section->arch == CODE_X86_64) {
+                filterx86_64(code, section->size, section->address, encode);
+            } else {
+                filterarm64(code, section->size, section->address, encode);
+            }
+            result = 1;
+        }
+    }
+
+    free(list.sections);
+    free(list.headers);
+    return result;
+}
+
+int bsfilter_encode_branches(u_char *buffer, off_t size)
+{
+    return filterbranches(buffer, size, 1);
+}
+
+int bsfilter_decode_branches(u_char *buffer, off_t size)
+{
+    return filterbranches(buffer, size, 0);
+}
@@ -0,0 +1,39 @@
+/*
+ *  bsfilter.h
+ *  Sparkle
+ *
+ *  Branch filter for executables.
+ */
+
+#ifndef BSFILTER_H
+#define BSFILTER_H
+
+#include <sys/types.h>
+
+/* Calls and branches in machine code store their targets relative to their
+   own address, so inserting code shifts the operands of every branch that
+   spans the insertion even though their targets are the same. The branch
+   filter rewrites these operands into absolute targets in the code sections
+   of x86_64 and arm64 Mach-O (including universal) and ELF files, so the
+   files being diffed differ in fewer places.
+
+   The filter only changes bytes inside code sections, so the same sections
+   are found before and after filtering and bsfilter_decode_branches() undoes
+   bsfilter_encode_branches() exactly. */
+
+/* bsfilter_encode_branches(buffer, size)
+ *
+ * Filters the executable in the 'size' bytes at 'buffer' in place.
+ *
+ * Returns 1 if the buffer was filtered, 0 if it isn't an executable with code
+ * the filter supports and was left unchanged, and -1 on failure. */
+int bsfilter_encode_branches(u_char *buffer, off_t size);
+
+/* bsfilter_decode_branches(buffer, size)
+ *
+ * Reverses bsfilter_encode_branches() in place.
+ *
+ * Returns the same values as bsfilter_encode_branches(). */
+int bsfilter_decode_branches(u_char *buffer, off_t size);
+
+#endif
@@ -32,12 +32,260 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:
 #include <bzlib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "bscommon.h"
+#include "bssimd.h"
+
+/* Size of the buffer the new file is produced in. The new file is written out
+   as it's patched so memory use doesn't depend on its size. */
+#define BSPATCH_BUFFER_SIZE (256 * 1024)
+
+/* Size of the buffer compressed BSDIFF40 sections are decompressed from */
+#define BZIP2_INPUT_BUFFER_SIZE (64 * 1024)
+
+/* Size of the buffer each section of a patch file is read into. The buffers
+   are page aligned and large so that few reads are needed. */
+#define PATCH_READ_BUFFER_SIZE (512 * 1024)
+#define PATCH_READ_BUFFER_ALIGNMENT 4096
+
+/* Number of control triples read and decoded at once */
+#define CTRL_READ_BATCH_SIZE 512
+
+/* Runs of zeros shorter than this are kept inside the surrounding literal
+   bytes when a diff block is stored as zero runs */
+#define MIN_ZERO_RUN_LENGTH 16
+
+#ifndef u_char
+typedef unsigned char u_char;
+#endif
+
+#ifndef MIN
+#define MIN(x, y) (((x)<(y)) ? (x) : (y))
+#endif
+
+/* A position in a patch file that's read from with pread() through a buffer.
+   All sections of a patch file share the same file descriptor. */
+typedef struct
+{
+    int fd;
+    off_t offset;           /* offset in the file of the next byte to buffer */
+    u_char *buffer;         /* PATCH_READ_BUFFER_SIZE bytes */
+    size_t bufferpos, bufferlen;
+} patchfile_t;
+
+/* Where the bytes of one section of the patch are read from. Exactly one of
+   'file', 'source' or 'buffer' is set. 'length' is the number of bytes left
+   in the section, or -1 if the section runs until the end of the patch.
+   If 'zeroruns' is set, 'buffer' holds the section encoded as zero runs. */
+typedef struct
+{
+    patchfile_t *file;
+    const struct bspatch_source *source;
+    const u_char *buffer;
+    off_t length;
+    int zeroruns;
+    off_t zeros, literals;  /* bytes left in the current zero run and literal run */
+} input_t;
+
+/* A raw diff block is mostly zeros, since it holds the differences between
+   matching bytes of the old and new file. When it has to be kept in memory
+   it's stored as a series of runs, each being the varint length of a run of
+   zeros, the varint length of a run of literal bytes, and the literal bytes.
+   Memory use then scales with how much of the file actually changed. */
+typedef struct
+{
+    u_char *bytes;
+    size_t length, capacity;
+} zeroruns_t;
+
+static int zeroruns_append(zeroruns_t *runs, const u_char *bytes, size_t length)
+{
+    if (runs->length + length > runs->capacity) {
+        size_t newcapacity = (runs->capacity > 0) ? runs->capacity : BSPATCH_BUFFER_SIZE;
+        while (runs->length + length > newcapacity) {
+            newcapacity *= 2;
+        }
+
+        u_char *newbytes = realloc(runs->bytes, newcapacity);
+        if (newbytes == NULL) {
+            return -1;
+        }
+        runs->bytes = newbytes;
+        runs->capacity = newcapacity;
+    }
+
+    memcpy(runs->bytes + runs->length, bytes, length);
+    runs->length += length;
+    return 0;
+}
+
+static int zeroruns_appendvarint(zeroruns_t *runs, size_t value)
+{
+    u_char buf[10] = {0};
+    size_t buflen = 0;
+
+    do {
+        buf[buflen] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            buf[buflen] |= 0x80;
+        }
+        buflen++;
+    } while (value != 0);
+
+    return zeroruns_append(runs, buf, buflen);
+}
+
+static size_t zeroruns_readvarint(const u_char **bytes)
+{
+    size_t value = 0;
+    int shift = 0;
+    u_char byte;
+
+    do {
+        byte = *(*bytes)++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+/* Appends 'length' bytes of a diff block to 'runs'. Returns 0 on success and
+   -1 if memory could not be allocated. */
+static int zeroruns_encode(zeroruns_t *runs, const u_char *bytes, size_t length)
+{
+    size_t i = 0;
+
+    while (i < length) {
+        size_t zerostart = i;
+        while (i < length && bytes[i] == 0) {
+            i++;
+        }
+
+        /* Literal bytes run until the next long enough run of zeros */
+        size_t literalstart = i, literalend = i, zerorun = 0;
+        for (; i < length && zerorun < MIN_ZERO_RUN_LENGTH; i++) {
+            if (bytes[i] == 0) {
+                zerorun++;
+            } else {
+                zerorun = 0;
+                literalend = i + 1;
+            }
+        }
+
+        if (zeroruns_appendvarint(runs, literalstart - zerostart) != 0 ||
+            zeroruns_appendvarint(runs, literalend - literalstart) != 0 ||
+            zeroruns_append(runs, bytes + literalstart, literalend - literalstart) != 0) {
+            return -1;
+        }
+
+        i = literalend;
+    }
+
+    return 0;
+}
+
+/* Reads up to 'len' bytes of a section. Returns the number of bytes read,
+   which is less than 'len' only at the end of the section, or -1 on failure. */
+static off_t input_read(input_t *input, void *buf, off_t len)
+{
+    off_t lenread = 0;
+
+    if (input->length >= 0 && len > input->length) {
+        len = input->length;
+    }
+
+    if (input->file != NULL) {
+        patchfile_t *file = input->file;
+        while (lenread < len) {
+            size_t bufferedlen = file->bufferlen - file->bufferpos;
+            if (bufferedlen == 0) {
+                /* Large reads skip the buffer and go straight to 'buf' */
+                int direct = (len - lenread >= PATCH_READ_BUFFER_SIZE);
+                u_char *readbuf = direct ? (u_char *)buf + lenread : file->buffer;
+                off_t readlen = direct ? len - lenread : PATCH_READ_BUFFER_SIZE;
+                /* Don't read past the end of the section */
+                if (!direct && input->length >= 0) {
+                    readlen = MIN(readlen, input->length - lenread);
+                }
+
+                ssize_t fileread;
+                do {
+                    fileread = pread(file->fd, readbuf, (size_t)readlen, file->offset);
+                } while (fileread < 0 && errno == EINTR);
+                if (fileread < 0) {
+                    warn("pread");
+                    return -1;
+                }
+                if (fileread == 0) {
+                    break;
+                }
+
+                file->offset += fileread;
+                if (direct) {
+                    lenread += fileread;
+                    continue;
+                }
+
+                file->bufferpos = 0;
+                file->bufferlen = (size_t)fileread;
+                bufferedlen = (size_t)fileread;
+            }
+
+            size_t copylen = MIN(bufferedlen, (size_t)(len - lenread));
+            memcpy((u_char *)buf + lenread, file->buffer + file->bufferpos, copylen);
+            file->bufferpos += copylen;
+            lenread += (off_t)copylen;
+        }
+    } else if (input->source != NULL) {
+        while (lenread < len) {
+            ssize_t sourceread = input->source->read(input->source->context, (u_char *)buf + lenread, (size_t)(len - lenread));
+            if (sourceread < 0) {
+                warnx("Failed to read patch\n");
+                return -1;
+            }
+            if (sourceread == 0) {
+                break;
+            }
+            lenread += sourceread;
+        }
+    } else if (input->zeroruns) {
+        while (lenread < len) {
+            off_t runlen = 0;
+            if (input->zeros > 0) {
+                runlen = MIN(input->zeros, len - lenread);
+                memset((u_char *)buf + lenread, 0, (size_t)runlen);
+                input->zeros -= runlen;
+            } else if (input->literals > 0) {
+                runlen = MIN(input->literals, len - lenread);
+                memcpy((u_char *)buf + lenread, input->buffer, (size_t)runlen);
+                input->buffer += runlen;
+                input->literals -= runlen;
+            } else {
+                input->zeros = (off_t)zeroruns_readvarint(&input->buffer);
+                input->literals = (off_t)zeroruns_readvarint(&input->buffer);
+            }
+            lenread += runlen;
+        }
+    } else if (len > 0) {
+        memcpy(buf, input->buffer, (size_t)len);
+        input->buffer += len;
+        lenread = len;
+    }
+
+    if (input->length >= 0) {
+        input->length -= lenread;
+    }
+
+    return lenread;
+}
 
 /* Compatibility layer for reading either the old BSDIFF40 or the new BSDIFN40
    patch formats: */
@@ -46,36 +294,73 @@ typedef void* stream_t;
 
 typedef struct
 {
-    stream_t (*open)(FILE*);
+    stream_t (*open)(input_t*);
     void (*close)(stream_t);
     off_t (*read)(stream_t, void*, off_t);
 } io_funcs_t;
 
-static stream_t BSDIFF40_open(FILE *f)
+typedef struct
+{
+    input_t *input;
+    bz_stream bz;
+    int ended;
+    char buffer[BZIP2_INPUT_BUFFER_SIZE];
+} bzip2_stream_t;
+
+static stream_t BSDIFF40_open(input_t *input)
 {
-    int bzerr = 0;
-    BZFILE *s = NULL;
-    if ((s = BZ2_bzReadOpen(&bzerr, f, 0, 0, NULL, 0)) == NULL) {
-        warnx("BZ2_bzReadOpen, bz2err = %d", bzerr);
+    bzip2_stream_t *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        warn("Failed to allocate memory for bzip2 stream");
+        return NULL;
     }
+
+    int bzerr = BZ2_bzDecompressInit(&s->bz, 0, 0);
+    if (bzerr != BZ_OK) {
+        warnx("BZ2_bzDecompressInit, bz2err = %d", bzerr);
+        free(s);
+        return NULL;
+    }
+
+    s->input = input;
     return s;
 }
 
-static void BSDIFF40_close(stream_t s)
+static void BSDIFF40_close(stream_t stream)
 {
-    int bzerr;
-    BZ2_bzReadClose(&bzerr, (BZFILE*)s);
+    bzip2_stream_t *s = stream;
+    BZ2_bzDecompressEnd(&s->bz);
+    free(s);
 }
 
-static off_t BSDIFF40_read(stream_t s, void *buf, off_t len)
+static off_t BSDIFF40_read(stream_t stream, void *buf, off_t len)
 {
-    int bzerr = 0, lenread = 0;
-    lenread = BZ2_bzRead(&bzerr, (BZFILE*)s, buf, (int)len);
-    if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-        warnx("Corrupt patch\n");
-        lenread = -1;
+    bzip2_stream_t *s = stream;
+
+    s->bz.next_out = buf;
+    s->bz.avail_out = (unsigned int)len;
+    while (s->bz.avail_out > 0 && !s->ended) {
+        if (s->bz.avail_in == 0) {
+            off_t lenread = input_read(s->input, s->buffer, sizeof(s->buffer));
+            if (lenread <= 0) {
+                warnx("Corrupt patch\n");
+                return -1;
+            }
+
+            s->bz.next_in = s->buffer;
+            s->bz.avail_in = (unsigned int)lenread;
+        }
+
+        int bzerr = BZ2_bzDecompress(&s->bz);
+        if (bzerr == BZ_STREAM_END) {
+            s->ended = 1;
+        } else if (bzerr != BZ_OK) {
+            warnx("Corrupt patch\n");
+            return -1;
+        }
     }
-    return lenread;
+
+    return len - (off_t)s->bz.avail_out;
 }
 
 static io_funcs_t BSDIFF40_funcs = {
@@ -85,9 +370,9 @@ static io_funcs_t BSDIFF40_funcs = {
 };
 
 
-static stream_t BSDIFN40_open(FILE *f)
+static stream_t BSDIFN40_open(input_t *input)
 {
-    return f;
+    return input;
 }
 
 static void BSDIFN40_close(stream_t __unused s)
@@ -96,7 +381,7 @@ static void BSDIFN40_close(stream_t __unused s)
 
 static off_t BSDIFN40_read(stream_t s, void *buf, off_t len)
 {
-    return (off_t)fread(buf, 1, (size_t)len, (FILE*)s);
+    return input_read((input_t*)s, buf, len);
 }
 
 static io_funcs_t BSDIFN40_funcs = {
@@ -106,10 +391,6 @@ static io_funcs_t BSDIFN40_funcs = {
 };
 
 
-#ifndef u_char
-typedef unsigned char u_char;
-#endif
-
 static off_t offtin(u_char *buf)
 {
     off_t y;
@@ -128,232 +409,338 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int bspatch(int argc,const char * const argv[])
+/* ctrlin(buf, len, pos, ctrl)
+ *
+ * Decodes the varint control triple at '*pos' in the 'len' bytes at 'buf' into
+ * 'ctrl' and advances '*pos' past it. Returns 1 if a triple was decoded, 0 if
+ * the triple continues past 'len' and -1 if it's corrupt. */
+static int ctrlin(const u_char *buf, off_t len, off_t *pos, off_t *ctrl)
 {
-    FILE * f = NULL, * cpf = NULL, * dpf = NULL, * epf = NULL;
-    stream_t cstream = NULL, dstream = NULL, estream = NULL;
-    ssize_t oldsize = 0,newsize = 0;
-    ssize_t bzctrllen = 0,bzdatalen = 0;
-    u_char header[32] = {0},buf[8] = {0};
-    u_char *old = NULL, *new = NULL;
-    off_t oldpos = 0,newpos = 0;
-    off_t ctrl[3] = {0};
-    off_t lenread = 0;
-    off_t i = 0;
-    io_funcs_t * io = NULL;
-    int exitstatus = -1;
+    off_t p = *pos;
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t value = 0;
+        u_char byte = 0x80;
+        for (int shift = 0; byte & 0x80; shift += 7) {
+            if (p == len) {
+                return 0;
+            }
+            if (shift > 63) {
+                return -1;
+            }
+            byte = buf[p++];
+            value |= (uint64_t)(byte & 0x7F) << shift;
+        }
 
-    if(argc!=4) {
-        warnx("usage: %s oldfile newfile patchfile\n",argv[0]);
-        goto cleanup;
+        /* The seek is zigzag encoded and the lengths can't be negative */
+        if (i == 2) {
+            ctrl[i] = (off_t)(value >> 1) ^ -(off_t)(value & 1);
+        } else if (value > INT64_MAX) {
+            return -1;
+        } else {
+            ctrl[i] = (off_t)value;
+        }
     }
 
-    /* Open patch file */
-    if ((f = fopen(argv[3], "r")) == NULL) {
-        warn("fopen(%s)", argv[3]);
-        goto cleanup;
-    }
+    *pos = p;
+    return 1;
+}
 
-    /*
-    File format:
-        0   8   "BSDIFF40" (bzip2) or "BSDIFN40" (raw)
-        8   8   X
-        16  8   Y
-        24  8   sizeof(newfile)
-        32  X   bzip2(control block)
-        32+X    Y   bzip2(diff block)
-        32+X+Y  ??? bzip2(extra block)
-    with control block a set of triples (x,y,z) meaning "add x bytes
-    from oldfile to x bytes from the diff block; copy y bytes from the
-    extra block; seek forwards in oldfile by z bytes".
-    */
-
-    /* Read header */
-    if (fread(header, 1, 32, f) < 32) {
-        if (feof(f)) {
-            warnx("Corrupt patch\n");
-        } else {
-            warn("fread(%s)", argv[3]);
-        }
-        goto cleanup;
+/*
+File format:
+    0   8   "BSDIFF40" (bzip2), "BSDIFN40" (raw) or "BSDIFV40" (raw, varint control)
+    8   8   X
+    16  8   Y
+    24  8   sizeof(newfile)
+    32  X   bzip2(control block)
+    32+X    Y   bzip2(diff block)
+    32+X+Y  ??? bzip2(extra block)
+with control block a set of triples (x,y,z) meaning "add x bytes
+from oldfile to x bytes from the diff block; copy y bytes from the
+extra block; seek forwards in oldfile by z bytes". The triples take 8
+bytes per value, except in BSDIFV40 where they're varints of 7 bits per byte,
+lowest first, with z zigzag encoded.
+*/
+
+/* readheader(input, io, varint, ctrllen, datalen, newsize)
+ *
+ * Reads the header of the patch from 'input' and returns the functions for
+ * reading its sections, whether its control block holds varints, and the
+ * lengths stored in it. Returns 0 on success and -1 if the header is corrupt. */
+static int readheader(input_t *input, io_funcs_t **io, int *varint, off_t *ctrllen, off_t *datalen, off_t *newsize)
+{
+    u_char header[32] = {0};
+
+    if (input_read(input, header, 32) < 32) {
+        warnx("Corrupt patch\n");
+        return -1;
     }
 
     /* Check for appropriate magic */
     if (memcmp(header, "BSDIFF40", 8) == 0)
-        io = &BSDIFF40_funcs;
+        *io = &BSDIFF40_funcs;
     else if (memcmp(header, "BSDIFN40", 8) == 0)
-        io = &BSDIFN40_funcs;
+        *io = &BSDIFN40_funcs;
+    else if (memcmp(header, "BSDIFV40", 8) == 0)
+        *io = &BSDIFN40_funcs;
     else {
         warnx("Corrupt patch\n");
-        goto cleanup;
+        return -1;
     }
 
+    *varint = (memcmp(header, "BSDIFV40", 8) == 0);
+
     /* Read lengths from header */
-    bzctrllen=offtin(header+8);
-    bzdatalen=offtin(header+16);
-    newsize=offtin(header+24);
-    if((bzctrllen<0) || (bzdatalen<0) || (newsize<0)) {
+    *ctrllen=offtin(header+8);
+    *datalen=offtin(header+16);
+    *newsize=offtin(header+24);
+    if((*ctrllen<0) || (*datalen<0) || (*newsize<0)) {
         warnx("Corrupt patch\n");
-        goto cleanup;
+        return -1;
     }
 
-    /* Close patch file and re-open it via libbzip2 at the right places */
-    if (fclose(f)) {
-        warn("fclose(%s)", argv[3]);
-        f = NULL;
-        goto cleanup;
-    }
-    f = NULL;
-    
-    if ((cpf = fopen(argv[3], "r")) == NULL) {
-        warn("fopen(%s)", argv[3]);
-        goto cleanup;
-    }
-    if (fseeko(cpf, 32, SEEK_SET)) {
-        warn("fseeko(%s, %lld)", argv[3],
-            (long long)32);
-        goto cleanup;
-    }
-    cstream = io->open(cpf);
-    if (cstream == NULL) {
-        warn("cstream open");
-        goto cleanup;
-    }
-    if ((dpf = fopen(argv[3], "r")) == NULL) {
-        warn("fopen(%s)", argv[3]);
-        goto cleanup;
-    }
-    if (fseeko(dpf, 32 + bzctrllen, SEEK_SET)) {
-        warn("fseeko(%s, %lld)", argv[3],
-            (long long)(32 + bzctrllen));
-        goto cleanup;
-    }
-    dstream = io->open(dpf);
-    if (dstream == NULL) {
-        warn("dstream open");
-        goto cleanup;
-    }
-    if ((epf = fopen(argv[3], "r")) == NULL) {
-        warn("fopen(%s)", argv[3]);
-        goto cleanup;
-    }
-    if (fseeko(epf, 32 + bzctrllen + bzdatalen, SEEK_SET)) {
-        warn("fseeko(%s, %lld)", argv[3],
-            (long long)(32 + bzctrllen + bzdatalen));
-        goto cleanup;
+    return 0;
+}
+
+/* readctrl(io, cstream, varint, ctrlbuf, ctrlbuflen, ctrlbatch)
+ *
+ * Reads and decodes the next batch of control triples into 'ctrlbatch', which
+ * has room for CTRL_READ_BATCH_SIZE triples. Varint triples vary in size, so
+ * the bytes of a triple that was only partly read are kept at the start of
+ * 'ctrlbuf' with their length in '*ctrlbuflen' for the next call. Returns the
+ * number of control values decoded, or -1 if the control block is corrupt. */
+static off_t readctrl(io_funcs_t *io, stream_t cstream, int varint, u_char *ctrlbuf, off_t *ctrlbuflen, off_t *ctrlbatch)
+{
+    off_t ctrlcount = 0;
+    off_t lenread = 0;
+
+    if (!varint) {
+        lenread = io->read(cstream, ctrlbuf, 24 * CTRL_READ_BATCH_SIZE);
+        if (lenread < 24) {
+            return -1;
+        }
+
+        ctrlcount = (lenread / 24) * 3;
+        for (off_t i = 0; i < ctrlcount; i++)
+            ctrlbatch[i] = offtin(ctrlbuf + i * 8);
+        return ctrlcount;
     }
-    estream = io->open(epf);
-    if (estream == NULL) {
-        warn("estream open");
-        goto cleanup;
+
+    lenread = io->read(cstream, ctrlbuf + *ctrlbuflen, 24 * CTRL_READ_BATCH_SIZE - *ctrlbuflen);
+    if (lenread < 0) {
+        return -1;
     }
-    off_t size = 0;
-    old = readfile(argv[1], &size);
-    if (old == NULL) {
-        warn("old file: %s", argv[1]);
-        goto cleanup;
+    off_t len = *ctrlbuflen + lenread;
+
+    off_t pos = 0;
+    int decoded = 1;
+    while (ctrlcount < 3 * CTRL_READ_BATCH_SIZE && (decoded = ctrlin(ctrlbuf, len, &pos, ctrlbatch + ctrlcount)) == 1) {
+        ctrlcount += 3;
     }
-    
-    oldsize = size;
-    
-    if((new=malloc((size_t)newsize+1))==NULL) {
-        warn("Failed to allocate memory for new");
-        goto cleanup;
+    if (decoded < 0 || ctrlcount == 0) {
+        return -1;
     }
 
-    oldpos=0;newpos=0;
+    memmove(ctrlbuf, ctrlbuf + pos, (size_t)(len - pos));
+    *ctrlbuflen = len - pos;
+    return ctrlcount;
+}
+
+/* applypatch(old, oldsize, newsize, io, varint, cstream, dstream, estream, new, sink)
+ *
+ * Produces the new file from the old file and the control, diff and extra
+ * sections of the patch, one buffer at a time. 'new' must have room for
+ * BSPATCH_BUFFER_SIZE bytes. Returns 0 on success and -1 on failure. */
+static int applypatch(const u_char *old, off_t oldsize, off_t newsize, io_funcs_t *io, int varint,
+    stream_t cstream, stream_t dstream, stream_t estream, u_char *new, const struct bspatch_sink *sink)
+{
+    u_char ctrlbuf[24 * CTRL_READ_BATCH_SIZE];
+    off_t ctrlbuflen = 0;                   /* bytes of a partly read varint triple at the start of ctrlbuf */
+    off_t ctrlbatch[3 * CTRL_READ_BATCH_SIZE];
+    off_t ctrlcount = 0, ctrlindex = 0;     /* number of decoded control values, and the next one to use */
+    const struct bssimd_kernels *simd = bssimd_best();
+    off_t oldpos = 0,newpos = 0;
+    off_t ctrl[3] = {0};
+    off_t lenread = 0;
+    off_t chunklen = 0;
+
     while(newpos<newsize) {
-        /* Read control data */
-        for(i=0;i<=2;i++) {
-            lenread = io->read(cstream, buf, 8);
-            if (lenread < 8) {
+        /* Read and decode control data a batch of triples at a time */
+        if (ctrlindex == ctrlcount) {
+            ctrlcount = readctrl(io, cstream, varint, ctrlbuf, &ctrlbuflen, ctrlbatch);
+            if (ctrlcount < 0) {
                 warnx("Corrupt patch\n");
-                goto cleanup;
+                return -1;
             }
-            ctrl[i]=offtin(buf);
-        };
+            ctrlindex = 0;
+        }
+
+        ctrl[0]=ctrlbatch[ctrlindex++];
+        ctrl[1]=ctrlbatch[ctrlindex++];
+        ctrl[2]=ctrlbatch[ctrlindex++];
 
         /* Sanity-check */
-        if(newpos+ctrl[0]>newsize) {
+        if((ctrl[0]<0) || (newpos+ctrl[0]>newsize)) {
             warnx("Corrupt patch\n");
-            goto cleanup;
+            return -1;
         }
 
-        /* Read diff string */
-        lenread = io->read(dstream, new + newpos, ctrl[0]);
-        if (lenread < 0 || lenread < ctrl[0]) {
-            warnx("Corrupt patch\n");
-            goto cleanup;
-        }
+        /* Read diff string and add old data to it, one buffer at a time */
+        while(ctrl[0]>0) {
+            chunklen = (ctrl[0] < BSPATCH_BUFFER_SIZE) ? ctrl[0] : BSPATCH_BUFFER_SIZE;
 
-        /* Add old data to diff string */
-        for(i=0;i<ctrl[0];i++)
-            if((oldpos+i>=0) && (oldpos+i<oldsize))
-                new[newpos+i]+=old[oldpos+i];
+            lenread = io->read(dstream, new, chunklen);
+            if (lenread < 0 || lenread < chunklen) {
+                warnx("Corrupt patch\n");
+                return -1;
+            }
 
-        /* Adjust pointers */
-        newpos+=ctrl[0];
-        oldpos+=ctrl[0];
+            /* Add old data to the part of the chunk that lines up with the old
+               file, and leave any bytes before or after it as they are */
+            if((oldpos<oldsize) && (oldpos>-chunklen)) {
+                off_t start=(oldpos<0) ? -oldpos : 0;
+                off_t end=MIN(chunklen,oldsize-oldpos);
+                simd->add(new+start,old+oldpos+start,end-start);
+            }
+
+            if (sink->write(sink->context, new, (size_t)chunklen) != 0) {
+                warnx("Failed to write new file\n");
+                return -1;
+            }
+
+            /* Adjust pointers */
+            newpos+=chunklen;
+            oldpos+=chunklen;
+            ctrl[0]-=chunklen;
+        }
 
         /* Sanity-check */
-        if(newpos+ctrl[1]>newsize) {
+        if((ctrl[1]<0) || (newpos+ctrl[1]>newsize)) {
             warnx("Corrupt patch\n");
-            goto cleanup;
+            return -1;
         }
 
-        /* Read extra string */
-        lenread = io->read(estream, new + newpos, ctrl[1]);
-        if (lenread < 0 || lenread < ctrl[1]) {
-            warnx("Corrupt patch\n");
-            goto cleanup;
+        /* Copy extra string, one buffer at a time */
+        while(ctrl[1]>0) {
+            chunklen = (ctrl[1] < BSPATCH_BUFFER_SIZE) ? ctrl[1] : BSPATCH_BUFFER_SIZE;
+
+            lenread = io->read(estream, new, chunklen);
+            if (lenread < 0 || lenread < chunklen) {
+                warnx("Corrupt patch\n");
+                return -1;
+            }
+
+            if (sink->write(sink->context, new, (size_t)chunklen) != 0) {
+                warnx("Failed to write new file\n");
+                return -1;
+            }
+
+            newpos+=chunklen;
+            ctrl[1]-=chunklen;
         }
 
         /* Adjust pointers */
-        newpos+=ctrl[1];
         oldpos+=ctrl[2];
     };
 
-    /* Clean up the bzip2 reads */
-    io->close(cstream);
-    cstream = NULL;
-    io->close(dstream);
-    dstream = NULL;
-    io->close(estream);
-    estream = NULL;
-    
-    if (fclose(cpf) != 0) {
-        warn("fclose cpf(%s)", argv[3]);
-        cpf = NULL;
+    return 0;
+}
+
+static int writefile(void *context, const void *buffer, size_t size)
+{
+    return writebuffer((FILE *)context, buffer, size);
+}
+
+int bspatch(int argc,const char * const argv[])
+{
+    FILE * f = NULL;
+    int fd = -1;
+    u_char *readbuffers = NULL;
+    patchfile_t cfile = {0}, dfile = {0}, efile = {0};
+    stream_t cstream = NULL, dstream = NULL, estream = NULL;
+    input_t cinput = {0}, dinput = {0}, einput = {0};
+    off_t oldsize = 0,newsize = 0;
+    off_t bzctrllen = 0,bzdatalen = 0;
+    void *oldmapping = NULL;
+    const u_char *old = NULL;
+    u_char *new = NULL;
+    io_funcs_t * io = NULL;
+    int varint = 0;
+    int exitstatus = -1;
+
+    if(argc!=4) {
+        warnx("usage: %s oldfile newfile patchfile\n",argv[0]);
         goto cleanup;
     }
-    cpf = NULL;
-    
-    if (fclose(dpf) != 0) {
-        warn("fclose dpf(%s)", argv[3]);
-        dpf = NULL;
+
+    /* Open patch file. It's opened once and all of its sections are read
+       with pread() from their own buffer. */
+    if ((fd = open(argv[3], O_RDONLY)) == -1) {
+        warn("open(%s)", argv[3]);
+        goto cleanup;
+    }
+
+    if (posix_memalign((void **)&readbuffers, PATCH_READ_BUFFER_ALIGNMENT, 3 * PATCH_READ_BUFFER_SIZE) != 0) {
+        readbuffers = NULL;
+        warnx("Failed to allocate memory for reading the patch");
+        goto cleanup;
+    }
+
+    /* Read header. The control block directly follows it, so it's read
+       from the same buffer afterwards. */
+    cfile.fd = fd;
+    cfile.buffer = readbuffers;
+    cinput.file = &cfile;
+    cinput.length = 32;
+    if (readheader(&cinput, &io, &varint, &bzctrllen, &bzdatalen, &newsize) != 0) {
+        goto cleanup;
+    }
+
+    cinput.length = bzctrllen;
+    dfile.fd = fd;
+    dfile.offset = 32 + bzctrllen;
+    dfile.buffer = readbuffers + PATCH_READ_BUFFER_SIZE;
+    dinput.file = &dfile;
+    dinput.length = bzdatalen;
+    efile.fd = fd;
+    efile.offset = 32 + bzctrllen + bzdatalen;
+    efile.buffer = readbuffers + 2 * PATCH_READ_BUFFER_SIZE;
+    einput.file = &efile;
+    einput.length = -1;
+    if ((cstream = io->open(&cinput)) == NULL ||
+        (dstream = io->open(&dinput)) == NULL ||
+        (estream = io->open(&einput)) == NULL) {
+        warnx("Failed to open patch streams\n");
+        goto cleanup;
+    }
+
+    /* The old file is mapped rather than read so that only the parts the
+       patch refers to are loaded */
+    oldmapping = mapfile(argv[1], &oldsize);
+    old = oldmapping;
+    if (old == NULL) {
+        warn("old file: %s", argv[1]);
         goto cleanup;
     }
-    dpf = NULL;
     
-    if (fclose(epf) != 0) {
-        warn("fclose epf(%s)", argv[3]);
-        epf = NULL;
+    if((new=malloc(BSPATCH_BUFFER_SIZE))==NULL) {
+        warn("Failed to allocate memory for new");
         goto cleanup;
     }
-    epf = NULL;
 
-    /* Write the new file */
+    /* Create the new file, which is written to as it's patched */
     f = fopen(argv[2], "w");
     if (f == NULL) {
         warn("failed to write new file: %s", argv[2]);
         goto cleanup;
     }
-    
-    if (fwrite(new, 1, (size_t)newsize, f) < (size_t)newsize) {
-        warn("failed to write to new file: %s", argv[2]);
+
+    struct bspatch_sink sink = { f, writefile };
+    if (applypatch(old, oldsize, newsize, io, varint, cstream, dstream, estream, new, &sink) != 0) {
         goto cleanup;
     }
-    
+
+    /* Finish writing the new file */
     if (fclose(f) != 0) {
         warn("failed to close new file: %s", argv[2]);
         f = NULL;
@@ -364,7 +751,7 @@ int bspatch(int argc,const char * const argv[])
     exitstatus = 0;
 cleanup:
     free(new);
-    free(old);
+    unmapfile(oldmapping, oldsize);
     
     if (f != NULL) {
         fclose(f);
@@ -374,25 +761,112 @@ cleanup:
         io->close(estream);
     }
     
-    if (epf != NULL) {
-        fclose(epf);
-    }
-    
     if (dstream != NULL) {
         io->close(dstream);
     }
     
-    if (dpf != NULL) {
-        fclose(dpf);
-    }
-    
     if (cstream != NULL) {
         io->close(cstream);
     }
-    
-    if (cpf != NULL) {
-        fclose(cpf);
+
+    free(readbuffers);
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    return exitstatus;
+}
+
+int bspatch_stream(const unsigned char *old, off_t oldsize, const struct bspatch_source *source, const struct bspatch_sink *sink)
+{
+    stream_t cstream = NULL, dstream = NULL, estream = NULL;
+    input_t sourceinput = {0}, cinput = {0}, dinput = {0};
+    off_t newsize = 0;
+    off_t bzctrllen = 0,bzdatalen = 0;
+    u_char *ctrlblock = NULL, *new = NULL;
+    zeroruns_t datablock = {0};
+    io_funcs_t * io = NULL;
+    int varint = 0;
+    int exitstatus = -1;
+
+    sourceinput.source = source;
+    sourceinput.length = -1;
+    if (readheader(&sourceinput, &io, &varint, &bzctrllen, &bzdatalen, &newsize) != 0) {
+        goto cleanup;
+    }
+
+    if((new=malloc(BSPATCH_BUFFER_SIZE))==NULL) {
+        warn("Failed to allocate memory for new");
+        goto cleanup;
+    }
+
+    /* The extra block is read from the source while patching, so the control
+       and diff blocks that precede it are read into memory first */
+    if ((ctrlblock = malloc((size_t)bzctrllen + 1)) == NULL) {
+        warn("Failed to allocate memory for the control block");
+        goto cleanup;
+    }
+
+    if (input_read(&sourceinput, ctrlblock, bzctrllen) < bzctrllen) {
+        warnx("Corrupt patch\n");
+        goto cleanup;
+    }
+
+    /* A raw diff block is stored as zero runs. A compressed one is already
+       small so it's kept as is. */
+    for (off_t datapos = 0; datapos < bzdatalen;) {
+        off_t chunklen = MIN(bzdatalen - datapos, BSPATCH_BUFFER_SIZE);
+        if (input_read(&sourceinput, new, chunklen) < chunklen) {
+            warnx("Corrupt patch\n");
+            goto cleanup;
+        }
+
+        int appended = (io == &BSDIFN40_funcs) ?
+            zeroruns_encode(&datablock, new, (size_t)chunklen) :
+            zeroruns_append(&datablock, new, (size_t)chunklen);
+        if (appended != 0) {
+            warn("Failed to allocate memory for the diff block");
+            goto cleanup;
+        }
+
+        datapos += chunklen;
+    }
+
+    cinput.buffer = ctrlblock;
+    cinput.length = bzctrllen;
+    dinput.buffer = datablock.bytes;
+    dinput.length = bzdatalen;
+    dinput.zeroruns = (io == &BSDIFN40_funcs);
+    if ((cstream = io->open(&cinput)) == NULL ||
+        (dstream = io->open(&dinput)) == NULL ||
+        (estream = io->open(&sourceinput)) == NULL) {
+        warnx("Failed to open patch streams\n");
+        goto cleanup;
+    }
+
+    if (applypatch(old, oldsize, newsize, io, varint, cstream, dstream, estream, new, sink) != 0) {
+        goto cleanup;
     }
 
+    exitstatus = 0;
+cleanup:
+    free(new);
+
+    if (estream != NULL) {
+        io->close(estream);
+    }
+
+    if (dstream != NULL) {
+        io->close(dstream);
+    }
+
+    if (cstream != NULL) {
+        io->close(cstream);
+    }
+
+    free(datablock.bytes);
+    free(ctrlblock);
+
     return exitstatus;
 }
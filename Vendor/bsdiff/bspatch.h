@@ -7,6 +7,44 @@
  *
  */
 
+#ifndef BSPATCH_H
+#define BSPATCH_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Supplies the bytes of a patch in order. 'read' fills 'buffer' with up to
+   'size' bytes and returns the number of bytes read, 0 at the end of the
+   patch, or -1 on failure. */
+struct bspatch_source
+{
+    void *context;
+    ssize_t (*read)(void *context, void *buffer, size_t size);
+};
+
+/* Receives the new file in order as it's patched. 'write' returns 0 on
+   success and -1 on failure. */
+struct bspatch_sink
+{
+    void *context;
+    int (*write)(void *context, const void *buffer, size_t size);
+};
+
+/* bspatch_stream(old, oldsize, source, sink)
+ *
+ * Applies the BSDIFF40, BSDIFN40 or BSDIFV40 patch read from 'source' to the
+ * 'oldsize' bytes at 'old' and writes the new file to 'sink'. The patch is read
+ * once from start to end so it doesn't have to be stored in a file. Its control
+ * block and diff block are held in memory because they precede the extra
+ * block, with runs of zeros left out of a raw diff block. The new file is
+ * written out in small pieces as it's patched, and 'old' is only read as the
+ * patch refers to it, so it can be a mapping of the old file.
+ *
+ * Returns 0 on success and -1 on failure. */
+int bspatch_stream(const unsigned char *old, off_t oldsize, const struct bspatch_source *source, const struct bspatch_sink *sink);
+
 // So that we can use this method in SUBinaryDeltaApply.m.
 // Silences the GCC warning that the prototype doesn't exist.
 int bspatch(int argc, const char * const argv[]);
+
+#endif
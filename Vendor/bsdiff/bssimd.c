@@ -0,0 +1,394 @@
+/*
+ *  bssimd.c
+ *  Sparkle
+ *
+ *  Vectorized byte loops for bsdiff and bspatch.
+ *
+ *  SSE2 is always present on x86_64 and NEON on arm64, so those kernels are
+ *  picked at compile time. AVX2 kernels are also built on x86_64 and used when
+ *  the CPU supports them. Every other architecture uses the scalar kernels.
+ */
+
+#include "bssimd.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BSSIMD_X86 1
+#include <immintrin.h>
+#define BSSIMD_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BSSIMD_ARM64 1
+#include <arm_neon.h>
+#endif
+
+/* Vector counters of equal bytes are summed before they can reach 256 */
+#define MAX_COUNT_ITERATIONS 255
+
+/* Scalar */
+
+static off_t mismatch_scalar(const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /* Compare eight bytes at a time. The lowest set bit of the difference
+     * belongs to the first mismatching byte. */
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            return i + (__builtin_ctzll(x ^ y) / 8);
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        if (a[i] != b[i])
+            break;
+    }
+
+    return i;
+}
+
+static off_t countequal_scalar(const u_char *a, const u_char *b, off_t n)
+{
+    off_t count = 0;
+    for (off_t i = 0; i < n; i++)
+        count += (a[i] == b[i]);
+    return count;
+}
+
+static uint64_t equalmask_scalar(const u_char *a, const u_char *b, size_t n)
+{
+    uint64_t mask = 0;
+    for (size_t i = 0; i < n; i++)
+        mask |= (uint64_t)(a[i] == b[i]) << i;
+    return mask;
+}
+
+static void subtract_scalar(u_char *dst, const u_char *a, const u_char *b, off_t n)
+{
+    for (off_t i = 0; i < n; i++)
+        dst[i] = (u_char)(a[i] - b[i]);
+}
+
+static void add_scalar(u_char *dst, const u_char *src, off_t n)
+{
+    for (off_t i = 0; i < n; i++)
+        dst[i] = (u_char)(dst[i] + src[i]);
+}
+
+static const struct bssimd_kernels scalar_kernels = {
+    BSSIMD_SCALAR, "scalar",
+    mismatch_scalar, countequal_scalar, equalmask_scalar, subtract_scalar, add_scalar
+};
+
+#ifdef BSSIMD_X86
+
+/* SSE2 */
+
+static inline uint32_t equalbits_sse2(const u_char *a, const u_char *b)
+{
+    __m128i x = _mm_loadu_si128((const void *)a);
+    __m128i y = _mm_loadu_si128((const void *)b);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+}
+
+static off_t mismatch_sse2(const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint32_t differ = equalbits_sse2(a + i, b + i) ^ 0xFFFF;
+        if (differ != 0)
+            return i + __builtin_ctz(differ);
+    }
+    return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static off_t countequal_sse2(const u_char *a, const u_char *b, off_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    off_t i = 0, count = 0;
+
+    while (i + 16 <= n)
+    {
+        /* Equal bytes compare to -1, so subtracting counts them per lane */
+        __m128i counts = zero;
+        for (int k = 0; (k < MAX_COUNT_ITERATIONS) && (i + 16 <= n); k++, i += 16)
+        {
+            __m128i x = _mm_loadu_si128((const void *)(a + i));
+            __m128i y = _mm_loadu_si128((const void *)(b + i));
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(x, y));
+        }
+
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+
+    return count + countequal_scalar(a + i, b + i, n - i);
+}
+
+static uint64_t equalmask_sse2(const u_char *a, const u_char *b, size_t n)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        mask |= (uint64_t)equalbits_sse2(a + i, b + i) << i;
+    if (i < n)
+        mask |= equalmask_scalar(a + i, b + i, n - i) << i;
+    return mask;
+}
+
+static void subtract_sse2(u_char *dst, const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const void *)(a + i));
+        __m128i y = _mm_loadu_si128((const void *)(b + i));
+        _mm_storeu_si128((void *)(dst + i), _mm_sub_epi8(x, y));
+    }
+    subtract_scalar(dst + i, a + i, b + i, n - i);
+}
+
+static void add_sse2(u_char *dst, const u_char *src, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const void *)(dst + i));
+        __m128i y = _mm_loadu_si128((const void *)(src + i));
+        _mm_storeu_si128((void *)(dst + i), _mm_add_epi8(x, y));
+    }
+    add_scalar(dst + i, src + i, n - i);
+}
+
+static const struct bssimd_kernels sse2_kernels = {
+    BSSIMD_SSE2, "sse2",
+    mismatch_sse2, countequal_sse2, equalmask_sse2, subtract_sse2, add_sse2
+};
+
+/* AVX2 */
+
+BSSIMD_AVX2_TARGET
+static inline uint32_t equalbits_avx2(const u_char *a, const u_char *b)
+{
+    __m256i x = _mm256_loadu_si256((const void *)a);
+    __m256i y = _mm256_loadu_si256((const void *)b);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+}
+
+BSSIMD_AVX2_TARGET
+static off_t mismatch_avx2(const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        uint32_t differ = ~equalbits_avx2(a + i, b + i);
+        if (differ != 0)
+            return i + __builtin_ctz(differ);
+    }
+    return i + mismatch_sse2(a + i, b + i, n - i);
+}
+
+BSSIMD_AVX2_TARGET
+static off_t countequal_avx2(const u_char *a, const u_char *b, off_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    off_t i = 0, count = 0;
+
+    while (i + 32 <= n)
+    {
+        __m256i counts = zero;
+        for (int k = 0; (k < MAX_COUNT_ITERATIONS) && (i + 32 <= n); k++, i += 32)
+        {
+            __m256i x = _mm256_loadu_si256((const void *)(a + i));
+            __m256i y = _mm256_loadu_si256((const void *)(b + i));
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(x, y));
+        }
+
+        __m256i sums = _mm256_sad_epu8(counts, zero);
+        __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        count += _mm_cvtsi128_si32(halves) + _mm_extract_epi16(halves, 4);
+    }
+
+    return count + countequal_sse2(a + i, b + i, n - i);
+}
+
+BSSIMD_AVX2_TARGET
+static uint64_t equalmask_avx2(const u_char *a, const u_char *b, size_t n)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+        mask |= (uint64_t)equalbits_avx2(a + i, b + i) << i;
+    if (i < n)
+        mask |= equalmask_sse2(a + i, b + i, n - i) << i;
+    return mask;
+}
+
+BSSIMD_AVX2_TARGET
+static void subtract_avx2(u_char *dst, const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const void *)(a + i));
+        __m256i y = _mm256_loadu_si256((const void *)(b + i));
+        _mm256_storeu_si256((void *)(dst + i), _mm256_sub_epi8(x, y));
+    }
+    subtract_sse2(dst + i, a + i, b + i, n - i);
+}
+
+BSSIMD_AVX2_TARGET
+static void add_avx2(u_char *dst, const u_char *src, off_t n)
+{
+    off_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const void *)(dst + i));
+        __m256i y = _mm256_loadu_si256((const void *)(src + i));
+        _mm256_storeu_si256((void *)(dst + i), _mm256_add_epi8(x, y));
+    }
+    add_sse2(dst + i, src + i, n - i);
+}
+
+static const struct bssimd_kernels avx2_kernels = {
+    BSSIMD_AVX2, "avx2",
+    mismatch_avx2, countequal_avx2, equalmask_avx2, subtract_avx2, add_avx2
+};
+
+static int supportsavx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef BSSIMD_ARM64
+
+/* NEON */
+
+static inline uint32_t equalbits_neon(const u_char *a, const u_char *b)
+{
+    /* NEON has no movemask, so give each lane its own bit and add the
+     * lanes of each half together */
+    static const uint8_t lanebits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(vceqq_u8(vld1q_u8(a), vld1q_u8(b)), vld1q_u8(lanebits));
+    return (uint32_t)vaddv_u8(vget_low_u8(bits)) | ((uint32_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static off_t mismatch_neon(const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        /* Narrow the comparison to four bits per byte */
+        uint8x16_t equal = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint64_t nibbles = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(equal), 4)), 0);
+        if (nibbles != UINT64_MAX)
+            return i + (__builtin_ctzll(~nibbles) / 4);
+    }
+    return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+static off_t countequal_neon(const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0, count = 0;
+
+    while (i + 16 <= n)
+    {
+        /* Equal bytes compare to 0xFF, so subtracting counts them per lane */
+        uint8x16_t counts = vdupq_n_u8(0);
+        for (int k = 0; (k < MAX_COUNT_ITERATIONS) && (i + 16 <= n); k++, i += 16)
+            counts = vsubq_u8(counts, vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+
+        count += vaddlvq_u8(counts);
+    }
+
+    return count + countequal_scalar(a + i, b + i, n - i);
+}
+
+static uint64_t equalmask_neon(const u_char *a, const u_char *b, size_t n)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        mask |= (uint64_t)equalbits_neon(a + i, b + i) << i;
+    if (i < n)
+        mask |= equalmask_scalar(a + i, b + i, n - i) << i;
+    return mask;
+}
+
+static void subtract_neon(u_char *dst, const u_char *a, const u_char *b, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        vst1q_u8(dst + i, vsubq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+    subtract_scalar(dst + i, a + i, b + i, n - i);
+}
+
+static void add_neon(u_char *dst, const u_char *src, off_t n)
+{
+    off_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    add_scalar(dst + i, src + i, n - i);
+}
+
+static const struct bssimd_kernels neon_kernels = {
+    BSSIMD_NEON, "neon",
+    mismatch_neon, countequal_neon, equalmask_neon, subtract_neon, add_neon
+};
+
+#endif
+
+const struct bssimd_kernels *bssimd_kernels(enum bssimd_level level)
+{
+    if (level == BSSIMD_SCALAR)
+        return &scalar_kernels;
+#ifdef BSSIMD_X86
+    if (level == BSSIMD_SSE2)
+        return &sse2_kernels;
+    if ((level == BSSIMD_AVX2) && supportsavx2())
+        return &avx2_kernels;
+#endif
+#ifdef BSSIMD_ARM64
+    if (level == BSSIMD_NEON)
+        return &neon_kernels;
+#endif
+    return NULL;
+}
+
+static pthread_once_t bestkernelsonce = PTHREAD_ONCE_INIT;
+static const struct bssimd_kernels *bestkernels;
+
+static void findbestkernels(void)
+{
+    static const enum bssimd_level levels[] = {BSSIMD_AVX2, BSSIMD_SSE2, BSSIMD_NEON};
+
+    bestkernels = &scalar_kernels;
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        const struct bssimd_kernels *kernels = bssimd_kernels(levels[i]);
+        if (kernels != NULL)
+        {
+            bestkernels = kernels;
+            break;
+        }
+    }
+}
+
+const struct bssimd_kernels *bssimd_best(void)
+{
+    pthread_once(&bestkernelsonce, findbestkernels);
+    return bestkernels;
+}
@@ -0,0 +1,56 @@
+/*
+ *  bssimd.h
+ *  Sparkle
+ *
+ *  Vectorized byte loops for bsdiff and bspatch.
+ */
+
+#ifndef BSSIMD_H
+#define BSSIMD_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Instruction sets the kernels can be built for. Not every level is
+   available on every CPU or architecture. */
+enum bssimd_level
+{
+    BSSIMD_SCALAR = 0,
+    BSSIMD_SSE2,
+    BSSIMD_AVX2,
+    BSSIMD_NEON
+};
+
+struct bssimd_kernels
+{
+    enum bssimd_level level;
+    const char *name;
+
+    /* Returns the index of the first of the 'n' bytes that differs between
+       'a' and 'b', or 'n' if there is none. */
+    off_t (*mismatch)(const u_char *a, const u_char *b, off_t n);
+
+    /* Returns the number of the 'n' bytes that are equal in 'a' and 'b'. */
+    off_t (*countequal)(const u_char *a, const u_char *b, off_t n);
+
+    /* Returns a mask with bit i set if a[i] == b[i]. 'n' must be at most 64. */
+    uint64_t (*equalmask)(const u_char *a, const u_char *b, size_t n);
+
+    /* dst[i] = a[i] - b[i] for the first 'n' bytes. 'dst' may not overlap
+       'a' or 'b'. */
+    void (*subtract)(u_char *dst, const u_char *a, const u_char *b, off_t n);
+
+    /* dst[i] += src[i] for the first 'n' bytes. 'dst' may not overlap 'src'. */
+    void (*add)(u_char *dst, const u_char *src, off_t n);
+};
+
+/* Returns the kernels for 'level', or NULL if the level isn't supported by
+   this build or CPU. Every level produces the same results; BSSIMD_SCALAR is
+   always available. */
+const struct bssimd_kernels *bssimd_kernels(enum bssimd_level level);
+
+/* Returns the fastest kernels supported by this CPU. */
+const struct bssimd_kernels *bssimd_best(void);
+
+#endif
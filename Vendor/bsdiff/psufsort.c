@@ -0,0 +1,454 @@
+/*
+ *  psufsort.c
+ *  Sparkle
+ *
+ *  Multithreaded suffix sorting for bsdiff.
+ *
+ *  sais() is linear but inherently sequential. This file sorts suffixes by
+ *  prefix doubling instead (in the spirit of Larsson and Sadakane's qsufsort,
+ *  which bsdiff originally used): suffixes are bucketed by their first two
+ *  bytes, and each round then refines every group of suffixes that share the
+ *  same first h bytes by the rank of the suffix h bytes further along, doubling
+ *  h each time. Groups are independent of each other within a round so they
+ *  are refined concurrently.
+ *
+ *  Each round runs in two phases separated by a join so that ranks are never
+ *  read and written at the same time:
+ *   1. Sort every unsorted group by the rank of its suffixes' h-th successor
+ *      and flag where the new, finer groups start (only reads V).
+ *   2. Assign each suffix the rank of its new group (only writes V).
+ */
+
+#include "psufsort.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Initial buckets are keyed by the first two bytes of a suffix, where 0
+   represents the end of the input */
+#define PSUFSORT_BUCKET_COUNT (257 * 257)
+/* Work is split into more chunks than threads so that large groups don't
+   stall the other threads */
+#define PSUFSORT_CHUNKS_PER_THREAD 16
+#define PSUFSORT_INSERTION_SORT_LIMIT 16
+
+/* Group flags tracked for every position in SA */
+#define GROUP_CONTINUES 0 /* same group as the previous position */
+#define GROUP_STARTS 1 /* first position of a group that may need sorting */
+#define GROUP_SORTED 2 /* group of its own that is in its final position */
+
+typedef struct
+{
+    const u_char *T;
+    psufsort_index_type *SA;
+    psufsort_index_type *V;
+    u_char *flags;
+    off_t n;
+    off_t h;
+    int threads;
+
+    /* Bucket counts for every thread, later turned into scatter offsets */
+    off_t *counts;
+    /* Last position of every initial bucket */
+    off_t *bucket_last;
+
+    /* Chunk c covers the positions [bounds[c], bounds[c + 1]) */
+    off_t *bounds;
+    int chunk_count;
+    atomic_int next_chunk;
+
+    /* Number of groups still unsorted after a round, per thread */
+    off_t *unsorted;
+} psufsort_ctx;
+
+typedef void (*psufsort_worker)(psufsort_ctx *ctx, int thread_index);
+
+typedef struct
+{
+    psufsort_ctx *ctx;
+    psufsort_worker worker;
+    int thread_index;
+    int spawned;
+    pthread_t thread_id;
+} psufsort_thread_args;
+
+static void *psufsort_thread_main(void *context)
+{
+    psufsort_thread_args *args = context;
+    args->worker(args->ctx, args->thread_index);
+    return NULL;
+}
+
+/* Runs worker on every thread index and waits for all of them to finish.
+   If a thread can't be spawned its share of the work is done on the calling
+   thread instead, so the result never depends on how many threads ran. */
+static void run_parallel(psufsort_ctx *ctx, psufsort_worker worker)
+{
+    int threads = ctx->threads;
+    if (threads <= 1) {
+        worker(ctx, 0);
+        return;
+    }
+
+    psufsort_thread_args *args = calloc((size_t)threads, sizeof(*args));
+    if (args == NULL) {
+        for (int t = 0; t < threads; t++) {
+            worker(ctx, t);
+        }
+        return;
+    }
+
+    for (int t = 1; t < threads; t++) {
+        args[t].ctx = ctx;
+        args[t].worker = worker;
+        args[t].thread_index = t;
+        args[t].spawned = (pthread_create(&args[t].thread_id, NULL, psufsort_thread_main, &args[t]) == 0);
+    }
+
+    worker(ctx, 0);
+
+    for (int t = 1; t < threads; t++) {
+        if (args[t].spawned) {
+            pthread_join(args[t].thread_id, NULL);
+        } else {
+            worker(ctx, t);
+        }
+    }
+
+    free(args);
+}
+
+static inline size_t initial_key(const u_char *T, off_t n, off_t i)
+{
+    if (i >= n) {
+        return 0;
+    }
+    if (i + 1 >= n) {
+        return (size_t)(T[i] + 1) * 257;
+    }
+    return (size_t)(T[i] + 1) * 257 + (size_t)T[i + 1] + 1;
+}
+
+static inline void thread_range(const psufsort_ctx *ctx, int thread_index, off_t *start, off_t *end)
+{
+    off_t total = ctx->n + 1;
+    *start = total * thread_index / ctx->threads;
+    *end = total * (thread_index + 1) / ctx->threads;
+}
+
+static void count_buckets(psufsort_ctx *ctx, int thread_index)
+{
+    off_t start, end;
+    thread_range(ctx, thread_index, &start, &end);
+
+    off_t *counts = ctx->counts + (size_t)thread_index * PSUFSORT_BUCKET_COUNT;
+    for (off_t i = start; i < end; i++) {
+        counts[initial_key(ctx->T, ctx->n, i)]++;
+    }
+}
+
+static void scatter_buckets(psufsort_ctx *ctx, int thread_index)
+{
+    off_t start, end;
+    thread_range(ctx, thread_index, &start, &end);
+
+    off_t *offsets = ctx->counts + (size_t)thread_index * PSUFSORT_BUCKET_COUNT;
+    for (off_t i = start; i < end; i++) {
+        size_t key = initial_key(ctx->T, ctx->n, i);
+        ctx->SA[offsets[key]++] = (psufsort_index_type)i;
+        ctx->V[i] = (psufsort_index_type)ctx->bucket_last[key];
+    }
+}
+
+#define SORT_KEY(index) (V[SA[(index)] + h])
+
+static inline void swap_entries(psufsort_index_type *SA, off_t a, off_t b)
+{
+    psufsort_index_type tmp = SA[a];
+    SA[a] = SA[b];
+    SA[b] = tmp;
+}
+
+static void sift_down(psufsort_index_type *SA, const psufsort_index_type *V, off_t h, off_t lo, off_t root, off_t size)
+{
+    for (;;) {
+        off_t child = 2 * root + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && SORT_KEY(lo + child) < SORT_KEY(lo + child + 1)) {
+            child++;
+        }
+        if (SORT_KEY(lo + root) >= SORT_KEY(lo + child)) {
+            break;
+        }
+        swap_entries(SA, lo + root, lo + child);
+        root = child;
+    }
+}
+
+static void heap_sort_group(psufsort_index_type *SA, const psufsort_index_type *V, off_t h, off_t lo, off_t hi)
+{
+    off_t size = hi - lo;
+    for (off_t root = size / 2 - 1; root >= 0; root--) {
+        sift_down(SA, V, h, lo, root, size);
+    }
+    for (off_t last = size - 1; last > 0; last--) {
+        swap_entries(SA, lo, lo + last);
+        sift_down(SA, V, h, lo, 0, last);
+    }
+}
+
+/* sort_group(SA, V, h, lo, hi, depth)
+ *
+ * Sorts SA[lo..hi-1] by the rank of the suffix h positions after each entry.
+ * This is a three-way quicksort because groups tend to have many equal keys,
+ * falling back to heap sort once 'depth' runs out. */
+static void sort_group(psufsort_index_type *SA, const psufsort_index_type *V, off_t h, off_t lo, off_t hi, int depth)
+{
+    while (hi - lo > PSUFSORT_INSERTION_SORT_LIMIT) {
+        if (depth == 0) {
+            heap_sort_group(SA, V, h, lo, hi);
+            return;
+        }
+        depth--;
+
+        off_t a = SORT_KEY(lo);
+        off_t b = SORT_KEY(lo + (hi - lo) / 2);
+        off_t c = SORT_KEY(hi - 1);
+        off_t pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+        /* [lo, lt) < pivot, [lt, i) == pivot, [gt, hi) > pivot */
+        off_t lt = lo, i = lo, gt = hi;
+        while (i < gt) {
+            off_t key = SORT_KEY(i);
+            if (key < pivot) {
+                swap_entries(SA, lt++, i++);
+            } else if (key > pivot) {
+                swap_entries(SA, i, --gt);
+            } else {
+                i++;
+            }
+        }
+
+        /* Recurse into the smaller side to bound the stack depth */
+        if (lt - lo < hi - gt) {
+            sort_group(SA, V, h, lo, lt, depth);
+            lo = gt;
+        } else {
+            sort_group(SA, V, h, gt, hi, depth);
+            hi = lt;
+        }
+    }
+
+    for (off_t i = lo + 1; i < hi; i++) {
+        psufsort_index_type entry = SA[i];
+        off_t key = V[entry + h];
+        off_t j = i;
+        while (j > lo && SORT_KEY(j - 1) > key) {
+            SA[j] = SA[j - 1];
+            j--;
+        }
+        SA[j] = entry;
+    }
+}
+
+static int sort_depth(off_t size)
+{
+    int depth = 0;
+    while (size > 1) {
+        size >>= 1;
+        depth += 2;
+    }
+    return depth;
+}
+
+static void refine_groups(psufsort_ctx *ctx, int thread_index)
+{
+    psufsort_index_type *SA = ctx->SA;
+    const psufsort_index_type *V = ctx->V;
+    u_char *flags = ctx->flags;
+    off_t h = ctx->h;
+
+    (void)thread_index;
+
+    int chunk;
+    while ((chunk = atomic_fetch_add(&ctx->next_chunk, 1)) < ctx->chunk_count) {
+        off_t k = ctx->bounds[chunk];
+        off_t end = ctx->bounds[chunk + 1];
+        while (k < end) {
+            if (flags[k] == GROUP_SORTED) {
+                k++;
+                continue;
+            }
+
+            off_t g = k + 1;
+            while (g < end && flags[g] == GROUP_CONTINUES) {
+                g++;
+            }
+
+            sort_group(SA, V, h, k, g, sort_depth(g - k));
+
+            for (off_t i = k + 1; i < g; i++) {
+                flags[i] = (SORT_KEY(i) != SORT_KEY(i - 1)) ? GROUP_STARTS : GROUP_CONTINUES;
+            }
+
+            k = g;
+        }
+    }
+}
+
+static void update_ranks(psufsort_ctx *ctx, int thread_index)
+{
+    const psufsort_index_type *SA = ctx->SA;
+    psufsort_index_type *V = ctx->V;
+    u_char *flags = ctx->flags;
+    off_t unsorted = 0;
+
+    int chunk;
+    while ((chunk = atomic_fetch_add(&ctx->next_chunk, 1)) < ctx->chunk_count) {
+        off_t k = ctx->bounds[chunk];
+        off_t end = ctx->bounds[chunk + 1];
+        while (k < end) {
+            if (flags[k] == GROUP_SORTED) {
+                k++;
+                continue;
+            }
+
+            off_t g = k + 1;
+            while (g < end && flags[g] == GROUP_CONTINUES) {
+                g++;
+            }
+
+            for (off_t i = k; i < g; i++) {
+                V[SA[i]] = (psufsort_index_type)(g - 1);
+            }
+
+            if (g - k == 1) {
+                flags[k] = GROUP_SORTED;
+            } else {
+                unsorted++;
+            }
+
+            k = g;
+        }
+    }
+
+    ctx->unsorted[thread_index] = unsorted;
+}
+
+/* Splits the positions into chunks whose boundaries fall on group starts so
+   that no group is shared between two chunks. */
+static void compute_chunk_bounds(psufsort_ctx *ctx)
+{
+    off_t total = ctx->n + 1;
+    int chunk_count = ctx->chunk_count;
+
+    ctx->bounds[0] = 0;
+    for (int c = 1; c < chunk_count; c++) {
+        off_t bound = total * c / chunk_count;
+        if (bound < ctx->bounds[c - 1]) {
+            bound = ctx->bounds[c - 1];
+        }
+        while (bound < total && ctx->flags[bound] == GROUP_CONTINUES) {
+            bound++;
+        }
+        ctx->bounds[c] = bound;
+    }
+    ctx->bounds[chunk_count] = total;
+}
+
+int psufsort(const u_char *T, psufsort_index_type *SA, psufsort_index_type *V, off_t n, int threads)
+{
+    int exitstatus = -1;
+    psufsort_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    if (n <= 0) {
+        SA[0] = 0;
+        V[0] = 0;
+        return 0;
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((off_t)threads > n) {
+        threads = (int)n;
+    }
+    /* More threads than processors only add overhead */
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors >= 1 && (long)threads > processors) {
+        threads = (int)processors;
+    }
+
+    ctx.T = T;
+    ctx.SA = SA;
+    ctx.V = V;
+    ctx.n = n;
+    ctx.threads = threads;
+    ctx.chunk_count = threads * PSUFSORT_CHUNKS_PER_THREAD;
+    if ((off_t)ctx.chunk_count > n + 1) {
+        ctx.chunk_count = (int)(n + 1);
+    }
+
+    if (((ctx.flags = malloc((size_t)n + 1)) == NULL) ||
+        ((ctx.counts = calloc((size_t)threads * PSUFSORT_BUCKET_COUNT, sizeof(off_t))) == NULL) ||
+        ((ctx.bucket_last = malloc(PSUFSORT_BUCKET_COUNT * sizeof(off_t))) == NULL) ||
+        ((ctx.bounds = malloc(((size_t)ctx.chunk_count + 1) * sizeof(off_t))) == NULL) ||
+        ((ctx.unsorted = calloc((size_t)threads, sizeof(off_t))) == NULL)) {
+        goto cleanup;
+    }
+
+    /* Bucket all suffixes by their first two bytes */
+    run_parallel(&ctx, count_buckets);
+
+    memset(ctx.flags, GROUP_CONTINUES, (size_t)n + 1);
+    off_t position = 0;
+    for (size_t key = 0; key < PSUFSORT_BUCKET_COUNT; key++) {
+        off_t bucket_start = position;
+        for (int t = 0; t < threads; t++) {
+            off_t *count = &ctx.counts[(size_t)t * PSUFSORT_BUCKET_COUNT + key];
+            off_t thread_count = *count;
+            *count = position;
+            position += thread_count;
+        }
+        if (position > bucket_start) {
+            ctx.flags[bucket_start] = (position - bucket_start == 1) ? GROUP_SORTED : GROUP_STARTS;
+            ctx.bucket_last[key] = position - 1;
+        }
+    }
+
+    run_parallel(&ctx, scatter_buckets);
+
+    /* Keep doubling the sorted prefix length until every group is a single suffix */
+    for (ctx.h = 2;; ctx.h *= 2) {
+        compute_chunk_bounds(&ctx);
+
+        atomic_store(&ctx.next_chunk, 0);
+        run_parallel(&ctx, refine_groups);
+
+        atomic_store(&ctx.next_chunk, 0);
+        run_parallel(&ctx, update_ranks);
+
+        off_t unsorted = 0;
+        for (int t = 0; t < threads; t++) {
+            unsorted += ctx.unsorted[t];
+        }
+        if (unsorted == 0) {
+            break;
+        }
+    }
+
+    exitstatus = 0;
+cleanup:
+    free(ctx.flags);
+    free(ctx.counts);
+    free(ctx.bucket_last);
+    free(ctx.bounds);
+    free(ctx.unsorted);
+
+    return exitstatus;
+}
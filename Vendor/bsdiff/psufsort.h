@@ -0,0 +1,38 @@
+/*
+ *  psufsort.h
+ *  Sparkle
+ *
+ *  Multithreaded suffix sorting for bsdiff.
+ */
+
+#ifndef PSUFSORT_H
+#define PSUFSORT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifndef psufsort_index_type
+#define psufsort_index_type off_t
+#endif
+
+/* psufsort(T, SA, V, n, threads)
+ *
+ * Sorts all n + 1 suffixes of T[0..n-1], including the empty suffix, using
+ * up to 'threads' threads but no more than the number of online processors.
+ * On success SA[0] is n and SA[1..n] is the suffix array of T, which is the
+ * same layout bsdiff produces from sais().
+ * Suffix arrays are unique so the result is identical to sais()'s.
+ *
+ * SA and V must both have room for n + 1 entries. V is used as scratch space
+ * and holds the inverse suffix array on return.
+ *
+ * Returns 0 on success and -1 if scratch memory could not be allocated. */
+int psufsort(const u_char *T, psufsort_index_type *SA, psufsort_index_type *V, off_t n, int threads);
+
+/* psufsort32(T, SA, V, n, threads)
+ *
+ * Same as psufsort() but with 32-bit entries in SA and V, which halves the
+ * memory needed. n must be less than INT32_MAX. */
+int psufsort32(const u_char *T, int32_t *SA, int32_t *V, off_t n, int threads);
+
+#endif
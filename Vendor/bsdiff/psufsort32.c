@@ -0,0 +1,13 @@
+/*
+ *  psufsort32.c
+ *  Sparkle
+ *
+ *  Builds psufsort with 32-bit suffix indexes for inputs smaller than 2 GiB.
+ */
+
+#include <stdint.h>
+
+#define psufsort_index_type int32_t
+#define psufsort psufsort32
+
+#include "psufsort.c"
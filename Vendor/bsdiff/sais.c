@@ -84,7 +84,7 @@ LMSsort1(const void *T, sais_index_type *SA,
   for(i = 0; i < n; ++i) {
     if(0 < (j = SA[i])) {
       assert(chr(j) >= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert(i < (b - SA));
       --j;
       *b++ = (chr(j) < c1) ? ~j : j;
@@ -99,7 +99,7 @@ LMSsort1(const void *T, sais_index_type *SA,
   for(i = n - 1, b = SA + B[c1 = 0]; 0 <= i; --i) {
     if(0 < (j = SA[i])) {
       assert(chr(j) <= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert((b - SA) <= i);
       --j;
       *--b = (chr(j) > c1) ? ~(j + 1) : j;
@@ -174,7 +174,7 @@ LMSsort2(const void *T, sais_index_type *SA,
     if(0 < (j = SA[i])) {
       if(n <= j) { d += 1; j -= n; }
       assert(chr(j) >= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert(i < (b - SA));
       --j;
       t = c0; t = (t << 1) | (chr(j) < c1);
@@ -202,7 +202,7 @@ LMSsort2(const void *T, sais_index_type *SA,
     if(0 < (j = SA[i])) {
       if(n <= j) { d += 1; j -= n; }
       assert(chr(j) <= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert((b - SA) <= i);
       --j;
       t = c0; t = (t << 1) | (chr(j) > c1);
@@ -271,7 +271,7 @@ induceSA(const void *T, sais_index_type *SA,
     if(0 < j) {
       --j;
       assert(chr(j) >= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert(i < (b - SA));
       *b++ = ((0 < j) && (chr(j - 1) < c1)) ? ~j : j;
     }
@@ -283,7 +283,7 @@ induceSA(const void *T, sais_index_type *SA,
     if(0 < (j = SA[i])) {
       --j;
       assert(chr(j) <= chr(j + 1));
-      if((c0 = chr(j)) != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if((c0 = chr(j)) != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert((b - SA) <= i);
       *--b = ((j == 0) || (chr(j - 1) > c1)) ? ~j : j;
     } else {
@@ -309,7 +309,7 @@ computeBWT(const void *T, sais_index_type *SA,
       --j;
       assert(chr(j) >= chr(j + 1));
       SA[i] = ~((sais_index_type)(c0 = chr(j)));
-      if(c0 != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if(c0 != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert(i < (b - SA));
       *b++ = ((0 < j) && (chr(j - 1) < c1)) ? ~j : j;
     } else if(j != 0) {
@@ -324,7 +324,7 @@ computeBWT(const void *T, sais_index_type *SA,
       --j;
       assert(chr(j) <= chr(j + 1));
       SA[i] = (c0 = chr(j));
-      if(c0 != c1) { B[c1] = b - SA; b = SA + B[c1 = c0]; }
+      if(c0 != c1) { B[c1] = (sais_index_type)(b - SA); b = SA + B[c1 = c0]; }
       assert((b - SA) <= i);
       *--b = ((0 < j) && (chr(j - 1) > c1)) ? ~((sais_index_type)chr(j - 1)) : j;
     } else if(j != 0) {
@@ -497,22 +497,22 @@ sais_main(const void *T, sais_index_type *SA,
 /*---------------------------------------------------------------------------*/
 
 sais_index_type
-sais(const unsigned char *T, sais_index_type *SA, int n) {
+sais(const unsigned char *T, sais_index_type *SA, sais_index_type n) {
   if((T == NULL) || (SA == NULL) || (n < 0)) { return -1; }
   if(n <= 1) { if(n == 1) { SA[0] = 0; } return 0; }
   return sais_main(T, SA, 0, n, UCHAR_SIZE, sizeof(unsigned char), 0);
 }
 
 sais_index_type
-sais_int(const int *T, sais_index_type *SA, int n, int k) {
+sais_int(const int *T, sais_index_type *SA, sais_index_type n, int k) {
   if((T == NULL) || (SA == NULL) || (n < 0) || (k <= 0)) { return -1; }
   if(n <= 1) { if(n == 1) { SA[0] = 0; } return 0; }
   return sais_main(T, SA, 0, n, k, sizeof(int), 0);
 }
 
 sais_index_type
-sais_bwt(const unsigned char *T, unsigned char *U, sais_index_type *A, int n) {
-  int i;
+sais_bwt(const unsigned char *T, unsigned char *U, sais_index_type *A, sais_index_type n) {
+  sais_index_type i;
   sais_index_type pidx;
   if((T == NULL) || (U == NULL) || (A == NULL) || (n < 0)) { return -1; }
   if(n <= 1) { if(n == 1) { U[0] = T[0]; } return n; }
@@ -526,8 +526,8 @@ sais_bwt(const unsigned char *T, unsigned char *U, sais_index_type *A, int n) {
 }
 
 sais_index_type
-sais_int_bwt(const sais_index_type *T, sais_index_type *U, sais_index_type *A, int n, int k) {
-  int i;
+sais_int_bwt(const sais_index_type *T, sais_index_type *U, sais_index_type *A, sais_index_type n, int k) {
+  sais_index_type i;
   sais_index_type pidx;
   if((T == NULL) || (U == NULL) || (A == NULL) || (n < 0) || (k <= 0)) { return -1; }
   if(n <= 1) { if(n == 1) { U[0] = T[0]; } return n; }
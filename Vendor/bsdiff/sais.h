@@ -32,24 +32,32 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <sys/types.h>
+#include <stdint.h>
 
+#ifndef sais_index_type
 #define sais_index_type off_t
+#endif
 
 /* find the suffix array SA of T[0..n-1]
    use a working space (excluding T and SA) of at most 2n+O(lg n) */
 sais_index_type
-sais(const unsigned char *T, sais_index_type *SA, int n);
+sais(const unsigned char *T, sais_index_type *SA, sais_index_type n);
 
 /* find the suffix array SA of T[0..n-1] in {0..k-1}^n
    use a working space (excluding T and SA) of at most MAX(4k,2n) */
 sais_index_type
-sais_int(const int *T, sais_index_type *SA, int n, int k);
+sais_int(const int *T, sais_index_type *SA, sais_index_type n, int k);
 
 /* burrows-wheeler transform */
 sais_index_type
-sais_bwt(const unsigned char *T, unsigned char *U, sais_index_type *A, int n);
+sais_bwt(const unsigned char *T, unsigned char *U, sais_index_type *A, sais_index_type n);
 sais_index_type
-sais_int_bwt(const sais_index_type *T, sais_index_type *U, sais_index_type *A, int n, int k);
+sais_int_bwt(const sais_index_type *T, sais_index_type *U, sais_index_type *A, sais_index_type n, int k);
+
+/* find the suffix array SA of T[0..n-1] using 32-bit indexes (see sais32.c)
+   n must be less than INT32_MAX */
+int32_t
+sais32(const unsigned char *T, int32_t *SA, int32_t n);
 
 
 #ifdef __cplusplus
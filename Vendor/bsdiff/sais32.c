@@ -0,0 +1,17 @@
+/*
+ *  sais32.c
+ *  Sparkle
+ *
+ *  Builds sais-lite with 32-bit suffix indexes for inputs smaller than 2 GiB.
+ *  sais-lite marks entries by negating them so the index type must be signed.
+ */
+
+#include <stdint.h>
+
+#define sais_index_type int32_t
+#define sais sais32
+#define sais_int sais32_int
+#define sais_bwt sais32_bwt
+#define sais_int_bwt sais32_int_bwt
+
+#include "sais.c"
@@ -35,10 +35,10 @@ class DeltaUpdate {
         return (archiveFileAttributes[.size] as! NSNumber).int64Value
     }
 
-    class func create(from: ArchiveItem, to: ArchiveItem, deltaVersion: SUBinaryDeltaMajorVersion, deltaCompressionMode: SPUDeltaCompressionMode, deltaCompressionLevel: UInt8, archivePath: URL) throws -> DeltaUpdate {
+    class func create(from: ArchiveItem, to: ArchiveItem, deltaVersion: SUBinaryDeltaMajorVersion, deltaCompressionMode: SPUDeltaCompressionMode, deltaCompressionLevel: UInt8, creationOptions: SPUDeltaCreationOptions, archivePath: URL) throws -> DeltaUpdate {
         var createDiffError: NSError?
 
-        if !createBinaryDelta(from.appPath.path, to.appPath.path, archivePath.path, deltaVersion, deltaCompressionMode, deltaCompressionLevel, false, &createDiffError) {
+        if !createBinaryDeltaWithOptions(from.appPath.path, to.appPath.path, archivePath.path, deltaVersion, deltaCompressionMode, deltaCompressionLevel, creationOptions, false, &createDiffError) {
             throw createDiffError!
         }
         
@@ -49,7 +49,7 @@ class DeltaUpdate {
         let _ = try? fileManager.removeItem(at: tempApplyToPath)
         
         var applyDiffError: NSError?
-        if !applyBinaryDelta(from.appPath.path, tempApplyToPath.path, archivePath.path, false, { _ in
+        if !applyBinaryDeltaWithFileDigestCache(from.appPath.path, tempApplyToPath.path, archivePath.path, creationOptions.fileDigestCache, false, { _ in
         }, &applyDiffError) {
             let _ = try? fileManager.removeItem(at: archivePath)
             throw applyDiffError!
@@ -73,6 +73,8 @@ struct GenerateAppcast: ParsableCommand {
     static let programNamePath: String = CommandLine.arguments.first ?? "./\(programName)"
     static let cacheDirectory = FileManager.default.urls(for: .cachesDirectory, in: .userDomainMask)[0].appendingPathComponent("Sparkle_generate_appcast")
     static let oldFilesDirectoryName = "old_updates"
+    static let suffixSortCacheDirectoryName = "suffix_sorts"
+    static let fileDigestCacheName = "file_digests"
     
     static let DEFAULT_MAX_VERSIONS_PER_BRANCH_IN_FEED = 3
     static let DEFAULT_MAXIMUM_DELTAS = 5
@@ -135,6 +137,51 @@ struct GenerateAppcast: ParsableCommand {
     @Option(name: .long, help: .hidden)
     var deltaCompressionLevel: UInt8 = 0
     
+    @Option(name: .long, help: ArgumentHelp("The number of threads to use for sorting the suffixes of each original file when creating delta updates. Using more threads can speed up creating delta updates that contain large files but does not change the generated delta updates. At most the number of processors can be used.", valueName: "threads"))
+    var deltaSuffixSortThreads: UInt32 = 1
+    
+    @Option(name: .long, help: ArgumentHelp("The number of threads to use for scanning each new file for differences when creating delta updates. Large files are split into this many parts that are diffed in parallel, which is faster but makes the generated delta updates slightly larger.", valueName: "threads"))
+    var deltaScanThreads: UInt32 = 1
+    
+    @Option(name: .long, help: ArgumentHelp("The maximum size in megabytes of the cache of sorted original files that is kept for creating delta updates. Sorting an original file is the slowest part of diffing it, and the same original files are usually diffed again in later runs. Pass 0 to disable the cache.", valueName: "megabytes"))
+    var deltaSuffixSortCacheSize: UInt64 = 4096
+    
+    @Option(name: .long, help: ArgumentHelp("The size in megabytes from which original files are diffed by hashing parts of them instead of sorting them when creating delta updates. This is much faster and takes far less memory for large files, but makes the generated delta updates larger. Pass 0 to hash every file.", valueName: "megabytes"))
+    var deltaHashDiffThreshold: UInt64 = SPUDeltaDefaultHashDiffThreshold / (1024 * 1024)
+    
+    @Option(name: .long, help: ArgumentHelp("The maximum number of files to diff at the same time when creating delta updates. By default this depends on the number of processors.", valueName: "count"))
+    var deltaConcurrentDiffs: UInt32 = 0
+    
+    @Option(name: .long, help: ArgumentHelp("The maximum amount of memory in megabytes that the files being diffed at the same time may take when creating delta updates, estimated from their sizes. Large files are diffed first and wait for each other to finish instead of running together once they would take more memory. By default half of the physical memory is used.", valueName: "megabytes"))
+    var deltaDiffMemoryLimit: UInt64 = 0
+    
+    @Flag(name: .customLong("delta-filter-branches"), help: ArgumentHelp("Filter the branch instructions of x86_64 and arm64 executables before diffing them when creating delta updates. This can make delta updates of code that moved around much smaller but diffs each executable twice. Old applications need to be using a version of Sparkle that supports version 3.8 delta updates to apply them."))
+    var deltaFilterBranches: Bool = false
+    
+    @Flag(name: .customLong("delta-varint-control"), help: ArgumentHelp("Store the control data of diffs as variable length integers when creating delta updates. This makes delta updates of files with many small changes smaller, especially with lz4 compression. Old applications need to be using a version of Sparkle that supports version 3.2 delta updates to apply them."))
+    var deltaVarintControl: Bool = false
+    
+    @Flag(name: .customLong("delta-framed-compression"), help: ArgumentHelp("Compress delta updates in independent frames using multiple threads, which also speeds up applying them. Delta updates get slightly larger and bzip2 compressed delta updates aren't affected. Old applications need to be using a version of Sparkle that supports version 3.3 delta updates to apply them."))
+    var deltaFramedCompression: Bool = false
+    
+    @Flag(name: .customLong("delta-front-coded-paths"), help: ArgumentHelp("Store each path in delta updates as the part it shares with the previous path and the rest of it. This makes delta updates of apps with many nested files smaller and faster to read. Old applications need to be using a version of Sparkle that supports version 3.5 delta updates to apply them."))
+    var deltaFrontCodedPaths: Bool = false
+    
+    @Flag(name: .customLong("delta-store-incompressible"), help: ArgumentHelp("Store files that look already compressed, like images and asset catalogs, without compressing them again when creating delta updates with --delta-framed-compression. This makes creating and applying delta updates faster. Old applications need to be using a version of Sparkle that supports version 3.6 delta updates to apply them."))
+    var deltaStoreIncompressible: Bool = false
+    
+    @Flag(name: .customLong("delta-deduplicate-files"), help: ArgumentHelp("Store added or changed files that have the same contents as another added or changed file only once when creating delta updates. This makes delta updates of apps with duplicated files smaller. Old applications need to be using a version of Sparkle that supports version 3.7 delta updates to apply them."))
+    var deltaDeduplicateFiles: Bool = false
+    
+    @Flag(name: .customLong("delta-compare-equal-files"), help: ArgumentHelp("Compare files byte by byte when their hashes say they are unchanged or can be cloned when creating delta updates. By default files are only compared by their hashes, so each file is read once."))
+    var deltaCompareEqualFiles: Bool = false
+    
+    @Flag(name: .customLong("delta-diff-similar-files"), help: ArgumentHelp("Diff files that are new at their path, like renamed helpers or moved resources, against the old file they have the most content in common with when creating delta updates, instead of storing them whole. Finding similar files reads each old version once more."))
+    var deltaDiffSimilarFiles: Bool = false
+    
+    @Flag(name: .customLong("disable-delta-digest-cache"), help: ArgumentHelp("Read every file of the original and new versions when creating and verifying delta updates. By default, the hashes of unchanged extracted files are cached between runs so that they don't need to be read again."))
+    var disableDeltaDigestCache: Bool = false
+    
     @Option(name: .long, help: ArgumentHelp("The Sparkle channel name that will be used for generating new updates. By default, no channel is used. Old applications need to be using Sparkle 2 to use this feature.", valueName: "channel-name"))
     var channel: String?
     
@@ -205,7 +252,7 @@ struct GenerateAppcast: ParsableCommand {
         
         For more advanced options that can be used for publishing updates, see https://sparkle-project.org/documentation/publishing/ for further documentation.
         
-        Extracted archives that are needed are cached in \((cacheDirectory.path as NSString).abbreviatingWithTildeInPath) to avoid re-computation in subsequent runs.
+        Extracted archives that are needed are cached in \((cacheDirectory.path as NSString).abbreviatingWithTildeInPath) to avoid re-computation in subsequent runs. Sorted original files used for creating delta updates are cached there too, up to --delta-suffix-sort-cache-size megabytes. Hashes of the extracted files are cached there as well, unless --disable-delta-digest-cache is passed.
                 
         Note that \(programName) does not support package-based (.pkg) updates.
         """)
@@ -236,15 +283,49 @@ struct GenerateAppcast: ParsableCommand {
             throw ValidationError("--link must be specified if --informational-update-versions is specified.")
         }
         
-        guard deltaCompressionLevel >= 0 && deltaCompressionLevel <= 9 else {
-            throw ValidationError("Invalid --delta-compression-level value was passed.")
+        guard deltaSuffixSortThreads >= 1 && deltaSuffixSortThreads <= ProcessInfo.processInfo.activeProcessorCount else {
+            throw ValidationError("Invalid --delta-suffix-sort-threads value was passed.")
+        }
+        
+        guard deltaScanThreads >= 1 else {
+            throw ValidationError("Invalid --delta-scan-threads value was passed.")
+        }
+        
+        guard deltaSuffixSortCacheSize <= UInt64.max / (1024 * 1024) else {
+            throw ValidationError("Invalid --delta-suffix-sort-cache-size value was passed.")
+        }
+        
+        guard deltaHashDiffThreshold <= UInt64.max / (1024 * 1024) else {
+            throw ValidationError("Invalid --delta-hash-diff-threshold value was passed.")
+        }
+        
+        guard deltaDiffMemoryLimit <= UInt64.max / (1024 * 1024) else {
+            throw ValidationError("Invalid --delta-diff-memory-limit value was passed.")
         }
         
         var validCompression: ObjCBool = false
-        let _ = deltaCompressionModeFromDescription(deltaCompression, &validCompression)
+        let deltaCompressionMode = deltaCompressionModeFromDescription(deltaCompression, &validCompression)
         if !validCompression.boolValue {
+            if deltaCompression.lowercased() == "zstd" {
+                throw ValidationError("--delta-compression \(deltaCompression) is not supported because generate_appcast was built without zstd support.")
+            }
             throw ValidationError("Invalid --delta-compression \(deltaCompression) was passed.")
         }
+        
+        // Only bzip2 and zstd have configurable compression levels
+        let maximumDeltaCompressionLevel: UInt8
+        switch deltaCompressionMode {
+        case .bzip2:
+            maximumDeltaCompressionLevel = 9
+        case .zstd:
+            maximumDeltaCompressionLevel = UInt8(SPUDeltaZstdMaxCompressionLevel)
+        default:
+            maximumDeltaCompressionLevel = 0
+        }
+        
+        guard deltaCompressionLevel <= maximumDeltaCompressionLevel else {
+            throw ValidationError("Invalid --delta-compression-level value was passed.")
+        }
     }
     
     func run() throws {
@@ -312,8 +393,42 @@ struct GenerateAppcast: ParsableCommand {
             throw ExitCode(1)
         }
         
+        let deltaCreationOptions = SPUDeltaCreationOptions()
+        deltaCreationOptions.suffixSortThreadCount = deltaSuffixSortThreads
+        deltaCreationOptions.scanThreadCount = deltaScanThreads
+        deltaCreationOptions.hashDiffThreshold = deltaHashDiffThreshold * 1024 * 1024
+        deltaCreationOptions.maximumConcurrentDiffCount = deltaConcurrentDiffs
+        deltaCreationOptions.diffMemoryLimit = deltaDiffMemoryLimit * 1024 * 1024
+        deltaCreationOptions.filtersExecutableBranches = deltaFilterBranches
+        deltaCreationOptions.usesVarintControlBlocks = deltaVarintControl
+        deltaCreationOptions.compressesInFrames = deltaFramedCompression
+        deltaCreationOptions.frontCodesRelativePaths = deltaFrontCodedPaths
+        deltaCreationOptions.storesIncompressibleData = deltaStoreIncompressible
+        deltaCreationOptions.deduplicatesFiles = deltaDeduplicateFiles
+        deltaCreationOptions.comparesEqualFiles = deltaCompareEqualFiles
+        deltaCreationOptions.diffsSimilarFiles = deltaDiffSimilarFiles
+        
+        let suffixSortCacheDirectory = GenerateAppcast.cacheDirectory.appendingPathComponent(GenerateAppcast.suffixSortCacheDirectoryName)
+        if deltaSuffixSortCacheSize > 0 {
+            deltaCreationOptions.suffixSortCacheDirectory = suffixSortCacheDirectory.path
+        }
+        
+        let fileDigestCachePath = GenerateAppcast.cacheDirectory.appendingPathComponent(GenerateAppcast.fileDigestCacheName).path
+        if disableDeltaDigestCache {
+            let _ = try? FileManager.default.removeItem(atPath: fileDigestCachePath)
+        } else {
+            deltaCreationOptions.fileDigestCache = SPUFileDigestCache(path: fileDigestCachePath)
+        }
+        
         do {
-            let appcastsByFeed = try makeAppcasts(archivesSourceDir: archivesSourceDir, outputPathURL: outputPathURL, cacheDirectory: GenerateAppcast.cacheDirectory, keys: keys, versions: versions, maxVersionsPerBranchInFeed: maxVersionsPerBranchInFeed, newChannel: channel, majorVersion: majorVersion, maximumDeltas: maximumDeltas, deltaCompressionModeDescription: deltaCompression, deltaCompressionLevel: deltaCompressionLevel, disableNestedCodeCheck: disableNestedCodeCheck, downloadURLPrefix: downloadURLPrefix, releaseNotesURLPrefix: releaseNotesURLPrefix, verbose: verbose)
+            let appcastsByFeed = try makeAppcasts(archivesSourceDir: archivesSourceDir, outputPathURL: outputPathURL, cacheDirectory: GenerateAppcast.cacheDirectory, keys: keys, versions: versions, maxVersionsPerBranchInFeed: maxVersionsPerBranchInFeed, newChannel: channel, majorVersion: majorVersion, maximumDeltas: maximumDeltas, deltaCompressionModeDescription: deltaCompression, deltaCompressionLevel: deltaCompressionLevel, deltaCreationOptions: deltaCreationOptions, disableNestedCodeCheck: disableNestedCodeCheck, downloadURLPrefix: downloadURLPrefix, releaseNotesURLPrefix: releaseNotesURLPrefix, verbose: verbose)
+            
+            // Also clears out the cache when it has been disabled
+            trimBinaryDeltaSuffixSortCache(suffixSortCacheDirectory.path, deltaSuffixSortCacheSize * 1024 * 1024)
+            
+            if let fileDigestCache = deltaCreationOptions.fileDigestCache, !fileDigestCache.save() {
+                print("Warning: failed to save the file digest cache to \(fileDigestCachePath)")
+            }
             
             let oldFilesDirectory = archivesSourceDir.appendingPathComponent(GenerateAppcast.oldFilesDirectoryName)
             